@@ -0,0 +1,23 @@
+using UnityEngine;
+
+// marks an opening between two rooms (e.g. a door) whose openness changes at runtime; the portal nearest to the object is used
+public class AcousticPortal : MonoBehaviour
+{
+    [Range(0.0f, 1.0f)]
+    public float openness = 1.0f;
+
+    private float sentOpenness = -1.0f;
+    private float[] position = new float[3];
+
+    void Update()
+    {
+        // the rooms are analysed when the scene is loaded, so we keep trying until there is a portal to set
+        if (openness == sentOpenness) return;
+
+        Vector3 portalPosition = transform.position;
+        position[0] = portalPosition.x; position[1] = portalPosition.y; position[2] = portalPosition.z;
+
+        if (NativeAcoustics.SetAcousticPortalOpenness(position, openness) != 0)
+            sentOpenness = openness;
+    }
+}
@@ -0,0 +1,218 @@
+using System;
+using System.Collections;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using UnityEngine;
+using Debug = UnityEngine.Debug;
+
+// exports the colliders of the scene (with their MaterialAudioAttributes) into the binary acoustic scene format and loads it at runtime
+public class AcousticSceneExporter : MonoBehaviour
+{
+    // the scene file is stored in the StreamingAssets folder so that it ships with the build
+    public string sceneFileName = "Acoustics.scene";
+    public bool quantiseVertices = false;
+    public bool loadOnStart = true;
+
+    // the closed rooms of the scene give the reverb of the listener's room without any rays
+    public bool analyseRooms = true;
+    public float roomCellSize = 0.5f;
+
+    // the edge graph lets the sources find their way around obstacles
+    public bool analyseDiffraction = true;
+
+    // used for geometry without MaterialAudioAttributes (the defaults of MaterialAudioAttributes)
+    private static readonly float[] defaultMaterial = { 0.95f, 0.2f, 0.2f, 0.2f, 0.2f };
+
+    private void Start()
+    {
+        if (loadOnStart) LoadScene();
+    }
+
+    public string GetScenePath()
+    {
+        return Path.Combine(Application.streamingAssetsPath, sceneFileName);
+    }
+
+    public void LoadScene()
+    {
+        Stopwatch stopwatch = Stopwatch.StartNew();
+
+        if (NativeAcoustics.LoadAcousticScene(GetScenePath()) == 0)
+        {
+            Debug.Log("Error loading the acoustic scene: " + NativeAcoustics.GetLastError());
+        }
+        else
+        {
+            Debug.Log("Loaded the acoustic scene in " + stopwatch.Elapsed.TotalMilliseconds.ToString("F1") + " ms");
+            if (analyseRooms) AnalyseRooms();
+            if (analyseDiffraction) AnalyseDiffraction();
+        }
+    }
+
+    // the analyses run on the native worker threads, so the game keeps running while they trace their rays
+    public void AnalyseRooms()
+    {
+        if (NativeAcoustics.AnalyseAcousticRooms(roomCellSize) == 0)
+        {
+            Debug.Log("Error analysing the acoustic rooms: " + NativeAcoustics.GetLastError());
+        }
+        else
+        {
+            StartCoroutine(LogWhenAnalysed("the acoustic rooms", NativeAcoustics.IsAcousticRoomAnalysisPending));
+        }
+    }
+
+    public void AnalyseDiffraction()
+    {
+        if (NativeAcoustics.AnalyseAcousticDiffraction() == 0)
+        {
+            Debug.Log("Error analysing the diffracting edges: " + NativeAcoustics.GetLastError());
+        }
+        else
+        {
+            StartCoroutine(LogWhenAnalysed("the diffracting edges", NativeAcoustics.IsAcousticDiffractionAnalysisPending));
+        }
+    }
+
+    private IEnumerator LogWhenAnalysed(string analysed, Func<int> isPending)
+    {
+        Stopwatch stopwatch = Stopwatch.StartNew();
+        while (isPending() != 0) yield return null;
+
+        Debug.Log("Analysed " + analysed + " in " + stopwatch.Elapsed.TotalMilliseconds.ToString("F1") + " ms");
+    }
+
+    [ContextMenu("Log the listener's room")]
+    public void LogListenerRoom()
+    {
+        GameObject listener = GameObject.Find("Listener");
+        if (listener == null) return;
+
+        Vector3 position = listener.transform.position;
+        float[] room = new float[10];
+        if (NativeAcoustics.GetAcousticRoom(new float[] { position.x, position.y, position.z }, room) == 0)
+        {
+            Debug.Log("The listener isn't in a closed room: " + NativeAcoustics.GetLastError());
+            return;
+        }
+
+        Debug.Log("Listener's room: " + room[0].ToString("F1") + " m^3, " + room[1].ToString("F1") + " m^2, mean absorption "
+                  + room[2].ToString("F2") + ", mean free path " + room[3].ToString("F2") + " m, RT60 (1 kHz) " + room[7].ToString("F2") + " s");
+    }
+
+    [ContextMenu("Log acoustic cache statistics")]
+    public void LogCacheStatistics()
+    {
+        long[] statistics = new long[6];
+        if (NativeAcoustics.GetAcousticCacheStatistics(statistics) == 0) return;
+
+        float hitRate = statistics[0] > 0 ? 100.0f * statistics[1] / statistics[0] : 0.0f;
+        Debug.Log("Acoustic cache: " + statistics[0] + " lookups, " + hitRate.ToString("F1") + "% hits, " + statistics[2] + " partial hits, "
+                  + statistics[3] + " misses, " + statistics[4] + " evictions, " + statistics[5] + " entries");
+    }
+
+    [ContextMenu("Export acoustic scene")]
+    public void ExportScene()
+    {
+        List<float> positions = new List<float>();
+        List<int> indices = new List<int>();
+        List<int> triangleMaterials = new List<int>();
+        List<float> materials = new List<float>(defaultMaterial);
+        Dictionary<MaterialAudioAttributes, int> materialIndices = new Dictionary<MaterialAudioAttributes, int>();
+        GameObject listener = GameObject.Find("Listener");
+
+        foreach (Collider collider in FindObjectsOfType<Collider>())
+        {
+            // the listener and triggers are not part of the acoustic geometry
+            if (collider.isTrigger || collider.gameObject == listener) continue;
+
+            Mesh mesh = GetColliderMesh(collider);
+            if (mesh == null)
+            {
+                Debug.Log("Skipping " + collider.name + ", its collider type can't be exported");
+                continue;
+            }
+
+            int material = GetMaterialIndex(collider.GetComponent<MaterialAudioAttributes>(), materials, materialIndices);
+            int firstVertex = positions.Count / 3;
+
+            foreach (Vector3 vertex in mesh.vertices)
+            {
+                Vector3 position = collider.transform.TransformPoint(vertex);
+                positions.Add(position.x);
+                positions.Add(position.y);
+                positions.Add(position.z);
+            }
+
+            int[] triangles = mesh.triangles;
+            for (int i = 0; i < triangles.Length; i += 3)
+            {
+                indices.Add(firstVertex + triangles[i]);
+                indices.Add(firstVertex + triangles[i + 1]);
+                indices.Add(firstVertex + triangles[i + 2]);
+                triangleMaterials.Add(material);
+            }
+
+            if (collider is BoxCollider) DestroyImmediate(mesh);
+        }
+
+        Directory.CreateDirectory(Application.streamingAssetsPath);
+
+        if (NativeAcoustics.ExportAcousticScene(GetScenePath(),
+                                                positions.ToArray(), positions.Count / 3,
+                                                indices.ToArray(), triangleMaterials.ToArray(), triangleMaterials.Count,
+                                                materials.ToArray(), materials.Count / 5,
+                                                quantiseVertices ? 1 : 0) == 0)
+        {
+            Debug.Log("Error exporting the acoustic scene: " + NativeAcoustics.GetLastError());
+        }
+        else
+        {
+            Debug.Log("Exported " + triangleMaterials.Count + " triangles and " + materials.Count / 5 + " materials to " + GetScenePath());
+        }
+    }
+
+    private int GetMaterialIndex(MaterialAudioAttributes attributes, List<float> materials, Dictionary<MaterialAudioAttributes, int> materialIndices)
+    {
+        if (attributes == null) return 0;
+
+        int index;
+        if (! materialIndices.TryGetValue(attributes, out index))
+        {
+            index = materials.Count / 5;
+            materials.Add(attributes.absorptionCoefficient);
+            materials.Add(attributes.scatteringCoefficient);
+            materials.Add(attributes.diffractionCoefficient);
+            materials.Add(attributes.transmissionCoefficient);
+            materials.Add(attributes.filterCoefficient);
+            materialIndices.Add(attributes, index);
+        }
+        return index;
+    }
+
+    private Mesh GetColliderMesh(Collider collider)
+    {
+        MeshCollider meshCollider = collider as MeshCollider;
+        if (meshCollider != null) return meshCollider.sharedMesh;
+
+        // a box collider is turned into a temporary cube mesh in the local space of the collider
+        BoxCollider boxCollider = collider as BoxCollider;
+        if (boxCollider != null)
+        {
+            GameObject cube = GameObject.CreatePrimitive(PrimitiveType.Cube);
+            Mesh mesh = Instantiate(cube.GetComponent<MeshFilter>().sharedMesh);
+            DestroyImmediate(cube);
+
+            Vector3[] vertices = mesh.vertices;
+            for (int i = 0; i < vertices.Length; i++)
+                vertices[i] = boxCollider.center + Vector3.Scale(vertices[i], boxCollider.size);
+            mesh.vertices = vertices;
+            return mesh;
+        }
+
+        // other primitive colliders are approximated by the rendered mesh
+        MeshFilter meshFilter = collider.GetComponent<MeshFilter>();
+        return meshFilter != null ? meshFilter.sharedMesh : null;
+    }
+}
@@ -10,6 +10,40 @@ public class AudioManager : MonoBehaviour
     // scaling factor for delay times
     public float delayScalingFactor = 1.0f;
 
+    // the CPU time per frame that the native acoustic analysis may use on its worker threads (0 for no limit)
+    public float acousticsBudgetMilliseconds = 2.0f;
+
+    // the governor lowers the quality of the quietest sources when the plugin instances together take more than
+    // processingBudget of real time (or the analysis more than acousticsBudgetMilliseconds), and raises it again later
+    public bool governQuality = true;
+    [Range(0.01f, 1.0f)] public float processingBudget = 0.25f;
+    public bool logQualityChanges = false;
+    private float[] qualityTelemetry = new float[7];
+
+    // times the stages of every plugin instance and logs them every profileLogInterval seconds
+    public bool profileProcessing = false;
+    public float profileLogInterval = 5.0f;
+    private bool isProfiling = false;
+    private float lastProfileLog = 0.0f;
+    private int[] profiledInstances = new int[256];
+
+    // records the blocks and setter calls of every plugin instance, and writes the latest of them to a Chrome trace
+    // (in Application.persistentDataPath) when writeTraceKey is pressed, e.g. right after hearing a glitch
+    public bool traceAudio = false;
+    public KeyCode writeTraceKey = KeyCode.F9;
+    private bool isTracing = false;
+
+    // captures what reaches every plugin instance while captureKey is toggled on (into a folder in
+    // Application.persistentDataPath), so that it can be rendered again offline with ReplayAcousticCaptures
+    public KeyCode captureKey = KeyCode.F10;
+    private bool isCapturing = false;
+
+    // the shared room reverbs follow the listener (the sources need their plugin's "Room Bus" set to "Send",
+    // and one more instance on its own mixer group set to "Return" plays the rooms)
+    public bool updateRoomBuses = true;
+    private GameObject listener;
+    private float[] listenerPosition = new float[3];
+
     /* * * Declare the native functions using DllImport * * */
     // function for checking the connection to the plugin
     [DllImport("audioplugin_SpatiotemporalReverb", CallingConvention = CallingConvention.Cdecl)]
@@ -35,6 +69,106 @@ public class AudioManager : MonoBehaviour
     private void Awake()
     {
         TestConnectionToJuce();
+        NativeAcoustics.InitialiseAcoustics();
+        listener = GameObject.Find("Listener");
+    }
+
+    private void OnDestroy()
+    {
+        NativeAcoustics.ShutdownAcoustics();
+    }
+
+    private void Update()
+    {
+        // every frame starts a new budget for the acoustic analysis
+        NativeAcoustics.BeginAcousticFrame(acousticsBudgetMilliseconds);
+        NativeAcoustics.SetAcousticSpeedOfSound(getSoundSpeed(medium));
+
+        if (governQuality) UpdateQuality();
+        UpdateProfiling();
+        UpdateTracing();
+        UpdateCapture();
+
+        if (updateRoomBuses && listener != null)
+        {
+            Vector3 position = listener.transform.position;
+            listenerPosition[0] = position.x; listenerPosition[1] = position.y; listenerPosition[2] = position.z;
+            NativeAcoustics.UpdateAcousticRoomBuses(listenerPosition);
+        }
+    }
+
+    private void UpdateQuality()
+    {
+        if (acousticsBudgetMilliseconds > 0.0f)
+            NativeAcoustics.SetAcousticQualityBudget(processingBudget, acousticsBudgetMilliseconds);
+
+        NativeAcoustics.UpdateAcousticQuality();
+
+        if (logQualityChanges && NativeAcoustics.GetAcousticQualityTelemetry(qualityTelemetry) != 0 && qualityTelemetry[6] != 0.0f)
+        {
+            Debug.Log((qualityTelemetry[6] > 0.0f ? "Raised" : "Lowered") + " the quality of instance " + qualityTelemetry[5]
+                      + " (load " + qualityTelemetry[0].ToString("P0") + ", tracing " + qualityTelemetry[1].ToString("F2") + " ms, "
+                      + qualityTelemetry[4] + " of " + qualityTelemetry[3] + " instances below full quality)");
+        }
+    }
+
+    private void UpdateProfiling()
+    {
+        if (profileProcessing != isProfiling)
+        {
+            if (NativeAcoustics.SetAcousticProfiling(profileProcessing ? 1 : 0) == 0)
+                Debug.Log("Error switching the profiling: " + NativeAcoustics.GetLastError());
+
+            // we only try once, so a build without profiling doesn't log an error every frame
+            isProfiling = profileProcessing;
+            lastProfileLog = Time.time;
+            NativeAcoustics.ResetAcousticProfile(-1);
+        }
+
+        if (! isProfiling || Time.time - lastProfileLog < profileLogInterval)
+            return;
+
+        lastProfileLog = Time.time;
+        int numInstances = Mathf.Min(NativeAcoustics.GetAcousticProfileInstances(profiledInstances, profiledInstances.Length), profiledInstances.Length);
+        for (int i = 0; i < numInstances; ++i)
+            Debug.Log(NativeAcoustics.GetProfileReport(profiledInstances[i]));
+    }
+
+    private void UpdateTracing()
+    {
+        if (traceAudio != isTracing)
+        {
+            NativeAcoustics.SetAcousticTracing(traceAudio ? 1 : 0);
+            isTracing = traceAudio;
+        }
+
+        if (isTracing && Input.GetKeyDown(writeTraceKey))
+        {
+            string path = System.IO.Path.Combine(Application.persistentDataPath, "reverb-trace-" + System.DateTime.Now.ToString("yyyyMMdd-HHmmss") + ".json");
+            if (NativeAcoustics.WriteAcousticTrace(path) != 0)
+                Debug.Log("Writing the audio trace to " + path);
+            else
+                Debug.Log("Error writing the audio trace: " + NativeAcoustics.GetLastError());
+        }
+    }
+
+    private void UpdateCapture()
+    {
+        if (! Input.GetKeyDown(captureKey))
+            return;
+
+        if (isCapturing)
+        {
+            if (NativeAcoustics.StopAcousticCapture() == 0)
+                Debug.Log("Error capturing the audio: " + NativeAcoustics.GetLastError());
+
+            isCapturing = false;
+            return;
+        }
+
+        string directory = System.IO.Path.Combine(Application.persistentDataPath, "reverb-capture-" + System.DateTime.Now.ToString("yyyyMMdd-HHmmss"));
+        isCapturing = NativeAcoustics.StartAcousticCapture(directory) != 0;
+        Debug.Log(isCapturing ? "Capturing the audio to " + directory : "Error capturing the audio: " + NativeAcoustics.GetLastError());
     }
 
     public void ApplyRaycastResult(RaycastResult raycastResult)
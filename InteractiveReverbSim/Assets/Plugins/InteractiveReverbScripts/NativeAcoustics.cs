@@ -0,0 +1,231 @@
+using System.Runtime.InteropServices; // for communicating with the reverb plugin
+using System.Text;
+
+// the native acoustics functions of the reverb plugin (see AcousticsInterface.cpp), which return 1 on success and 0 on failure
+public static class NativeAcoustics
+{
+    private const string pluginName = "audioplugin_SpatiotemporalReverb";
+
+    /* * * Lifetime * * */
+    // creates the objects that the native acoustics share with the plugin instances (and starts their threads); the
+    // functions below create them too on first use, but not while the library is being loaded
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int InitialiseAcoustics();
+
+    // lets go of them again, which has to happen before the library is unloaded
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int ShutdownAcoustics();
+
+    /* * * Acoustic scene * * */
+    // materials holds absorption, scattering, diffraction, transmission and filter coefficient per material
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int ExportAcousticScene ([MarshalAs(UnmanagedType.LPUTF8Str)] string path,
+                                                  float[] positions, int numVertices,
+                                                  int[] indices, int[] triangleMaterials, int numTriangles,
+                                                  float[] materials, int numMaterials,
+                                                  int quantiseVertices);
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int LoadAcousticScene ([MarshalAs(UnmanagedType.LPUTF8Str)] string path);
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int UnloadAcousticScene();
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int ValidateAcousticScene ([MarshalAs(UnmanagedType.LPUTF8Str)] string path);
+
+    /* * * Rooms * * */
+    // queues the analysis that splits the loaded scene into closed rooms (with cells of cellSize metres) and
+    // estimates their reverb; it runs on a worker thread, the rooms are there once IsAcousticRoomAnalysisPending returns 0
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int AnalyseAcousticRooms (float cellSize);
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int IsAcousticRoomAnalysisPending();
+
+    // room receives volume, surface area, mean absorption, mean free path and the Eyring reverb times of the
+    // octave bands from 125 Hz to 4 kHz (10 values); fails outside of every closed room
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int GetAcousticRoom (float[] position, float[] room);
+
+    // sets how far the portal nearest to position (within 2 m) is open, from 0 to 1
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int SetAcousticPortalOpenness (float[] position, float openness);
+
+    // updates the shared reverb buses of the rooms for the listener; called once per frame
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int UpdateAcousticRoomBuses (float[] listenerPosition);
+
+    /* * * Diffraction * * */
+    // queues the extraction of the diffracting edges of the loaded scene, which links the ones that see each other;
+    // like the room analysis it runs on a worker thread
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int AnalyseAcousticDiffraction();
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int IsAcousticDiffractionAnalysisPending();
+
+    // path receives the length, the gain and the low-pass cutoff frequency of the shortest path around the
+    // obstacles, where the sound seems to come from (3 values) and the number of edges (7 values)
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int FindAcousticDiffractionPath (float[] sourcePosition, float[] listenerPosition, float[] path);
+
+    /* * * Reverb analysis * * */
+    // the analysis runs on worker threads; slot identifies the source (0 to 255) and is what the plugin's
+    // "Acoustic Source" parameter refers to. Positions are float[3]
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int SubmitAcousticQuery (int slot, float[] sourcePosition, float[] listenerPosition, int rayBudget);
+
+    // estimate is a float[4] of the obstructed reflections, the longest and the average distance and the average absorption;
+    // returns 0 if there is no new result since the last call
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int ReadAcousticQueryResult (int slot, float[] estimate);
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int RemoveAcousticSource (int slot);
+
+    // the CPU time the workers may spend on each frame (0 for no limit)
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int BeginAcousticFrame (float budgetMilliseconds);
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern float GetAcousticFrameMilliseconds();
+
+    // the speed of sound in the medium of the level, which turns the analysed distances into delays (including the
+    // propagation delay of the direct sound)
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int SetAcousticSpeedOfSound (float speedOfSound);
+
+    // statistics receives lookups, hits, partial hits, misses, evictions and the number of cached entries, of the
+    // reverb estimates and the diffraction paths together
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int GetAcousticCacheStatistics (long[] statistics);
+
+    /* * * Quality governor * * */
+    // the share of real time that all plugin instances together may take, and the tracing time per frame
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int SetAcousticQualityBudget (float processingLoad, float tracingMilliseconds);
+
+    // lowers or raises the quality of the instances to keep them within the budget; called once per frame
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int UpdateAcousticQuality();
+
+    // telemetry receives the processing load, the tracing time, the pressure, the number of instances, the number of
+    // instances below full quality, the last changed instance and the last change (+1 raised, -1 lowered) (7 values)
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int GetAcousticQualityTelemetry (float[] telemetry);
+
+    /* * * Kernel instruction sets * * */
+    // 0 generic, 1 SSE2, 2 AVX2, 3 AVX-512, 4 NEON; -1 goes back to the best one of the machine
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int ForceAcousticKernelIsa (int isa);
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    private static extern int GetAcousticKernelIsa (byte[] buffer, int bufferSize);
+
+    // the name of the instruction set that the DSP and tracing kernels run with
+    public static string GetKernelIsaName()
+    {
+        byte[] buffer = new byte[32];
+        GetAcousticKernelIsa(buffer, buffer.Length);
+
+        int length = System.Array.IndexOf(buffer, (byte) 0);
+        return Encoding.UTF8.GetString(buffer, 0, length < 0 ? buffer.Length : length);
+    }
+
+    /* * * Stage profiling * * */
+    // times the stages of all plugin instances (1) or stops timing them (0)
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int SetAcousticProfiling (int enabled);
+
+    // fills instances with the ids of the profiled instances and returns how many there are
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int GetAcousticProfileInstances (int[] instances, int maxNumInstances);
+
+    // profile receives the acoustic source, the number of blocks and of deadline misses of the instance, followed by
+    // count, min, mean, p99 and max (in microseconds) of every stage (3 + 5 * GetAcousticProfileNumStages() values)
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int GetAcousticProfile (int instance, float[] profile);
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int GetAcousticProfileNumStages();
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    private static extern int GetAcousticProfileStageName (int stage, byte[] buffer, int bufferSize);
+
+    // -1 starts the timings of all instances over
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int ResetAcousticProfile (int instance);
+
+    // the timings of an instance as text, one stage per line (the stages that haven't run are left out)
+    public static string GetProfileReport (int instance)
+    {
+        int numStages = GetAcousticProfileNumStages();
+        float[] profile = new float[3 + 5 * numStages];
+        if (GetAcousticProfile(instance, profile) == 0)
+            return GetLastError();
+
+        var report = new StringBuilder();
+        report.AppendFormat("instance {0} (source {1}): {2} blocks, {3} deadline misses\n", instance, profile[0], profile[1], profile[2]);
+
+        byte[] buffer = new byte[64];
+        for (int stage = 0; stage < numStages; ++stage)
+        {
+            int offset = 3 + 5 * stage;
+            if (profile[offset] == 0.0f)
+                continue;
+
+            int numBytes = GetAcousticProfileStageName(stage, buffer, buffer.Length);
+            string name = numBytes > 1 ? Encoding.UTF8.GetString(buffer, 0, numBytes - 1) : stage.ToString();
+            report.AppendFormat("{0,-20} min {1,8:F1} us  mean {2,8:F1} us  p99 {3,8:F1} us  max {4,8:F1} us\n",
+                                name, profile[offset + 1], profile[offset + 2], profile[offset + 3], profile[offset + 4]);
+        }
+
+        return report.ToString();
+    }
+
+    /* * * Tracing * * */
+    // starts (1) or stops (0) recording the blocks and setter calls of all plugin instances
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int SetAcousticTracing (int enabled);
+
+    // writes the latest events to path as a Chrome trace (JSON, for chrome://tracing or Perfetto) in the background
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int WriteAcousticTrace ([MarshalAs(UnmanagedType.LPUTF8Str)] string path);
+
+    // 0 no trace requested, 1 being written, 2 written, 3 failed
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int GetAcousticTraceState();
+
+    /* * * Capture and replay * * */
+    // captures what reaches every plugin instance (input, setter calls, parameters) into directory/capture-<instance>.stcap
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int StartAcousticCapture ([MarshalAs(UnmanagedType.LPUTF8Str)] string directory);
+
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int StopAcousticCapture();
+
+    // renders the captures again offline (each into a WAV file next to it) and returns the number rendered;
+    // hashes receives the hash of each output (0 for a capture that failed), which is the same for identical renders
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int ReplayAcousticCaptures (string[] paths, int numPaths, ulong[] hashes);
+
+    /* * * Unit tests * * */
+    // runs the unit tests of the plugin and returns the number of failed checks; the results go to the log
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    public static extern int RunAcousticUnitTests();
+
+    /* * * Errors * * */
+    [DllImport(pluginName, CallingConvention = CallingConvention.Cdecl)]
+    private static extern int GetAcousticsError (byte[] buffer, int bufferSize);
+
+    // the reason for the last failure
+    public static string GetLastError()
+    {
+        byte[] buffer = new byte[1024];
+        int numBytes = GetAcousticsError(buffer, buffer.Length);
+
+        // we leave out the null terminator
+        return numBytes > 1 ? Encoding.UTF8.GetString(buffer, 0, numBytes - 1) : "";
+    }
+}
@@ -1,6 +1,7 @@
 using System.Collections;
 using System.Collections.Generic;
 using UnityEngine;
+using UnityEngine.Audio;
 
 public class RayCastAudioSource : MonoBehaviour
 {
@@ -12,6 +13,19 @@ public class RayCastAudioSource : MonoBehaviour
     // Type of raycast
     public RaycastType raycastType = RaycastType.Random;
 
+    // the new rays that the native analysis casts for this source per frame; without a loaded acoustic scene the Unity raycasts are used
+    public bool useNativeAnalysis = true;
+    public int raysPerFrame = 8;
+
+    // the slot of this source in the native analysis (unique per source, 0 to 255)
+    public int acousticSourceSlot = 0;
+
+    // the mixer of this source's plugin, and the name its "Acoustic Source" parameter is exposed as (empty if it isn't);
+    // with both set, the plugin is given the slot and picks up the results on the audio thread, without this script
+    public AudioMixer audioMixer;
+    public string exposedAcousticSourceParameter = "";
+    private bool pluginReadsResults = false;
+
     // Variables for the plugin
     private float obstructedRays = 0.0f;
     private float longestDistance = 0.0f;
@@ -26,58 +40,116 @@ public class RayCastAudioSource : MonoBehaviour
 
     bool playerMoved = false;
 
+    private GameObject listener;
+    private float[] sourcePosition = new float[3];
+    private float[] listenerPosition = new float[3];
+    private float[] estimate = new float[4];
+
     void Start()
     {
         audioSource = GetComponent<AudioSource>();
         if (audioSource == null)
             audioSource = gameObject.AddComponent<AudioSource>();
+
+        listener = GameObject.Find("Listener");
+        pluginReadsResults = useNativeAnalysis && SetPluginAcousticSource(acousticSourceSlot);
+    }
+
+    void OnDestroy()
+    {
+        if (useNativeAnalysis) NativeAcoustics.RemoveAcousticSource(acousticSourceSlot);
+        if (pluginReadsResults) SetPluginAcousticSource(-1);
+    }
+
+    bool SetPluginAcousticSource(int slot)
+    {
+        if (audioMixer == null || exposedAcousticSourceParameter == "")
+            return false;
+
+        // Unity sees the plugin's parameters normalised to 0 to 1; "Acoustic Source" goes from -1 (none) to 255
+        return audioMixer.SetFloat(exposedAcousticSourceParameter, (slot + 1) / 256.0f);
     }
 
     void LateUpdate()
     {
-        if (playerMoved)
+        // unlike the Unity raycasts we query even when nothing moved, since every query adds raysPerFrame rays to the estimate
+        if (useNativeAnalysis && audioSource.isPlaying && listener != null && UpdateNativeAnalysis())
+        {
+            if (!pluginReadsResults && ReadNativeResult())
+                ApplyReverbParameters();
+        }
+        else if (playerMoved)
         {
             if (audioSource.isPlaying)
             {
-                // communicate values to the plugin (Note: we only call the functions if the values have changed)
-
-                // Set the filter value for the reverb effect
                 obstructedRays = sphericalRaycast.CastSphericalRays(transform.position, raycastType);
-                if (obstructedRays != obstructedRaysTemp)
-                {
-                    audioManager.SendObstructionReflections(obstructedRays);
-                    obstructedRaysTemp = obstructedRays;
-                }
-
-                // Set the diffusion size for the reverb effect
                 longestDistance = sphericalRaycast.GetLongestDistance();
-                if (longestDistance != longestDistanceTemp)
-                {
-                    audioManager.ApplyDiffusionTime(longestDistance);
-                    longestDistanceTemp = longestDistance;
-                }
-
-                // Set the delay time for the reverb effect
                 averageDistance = sphericalRaycast.GetAverageDistance();
-                if (averageDistance != averageDistanceTemp)
-                {
-                    audioManager.ApplyDelayTime(averageDistance);
-                    averageDistanceTemp = averageDistance;
-                }
-
-                // Set the feedback for the reverb effect
                 averageAbsorption = sphericalRaycast.GetAverageAbsorption();
-                if (averageAbsorption != averageAbsorptionTemp)
-                {
-                    audioManager.ApplyFeedback(averageAbsorption);
-                    averageAbsorptionTemp = averageAbsorption;
-                }
+                ApplyReverbParameters();
             }
         }
 
         playerMoved = false;
     }
 
+    bool UpdateNativeAnalysis()
+    {
+        Vector3 source = transform.position;
+        Vector3 listenerPos = listener.transform.position;
+        sourcePosition[0] = source.x; sourcePosition[1] = source.y; sourcePosition[2] = source.z;
+        listenerPosition[0] = listenerPos.x; listenerPosition[1] = listenerPos.y; listenerPosition[2] = listenerPos.z;
+
+        // this fails when no acoustic scene is loaded, in which case we fall back to the Unity raycasts
+        return NativeAcoustics.SubmitAcousticQuery(acousticSourceSlot, sourcePosition, listenerPosition, raysPerFrame) != 0;
+    }
+
+    bool ReadNativeResult()
+    {
+        // the result of the query arrives a frame or so later; until then we keep the previous values
+        if (NativeAcoustics.ReadAcousticQueryResult(acousticSourceSlot, estimate) == 0)
+            return false;
+
+        obstructedRays = estimate[0];
+        longestDistance = estimate[1];
+        averageDistance = estimate[2];
+        averageAbsorption = estimate[3];
+        return true;
+    }
+
+    void ApplyReverbParameters()
+    {
+        // communicate values to the plugin (Note: we only call the functions if the values have changed)
+
+        // Set the filter value for the reverb effect
+        if (obstructedRays != obstructedRaysTemp)
+        {
+            audioManager.SendObstructionReflections(obstructedRays);
+            obstructedRaysTemp = obstructedRays;
+        }
+
+        // Set the diffusion size for the reverb effect
+        if (longestDistance != longestDistanceTemp)
+        {
+            audioManager.ApplyDiffusionTime(longestDistance);
+            longestDistanceTemp = longestDistance;
+        }
+
+        // Set the delay time for the reverb effect
+        if (averageDistance != averageDistanceTemp)
+        {
+            audioManager.ApplyDelayTime(averageDistance);
+            averageDistanceTemp = averageDistance;
+        }
+
+        // Set the feedback for the reverb effect
+        if (averageAbsorption != averageAbsorptionTemp)
+        {
+            audioManager.ApplyFeedback(averageAbsorption);
+            averageAbsorptionTemp = averageAbsorption;
+        }
+    }
+
     public void SetPlayerMoved()
     {
         playerMoved = true;
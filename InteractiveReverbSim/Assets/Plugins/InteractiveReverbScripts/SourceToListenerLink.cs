@@ -12,6 +12,9 @@ public class SourceToListenerLink : MonoBehaviour
     public bool debug = false;
     public bool visualize = true;
     public bool boostEffect = false;
+
+    // use the native edge graph for the way around obstacles (see AcousticSceneExporter.analyseDiffraction)
+    public bool useDiffraction = true;
     float factor = 1.0f;
 
     float leftRightAngle = 90.0f;
@@ -21,6 +24,10 @@ public class SourceToListenerLink : MonoBehaviour
 
     bool playerMoved = false;
 
+    float[] sourcePosition = new float[3];
+    float[] listenerPosition = new float[3];
+    float[] diffractionPath = new float[7];
+
     void Start()
     {
         // Initialize the audioSource
@@ -53,8 +60,12 @@ public class SourceToListenerLink : MonoBehaviour
             // TODO: only call when player or soundsource moves
             handleLinkRay(hits);
             
-            // if the direct line of sight is blocked, shoot analysis rays
-            if (hits.Length > 1) shootAnalysisRays(direction, distance);
+            // if the direct line of sight is blocked, the sound takes the way around the obstacles (or the analysis rays estimate it)
+            if (hits.Length > 1)
+            {
+                if (!(useDiffraction && applyDiffractionPath(ref distance)))
+                    shootAnalysisRays(direction, distance);
+            }
 
             // create a new RaycastResult
             RaycastResult link = new RaycastResult
@@ -149,6 +160,40 @@ public class SourceToListenerLink : MonoBehaviour
         }
     }
 
+    bool applyDiffractionPath(ref float distance)
+    {
+        Vector3 source = transform.position;
+        Vector3 listenerPoint = listener.transform.position;
+        sourcePosition[0] = source.x; sourcePosition[1] = source.y; sourcePosition[2] = source.z;
+        listenerPosition[0] = listenerPoint.x; listenerPosition[1] = listenerPoint.y; listenerPosition[2] = listenerPoint.z;
+
+        if (NativeAcoustics.FindAcousticDiffractionPath(sourcePosition, listenerPosition, diffractionPath) == 0 || diffractionPath[6] == 0.0f)
+            return false;
+
+        // the louder of the sound through the obstacles and the sound around them wins
+        float gain = diffractionPath[1];
+        if (gain > transmissionCoefficient)
+        {
+            transmissionCoefficient = gain;
+            distance = diffractionPath[0];
+
+            // the sound comes from the last edge before the listener
+            Vector3 apparentPosition = new Vector3(diffractionPath[3], diffractionPath[4], diffractionPath[5]);
+            leftRightAngle = Vector3.Angle(apparentPosition - listenerPoint, listener.transform.right);
+            frontBackAngle = Vector3.Angle(apparentPosition - listenerPoint, listener.transform.forward);
+
+            for (int i = 0; i < filterCoefficient.Length; i++)
+            {
+                filterCoefficient[i] = Mathf.Max(filterCoefficient[i], Mathf.Min(diffractionPath[2], 10e3f));
+            }
+
+            if (visualize) Debug.DrawLine(source, apparentPosition, new Color(0, 0.5f, 1, 1), 0.02f, true);
+            if (visualize) Debug.DrawLine(apparentPosition, listenerPoint, new Color(0, 0.5f, 1, 1), 0.02f, true);
+        }
+
+        return true;
+    }
+
     void handleLinkRay(RaycastHit[] hits)
     {
         Vector3 connectionPoint = transform.position;
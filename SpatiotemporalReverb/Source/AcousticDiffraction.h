@@ -0,0 +1,522 @@
+//
+//  AcousticDiffraction.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "AcousticScene.h"
+#include "AcousticRooms.h"
+#include <map>
+#include <unordered_map>
+
+// the way around an obstacle from a source to the listener, over one or two edges
+struct DiffractionPath
+{
+    bool isDirect { false };      // nothing is in the way, so there are no edges
+    int numEdges { 0 };
+    float length { 0.0f };         // along the path, in m
+    float directDistance { 0.0f }; // the straight line from the source to the listener, in m
+    AcousticVector apparentPosition; // where the sound seems to come from: the last edge before the listener
+    std::array<float, AcousticBands::numBands> bandGains {}; // the amplitude left after the edges, per octave band
+
+    // the gain of the lowest band; the higher bands are covered by getCutoffFrequency()
+    float getGain() const noexcept
+    {
+        return bandGains[0];
+    }
+
+    // the frequency at which the edges take 3 dB more than they take of the lowest band
+    float getCutoffFrequency() const noexcept
+    {
+        auto& frequencies = AcousticBands::centreFrequencies;
+        float previousDecibels = 0.0f;
+
+        for (size_t band = 1; band < AcousticBands::numBands; ++band)
+        {
+            float decibels = juce::Decibels::gainToDecibels (bandGains[band] / juce::jmax (1e-6f, bandGains[0]), -100.0f);
+            if (decibels <= -3.0f)
+            {
+                // we interpolate between the bands in octaves
+                float fraction = (-3.0f - previousDecibels) / (decibels - previousDecibels);
+                return frequencies[band - 1] * std::pow (2.0f, fraction);
+            }
+
+            previousDecibels = decibels;
+        }
+
+        return 20000.0f;
+    }
+};
+
+/*  Finds the way that sound bends around obstacles between a source and the listener, without casting rays around
+    the obstacle.
+    - the diffracting edges are extracted from the mesh once: the outer (convex) edges between two faces that meet at
+      an angle, and the open edges of single faces (e.g. the end of a thin wall)
+    - the edges are linked to the nearest edges they can see, which makes up the edge graph
+    - a query tests which of the edges near the source and near the listener they can see, and searches the paths over
+      one edge and over two linked edges for the shortest one
+    So a query casts at most 2 * maxNumCandidates rays and visits maxNumCandidates * maxNumLinks pairs of edges, however
+    large the scene is. Each edge attenuates the bands after Maekawa's approximation for a thin screen,
+    10 log10 (3 + 20 N) dB with the Fresnel number N = 2 delta / wavelength, where delta is the detour over the edge.
+    The edges are told apart from flat seams by the normals of the faces, which assumes that the triangles are
+    wound like Unity's (their front faces pointing out of the solid).
+*/
+class AcousticEdgeGraph
+{
+public:
+    struct Settings
+    {
+        float minWedgeAngle { 20.0f };    // in degrees, between the normals of the two faces; flatter edges don't diffract
+        float minEdgeLength { 0.1f };     // in m
+        float searchRadius { 10.0f };     // in m, how far from the source and the listener edges are looked for
+        float maxLinkDistance { 30.0f };  // in m
+        size_t maxNumLinks { 32 };        // per edge, to the nearest edges it can see
+        size_t maxNumCandidates { 16 };   // the edges nearest to the source and to the listener that are tested
+    };
+
+    struct Edge
+    {
+        AcousticVector start, end;
+        AcousticVector outward; // points away from the solid, for lifting points on the edge off the faces
+    };
+
+    AcousticEdgeGraph (const AcousticScene& scene, juce::uint32 newSceneVersion, const Settings& newSettings)
+        : settings (newSettings), sceneVersion (newSceneVersion)
+    {
+        // make sure that the settings are valid
+        jassert (settings.searchRadius > 0.0f && settings.maxLinkDistance > 0.0f && settings.maxNumCandidates > 0);
+
+        extractEdges (scene);
+        buildGrid();
+        linkEdges (scene);
+    }
+
+    juce::uint32 getSceneVersion() const noexcept
+    {
+        return sceneVersion;
+    }
+
+    size_t getNumEdges() const noexcept
+    {
+        return edges.size();
+    }
+
+    const Edge& getEdge (size_t edge) const noexcept
+    {
+        jassert (edge < edges.size());
+        return edges[edge];
+    }
+
+    size_t getNumLinks() const noexcept
+    {
+        return links.size();
+    }
+
+    // finds the shortest path from the source to the listener, which is the direct one if nothing is in the way;
+    // returns false if there is neither (the scene must be the one the graph was built from). The speed of sound (in
+    // m/s) sets the wavelengths that the edges attenuate
+    bool findPath (const AcousticScene& scene, const AcousticVector& source, const AcousticVector& listener,
+                   float speedOfSound, DiffractionPath& path) const
+    {
+        path = {};
+        path.directDistance = (listener - source).length();
+
+        if (! isOccluded (scene, source, listener))
+        {
+            path.isDirect = true;
+            path.length = path.directDistance;
+            path.apparentPosition = source;
+            path.bandGains.fill (1.0f);
+            return true;
+        }
+
+        auto sourceEdges = findVisibleEdges (scene, source, listener);
+        auto listenerEdges = findVisibleEdges (scene, listener, source);
+
+        std::unordered_map<juce::uint32, AcousticVector> seenByListener;
+        for (auto& visible : listenerEdges)
+            seenByListener.emplace (visible.edge, visible.point);
+
+        std::array<AcousticVector, 2> bestPoints;
+        float bestLength = std::numeric_limits<float>::max();
+
+        for (auto& visible : sourceEdges)
+        {
+            // over a single edge, which both ends can see
+            if (seenByListener.count (visible.edge) != 0)
+            {
+                float length = (visible.point - source).length() + (listener - visible.point).length();
+                if (length < bestLength)
+                {
+                    bestLength = length;
+                    bestPoints = { visible.point, visible.point };
+                    path.numEdges = 1;
+                }
+            }
+
+            // over an edge that the source sees and a linked edge that the listener sees
+            for (auto link = linkOffsets[visible.edge]; link < linkOffsets[visible.edge + 1]; ++link)
+            {
+                auto next = links[link];
+                if (seenByListener.count (next) == 0)
+                    continue;
+
+                auto& first = edges[visible.edge];
+                auto& second = edges[next];
+                AcousticVector firstPoint = visible.point, secondPoint = seenByListener[next];
+
+                // each point is the best one for the other, which settles after a few rounds
+                for (int round = 0; round < 3; ++round)
+                {
+                    firstPoint = getPointOfShortestPath (first, source, secondPoint);
+                    secondPoint = getPointOfShortestPath (second, firstPoint, listener);
+                }
+
+                float length = (firstPoint - source).length() + (secondPoint - firstPoint).length() + (listener - secondPoint).length();
+                if (length < bestLength)
+                {
+                    bestLength = length;
+                    bestPoints = { firstPoint, secondPoint };
+                    path.numEdges = 2;
+                }
+            }
+        }
+
+        if (path.numEdges == 0)
+            return false;
+
+        path.length = bestLength;
+        path.apparentPosition = bestPoints[(size_t) path.numEdges - 1];
+        path.bandGains.fill (1.0f);
+
+        if (path.numEdges == 1)
+        {
+            applyEdge (source, bestPoints[0], listener, speedOfSound, path.bandGains);
+        }
+        else
+        {
+            applyEdge (source, bestPoints[0], bestPoints[1], speedOfSound, path.bandGains);
+            applyEdge (bestPoints[0], bestPoints[1], listener, speedOfSound, path.bandGains);
+        }
+
+        return true;
+    }
+
+private:
+    static constexpr float liftDistance = 0.01f;     // in m, keeps the rays from hitting the faces of their own edge
+    static constexpr float maxEdgeAttenuation = 24.0f; // in dB, the practical limit of a single screen
+
+    struct VisibleEdge
+    {
+        juce::uint32 edge;
+        AcousticVector point; // the point on the edge that the path goes over
+    };
+
+    Settings settings;
+    juce::uint32 sceneVersion;
+    std::vector<Edge> edges;
+
+    // the edges that each edge can see: links[linkOffsets[edge]] to links[linkOffsets[edge + 1] - 1]
+    std::vector<juce::uint32> linkOffsets;
+    std::vector<juce::uint32> links;
+
+    // the edges that pass through each cell of searchRadius metres
+    std::unordered_map<juce::int64, std::vector<juce::uint32>> grid;
+
+    // helper functions
+    void extractEdges (const AcousticScene& scene)
+    {
+        // the faces on each edge, with the vertices welded at a millimetre, since the triangles don't share them
+        struct Face
+        {
+            AcousticVector normal;
+            AcousticVector opposite; // the vertex of the face that isn't on the edge
+        };
+
+        struct EdgeFaces
+        {
+            AcousticVector start, end;
+            std::vector<Face> faces;
+        };
+
+        std::map<std::array<int, 3>, juce::uint32> vertexIds;
+        std::map<std::pair<juce::uint32, juce::uint32>, EdgeFaces> edgeFaces;
+
+        auto getVertexId = [&vertexIds] (const AcousticVector& vertex)
+        {
+            std::array<int, 3> key { juce::roundToInt (vertex.x * 1000.0f), juce::roundToInt (vertex.y * 1000.0f),
+                                     juce::roundToInt (vertex.z * 1000.0f) };
+            return vertexIds.emplace (key, (juce::uint32) vertexIds.size()).first->second;
+        };
+
+        for (size_t triangle = 0; triangle < scene.getNumTriangles(); ++triangle)
+        {
+            std::array<AcousticVector, 3> vertices;
+            scene.getTriangle (triangle, vertices[0], vertices[1], vertices[2]);
+
+            auto normal = (vertices[1] - vertices[0]).cross (vertices[2] - vertices[0]);
+            if (normal.length() <= 0.0f)
+                continue;
+
+            std::array<juce::uint32, 3> ids { getVertexId (vertices[0]), getVertexId (vertices[1]), getVertexId (vertices[2]) };
+            for (size_t corner = 0; corner < 3; ++corner)
+            {
+                size_t next = (corner + 1) % 3, opposite = (corner + 2) % 3;
+                if (ids[corner] == ids[next])
+                    continue;
+
+                auto key = std::minmax (ids[corner], ids[next]);
+                auto& entry = edgeFaces[{ key.first, key.second }];
+                if (entry.faces.empty())
+                {
+                    entry.start = vertices[corner];
+                    entry.end = vertices[next];
+                }
+
+                entry.faces.push_back ({ normal.normalised(), vertices[opposite] });
+            }
+        }
+
+        float minCosine = std::cos (juce::degreesToRadians (settings.minWedgeAngle));
+
+        for (auto& [key, entry] : edgeFaces)
+        {
+            auto direction = entry.end - entry.start;
+            if (direction.length() < settings.minEdgeLength)
+                continue;
+
+            if (entry.faces.size() == 1)
+            {
+                // the open edge of a face is a thin screen, so we lift off it in the plane of the face, away from the face
+                auto towardsFace = entry.faces[0].opposite - entry.start;
+                auto axis = direction.normalised();
+                auto outward = (axis * towardsFace.dot (axis) - towardsFace).normalised();
+                edges.push_back ({ entry.start, entry.end, outward });
+            }
+            else if (entry.faces.size() == 2)
+            {
+                auto& first = entry.faces[0];
+                auto& second = entry.faces[1];
+
+                // an edge between (nearly) coplanar faces is only a seam, and sound doesn't bend around an inner corner
+                bool isSeam = first.normal.dot (second.normal) > minCosine;
+                bool isConvex = (second.opposite - entry.start).dot (first.normal) < 0.0f;
+                if (! isSeam && isConvex)
+                    edges.push_back ({ entry.start, entry.end, (first.normal + second.normal).normalised() });
+            }
+
+            // edges with more than two faces are where separate meshes touch, which we leave out
+        }
+    }
+
+    void buildGrid()
+    {
+        for (juce::uint32 edge = 0; edge < (juce::uint32) edges.size(); ++edge)
+        {
+            auto low = getCellOf (AcousticVector::min (edges[edge].start, edges[edge].end));
+            auto high = getCellOf (AcousticVector::max (edges[edge].start, edges[edge].end));
+
+            for (int x = low[0]; x <= high[0]; ++x)
+                for (int y = low[1]; y <= high[1]; ++y)
+                    for (int z = low[2]; z <= high[2]; ++z)
+                        grid[getKeyOf ({ x, y, z })].push_back (edge);
+        }
+    }
+
+    void linkEdges (const AcousticScene& scene)
+    {
+        linkOffsets.assign (edges.size() + 1, 0);
+        std::vector<juce::uint32> candidates;
+        std::vector<std::pair<float, juce::uint32>> nearby;
+
+        // the midpoint of an edge lies within the cells that the edge is in, so the grid cells within the link distance
+        // of a midpoint (and the lift of the other midpoint) hold every edge that it can link to
+        float linkReach = settings.maxLinkDistance + liftDistance;
+        AcousticVector reach { linkReach, linkReach, linkReach };
+
+        for (size_t edge = 0; edge < edges.size(); ++edge)
+        {
+            auto from = getLiftedMidpoint (edges[edge]);
+            auto low = getCellOf (from - reach);
+            auto high = getCellOf (from + reach);
+
+            candidates.clear();
+            for (int x = low[0]; x <= high[0]; ++x)
+                for (int y = low[1]; y <= high[1]; ++y)
+                    for (int z = low[2]; z <= high[2]; ++z)
+                        if (auto cell = grid.find (getKeyOf ({ x, y, z })); cell != grid.end())
+                            candidates.insert (candidates.end(), cell->second.begin(), cell->second.end());
+
+            // a long edge passes through several cells
+            std::sort (candidates.begin(), candidates.end());
+            candidates.erase (std::unique (candidates.begin(), candidates.end()), candidates.end());
+
+            nearby.clear();
+            for (auto other : candidates)
+            {
+                float distance = (getLiftedMidpoint (edges[other]) - from).length();
+                if (other != edge && distance <= settings.maxLinkDistance)
+                    nearby.push_back ({ distance, other });
+            }
+
+            std::sort (nearby.begin(), nearby.end());
+
+            // the nearest edges that this one can see
+            size_t numLinks = 0;
+            for (auto& [distance, other] : nearby)
+            {
+                if (numLinks == settings.maxNumLinks)
+                    break;
+
+                if (! isOccluded (scene, from, getLiftedMidpoint (edges[other])))
+                {
+                    links.push_back (other);
+                    ++numLinks;
+                }
+            }
+
+            linkOffsets[edge + 1] = (juce::uint32) links.size();
+        }
+    }
+
+    // the edges near position (the nearest first) that can see it, with the points the paths to target go over
+    std::vector<VisibleEdge> findVisibleEdges (const AcousticScene& scene, const AcousticVector& position, const AcousticVector& target) const
+    {
+        auto centre = getCellOf (position);
+        std::vector<juce::uint32> candidates;
+
+        for (int x = -1; x <= 1; ++x)
+            for (int y = -1; y <= 1; ++y)
+                for (int z = -1; z <= 1; ++z)
+                    if (auto cell = grid.find (getKeyOf ({ centre[0] + x, centre[1] + y, centre[2] + z })); cell != grid.end())
+                        candidates.insert (candidates.end(), cell->second.begin(), cell->second.end());
+
+        // a long edge passes through several cells
+        std::sort (candidates.begin(), candidates.end());
+        candidates.erase (std::unique (candidates.begin(), candidates.end()), candidates.end());
+
+        std::vector<std::pair<float, VisibleEdge>> nearest;
+        for (auto edge : candidates)
+        {
+            auto point = getPointOfShortestPath (edges[edge], position, target);
+            float distance = (point - position).length();
+            if (distance <= settings.searchRadius)
+                nearest.push_back ({ distance, { edge, point } });
+        }
+
+        auto numCandidates = juce::jmin (nearest.size(), settings.maxNumCandidates);
+        std::partial_sort (nearest.begin(), nearest.begin() + (std::ptrdiff_t) numCandidates, nearest.end(),
+                           [] (const auto& a, const auto& b) { return a.first < b.first; });
+
+        std::vector<VisibleEdge> visible;
+        for (size_t candidate = 0; candidate < numCandidates; ++candidate)
+        {
+            auto& [distance, edge] = nearest[candidate];
+            if (! isOccluded (scene, position, edge.point + edges[edge.edge].outward * liftDistance))
+                visible.push_back (edge);
+        }
+
+        return visible;
+    }
+
+    // the point on the edge that makes the way from a over the edge to b the shortest
+    static AcousticVector getPointOfShortestPath (const Edge& edge, const AcousticVector& a, const AcousticVector& b) noexcept
+    {
+        auto direction = edge.end - edge.start;
+        auto getLength = [&] (float t) { auto point = edge.start + direction * t; return (point - a).length() + (b - point).length(); };
+
+        // the length is convex along the edge, so a golden section search finds its minimum
+        constexpr float ratio = 0.618034f;
+        float low = 0.0f, high = 1.0f;
+        float left = high - ratio * (high - low), right = low + ratio * (high - low);
+        float leftLength = getLength (left), rightLength = getLength (right);
+
+        for (int iteration = 0; iteration < 24; ++iteration)
+        {
+            if (leftLength < rightLength)
+            {
+                high = right;
+                right = left;
+                rightLength = leftLength;
+                left = high - ratio * (high - low);
+                leftLength = getLength (left);
+            }
+            else
+            {
+                low = left;
+                left = right;
+                leftLength = rightLength;
+                right = low + ratio * (high - low);
+                rightLength = getLength (right);
+            }
+        }
+
+        return edge.start + direction * (0.5f * (low + high));
+    }
+
+    // Maekawa's attenuation of the edge at point on the way from previous to next
+    static void applyEdge (const AcousticVector& previous, const AcousticVector& point, const AcousticVector& next,
+                           float speedOfSound, std::array<float, AcousticBands::numBands>& bandGains) noexcept
+    {
+        float detour = (point - previous).length() + (next - point).length() - (next - previous).length();
+
+        for (size_t band = 0; band < AcousticBands::numBands; ++band)
+        {
+            float fresnelNumber = 2.0f * juce::jmax (0.0f, detour) * AcousticBands::centreFrequencies[band] / speedOfSound;
+            float attenuation = juce::jmin (maxEdgeAttenuation, 10.0f * std::log10 (3.0f + 20.0f * fresnelNumber));
+            bandGains[band] *= juce::Decibels::decibelsToGain (-attenuation);
+        }
+    }
+
+    static bool isOccluded (const AcousticScene& scene, const AcousticVector& from, const AcousticVector& to) noexcept
+    {
+        auto offset = to - from;
+        float distance = offset.length();
+        if (distance <= liftDistance)
+            return false;
+
+        return scene.isOccluded ({ from, offset * (1.0f / distance), distance - liftDistance });
+    }
+
+    static AcousticVector getLiftedMidpoint (const Edge& edge) noexcept
+    {
+        return (edge.start + edge.end) * 0.5f + edge.outward * liftDistance;
+    }
+
+    std::array<int, 3> getCellOf (const AcousticVector& position) const noexcept
+    {
+        return { (int) std::floor (position.x / settings.searchRadius), (int) std::floor (position.y / settings.searchRadius),
+                 (int) std::floor (position.z / settings.searchRadius) };
+    }
+
+    static juce::int64 getKeyOf (const std::array<int, 3>& cell) noexcept
+    {
+        // 21 bits per axis, which covers far more than any scene at the cell sizes we use
+        auto pack = [] (int coordinate) { return (juce::int64) (coordinate & 0x1fffff); };
+        return (pack (cell[0]) << 42) | (pack (cell[1]) << 21) | pack (cell[2]);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticEdgeGraph)
+};
+
+// the edge graph of the loaded scene, shared like the scene itself
+class SharedAcousticEdgeGraph
+{
+public:
+    std::shared_ptr<const AcousticEdgeGraph> get() const
+    {
+        const juce::SpinLock::ScopedLockType lock (graphLock);
+        return graph;
+    }
+
+    void set (std::shared_ptr<const AcousticEdgeGraph> newGraph)
+    {
+        const juce::SpinLock::ScopedLockType lock (graphLock);
+        std::swap (graph, newGraph);
+    }
+
+private:
+    juce::SpinLock graphLock;
+    std::shared_ptr<const AcousticEdgeGraph> graph;
+};
@@ -0,0 +1,300 @@
+//
+//  AcousticDirections.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "AcousticGeometry.h"
+
+/*  Generates the directions that the rays are cast in. Compared to independent random directions (like
+    Random.onUnitSphere in Unity), the patterns cover the sphere evenly, so the same parameter stability takes fewer rays:
+    - fibonacci: the Fibonacci sphere, the most even spread for a given number of directions; its points are taken in
+      golden-ratio strides rather than from pole to pole, so that a prefix of the set (e.g. the rays that a reservoir
+      has cast so far) is spread over the whole sphere too
+    - sobol: the first two Sobol dimensions with hash-based Owen scrambling, any prefix of the set is well spread
+    - random: independent uniform directions, for reference
+    Every frame the set is rotated by a new random rotation (and the Sobol scramble is reseeded), so the error of a
+    fixed pattern doesn't turn into a bias. Directions are written in batches of SIMD registers (x, y and z each in
+    their own registers), the layout that a ray packet is traced in.
+*/
+class AcousticDirectionGenerator
+{
+public:
+    enum class Pattern
+    {
+        fibonacci,
+        sobol,
+        random
+    };
+
+    using Register = juce::dsp::SIMDRegister<float>;
+
+    // the part of the sphere that the directions cover: a cone of directions around an axis
+    struct Domain
+    {
+        AcousticVector axis { 0.0f, 0.0f, 1.0f };
+        float minCosine { -1.0f }; // the cosine of the largest angle to the axis
+
+        static Domain sphere() noexcept
+        {
+            return {};
+        }
+
+        // e.g. the reflections off a surface, around its normal
+        static Domain hemisphere (const AcousticVector& normal) noexcept
+        {
+            return { normal.normalised(), 0.0f };
+        }
+
+        static Domain cone (const AcousticVector& axis, float halfAngle) noexcept
+        {
+            // make sure that the half angle is valid
+            jassert (0.0f < halfAngle && halfAngle <= juce::MathConstants<float>::pi);
+            return { axis.normalised(), std::cos (halfAngle) };
+        }
+    };
+
+    // directions in packet layout: lane i % Register::size() of register i / Register::size()
+    struct Batch
+    {
+        std::vector<Register> x, y, z;
+        size_t numDirections { 0 };
+
+        void resize (size_t newNumDirections)
+        {
+            size_t numRegisters = (newNumDirections + Register::size() - 1) / Register::size();
+            x.resize (numRegisters);
+            y.resize (numRegisters);
+            z.resize (numRegisters);
+            numDirections = newNumDirections;
+        }
+
+        AcousticVector operator[] (size_t index) const noexcept
+        {
+            jassert (index < numDirections);
+            size_t packet = index / Register::size(), lane = index % Register::size();
+            return { x[packet].get (lane), y[packet].get (lane), z[packet].get (lane) };
+        }
+
+        size_t size() const noexcept
+        {
+            return numDirections;
+        }
+    };
+
+    explicit AcousticDirectionGenerator (Pattern newPattern = Pattern::fibonacci, juce::int64 seed = 1)
+        : pattern (newPattern), random (seed)
+    {
+        nextFrame();
+    }
+
+    void setPattern (Pattern newPattern) noexcept
+    {
+        pattern = newPattern;
+    }
+
+    Pattern getPattern() const noexcept
+    {
+        return pattern;
+    }
+
+    // draws a new rotation (and Sobol scramble) for the directions that are generated from now on
+    void nextFrame()
+    {
+        rotation = getRandomRotation();
+        spin = juce::MathConstants<float>::twoPi * random.nextFloat();
+        scrambleSeed = (juce::uint32) random.nextInt();
+    }
+
+    // writes a set of numDirections directions within the domain to batch
+    void generate (size_t numDirections, const Domain& domain, Batch& batch)
+    {
+        batch.resize (numDirections);
+        size_t stride = getGoldenStride (numDirections);
+
+        // the directions are generated around the z axis, then turned towards the axis of the domain in one go
+        for (size_t packet = 0; packet < batch.x.size(); ++packet)
+        {
+            for (size_t lane = 0; lane < Register::size(); ++lane)
+            {
+                size_t index = juce::jmin (packet * Register::size() + lane, numDirections - 1);
+                auto direction = getLocalDirection (pattern == Pattern::fibonacci ? (index * stride) % numDirections : index,
+                                                    numDirections, domain.minCosine);
+                batch.x[packet].set (lane, direction.x);
+                batch.y[packet].set (lane, direction.y);
+                batch.z[packet].set (lane, direction.z);
+            }
+        }
+
+        transform (batch, getFrameOf (domain));
+    }
+
+private:
+    // the columns of a 3 by 3 matrix
+    using Matrix = std::array<AcousticVector, 3>;
+
+    Pattern pattern;
+    juce::Random random;
+    Matrix rotation;
+    float spin { 0.0f };
+    juce::uint32 scrambleSeed { 0 };
+
+    // helper functions
+    AcousticVector getLocalDirection (size_t index, size_t numDirections, float minCosine)
+    {
+        // u picks the height on the z axis (equal heights cover equal areas) and v the angle around it
+        float u = 0.0f, v = 0.0f;
+
+        switch (pattern)
+        {
+            case Pattern::fibonacci:
+            {
+                constexpr double goldenRatio = 1.6180339887498949;
+                u = ((float) index + 0.5f) / (float) numDirections;
+                v = (float) std::fmod ((double) index / goldenRatio, 1.0);
+                break;
+            }
+            case Pattern::sobol:
+            {
+                auto shuffled = scramble ((juce::uint32) index, scrambleSeed);
+                u = toUnitFloat (scramble (getSobol (shuffled, 0), hash (scrambleSeed + 1)));
+                v = toUnitFloat (scramble (getSobol (shuffled, 1), hash (scrambleSeed + 2)));
+                break;
+            }
+            case Pattern::random:
+            {
+                u = random.nextFloat();
+                v = random.nextFloat();
+                break;
+            }
+        }
+
+        float z = 1.0f - u * (1.0f - minCosine);
+        float phi = juce::MathConstants<float>::twoPi * v;
+        float radius = std::sqrt (juce::jmax (0.0f, 1.0f - z * z));
+        return { radius * std::cos (phi), radius * std::sin (phi), z };
+    }
+
+    // the step through the Fibonacci points closest to numDirections / golden ratio that visits each of them once; the
+    // heights of the points taken so far then follow the golden ratio sequence, which leaves no gap of the sphere behind
+    static size_t getGoldenStride (size_t numDirections) noexcept
+    {
+        constexpr double goldenRatio = 1.6180339887498949;
+        size_t stride = juce::jmax ((size_t) 1, (size_t) std::round ((double) numDirections / goldenRatio));
+
+        while (std::gcd (stride, numDirections) != 1)
+            ++stride;
+
+        return stride;
+    }
+
+    Matrix getFrameOf (const Domain& domain) const noexcept
+    {
+        // the whole sphere is rotated freely, a cone can only be spun around its axis
+        if (domain.minCosine <= -1.0f)
+            return rotation;
+
+        float cosine = std::cos (spin), sine = std::sin (spin);
+        Matrix spun { AcousticVector { cosine, sine, 0.0f }, AcousticVector { -sine, cosine, 0.0f }, AcousticVector { 0.0f, 0.0f, 1.0f } };
+        return multiply (getBasisAround (domain.axis), spun);
+    }
+
+    static void transform (Batch& batch, const Matrix& matrix) noexcept
+    {
+        for (size_t packet = 0; packet < batch.x.size(); ++packet)
+        {
+            auto x = batch.x[packet], y = batch.y[packet], z = batch.z[packet];
+            batch.x[packet] = x * matrix[0].x + y * matrix[1].x + z * matrix[2].x;
+            batch.y[packet] = x * matrix[0].y + y * matrix[1].y + z * matrix[2].y;
+            batch.z[packet] = x * matrix[0].z + y * matrix[1].z + z * matrix[2].z;
+        }
+    }
+
+    static Matrix multiply (const Matrix& a, const Matrix& b) noexcept
+    {
+        Matrix product;
+        for (size_t column = 0; column < 3; ++column)
+            product[column] = a[0] * b[column].x + a[1] * b[column].y + a[2] * b[column].z;
+
+        return product;
+    }
+
+    // an orthonormal basis whose third vector is the axis (Duff et al., "Building an Orthonormal Basis, Revisited")
+    static Matrix getBasisAround (const AcousticVector& axis) noexcept
+    {
+        float sign = std::copysign (1.0f, axis.z);
+        float a = -1.0f / (sign + axis.z);
+        float b = axis.x * axis.y * a;
+        return { AcousticVector { 1.0f + sign * axis.x * axis.x * a, sign * b, -sign * axis.x },
+                 AcousticVector { b, sign + axis.y * axis.y * a, -axis.y },
+                 axis };
+    }
+
+    // a uniformly distributed rotation, from a random unit quaternion (Shoemake)
+    Matrix getRandomRotation()
+    {
+        float u1 = random.nextFloat(), u2 = random.nextFloat(), u3 = random.nextFloat();
+        float lower = std::sqrt (1.0f - u1), upper = std::sqrt (u1);
+        float twoPi = juce::MathConstants<float>::twoPi;
+        float qx = lower * std::sin (twoPi * u2), qy = lower * std::cos (twoPi * u2);
+        float qz = upper * std::sin (twoPi * u3), qw = upper * std::cos (twoPi * u3);
+
+        return { AcousticVector { 1.0f - 2.0f * (qy * qy + qz * qz), 2.0f * (qx * qy + qz * qw), 2.0f * (qx * qz - qy * qw) },
+                 AcousticVector { 2.0f * (qx * qy - qz * qw), 1.0f - 2.0f * (qx * qx + qz * qz), 2.0f * (qy * qz + qx * qw) },
+                 AcousticVector { 2.0f * (qx * qz + qy * qw), 2.0f * (qy * qz - qx * qw), 1.0f - 2.0f * (qx * qx + qy * qy) } };
+    }
+
+    static juce::uint32 getSobol (juce::uint32 index, int dimension) noexcept
+    {
+        // the first dimension is the van der Corput sequence, the second one has the direction numbers v = v ^ (v >> 1)
+        juce::uint32 result = 0, directionNumber = 0x80000000u;
+        for (; index != 0; index >>= 1)
+        {
+            if ((index & 1) != 0)
+                result ^= directionNumber;
+
+            directionNumber = dimension == 0 ? directionNumber >> 1 : directionNumber ^ (directionNumber >> 1);
+        }
+
+        return result;
+    }
+
+    // nested uniform (Owen) scrambling of the bits of x, after Burley, "Practical Hash-based Owen Scrambling"
+    static juce::uint32 scramble (juce::uint32 x, juce::uint32 seed) noexcept
+    {
+        x = reverseBits (x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverseBits (x);
+    }
+
+    static juce::uint32 reverseBits (juce::uint32 x) noexcept
+    {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    static juce::uint32 hash (juce::uint32 x) noexcept
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        return x ^ (x >> 16);
+    }
+
+    static float toUnitFloat (juce::uint32 x) noexcept
+    {
+        // the upper 24 bits, so that the result stays below 1
+        return (float) (x >> 8) * (1.0f / 16777216.0f);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticDirectionGenerator)
+};
@@ -0,0 +1,102 @@
+//
+//  AcousticGeometry.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+// the small amount of vector maths needed by the native acoustics (Unity's coordinate system, in metres)
+struct AcousticVector
+{
+    float x { 0.0f }, y { 0.0f }, z { 0.0f };
+
+    AcousticVector() = default;
+    AcousticVector (float newX, float newY, float newZ) : x (newX), y (newY), z (newZ) {}
+
+    AcousticVector operator+ (const AcousticVector& other) const noexcept { return { x + other.x, y + other.y, z + other.z }; }
+    AcousticVector operator- (const AcousticVector& other) const noexcept { return { x - other.x, y - other.y, z - other.z }; }
+    AcousticVector operator* (float scale) const noexcept                 { return { x * scale, y * scale, z * scale }; }
+
+    float operator[] (size_t axis) const noexcept
+    {
+        jassert (axis < 3);
+        return axis == 0 ? x : (axis == 1 ? y : z);
+    }
+
+    float dot (const AcousticVector& other) const noexcept
+    {
+        return x * other.x + y * other.y + z * other.z;
+    }
+
+    AcousticVector cross (const AcousticVector& other) const noexcept
+    {
+        return { y * other.z - z * other.y, z * other.x - x * other.z, x * other.y - y * other.x };
+    }
+
+    float length() const noexcept
+    {
+        return std::sqrt (dot (*this));
+    }
+
+    AcousticVector normalised() const noexcept
+    {
+        float currentLength = length();
+        return currentLength > 0.0f ? *this * (1.0f / currentLength) : *this;
+    }
+
+    static AcousticVector min (const AcousticVector& a, const AcousticVector& b) noexcept
+    {
+        return { juce::jmin (a.x, b.x), juce::jmin (a.y, b.y), juce::jmin (a.z, b.z) };
+    }
+
+    static AcousticVector max (const AcousticVector& a, const AcousticVector& b) noexcept
+    {
+        return { juce::jmax (a.x, b.x), juce::jmax (a.y, b.y), juce::jmax (a.z, b.z) };
+    }
+};
+
+struct AcousticBounds
+{
+    AcousticVector min { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+    AcousticVector max { std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest() };
+
+    void expand (const AcousticVector& point) noexcept
+    {
+        min = AcousticVector::min (min, point);
+        max = AcousticVector::max (max, point);
+    }
+
+    void expand (const AcousticBounds& other) noexcept
+    {
+        min = AcousticVector::min (min, other.min);
+        max = AcousticVector::max (max, other.max);
+    }
+
+    bool isEmpty() const noexcept
+    {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    bool contains (const AcousticBounds& other) const noexcept
+    {
+        return other.min.x >= min.x && other.min.y >= min.y && other.min.z >= min.z
+            && other.max.x <= max.x && other.max.y <= max.y && other.max.z <= max.z;
+    }
+
+    float getSurfaceArea() const noexcept
+    {
+        if (isEmpty())
+            return 0.0f;
+
+        auto size = max - min;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+};
+
+struct AcousticRay
+{
+    AcousticVector origin;
+    AcousticVector direction; // normalised
+    float maxDistance { std::numeric_limits<float>::max() };
+};
@@ -0,0 +1,75 @@
+//
+//  AcousticMailbox.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+/*  Hands the latest result of a worker to any number of readers (e.g. the audio thread) without locks.
+    It is a sequence lock: the writer never waits, and a reader simply retries if it caught the writer in the middle
+    of an update. The value is kept in atomic words, so a torn read is detected rather than undefined.
+*/
+template <typename Value>
+class AcousticMailbox
+{
+public:
+    static_assert (std::is_trivially_copyable<Value>::value, "the value is copied word by word");
+
+    AcousticMailbox()
+    {
+        for (auto& word : words)
+            word.store (0, std::memory_order_relaxed);
+    }
+
+    // must only be called from one thread at a time
+    void publish (const Value& value) noexcept
+    {
+        std::array<juce::uint32, numWords> source {};
+        std::memcpy (source.data(), &value, sizeof (Value));
+
+        auto current = sequence.load (std::memory_order_relaxed);
+        sequence.store (current + 1, std::memory_order_relaxed); // odd while the value is being written
+        std::atomic_thread_fence (std::memory_order_release);
+
+        for (size_t i = 0; i < numWords; ++i)
+            words[i].store (source[i], std::memory_order_relaxed);
+
+        sequence.store (current + 2, std::memory_order_release);
+    }
+
+    // returns true if a value has been published since lastSequence (which is updated), without ever blocking the writer
+    bool read (Value& value, juce::uint32& lastSequence) const noexcept
+    {
+        std::array<juce::uint32, numWords> destination;
+
+        for (;;)
+        {
+            auto before = sequence.load (std::memory_order_acquire);
+            if (before == lastSequence || before == 0)
+                return false;
+
+            if ((before & 1) != 0)
+                continue;
+
+            for (size_t i = 0; i < numWords; ++i)
+                destination[i] = words[i].load (std::memory_order_relaxed);
+
+            std::atomic_thread_fence (std::memory_order_acquire);
+            if (sequence.load (std::memory_order_relaxed) == before)
+            {
+                std::memcpy (static_cast<void*> (&value), destination.data(), sizeof (Value));
+                lastSequence = before;
+                return true;
+            }
+        }
+    }
+
+private:
+    static constexpr size_t numWords = (sizeof (Value) + sizeof (juce::uint32) - 1) / sizeof (juce::uint32);
+
+    std::atomic<juce::uint32> sequence { 0 };
+    std::array<std::atomic<juce::uint32>, numWords> words;
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticMailbox)
+};
@@ -0,0 +1,284 @@
+//
+//  AcousticQueryCache.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "AcousticRayReservoir.h"
+#include "AcousticDiffraction.h"
+#include <list>
+#include <unordered_map>
+
+/*  A bounded LRU cache of the results of the acoustic queries, so that the spots the player keeps coming back to don't
+    have to be traced again: the converged reverb estimates (ReverbEstimate) and the paths of the link from the source
+    to the listener, i.e. its obstruction and its filter (DiffractionPath). The source and the listener positions are
+    snapped to the points of a regular grid, and a key is made of the two grid points and the version of the scene (an
+    entry of an old scene can never be returned).
+    Lookups interpolate trilinearly between the grid points around the listener. Paths are only interpolated between
+    points that agree on the way around the obstacles (direct, or over as many edges); otherwise the nearest one wins.
+*/
+template <typename Estimate>
+class AcousticQueryCache
+{
+public:
+    struct Statistics
+    {
+        juce::int64 lookups { 0 };
+        juce::int64 hits { 0 };        // all neighbouring grid points were cached
+        juce::int64 partialHits { 0 }; // some of them were cached
+        juce::int64 misses { 0 };
+        juce::int64 evictions { 0 };
+
+        float getHitRate() const noexcept
+        {
+            return lookups > 0 ? (float) hits / (float) lookups : 0.0f;
+        }
+    };
+
+    struct Lookup
+    {
+        Estimate estimate;
+        float coverage { 0.0f }; // the share of the interpolation weight that was cached, 1 for a full hit
+
+        bool isHit() const noexcept
+        {
+            return coverage >= 1.0f;
+        }
+    };
+
+    explicit AcousticQueryCache (size_t maxNumEntries = 4096, float newCellSize = 0.5f)
+        : capacity (maxNumEntries), cellSize (newCellSize)
+    {
+        // make sure that the input values are valid
+        jassert (capacity > 0 && cellSize > 0.0f);
+        entries.reserve (capacity);
+    }
+
+    Lookup lookup (const AcousticVector& source, const AcousticVector& listener, juce::uint32 sceneVersion)
+    {
+        ++statistics.lookups;
+
+        Lookup result;
+        auto sourcePoint = getNearestPoint (source);
+
+        // the listener lies in a cell, whose 8 corners we interpolate between
+        std::array<int, 3> lowerCorner;
+        std::array<float, 3> fraction;
+        for (size_t axis = 0; axis < 3; ++axis)
+        {
+            float position = listener[axis] / cellSize;
+            lowerCorner[axis] = (int) std::floor (position);
+            fraction[axis] = position - (float) lowerCorner[axis];
+        }
+
+        std::array<std::pair<const Estimate*, float>, 8> found;
+        size_t numFound = 0;
+        float totalWeight = 0.0f;
+
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            std::array<int, 3> listenerPoint;
+            float weight = 1.0f;
+            for (size_t axis = 0; axis < 3; ++axis)
+            {
+                bool upper = ((corner >> axis) & 1) != 0;
+                listenerPoint[axis] = lowerCorner[axis] + (upper ? 1 : 0);
+                weight *= upper ? fraction[axis] : 1.0f - fraction[axis];
+            }
+
+            if (weight <= 0.0f)
+                continue;
+
+            if (auto* estimate = find ({ sourcePoint, listenerPoint, sceneVersion }))
+            {
+                found[numFound++] = { estimate, weight };
+                totalWeight += weight;
+            }
+        }
+
+        // corners with zero weight don't count, so a listener right on a grid point only needs that one
+        result.coverage = totalWeight > 1.0f - 1e-5f ? 1.0f : totalWeight;
+
+        if (totalWeight > 0.0f)
+            result.estimate = interpolate (found.data(), numFound, totalWeight);
+
+        if (result.isHit())
+            ++statistics.hits;
+        else if (totalWeight > 0.0f)
+            ++statistics.partialHits;
+        else
+            ++statistics.misses;
+
+        return result;
+    }
+
+    // the estimate is filed under the grid points nearest to the source and the listener
+    void store (const AcousticVector& source, const AcousticVector& listener, juce::uint32 sceneVersion, const Estimate& estimate)
+    {
+        Key key { getNearestPoint (source), getNearestPoint (listener), sceneVersion };
+
+        auto existing = entries.find (key);
+        if (existing != entries.end())
+        {
+            existing->second->estimate = estimate;
+            recentlyUsed.splice (recentlyUsed.begin(), recentlyUsed, existing->second);
+            return;
+        }
+
+        if (entries.size() >= capacity)
+        {
+            entries.erase (recentlyUsed.back().key);
+            recentlyUsed.pop_back();
+            ++statistics.evictions;
+        }
+
+        recentlyUsed.push_front ({ key, estimate });
+        entries.emplace (key, recentlyUsed.begin());
+    }
+
+    // called when the geometry changes, since the entries of the old scene can't be hit anymore
+    void invalidate()
+    {
+        entries.clear();
+        recentlyUsed.clear();
+    }
+
+    const Statistics& getStatistics() const noexcept
+    {
+        return statistics;
+    }
+
+    void resetStatistics() noexcept
+    {
+        statistics = {};
+    }
+
+    size_t getNumEntries() const noexcept
+    {
+        return entries.size();
+    }
+
+private:
+    struct Key
+    {
+        std::array<int, 3> source;
+        std::array<int, 3> listener;
+        juce::uint32 sceneVersion;
+
+        bool operator== (const Key& other) const noexcept
+        {
+            return source == other.source && listener == other.listener && sceneVersion == other.sceneVersion;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator() (const Key& key) const noexcept
+        {
+            // spatial hash of the two grid points (with the primes of Teschner et al.) and the scene version
+            auto hashPoint = [] (const std::array<int, 3>& point)
+            {
+                return ((juce::uint64) (juce::uint32) point[0] * 73856093u)
+                     ^ ((juce::uint64) (juce::uint32) point[1] * 19349663u)
+                     ^ ((juce::uint64) (juce::uint32) point[2] * 83492791u);
+            };
+
+            juce::uint64 hash = hashPoint (key.source);
+            hash ^= hashPoint (key.listener) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+            hash ^= (juce::uint64) key.sceneVersion * 0xff51afd7ed558ccdull;
+            return (size_t) hash;
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        Estimate estimate;
+    };
+
+    size_t capacity;
+    float cellSize;
+
+    std::list<Entry> recentlyUsed; // most recently used first
+    std::unordered_map<Key, typename std::list<Entry>::iterator, KeyHash> entries;
+    Statistics statistics;
+
+    // helper functions
+    std::array<int, 3> getNearestPoint (const AcousticVector& position) const noexcept
+    {
+        return { (int) std::lround (position.x / cellSize), (int) std::lround (position.y / cellSize), (int) std::lround (position.z / cellSize) };
+    }
+
+    const Estimate* find (const Key& key)
+    {
+        auto entry = entries.find (key);
+        if (entry == entries.end())
+            return nullptr;
+
+        recentlyUsed.splice (recentlyUsed.begin(), recentlyUsed, entry->second);
+        return &entry->second->estimate;
+    }
+
+    static ReverbEstimate interpolate (const std::pair<const ReverbEstimate*, float>* found, size_t numFound, float totalWeight) noexcept
+    {
+        ReverbEstimate sum;
+        sum.averageAbsorption = 0.0f;
+
+        for (size_t i = 0; i < numFound; ++i)
+        {
+            auto& [estimate, weight] = found[i];
+            sum.obstructedReflections += weight * estimate->obstructedReflections;
+            sum.longestDistance       += weight * estimate->longestDistance;
+            sum.averageDistance       += weight * estimate->averageDistance;
+            sum.averageAbsorption     += weight * estimate->averageAbsorption;
+            sum.numRays = juce::jmax (sum.numRays, estimate->numRays);
+        }
+
+        sum.obstructedReflections /= totalWeight;
+        sum.longestDistance       /= totalWeight;
+        sum.averageDistance       /= totalWeight;
+        sum.averageAbsorption     /= totalWeight;
+        return sum;
+    }
+
+    static DiffractionPath interpolate (const std::pair<const DiffractionPath*, float>* found, size_t numFound, float totalWeight) noexcept
+    {
+        // a path around the other side of an obstacle (or one that is blocked) can't be blended in, so the nearest
+        // point is taken as it is unless all the points agree
+        auto* nearest = std::max_element (found, found + numFound, [] (auto& a, auto& b) { return a.second < b.second; });
+        bool allAgree = std::all_of (found, found + numFound, [nearest] (auto& point)
+        {
+            return point.first->isDirect == nearest->first->isDirect && point.first->numEdges == nearest->first->numEdges;
+        });
+
+        if (! allAgree || (! nearest->first->isDirect && nearest->first->numEdges == 0))
+            return *nearest->first;
+
+        DiffractionPath sum;
+        sum.isDirect = nearest->first->isDirect;
+        sum.numEdges = nearest->first->numEdges;
+
+        for (size_t i = 0; i < numFound; ++i)
+        {
+            auto& [path, weight] = found[i];
+            sum.length           += weight * path->length;
+            sum.directDistance   += weight * path->directDistance;
+            sum.apparentPosition = sum.apparentPosition + path->apparentPosition * weight;
+
+            for (size_t band = 0; band < AcousticBands::numBands; ++band)
+                sum.bandGains[band] += weight * path->bandGains[band];
+        }
+
+        sum.length           /= totalWeight;
+        sum.directDistance   /= totalWeight;
+        sum.apparentPosition = sum.apparentPosition * (1.0f / totalWeight);
+
+        for (auto& gain : sum.bandGains)
+            gain /= totalWeight;
+
+        return sum;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticQueryCache)
+};
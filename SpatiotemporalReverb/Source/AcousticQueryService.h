@@ -0,0 +1,517 @@
+//
+//  AcousticQueryService.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "AcousticScene.h"
+#include "AcousticRayReservoir.h"
+#include "AcousticQueryCache.h"
+#include "AcousticDiffraction.h"
+#include "AcousticMailbox.h"
+#include "AcousticRooms.h"
+#include "QualityGovernor.h"
+#include <deque>
+
+/*  Runs the acoustic analysis of the sources on a pool of worker threads, so that the game thread never waits for rays.
+    - the game thread submits a query per source and frame; a newer query of a source replaces one that hasn't run yet
+    - the jobs are spread over per-worker queues, and idle workers steal from the others
+    - the work started per frame is limited by a time budget, the rest waits for the next frame
+    - each source has a mailbox that the audio thread (or the game thread) reads the latest result from, lock-free
+    - the quality governor scales the ray budget of a source down when the CPU budget is overrun
+    - the analyses of the whole scene (its rooms and its diffracting edges) run on the same workers, ahead of the
+      sources; they aren't limited by the time budget, their results replace the shared rooms and edges once done
+    Sources are identified by a slot number, which is also the "Acoustic Source" parameter of the plugin.
+*/
+class AcousticQueryService
+{
+public:
+    static constexpr int maxNumSources = 256;
+
+    struct Query
+    {
+        AcousticVector source;
+        AcousticVector listener;
+        size_t rayBudget { 0 };
+    };
+
+    AcousticQueryService()
+    {
+        int numWorkers = juce::jlimit (1, 4, juce::SystemStats::getNumCpus() - 2);
+        for (int i = 0; i < numWorkers; ++i)
+            workers.push_back (std::make_unique<Worker> (*this, i));
+
+        for (auto& worker : workers)
+            worker->startThread();
+    }
+
+    ~AcousticQueryService()
+    {
+        for (auto& worker : workers)
+            worker->signalThreadShouldExit();
+
+        workAvailable.signal();
+
+        for (auto& worker : workers)
+            worker->stopThread (1000);
+    }
+
+    // called from the game thread, never blocks on the analysis
+    void submit (int slot, const Query& query)
+    {
+        // make sure that the slot is valid
+        jassert (juce::isPositiveAndBelow (slot, maxNumSources));
+        auto& state = sources[(size_t) slot];
+
+        {
+            const juce::SpinLock::ScopedLockType lock (state.queryLock);
+            state.pendingQuery = query;
+            state.hasPendingQuery = true;
+        }
+
+        state.isActive = true;
+        schedule (slot);
+    }
+
+    // the source's reservoir is dropped the next time one of its jobs runs
+    void removeSource (int slot)
+    {
+        jassert (juce::isPositiveAndBelow (slot, maxNumSources));
+        sources[(size_t) slot].isActive = false;
+        schedule (slot);
+    }
+
+    // starts the time budget of a new frame; a budget of 0 means unlimited
+    void beginFrame (double budgetMilliseconds)
+    {
+        frameBudgetTicks = (juce::int64) (budgetMilliseconds * 1e-3 * (double) juce::Time::getHighResolutionTicksPerSecond());
+        lastFrameTicksUsed = frameTicksUsed.exchange (0);
+        workAvailable.signal();
+    }
+
+    // safe to call from the audio thread
+    bool readResult (int slot, ReverbEstimate& estimate, juce::uint32& lastSequence) const noexcept
+    {
+        if (! juce::isPositiveAndBelow (slot, maxNumSources))
+            return false;
+
+        return sources[(size_t) slot].mailbox.read (estimate, lastSequence);
+    }
+
+    // finds the way around the obstacles from the source to the listener like AcousticEdgeGraph::findPath, but looks
+    // it up in the path cache first; a search that finds no way is cached too. Called from the game thread
+    bool findDiffractionPath (const AcousticEdgeGraph& graph, const AcousticScene& scene, juce::uint32 sceneVersion,
+                              const AcousticVector& source, const AcousticVector& listener, DiffractionPath& path)
+    {
+        {
+            const juce::SpinLock::ScopedLockType lock (cacheLock);
+            updateCachedSceneVersion (sceneVersion);
+
+            auto cached = pathCache.lookup (source, listener, sceneVersion);
+            if (cached.isHit())
+            {
+                path = cached.estimate;
+                return path.isDirect || path.numEdges > 0;
+            }
+        }
+
+        bool isFound = graph.findPath (scene, source, listener, getSpeedOfSound(), path);
+
+        const juce::SpinLock::ScopedLockType lock (cacheLock);
+        pathCache.store (source, listener, sceneVersion, path);
+        return isFound;
+    }
+
+    // queues the room analysis of the loaded scene; a newer request replaces one that hasn't started yet. Called from
+    // the game thread, the rooms are published to SharedAcousticRooms once a worker is done with them
+    void analyseRooms (const AcousticRoomMap::Settings& settings)
+    {
+        {
+            const juce::SpinLock::ScopedLockType lock (sceneAnalysisLock);
+            pendingRoomSettings = settings;
+            if (! hasPendingRoomAnalysis)
+                ++numRoomAnalyses;
+
+            hasPendingRoomAnalysis = true;
+        }
+
+        workAvailable.signal();
+    }
+
+    // queues the extraction of the diffracting edges of the loaded scene, like analyseRooms()
+    void analyseEdges (const AcousticEdgeGraph::Settings& settings)
+    {
+        {
+            const juce::SpinLock::ScopedLockType lock (sceneAnalysisLock);
+            pendingEdgeSettings = settings;
+            if (! hasPendingEdgeAnalysis)
+                ++numEdgeAnalyses;
+
+            hasPendingEdgeAnalysis = true;
+        }
+
+        workAvailable.signal();
+    }
+
+    // whether a room analysis has been queued and its rooms haven't been published yet
+    bool isRoomAnalysisPending() const noexcept
+    {
+        return numRoomAnalyses.load() > 0;
+    }
+
+    bool isEdgeAnalysisPending() const noexcept
+    {
+        return numEdgeAnalyses.load() > 0;
+    }
+
+    // the statistics of the reverb estimates and of the paths added up
+    AcousticQueryCache<ReverbEstimate>::Statistics getCacheStatistics (size_t& numEntries) const
+    {
+        const juce::SpinLock::ScopedLockType lock (cacheLock);
+        numEntries = queryCache.getNumEntries() + pathCache.getNumEntries();
+
+        auto statistics = queryCache.getStatistics();
+        auto& pathStatistics = pathCache.getStatistics();
+        statistics.lookups     += pathStatistics.lookups;
+        statistics.hits        += pathStatistics.hits;
+        statistics.partialHits += pathStatistics.partialHits;
+        statistics.misses      += pathStatistics.misses;
+        statistics.evictions   += pathStatistics.evictions;
+        return statistics;
+    }
+
+    // the time the workers spent on the analysis during the last frame
+    double getLastFrameMilliseconds() const noexcept
+    {
+        return 1e3 * (double) lastFrameTicksUsed.load() / (double) juce::Time::getHighResolutionTicksPerSecond();
+    }
+
+    int getNumWorkers() const noexcept
+    {
+        return (int) workers.size();
+    }
+
+    // the speed of sound in the medium of the level (see AudioManager.getSoundSpeed), in meters per second
+    void setSpeedOfSound (float newSpeedOfSound) noexcept
+    {
+        // make sure that the speed of sound is valid
+        jassert (newSpeedOfSound > 0.0f);
+
+        // the cached diffraction paths were attenuated for the wavelengths of the old speed
+        if (speedOfSound.exchange (newSpeedOfSound) != newSpeedOfSound)
+        {
+            const juce::SpinLock::ScopedLockType lock (cacheLock);
+            pathCache.invalidate();
+        }
+    }
+
+    float getSpeedOfSound() const noexcept
+    {
+        return speedOfSound.load (std::memory_order_relaxed);
+    }
+
+private:
+    struct SourceState
+    {
+        juce::SpinLock queryLock;
+        Query pendingQuery;
+        bool hasPendingQuery { false };
+
+        std::atomic<bool> isActive { false };
+        std::atomic<bool> isScheduled { false }; // at most one job per source is queued or running
+
+        // only touched by the job of the source
+        std::unique_ptr<AcousticRayReservoir> reservoir;
+        std::shared_ptr<const AcousticScene> scene;
+
+        AcousticMailbox<ReverbEstimate> mailbox;
+    };
+
+    class Worker : public juce::Thread
+    {
+    public:
+        Worker (AcousticQueryService& ownerToUse, int indexToUse)
+            : juce::Thread ("Acoustic query worker " + juce::String (indexToUse)), owner (ownerToUse), index (indexToUse)
+        {
+        }
+
+        void run() override
+        {
+            while (! threadShouldExit())
+            {
+                // a scene analysis is a one-off job, so it doesn't count towards the time budget of a frame
+                if (owner.runSceneAnalysis())
+                    continue;
+
+                int slot = -1;
+                if (owner.isWithinBudget())
+                    slot = owner.takeJob (index);
+
+                if (slot < 0)
+                {
+                    owner.workAvailable.wait (5);
+                    continue;
+                }
+
+                auto start = juce::Time::getHighResolutionTicks();
+                owner.runJob (slot);
+                owner.frameTicksUsed += juce::Time::getHighResolutionTicks() - start;
+            }
+        }
+
+        // the queue of this worker; the owner takes from the back, thieves from the front
+        juce::SpinLock queueLock;
+        std::deque<int> queue;
+
+    private:
+        AcousticQueryService& owner;
+        int index;
+    };
+
+    juce::SharedResourcePointer<SharedAcousticScene> sharedScene;
+    juce::SharedResourcePointer<SharedAcousticRooms> sharedRooms;
+    juce::SharedResourcePointer<SharedAcousticEdgeGraph> sharedEdgeGraph;
+    juce::SharedResourcePointer<QualityGovernor> qualityGovernor;
+    std::array<SourceState, maxNumSources> sources;
+    std::vector<std::unique_ptr<Worker>> workers;
+    juce::WaitableEvent workAvailable;
+
+    std::atomic<juce::int64> frameBudgetTicks { 0 };
+    std::atomic<juce::int64> frameTicksUsed { 0 };
+    std::atomic<juce::int64> lastFrameTicksUsed { 0 };
+    std::atomic<float> speedOfSound { 343.0f };
+
+    juce::SpinLock cacheLock;
+    AcousticQueryCache<ReverbEstimate> queryCache;
+    AcousticQueryCache<DiffractionPath> pathCache;
+    juce::uint32 cachedSceneVersion { 0 }; // guarded by cacheLock
+
+    juce::SpinLock sceneAnalysisLock;
+    AcousticRoomMap::Settings pendingRoomSettings;
+    AcousticEdgeGraph::Settings pendingEdgeSettings;
+    bool hasPendingRoomAnalysis { false }, hasPendingEdgeAnalysis { false };
+    std::atomic<int> numRoomAnalyses { 0 }, numEdgeAnalyses { 0 }; // queued or running
+
+    // helper functions
+    // must be called with cacheLock held
+    void updateCachedSceneVersion (juce::uint32 sceneVersion)
+    {
+        if (cachedSceneVersion != sceneVersion)
+        {
+            queryCache.invalidate();
+            pathCache.invalidate();
+            cachedSceneVersion = sceneVersion;
+        }
+    }
+
+    // runs one pending scene analysis, if there is any; the rooms and the edges can run on two workers at once
+    bool runSceneAnalysis()
+    {
+        AcousticRoomMap::Settings roomSettings;
+        AcousticEdgeGraph::Settings edgeSettings;
+        bool shouldAnalyseRooms = false, shouldAnalyseEdges = false;
+        {
+            const juce::SpinLock::ScopedLockType lock (sceneAnalysisLock);
+            if (hasPendingRoomAnalysis)
+            {
+                roomSettings = pendingRoomSettings;
+                shouldAnalyseRooms = true;
+                hasPendingRoomAnalysis = false;
+            }
+            else if (hasPendingEdgeAnalysis)
+            {
+                edgeSettings = pendingEdgeSettings;
+                shouldAnalyseEdges = true;
+                hasPendingEdgeAnalysis = false;
+            }
+        }
+
+        if (! shouldAnalyseRooms && ! shouldAnalyseEdges)
+            return false;
+
+        auto snapshot = sharedScene->getSnapshot();
+        if (snapshot.scene != nullptr)
+        {
+            if (shouldAnalyseRooms)
+            {
+                auto rooms = std::make_shared<AcousticRoomMap> (*snapshot.scene, snapshot.version, roomSettings);
+
+                // a scene that was loaded meanwhile has dropped the rooms of the old one, which we mustn't bring back
+                if (sharedScene->getSnapshot().version == snapshot.version)
+                    sharedRooms->set (std::move (rooms));
+            }
+            else
+            {
+                auto graph = std::make_shared<AcousticEdgeGraph> (*snapshot.scene, snapshot.version, edgeSettings);
+
+                if (sharedScene->getSnapshot().version == snapshot.version)
+                    sharedEdgeGraph->set (std::move (graph));
+            }
+        }
+
+        if (shouldAnalyseRooms)
+            --numRoomAnalyses;
+        else
+            --numEdgeAnalyses;
+
+        return true;
+    }
+
+    bool isWithinBudget() const noexcept
+    {
+        auto budget = frameBudgetTicks.load();
+        return budget <= 0 || frameTicksUsed.load() < budget;
+    }
+
+    void schedule (int slot)
+    {
+        if (sources[(size_t) slot].isScheduled.exchange (true))
+            return;
+
+        // a source always goes to the same worker first, which keeps its reservoir in that core's cache
+        auto& worker = *workers[(size_t) slot % workers.size()];
+        {
+            const juce::SpinLock::ScopedLockType lock (worker.queueLock);
+            worker.queue.push_back (slot);
+        }
+
+        workAvailable.signal();
+    }
+
+    int takeJob (int workerIndex)
+    {
+        auto& ownWorker = *workers[(size_t) workerIndex];
+        {
+            const juce::SpinLock::ScopedLockType lock (ownWorker.queueLock);
+            if (! ownWorker.queue.empty())
+            {
+                int slot = ownWorker.queue.back();
+                ownWorker.queue.pop_back();
+                return slot;
+            }
+        }
+
+        // our own queue is empty, so we steal the oldest job of another worker
+        for (size_t offset = 1; offset < workers.size(); ++offset)
+        {
+            auto& victim = *workers[((size_t) workerIndex + offset) % workers.size()];
+            const juce::SpinLock::ScopedLockType lock (victim.queueLock);
+            if (! victim.queue.empty())
+            {
+                int slot = victim.queue.front();
+                victim.queue.pop_front();
+                return slot;
+            }
+        }
+
+        return -1;
+    }
+
+    void runJob (int slot)
+    {
+        auto& state = sources[(size_t) slot];
+
+        Query query;
+        bool hasQuery;
+        {
+            const juce::SpinLock::ScopedLockType lock (state.queryLock);
+            query = state.pendingQuery;
+            hasQuery = state.hasPendingQuery;
+            state.hasPendingQuery = false;
+        }
+
+        if (! state.isActive)
+        {
+            state.reservoir.reset();
+            state.scene.reset();
+        }
+        else if (hasQuery)
+        {
+            ReverbEstimate estimate;
+            if (analyse (slot, state, query, estimate))
+                state.mailbox.publish (estimate);
+        }
+
+        // a query that came in while we were running is scheduled again
+        state.isScheduled = false;
+
+        bool hasNewQuery;
+        {
+            const juce::SpinLock::ScopedLockType lock (state.queryLock);
+            hasNewQuery = state.hasPendingQuery;
+        }
+
+        if (hasNewQuery)
+            schedule (slot);
+    }
+
+    bool analyse (int slot, SourceState& state, const Query& query, ReverbEstimate& estimate)
+    {
+        auto snapshot = sharedScene->getSnapshot();
+        if (snapshot.scene == nullptr)
+            return false;
+
+        // we hold on to the scene, so that a reloaded scene can never end up at the address of the old one
+        state.scene = snapshot.scene;
+        if (state.reservoir == nullptr)
+            state.reservoir = std::make_unique<AcousticRayReservoir>();
+
+        // spots that have been analysed before don't need any rays
+        AcousticQueryCache<ReverbEstimate>::Lookup cached;
+        {
+            const juce::SpinLock::ScopedLockType lock (cacheLock);
+            updateCachedSceneVersion (snapshot.version);
+            cached = queryCache.lookup (query.source, query.listener, snapshot.version);
+        }
+
+        // in a closed room the delay and the absorption come from the room analysis, the rays only correct locally
+        // (obstruction and size), which takes fewer of them
+        auto rooms = sharedRooms->get();
+        if (rooms != nullptr && rooms->getSceneVersion() != snapshot.version)
+            rooms.reset();
+
+        const AcousticRoom* room = rooms != nullptr ? rooms->getRoomAt (query.listener) : nullptr;
+        int sourceRoom = rooms != nullptr ? rooms->getRoomIndexAt (query.source) : -1;
+
+        auto rayBudget = room != nullptr ? juce::jmax ((size_t) 1, query.rayBudget / 2) : query.rayBudget;
+        rayBudget = juce::jmax ((size_t) 1, (size_t) ((float) rayBudget * qualityGovernor->getRayBudgetScale (slot)));
+
+        estimate = cached.estimate;
+        estimate.directDistance = (query.source - query.listener).length();
+        if (cached.isHit())
+            return applyRoom (room, sourceRoom, estimate);
+
+        auto traced = state.reservoir->update (*snapshot.scene, query.source, query.listener, rayBudget);
+
+        // once the reservoir has converged it is worth keeping; until then a partial hit beats a handful of rays
+        if (state.reservoir->isConverged())
+        {
+            const juce::SpinLock::ScopedLockType lock (cacheLock);
+            queryCache.store (query.source, query.listener, snapshot.version, traced);
+        }
+
+        if (state.reservoir->isConverged() || cached.coverage == 0.0f)
+        {
+            estimate = traced;
+            estimate.directDistance = (query.source - query.listener).length();
+        }
+
+        return applyRoom (room, sourceRoom, estimate);
+    }
+
+    static bool applyRoom (const AcousticRoom* room, int sourceRoom, ReverbEstimate& estimate) noexcept
+    {
+        estimate.sourceRoom = sourceRoom;
+
+        if (room != nullptr)
+        {
+            estimate.averageDistance = room->meanFreePath;
+            estimate.averageAbsorption = room->meanAbsorption;
+        }
+
+        return true;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticQueryService)
+};
@@ -0,0 +1,301 @@
+//
+//  AcousticRayReservoir.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "AcousticScene.h"
+#include "AcousticDirections.h"
+
+// the reverb parameters that the rays of a source estimate (the same quantities as DiffusionRayHandler in Unity)
+struct ReverbEstimate
+{
+    float obstructedReflections { 0.0f }; // share of the reflections that can't reach the listener
+    float longestDistance { 0.0f };       // longest distance to a surface, drives the diffusion size
+    float averageDistance { 0.0f };       // average distance of the paths that reach the listener, drives the delay time
+    float averageAbsorption { 1.0f };     // average absorption of the surfaces that were hit, drives the feedback
+    size_t numRays { 0 };
+    int sourceRoom { -1 };                // the room of the source (see AcousticRoomMap), -1 outside of every room
+    float directDistance { 0.0f };        // straight from the source to the listener, drives the propagation delay
+};
+
+/*  Keeps the ray results of a source across frames instead of throwing them away. Every update casts only a small
+    budget of new rays, which replace the oldest ones, and the estimate is taken over the whole reservoir, so it
+    converges over a few frames and stays stable afterwards.
+    When the source or the listener moves a little, the stored surface hits are reprojected (their distances are
+    recomputed and their view of the listener is re-tested bit by bit); when either of them moves a lot, the
+    reservoir starts over.
+*/
+class AcousticRayReservoir
+{
+public:
+    struct Settings
+    {
+        size_t capacity { 256 };
+        float invalidationDistance { 2.0f }; // moves beyond this start the reservoir over
+        float maxRayRange { 40.0f };
+        float listenerRadius { 0.5f };
+        AcousticDirectionGenerator::Pattern pattern { AcousticDirectionGenerator::Pattern::fibonacci };
+    };
+
+    AcousticRayReservoir() : AcousticRayReservoir (Settings())
+    {
+    }
+
+    explicit AcousticRayReservoir (const Settings& newSettings) : settings (newSettings), directionGenerator (newSettings.pattern)
+    {
+        // make sure that the settings are valid
+        jassert (settings.capacity > 0);
+        samples.reserve (settings.capacity);
+    }
+
+    ReverbEstimate update (const AcousticScene& scene, const AcousticVector& source, const AcousticVector& listener, size_t rayBudget)
+    {
+        if (&scene != currentScene || (source - sourcePosition).length() > settings.invalidationDistance
+                                   || (listener - listenerPosition).length() > settings.invalidationDistance)
+            invalidate();
+
+        currentScene = &scene;
+        reproject (scene, source, listener, rayBudget);
+
+        for (size_t ray = 0; ray < rayBudget; ++ray)
+        {
+            // each pass over the reservoir casts one full (newly rotated) set, so the reservoir always covers the sphere evenly
+            if (nextSample == 0 || directions.size() != settings.capacity)
+            {
+                directionGenerator.nextFrame();
+                directionGenerator.generate (settings.capacity, AcousticDirectionGenerator::Domain::sphere(), directions);
+            }
+
+            auto sample = castRay (scene, directions[nextSample]);
+            sample.isCurrent = true;
+            ++numCurrentSamples;
+
+            if (samples.size() < settings.capacity)
+            {
+                samples.push_back (sample);
+            }
+            else
+            {
+                if (samples[nextSample].isCurrent)
+                    --numCurrentSamples;
+
+                samples[nextSample] = sample;
+            }
+
+            nextSample = (nextSample + 1) % settings.capacity;
+        }
+
+        return getEstimate();
+    }
+
+    void invalidate()
+    {
+        samples.clear();
+        nextSample = 0;
+        numCurrentSamples = 0;
+        currentScene = nullptr;
+    }
+
+    ReverbEstimate getEstimate() const
+    {
+        ReverbEstimate estimate;
+        estimate.numRays = samples.size();
+
+        size_t numObstructed = 0, numListenerPaths = 0, numSurfaceHits = 0;
+        float totalDistance = 0.0f, totalAbsorption = 0.0f;
+
+        for (auto& sample : samples)
+        {
+            estimate.longestDistance = juce::jmax (estimate.longestDistance, sample.distance);
+
+            if (sample.hitSurface)
+            {
+                ++numSurfaceHits;
+                totalAbsorption += sample.absorption;
+            }
+
+            if (sample.reachesListener)
+            {
+                ++numListenerPaths;
+                totalDistance += sample.listenerDistance;
+            }
+            else if (sample.hitSurface && sample.isObstructed)
+            {
+                ++numObstructed;
+            }
+        }
+
+        if (! samples.empty())
+            estimate.obstructedReflections = (float) numObstructed / (float) samples.size();
+
+        if (numListenerPaths > 0)
+            estimate.averageDistance = totalDistance / (float) numListenerPaths;
+
+        // with nothing around to reflect the sound, everything is absorbed
+        if (numSurfaceHits > 0)
+            estimate.averageAbsorption = totalAbsorption / (float) numSurfaceHits;
+
+        return estimate;
+    }
+
+    size_t getNumRays() const noexcept
+    {
+        return samples.size();
+    }
+
+    // every slot of the reservoir holds a ray that was cast (or whose view of the listener was re-tested) since the
+    // source or the listener last moved; a reprojected reservoir is full, but not converged until then
+    bool isConverged() const noexcept
+    {
+        return samples.size() == settings.capacity && numCurrentSamples == settings.capacity;
+    }
+
+private:
+    struct Sample
+    {
+        AcousticVector hitPoint;
+        AcousticVector normal;
+        float distance { 0.0f };         // from the source to the first hit (surface or listener)
+        float listenerDistance { 0.0f }; // length of the segment that reaches the listener
+        float absorption { 0.0f };
+        bool hitSurface { false };
+        bool hitListener { false };      // the ray went straight to the listener
+        bool reachesListener { false };
+        bool isObstructed { false };
+        bool isCurrent { false };        // cast or re-tested at the current positions
+    };
+
+    Settings settings;
+    std::vector<Sample> samples;
+    size_t nextSample { 0 };
+    size_t numCurrentSamples { 0 };
+
+    const AcousticScene* currentScene { nullptr };
+    AcousticVector sourcePosition, listenerPosition;
+    AcousticDirectionGenerator directionGenerator;
+    AcousticDirectionGenerator::Batch directions;
+
+    // helper functions
+    static float intersectSphere (const AcousticRay& ray, const AcousticVector& centre, float radius) noexcept
+    {
+        auto toCentre = centre - ray.origin;
+        float along = toCentre.dot (ray.direction);
+        float squaredDistance = toCentre.dot (toCentre) - along * along;
+
+        if (squaredDistance > radius * radius)
+            return -1.0f;
+
+        float distance = along - std::sqrt (radius * radius - squaredDistance);
+        return distance >= 0.0f && distance < ray.maxDistance ? distance : -1.0f;
+    }
+
+    Sample castRay (const AcousticScene& scene, const AcousticVector& direction) const
+    {
+        Sample sample;
+        AcousticRay ray { sourcePosition, direction, settings.maxRayRange };
+
+        AcousticScene::Hit hit;
+        bool hitSurface = scene.intersect (ray, hit);
+        float listenerDistance = intersectSphere ({ sourcePosition, direction, hitSurface ? hit.distance : settings.maxRayRange }, listenerPosition, settings.listenerRadius);
+
+        if (listenerDistance >= 0.0f)
+        {
+            sample.hitListener = true;
+            sample.reachesListener = true;
+            sample.distance = listenerDistance;
+            sample.listenerDistance = listenerDistance;
+            return sample;
+        }
+
+        // a ray that escapes the scene doesn't count as obstructed
+        if (! hitSurface)
+            return sample;
+
+        sample.hitSurface = true;
+        sample.hitPoint = sourcePosition + direction * hit.distance;
+        sample.normal = hit.normal;
+        sample.distance = hit.distance;
+        sample.absorption = scene.getMaterial (hit.triangle).absorption;
+        testListenerVisibility (scene, sample);
+        return sample;
+    }
+
+    void testListenerVisibility (const AcousticScene& scene, Sample& sample) const
+    {
+        // the reflection is traced from the surface to the listener, with what is left of the range
+        sample.reachesListener = false;
+        sample.isObstructed = false;
+
+        float remainingRange = settings.maxRayRange - sample.distance;
+        if (remainingRange <= 0.0f)
+            return;
+
+        auto toListener = listenerPosition - sample.hitPoint;
+        float segmentLength = juce::jmax (0.0f, toListener.length() - settings.listenerRadius);
+        AcousticRay reflection { sample.hitPoint + sample.normal * 1e-3f, toListener.normalised(), juce::jmin (segmentLength, remainingRange) };
+
+        sample.isObstructed = scene.isOccluded (reflection);
+        sample.reachesListener = ! sample.isObstructed && segmentLength <= remainingRange;
+        sample.listenerDistance = segmentLength;
+    }
+
+    void reproject (const AcousticScene& scene, const AcousticVector& source, const AcousticVector& listener, size_t revalidationBudget)
+    {
+        bool sourceMoved = (source - sourcePosition).length() > 0.0f;
+        bool listenerMoved = (listener - listenerPosition).length() > 0.0f;
+        sourcePosition = source;
+        listenerPosition = listener;
+
+        if (samples.empty())
+            return;
+
+        if (sourceMoved || listenerMoved)
+        {
+            numCurrentSamples = 0;
+
+            for (auto& sample : samples)
+            {
+                sample.isCurrent = false;
+
+                if (sample.hitListener)
+                {
+                    sample.distance = juce::jmax (0.0f, (listenerPosition - sourcePosition).length() - settings.listenerRadius);
+                    sample.listenerDistance = sample.distance;
+                }
+                else if (sample.hitSurface)
+                {
+                    // the surface stays where it is, only the distances change
+                    sample.distance = (sample.hitPoint - sourcePosition).length();
+                    sample.listenerDistance = juce::jmax (0.0f, (listenerPosition - sample.hitPoint).length() - settings.listenerRadius);
+                }
+            }
+        }
+
+        if (numCurrentSamples == samples.size())
+            return;
+
+        // the view of the listener is re-tested for a budget of the stored hits per update, until all of them are current;
+        // we go back from the newest ray, since the oldest ones are replaced by new rays next (and the rays that were cast
+        // since the move are skipped, they are current already)
+        size_t numTested = 0;
+        for (size_t i = 0; i < samples.size() && numTested < revalidationBudget; ++i)
+        {
+            auto& sample = samples[(nextSample + samples.size() - 1 - i) % samples.size()];
+
+            if (sample.isCurrent)
+                continue;
+
+            // the rays without a surface hit have nothing to re-test, their reprojection is all there is
+            if (sample.hitSurface)
+                testListenerVisibility (scene, sample);
+
+            sample.isCurrent = true;
+            ++numCurrentSamples;
+            ++numTested;
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticRayReservoir)
+};
@@ -0,0 +1,307 @@
+//
+//  AcousticRoomBuses.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "CpuDispatch.h"
+#include "SourceLaneGroup.h"
+
+/*  One shared late reverb per room instead of one per source, so the cost of the reverb grows with the number of
+    rooms rather than with the number of sources.
+    - the plugin instance of a source sends its signal to the bus of the room it is in (see send())
+    - one plugin instance renders all the buses and mixes them for the listener (see render())
+    - energy flows between the buses through the portals of the room graph, with a gain per pair of rooms; the gains
+      are scaled down where needed, so that the energy going round between the rooms always dies away
+    The rooms are the lanes of SourceLaneGroups, so four rooms share the per-sample work of one reverb chain.
+    The buses are shared by every plugin instance in the process. send() and render() must be called from the
+    audio thread (Unity renders all of its mixer effects on one thread); a send that comes after the render of a
+    block is rendered with the next block. The room parameters are set from the game thread. While prepare() lays
+    out the buses again, the audio thread skips them (it never waits for the lock).
+*/
+class AcousticRoomBuses
+{
+public:
+    static constexpr size_t maxNumRooms = 16;
+
+    AcousticRoomBuses()
+    {
+        for (size_t room = 0; room < maxNumRooms; ++room)
+        {
+            listenerGains[room] = 0.0f;
+            for (auto& gain : couplingGains[room])
+                gain = 0.0f;
+        }
+    }
+
+    // called by every instance before playback, since it allocates; the buses are only laid out again when the sample
+    // rate changes or an instance comes with longer blocks than the buses were prepared for
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        const juce::SpinLock::ScopedLockType lock (processLock);
+        if (isPrepared && spec.sampleRate == sampleRate && spec.maximumBlockSize <= maximumBlockSize)
+            return;
+
+        isPrepared = false;
+
+        // the instances that are already playing keep their block size
+        sampleRate = spec.sampleRate;
+        maximumBlockSize = juce::jmax (maximumBlockSize, (size_t) spec.maximumBlockSize);
+
+        for (auto& group : groups)
+            group.prepare ({ sampleRate, (juce::uint32) maximumBlockSize, 1 });
+
+        for (auto& room : rooms)
+        {
+            room.send.assign (maximumBlockSize, 0.0f);
+            room.input.assign (maximumBlockSize, 0.0f);
+            room.output.assign (maximumBlockSize, 0.0f);
+            room.sendGeneration = 0;
+        }
+
+        listenerMix.assign (maximumBlockSize, 0.0f);
+        numMixSamples = 0;
+        isPrepared = true;
+    }
+
+    bool isActive() const noexcept
+    {
+        return isPrepared;
+    }
+
+    // whether an instance has rendered the buses lately, i.e. whether a send would be heard
+    bool isRendered() const noexcept
+    {
+        auto renderTime = lastRenderTime.load();
+        return isPrepared && renderTime != 0 && juce::Time::getMillisecondCounter() - renderTime < 500;
+    }
+
+    // adds a block of a source's signal to the bus of its room; returns false if it couldn't be sent
+    bool send (int room, const float* samples, size_t numSamples, float gain) noexcept
+    {
+        const juce::SpinLock::ScopedTryLockType lock (processLock);
+        if (! lock.isLocked() || ! isPrepared || ! juce::isPositiveAndBelow (room, (int) maxNumRooms) || numSamples > maximumBlockSize)
+            return false;
+
+        auto& bus = rooms[(size_t) room];
+
+        // a send that was never rendered (e.g. while no instance renders the buses) is dropped
+        if (bus.sendGeneration != generation)
+        {
+            std::fill (bus.send.begin(), bus.send.end(), 0.0f);
+            bus.sendGeneration = generation;
+        }
+
+        for (size_t sample = 0; sample < numSamples; ++sample)
+            bus.send[sample] += gain * samples[sample];
+
+        return true;
+    }
+
+    // renders the buses and writes what the listener hears of them to output (mono). The buses must advance once per
+    // block, so of several instances that return them only one renders them; the others get a copy of its latest mix
+    void render (const void* instance, float* output, size_t numSamples) noexcept
+    {
+        std::fill (output, output + numSamples, 0.0f);
+
+        const juce::SpinLock::ScopedTryLockType lock (processLock);
+        if (! lock.isLocked() || ! isPrepared || numSamples > maximumBlockSize)
+            return;
+
+        if (! claimRendering (instance))
+        {
+            std::copy (listenerMix.begin(), listenerMix.begin() + (std::ptrdiff_t) juce::jmin (numSamples, numMixSamples), output);
+            return;
+        }
+
+        applyRoomParameters();
+        normaliseCouplings();
+
+        // the reverb lanes and the mixes are compiled for the best instruction set of the machine
+        CpuDispatch::run ([&] { renderRooms (output, numSamples); });
+
+        std::copy (output, output + numSamples, listenerMix.begin());
+        numMixSamples = numSamples;
+
+        ++generation;
+        lastRenderTime = juce::Time::getMillisecondCounter();
+    }
+
+    // hands the rendering over to the next instance that returns the buses; called when an instance goes away
+    void stopRendering (const void* instance) noexcept
+    {
+        renderer.compare_exchange_strong (instance, nullptr);
+    }
+
+    // called from the game thread
+    void setRoom (size_t room, float delayTime, float feedback, float diffusionTime) noexcept
+    {
+        jassert (room < maxNumRooms);
+        auto& parameters = roomParameters[room];
+        parameters.delayTime = delayTime;
+        parameters.feedback = feedback;
+        parameters.diffusionTime = diffusionTime;
+        parameters.hasChanged = true;
+    }
+
+    // the share of the output of a room that flows into another room through their portals
+    void setCoupling (size_t fromRoom, size_t toRoom, float gain) noexcept
+    {
+        jassert (fromRoom < maxNumRooms && toRoom < maxNumRooms);
+        couplingGains[fromRoom][toRoom] = gain;
+    }
+
+    // how much of a room the listener hears
+    void setListenerGain (size_t room, float gain) noexcept
+    {
+        jassert (room < maxNumRooms);
+        listenerGains[room] = gain;
+    }
+
+private:
+    static constexpr size_t numGroups = (maxNumRooms + SourceLaneGroup::numLanes - 1) / SourceLaneGroup::numLanes;
+
+    struct Bus
+    {
+        std::vector<float> send, input, output;
+        juce::uint32 sendGeneration { 0 };
+    };
+
+    struct RoomParameters
+    {
+        std::atomic<float> delayTime { 0.0f };
+        std::atomic<float> feedback { 0.0f };
+        std::atomic<float> diffusionTime { 0.0f };
+        std::atomic<bool> hasChanged { false };
+    };
+
+    // the largest gain of the energy that goes round between the rooms in one pass, like the largest feedback of a room
+    static constexpr float maxLoopGain = 0.99f;
+
+    std::array<SourceLaneGroup, numGroups> groups;
+    std::array<Bus, maxNumRooms> rooms;
+    double sampleRate { 0.0 };
+    size_t maximumBlockSize { 0 };
+    juce::uint32 generation { 1 };
+    std::atomic<bool> isPrepared { false };
+    std::atomic<juce::uint32> lastRenderTime { 0 };
+    juce::SpinLock processLock;
+
+    // the instance that renders the buses and the mix it rendered last
+    std::atomic<const void*> renderer { nullptr };
+    std::vector<float> listenerMix;
+    size_t numMixSamples { 0 };
+
+    std::array<RoomParameters, maxNumRooms> roomParameters;
+    std::array<std::array<std::atomic<float>, maxNumRooms>, maxNumRooms> couplingGains;
+    std::array<std::array<float, maxNumRooms>, maxNumRooms> normalisedCouplingGains {};
+    std::array<std::atomic<float>, maxNumRooms> listenerGains;
+
+    // helper functions
+    void renderRooms (float* output, size_t numSamples) noexcept
+    {
+        // the input of a bus is what was sent to it and what came through the portals during the last block
+        for (size_t room = 0; room < maxNumRooms; ++room)
+        {
+            auto& bus = rooms[room];
+            for (size_t sample = 0; sample < numSamples; ++sample)
+                bus.input[sample] = bus.sendGeneration == generation ? bus.send[sample] : 0.0f;
+
+            for (size_t from = 0; from < maxNumRooms; ++from)
+            {
+                float gain = normalisedCouplingGains[from][room];
+                if (gain <= 0.0f || from == room)
+                    continue;
+
+                DspKernels::multiplyAdd (bus.input.data(), rooms[from].output.data(), gain, numSamples);
+            }
+        }
+
+        for (size_t group = 0; group < groups.size(); ++group)
+        {
+            std::array<const float*, SourceLaneGroup::numLanes> inputs;
+            std::array<float*, SourceLaneGroup::numLanes> outputs;
+
+            for (size_t lane = 0; lane < SourceLaneGroup::numLanes; ++lane)
+            {
+                inputs[lane] = rooms[group * SourceLaneGroup::numLanes + lane].input.data();
+                outputs[lane] = rooms[group * SourceLaneGroup::numLanes + lane].output.data();
+            }
+
+            groups[group].process (inputs.data(), outputs.data(), numSamples);
+        }
+
+        for (size_t room = 0; room < maxNumRooms; ++room)
+        {
+            float gain = listenerGains[room].load (std::memory_order_relaxed);
+            if (gain <= 0.0f)
+                continue;
+
+            DspKernels::multiplyAdd (output, rooms[room].output.data(), gain, numSamples);
+        }
+    }
+
+    bool claimRendering (const void* instance) noexcept
+    {
+        auto* current = renderer.load();
+        if (current == instance)
+            return true;
+
+        // an instance that hasn't rendered for a while (e.g. it has been switched to another mode) is replaced
+        if (current != nullptr && isRendered())
+            return false;
+
+        renderer = instance;
+        return true;
+    }
+
+    // a room puts out 1 / (1 - feedback^2) times the energy that goes into it, and passes the square of the coupling
+    // gain of it on to each other room; we scale the gains out of each room so that what one pass round the rooms
+    // returns of its output is at most maxLoopGain^2, which bounds the gain of the whole loop (its spectral radius)
+    void normaliseCouplings() noexcept
+    {
+        std::array<float, maxNumRooms> energyGains;
+        for (size_t room = 0; room < maxNumRooms; ++room)
+        {
+            float feedback = juce::jmin (roomParameters[room].feedback.load (std::memory_order_relaxed), maxLoopGain);
+            energyGains[room] = 1.0f / (1.0f - feedback * feedback);
+        }
+
+        for (size_t from = 0; from < maxNumRooms; ++from)
+        {
+            float loopEnergy = 0.0f;
+            for (size_t to = 0; to < maxNumRooms; ++to)
+            {
+                float gain = to != from ? juce::jmax (0.0f, couplingGains[from][to].load (std::memory_order_relaxed)) : 0.0f;
+                normalisedCouplingGains[from][to] = gain;
+                loopEnergy += gain * gain * energyGains[to];
+            }
+
+            if (loopEnergy > maxLoopGain * maxLoopGain)
+            {
+                float scale = maxLoopGain / std::sqrt (loopEnergy);
+                for (auto& gain : normalisedCouplingGains[from])
+                    gain *= scale;
+            }
+        }
+    }
+
+    void applyRoomParameters() noexcept
+    {
+        for (size_t room = 0; room < maxNumRooms; ++room)
+        {
+            auto& parameters = roomParameters[room];
+            if (! parameters.hasChanged.exchange (false))
+                continue;
+
+            auto& group = groups[room / SourceLaneGroup::numLanes];
+            auto lane = room % SourceLaneGroup::numLanes;
+            group.setDelayTime (lane, parameters.delayTime.load());
+            group.setFeedback (lane, parameters.feedback.load());
+            group.setDiffusionSize (lane, parameters.diffusionTime.load());
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticRoomBuses)
+};
@@ -0,0 +1,523 @@
+//
+//  AcousticRooms.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "AcousticScene.h"
+#include <deque>
+#include <map>
+
+// the octave bands of the analytic reverb estimates
+namespace AcousticBands
+{
+    constexpr size_t numBands = 6;
+    constexpr std::array<float, numBands> centreFrequencies { 125.0f, 250.0f, 500.0f, 1000.0f, 2000.0f, 4000.0f };
+
+    // the intensity attenuation of air in 1/m, at 20 degrees and 50 % relative humidity (after Kuttruff, "Room Acoustics")
+    constexpr std::array<float, numBands> airAttenuation { 0.0001f, 0.0003f, 0.0006f, 0.0011f, 0.0026f, 0.0084f };
+}
+
+// what the statistical room acoustics make of a closed room
+struct AcousticRoom
+{
+    float volume { 0.0f };         // in m^3
+    float surfaceArea { 0.0f };    // in m^2
+    float meanAbsorption { 0.0f }; // the area-weighted absorption coefficient of the surfaces
+    float meanFreePath { 0.0f };   // 4V / S, the average distance between two reflections
+    std::array<float, AcousticBands::numBands> sabineReverbTimes {};
+    std::array<float, AcousticBands::numBands> eyringReverbTimes {};
+    AcousticBounds bounds;
+
+    // the Eyring reverb time of the mid frequencies (500 Hz and 1 kHz)
+    float getReverbTime() const noexcept
+    {
+        return 0.5f * (eyringReverbTimes[2] + eyringReverbTimes[3]);
+    }
+};
+
+// an opening between a room and another room (or the outside, -1)
+struct AcousticPortal
+{
+    std::array<int, 2> rooms { -1, -1 }; // the first one is always a room
+    float area { 0.0f };                 // in m^2
+    AcousticVector centre;
+};
+
+/*  Splits the scene into its rooms and estimates their reverb analytically (Sabine and Eyring), so that the
+    listener's room can be looked up in O(1) instead of being traced.
+    The bounds of the scene are divided into cells, and two neighbouring cells are connected if nothing lies between
+    their centres. The free space is split into regions at its doorways (see findRegions()), and the openings between
+    the regions become the portals of the room graph. The regions are the rooms, except for the one that reaches
+    the border of the grid (the outside) and those too small to be a room (e.g. the inside of a wall). Each wall
+    between two cells adds its area (corrected for its slope towards the grid) and its absorption to the room on
+    either side.
+    The analysis casts a few rays per cell, so it is meant to run once after a scene has been loaded.
+*/
+class AcousticRoomMap
+{
+public:
+    struct Settings
+    {
+        float cellSize { 0.5f };
+        size_t maxNumCells { 1 << 21 }; // the cells grow beyond cellSize for scenes that would need more
+        float minRoomVolume { 2.0f };
+        float doorwayWidth { 1.5f }; // narrower openings separate two rooms
+    };
+
+    AcousticRoomMap (const AcousticScene& scene, juce::uint32 newSceneVersion, const Settings& settings)
+        : sceneVersion (newSceneVersion)
+    {
+        // make sure that the settings are valid
+        jassert (settings.cellSize > 0.0f && settings.maxNumCells > 0);
+
+        if (scene.getNumTriangles() > 0)
+            analyse (scene, settings);
+    }
+
+    // the room that the position lies in, or nullptr outside of every closed room
+    const AcousticRoom* getRoomAt (const AcousticVector& position) const noexcept
+    {
+        int room = getRoomIndexAt (position);
+        return room >= 0 ? &rooms[(size_t) room] : nullptr;
+    }
+
+    int getRoomIndexAt (const AcousticVector& position) const noexcept
+    {
+        std::array<int, 3> cell;
+        for (size_t axis = 0; axis < 3; ++axis)
+        {
+            cell[axis] = (int) std::floor ((position[axis] - origin[axis]) / cellSize);
+            if (! juce::isPositiveAndBelow (cell[axis], dimensions[axis]))
+                return -1;
+        }
+
+        return cellRooms[getCellIndex (cell[0], cell[1], cell[2])];
+    }
+
+    size_t getNumRooms() const noexcept
+    {
+        return rooms.size();
+    }
+
+    const AcousticRoom& getRoom (size_t room) const noexcept
+    {
+        jassert (room < rooms.size());
+        return rooms[room];
+    }
+
+    size_t getNumPortals() const noexcept
+    {
+        return portals.size();
+    }
+
+    const AcousticPortal& getPortal (size_t portal) const noexcept
+    {
+        jassert (portal < portals.size());
+        return portals[portal];
+    }
+
+    // the portal whose centre is nearest to the position (within maxDistance), or -1
+    int findNearestPortal (const AcousticVector& position, float maxDistance) const noexcept
+    {
+        int nearest = -1;
+        for (size_t portal = 0; portal < portals.size(); ++portal)
+        {
+            float distance = (portals[portal].centre - position).length();
+            if (distance <= maxDistance)
+            {
+                maxDistance = distance;
+                nearest = (int) portal;
+            }
+        }
+
+        return nearest;
+    }
+
+    juce::uint32 getSceneVersion() const noexcept
+    {
+        return sceneVersion;
+    }
+
+    float getCellSize() const noexcept
+    {
+        return cellSize;
+    }
+
+private:
+    // a wall between two cells, as seen from the first of them
+    struct Wall
+    {
+        size_t cell;
+        float area;
+        float absorption;
+    };
+
+    juce::uint32 sceneVersion;
+    AcousticVector origin;
+    float cellSize { 1.0f };
+    std::array<int, 3> dimensions { 0, 0, 0 };
+    std::vector<int> cellRooms; // the room of each cell, -1 for none
+    std::vector<AcousticRoom> rooms;
+    std::vector<AcousticPortal> portals;
+
+    // helper functions
+    size_t getCellIndex (int x, int y, int z) const noexcept
+    {
+        return ((size_t) z * (size_t) dimensions[1] + (size_t) y) * (size_t) dimensions[0] + (size_t) x;
+    }
+
+    AcousticVector getCellCentre (int x, int y, int z) const noexcept
+    {
+        return origin + AcousticVector ((float) x + 0.5f, (float) y + 0.5f, (float) z + 0.5f) * cellSize;
+    }
+
+    AcousticVector getCellCentreOf (size_t cell) const noexcept
+    {
+        return getCellCentre ((int) (cell % (size_t) dimensions[0]),
+                              (int) ((cell / (size_t) dimensions[0]) % (size_t) dimensions[1]),
+                              (int) (cell / ((size_t) dimensions[0] * (size_t) dimensions[1])));
+    }
+
+    void layOutGrid (const AcousticBounds& sceneBounds, const Settings& settings)
+    {
+        // the grid is padded by a cell on each side, so that the outside is always connected to its border
+        auto extent = sceneBounds.max - sceneBounds.min;
+        cellSize = settings.cellSize;
+
+        for (;;)
+        {
+            for (size_t axis = 0; axis < 3; ++axis)
+                dimensions[axis] = (int) std::ceil (extent[axis] / cellSize) + 2;
+
+            if ((size_t) dimensions[0] * (size_t) dimensions[1] * (size_t) dimensions[2] <= settings.maxNumCells)
+                break;
+
+            cellSize *= 1.25f;
+        }
+
+        origin = sceneBounds.min - AcousticVector (cellSize, cellSize, cellSize);
+        cellRooms.assign ((size_t) dimensions[0] * (size_t) dimensions[1] * (size_t) dimensions[2], -1);
+    }
+
+    // traces the link between a cell and its neighbour along an axis; returns true if it is open
+    bool traceLink (const AcousticScene& scene, const AcousticVector& from, const AcousticVector& to, size_t fromCell,
+                    std::vector<Wall>& walls) const
+    {
+        AcousticRay ray { from, (to - from).normalised(), cellSize };
+        AcousticScene::Hit hit;
+        if (! scene.intersect (ray, hit))
+            return true;
+
+        // a slanted wall is crossed by more links per m^2 than one facing the grid, which the area of a link makes up for
+        float slope = std::abs (hit.normal.x) + std::abs (hit.normal.y) + std::abs (hit.normal.z);
+        walls.push_back ({ fromCell, cellSize * cellSize / juce::jmax (1.0f, slope), scene.getMaterial (hit.triangle).absorption });
+        return false;
+    }
+
+    void analyse (const AcousticScene& scene, const Settings& settings)
+    {
+        layOutGrid (scene.getBounds(), settings);
+
+        // bit n of a cell is set if it is connected to its neighbour in the positive direction of axis n
+        std::vector<juce::uint8> openLinks (cellRooms.size(), 0);
+        std::vector<Wall> walls;
+
+        for (int z = 0; z < dimensions[2]; ++z)
+            for (int y = 0; y < dimensions[1]; ++y)
+                for (int x = 0; x < dimensions[0]; ++x)
+                {
+                    const std::array<int, 3> cell { x, y, z };
+                    auto centre = getCellCentre (x, y, z);
+
+                    for (size_t axis = 0; axis < 3; ++axis)
+                    {
+                        auto neighbour = cell;
+                        if (++neighbour[axis] >= dimensions[axis])
+                            continue;
+
+                        auto neighbourCentre = getCellCentre (neighbour[0], neighbour[1], neighbour[2]);
+                        auto cellIndex = getCellIndex (x, y, z);
+
+                        // a blocked link is traced back as well, since the other side of the wall can be another surface
+                        if (traceLink (scene, centre, neighbourCentre, cellIndex, walls))
+                            openLinks[cellIndex] |= (juce::uint8) (1 << axis);
+                        else
+                            traceLink (scene, neighbourCentre, centre, getCellIndex (neighbour[0], neighbour[1], neighbour[2]), walls);
+                    }
+                }
+
+        auto regions = findRegions (openLinks, settings);
+        collectRooms (regions, openLinks, walls, settings);
+    }
+
+    // calls visit (neighbour, axis) for every neighbour that the cell is connected to
+    template <typename Visitor>
+    void forEachOpenNeighbour (size_t cell, const std::vector<juce::uint8>& openLinks, Visitor&& visit) const
+    {
+        const std::array<size_t, 3> strides { 1, (size_t) dimensions[0], (size_t) dimensions[0] * (size_t) dimensions[1] };
+
+        for (size_t axis = 0; axis < 3; ++axis)
+        {
+            // the link is stored with the cell on its negative side
+            if ((openLinks[cell] & (1 << axis)) != 0)
+                visit (cell + strides[axis], axis);
+
+            size_t coordinate = (cell / strides[axis]) % (size_t) dimensions[axis];
+            if (coordinate > 0 && (openLinks[cell - strides[axis]] & (1 << axis)) != 0)
+                visit (cell - strides[axis], axis);
+        }
+    }
+
+    // a breadth-first search from the queued cells, which labels each cell it reaches with nextLabel (label of the cell it came from)
+    template <typename NextLabel>
+    void spread (std::deque<size_t>& queue, std::vector<int>& labels, const std::vector<juce::uint8>& openLinks, NextLabel&& nextLabel) const
+    {
+        while (! queue.empty())
+        {
+            auto cell = queue.front();
+            queue.pop_front();
+
+            forEachOpenNeighbour (cell, openLinks, [&] (size_t neighbour, size_t)
+            {
+                if (labels[neighbour] < 0)
+                {
+                    labels[neighbour] = nextLabel (labels[cell]);
+                    queue.push_back (neighbour);
+                }
+            });
+        }
+    }
+
+    // labels every unlabelled cell with the index of its connected group (counting on from numLabels)
+    int labelGroups (std::vector<int>& labels, const std::vector<juce::uint8>& openLinks, int numLabels, const std::vector<bool>* mask = nullptr) const
+    {
+        std::deque<size_t> queue;
+        std::vector<juce::uint8> maskedLinks;
+
+        // within the mask, only the links between two cells of the mask count
+        if (mask != nullptr)
+        {
+            maskedLinks.assign (openLinks.size(), 0);
+            for (size_t cell = 0; cell < openLinks.size(); ++cell)
+                if ((*mask)[cell])
+                    forEachOpenNeighbour (cell, openLinks, [&] (size_t neighbour, size_t axis)
+                    {
+                        if ((*mask)[neighbour] && neighbour > cell)
+                            maskedLinks[cell] |= (juce::uint8) (1 << axis);
+                    });
+        }
+
+        auto& links = mask != nullptr ? maskedLinks : openLinks;
+
+        for (size_t start = 0; start < labels.size(); ++start)
+        {
+            if (labels[start] >= 0 || (mask != nullptr && ! (*mask)[start]))
+                continue;
+
+            labels[start] = numLabels++;
+            queue.push_back (start);
+            spread (queue, labels, links, [] (int label) { return label; });
+        }
+
+        return numLabels;
+    }
+
+    /*  Splits the free space into regions at its narrow openings (doorways, windows):
+        1. the distance of every cell to the nearest wall is measured in cells
+        2. the cells far enough from the walls are the cores of the regions, whose narrow openings are closed
+        3. the cores grow back to fill the space, each cell joining the nearest core
+        Space without any core (e.g. a narrow corridor) keeps its connected group as a region.
+    */
+    std::vector<int> findRegions (const std::vector<juce::uint8>& openLinks, const Settings& settings) const
+    {
+        size_t numCells = openLinks.size();
+        std::vector<int> distances (numCells, -1);
+        std::deque<size_t> queue;
+
+        for (size_t cell = 0; cell < numCells; ++cell)
+        {
+            int numOpenLinks = 0, numLinks = 0;
+            forEachOpenNeighbour (cell, openLinks, [&] (size_t, size_t) { ++numOpenLinks; });
+
+            for (size_t axis = 0; axis < 3; ++axis)
+            {
+                size_t stride = axis == 0 ? 1 : (axis == 1 ? (size_t) dimensions[0] : (size_t) dimensions[0] * (size_t) dimensions[1]);
+                size_t coordinate = (cell / stride) % (size_t) dimensions[axis];
+                numLinks += (coordinate > 0 ? 1 : 0) + (coordinate + 1 < (size_t) dimensions[axis] ? 1 : 0);
+            }
+
+            // a cell next to a wall has a blocked link (the border of the grid doesn't count as a wall)
+            if (numOpenLinks < numLinks)
+            {
+                distances[cell] = 1;
+                queue.push_back (cell);
+            }
+        }
+
+        spread (queue, distances, openLinks, [] (int distance) { return distance + 1; });
+
+        // an opening narrower than the doorway width has no cells this far from the walls (the cells next to the
+        // walls are already 1 away, and a doorway in a thin wall is measured from the cells beside its jambs)
+        int coreDistance = (int) std::ceil (settings.doorwayWidth / (2.0f * cellSize)) + 1;
+        std::vector<bool> isCore (numCells);
+        for (size_t cell = 0; cell < numCells; ++cell)
+            isCore[cell] = distances[cell] < 0 || distances[cell] >= coreDistance;
+
+        std::vector<int> regions (numCells, -1);
+        int numRegions = labelGroups (regions, openLinks, 0, &isCore);
+
+        for (size_t cell = 0; cell < numCells; ++cell)
+            if (regions[cell] >= 0)
+                queue.push_back (cell);
+
+        spread (queue, regions, openLinks, [] (int region) { return region; });
+        labelGroups (regions, openLinks, numRegions);
+        return regions;
+    }
+
+    void collectRooms (const std::vector<int>& regions, const std::vector<juce::uint8>& openLinks, const std::vector<Wall>& walls, const Settings& settings)
+    {
+        int numRegions = regions.empty() ? 0 : *std::max_element (regions.begin(), regions.end()) + 1;
+
+        struct Region
+        {
+            size_t numCells { 0 };
+            float surfaceArea { 0.0f };
+            float absorptionArea { 0.0f };
+            bool isOutside { false };
+            AcousticBounds bounds;
+        };
+
+        std::vector<Region> summaries ((size_t) numRegions);
+
+        for (int z = 0; z < dimensions[2]; ++z)
+            for (int y = 0; y < dimensions[1]; ++y)
+                for (int x = 0; x < dimensions[0]; ++x)
+                {
+                    auto& region = summaries[(size_t) regions[getCellIndex (x, y, z)]];
+                    ++region.numCells;
+                    region.bounds.expand (getCellCentre (x, y, z));
+
+                    if (x == 0 || y == 0 || z == 0 || x == dimensions[0] - 1 || y == dimensions[1] - 1 || z == dimensions[2] - 1)
+                        region.isOutside = true;
+                }
+
+        for (auto& wall : walls)
+        {
+            auto& region = summaries[(size_t) regions[wall.cell]];
+            region.surfaceArea += wall.area;
+            region.absorptionArea += wall.area * wall.absorption;
+        }
+
+        // the openings between two regions, keyed by the pair of regions
+        std::map<std::pair<int, int>, AcousticPortal> openings;
+        float linkArea = cellSize * cellSize;
+
+        for (size_t cell = 0; cell < regions.size(); ++cell)
+        {
+            forEachOpenNeighbour (cell, openLinks, [&] (size_t neighbour, size_t)
+            {
+                if (neighbour < cell || regions[cell] == regions[neighbour])
+                    return;
+
+                auto key = std::minmax (regions[cell], regions[neighbour]);
+                auto& opening = openings[key];
+                opening.area += linkArea;
+                opening.centre = opening.centre + (getCellCentreOf (cell) + getCellCentreOf (neighbour)) * (0.5f * linkArea);
+            });
+        }
+
+        // for the decay of a room on its own, an opening absorbs everything that goes through it
+        for (auto& [key, opening] : openings)
+        {
+            for (int region : { key.first, key.second })
+            {
+                summaries[(size_t) region].surfaceArea += opening.area;
+                summaries[(size_t) region].absorptionArea += opening.area;
+            }
+        }
+
+        // only closed regions that are large enough become rooms
+        std::vector<int> roomOfRegion ((size_t) numRegions, -1);
+        float cellVolume = cellSize * cellSize * cellSize;
+
+        for (size_t index = 0; index < summaries.size(); ++index)
+        {
+            auto& region = summaries[index];
+            float volume = (float) region.numCells * cellVolume;
+            if (region.isOutside || volume < settings.minRoomVolume || region.surfaceArea <= 0.0f)
+                continue;
+
+            roomOfRegion[index] = (int) rooms.size();
+            rooms.push_back (makeRoom (volume, region.surfaceArea, region.absorptionArea / region.surfaceArea, region.bounds));
+        }
+
+        for (size_t cell = 0; cell < cellRooms.size(); ++cell)
+            cellRooms[cell] = roomOfRegion[(size_t) regions[cell]];
+
+        // a portal connects a room to another room or to the outside, openings into the rest are dropped
+        for (auto& [key, opening] : openings)
+        {
+            int roomA = roomOfRegion[(size_t) key.first], roomB = roomOfRegion[(size_t) key.second];
+            bool isOutsideA = summaries[(size_t) key.first].isOutside, isOutsideB = summaries[(size_t) key.second].isOutside;
+
+            if ((roomA < 0 && ! isOutsideA) || (roomB < 0 && ! isOutsideB) || (roomA < 0 && roomB < 0))
+                continue;
+
+            AcousticPortal portal = opening;
+            portal.centre = opening.centre * (1.0f / opening.area);
+            portal.rooms = { roomA >= 0 ? roomA : roomB, roomA >= 0 ? roomB : roomA };
+            portals.push_back (portal);
+        }
+    }
+
+    AcousticRoom makeRoom (float volume, float surfaceArea, float meanAbsorption, AcousticBounds cellCentres) const
+    {
+        AcousticRoom room;
+        room.volume = volume;
+        room.surfaceArea = surfaceArea;
+        room.meanAbsorption = meanAbsorption;
+        room.meanFreePath = 4.0f * volume / surfaceArea;
+
+        // the cells reach half a cell beyond their centres
+        auto halfCell = AcousticVector (cellSize, cellSize, cellSize) * 0.5f;
+        room.bounds.expand (cellCentres.min - halfCell);
+        room.bounds.expand (cellCentres.max + halfCell);
+
+        // Sabine: T = 0.161 V / (S a + 4 m V), Eyring: T = 0.161 V / (-S ln(1 - a) + 4 m V)
+        float eyringAbsorption = -std::log (1.0f - juce::jlimit (0.0f, 0.99f, meanAbsorption));
+        for (size_t band = 0; band < AcousticBands::numBands; ++band)
+        {
+            float airAbsorption = 4.0f * AcousticBands::airAttenuation[band] * volume;
+            room.sabineReverbTimes[band] = 0.161f * volume / (surfaceArea * meanAbsorption + airAbsorption);
+            room.eyringReverbTimes[band] = 0.161f * volume / (surfaceArea * eyringAbsorption + airAbsorption);
+        }
+
+        return room;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticRoomMap)
+};
+
+// the rooms of the currently loaded scene, shared by every plugin instance in the process
+class SharedAcousticRooms
+{
+public:
+    std::shared_ptr<const AcousticRoomMap> get() const
+    {
+        const juce::SpinLock::ScopedLockType lock (roomsLock);
+        return rooms;
+    }
+
+    void set (std::shared_ptr<const AcousticRoomMap> newRooms)
+    {
+        const juce::SpinLock::ScopedLockType lock (roomsLock);
+        std::swap (rooms, newRooms);
+    }
+
+private:
+    juce::SpinLock roomsLock;
+    std::shared_ptr<const AcousticRoomMap> rooms;
+};
@@ -0,0 +1,590 @@
+//
+//  AcousticScene.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "AcousticGeometry.h"
+#include "CpuDispatch.h"
+
+/*  The binary scene format holds everything the native tracer needs to know about a level: triangles,
+    a material per triangle, the material table (the coefficients of MaterialAudioAttributes) and a prebuilt BVH.
+    The file is memory-mapped and used in place, so loading a level costs a validation pass and no parsing.
+
+    Layout (little endian, every section starts on a 16 byte boundary):
+        Header
+        vertices            numVertices  x (float[3] or QuantisedVertex)
+        triangles           numTriangles x Triangle, in BVH leaf order
+        material indices    numTriangles x uint16
+        materials           numMaterials x Material
+        BVH nodes           numNodes     x Node, depth-first with the two children of a node stored next to each other
+*/
+namespace AcousticSceneFormat
+{
+    static constexpr char magic[4] = { 'U', 'R', 'A', 'S' };
+    static constexpr juce::uint32 currentVersion = 1;
+    static constexpr size_t sectionAlignment = 16;
+    static constexpr size_t maxTreeDepth = 64;
+
+    enum Flags : juce::uint32
+    {
+        quantisedVertices = 1 << 0 // vertices are stored as 16 bits per axis within the scene bounds
+    };
+
+    struct Header
+    {
+        char magic[4];
+        juce::uint32 version;
+        juce::uint32 flags;
+        juce::uint32 numVertices;
+        juce::uint32 numTriangles;
+        juce::uint32 numMaterials;
+        juce::uint32 numNodes;
+        juce::uint32 reserved;
+        float boundsMin[3];
+        float boundsMax[3];
+        juce::uint64 vertexOffset;
+        juce::uint64 triangleOffset;
+        juce::uint64 materialIndexOffset;
+        juce::uint64 materialOffset;
+        juce::uint64 nodeOffset;
+        juce::uint64 fileSize;
+    };
+
+    struct QuantisedVertex
+    {
+        juce::uint16 position[3];
+    };
+
+    struct Triangle
+    {
+        juce::uint32 vertices[3];
+    };
+
+    // mirrors MaterialAudioAttributes
+    struct Material
+    {
+        float absorption;
+        float scattering;
+        float diffraction;
+        float transmission;
+        float filter;
+    };
+
+    // an interior node has numTriangles == 0 and its children at firstChildOrTriangle and firstChildOrTriangle + 1
+    struct Node
+    {
+        float boundsMin[3];
+        juce::uint32 firstChildOrTriangle;
+        float boundsMax[3];
+        juce::uint32 numTriangles;
+    };
+
+    static_assert (sizeof (Header) == 104, "the header layout is part of the file format");
+    static_assert (sizeof (QuantisedVertex) == 6 && sizeof (Triangle) == 12, "the vertex layout is part of the file format");
+    static_assert (sizeof (Material) == 20 && sizeof (Node) == 32, "the material and node layout is part of the file format");
+
+    inline AcousticVector dequantise (const QuantisedVertex& vertex, const AcousticVector& boundsMin, const AcousticVector& boundsMax) noexcept
+    {
+        auto step = (boundsMax - boundsMin) * (1.0f / 65535.0f);
+        return { boundsMin.x + (float) vertex.position[0] * step.x,
+                 boundsMin.y + (float) vertex.position[1] * step.y,
+                 boundsMin.z + (float) vertex.position[2] * step.z };
+    }
+}
+
+class AcousticScene
+{
+public:
+    struct Hit
+    {
+        float distance { 0.0f };
+        size_t triangle { 0 };
+        AcousticVector normal; // normalised, facing the ray
+    };
+
+    AcousticScene()
+    {
+    }
+
+    juce::Result open (const juce::File& file)
+    {
+        close();
+
+        auto newFile = std::make_unique<juce::MemoryMappedFile> (file, juce::MemoryMappedFile::readOnly);
+        if (newFile->getData() == nullptr)
+            return juce::Result::fail ("Could not map " + file.getFullPathName());
+
+        auto result = validate (newFile->getData(), newFile->getSize());
+        if (result.failed())
+            return result;
+
+        mappedFile = std::move (newFile);
+        sections = getSections (mappedFile->getData());
+        return juce::Result::ok();
+    }
+
+    void close()
+    {
+        sections = {};
+        mappedFile.reset();
+    }
+
+    // checks everything the tracer relies on, so that a corrupt or outdated file can never be read out of bounds
+    static juce::Result validate (const void* data, size_t numBytes)
+    {
+        auto layoutResult = validateLayout (data, numBytes);
+        if (layoutResult.failed())
+            return layoutResult;
+
+        return validateContents (getSections (data));
+    }
+
+    bool isLoaded() const noexcept
+    {
+        return sections.header != nullptr;
+    }
+
+    size_t getNumTriangles() const noexcept
+    {
+        return isLoaded() ? sections.header->numTriangles : 0;
+    }
+
+    size_t getNumMaterials() const noexcept
+    {
+        return isLoaded() ? sections.header->numMaterials : 0;
+    }
+
+    AcousticBounds getBounds() const noexcept
+    {
+        return isLoaded() ? getBounds (*sections.header) : AcousticBounds();
+    }
+
+    void getTriangle (size_t triangle, AcousticVector& a, AcousticVector& b, AcousticVector& c) const noexcept
+    {
+        jassert (triangle < getNumTriangles());
+        getTriangle (sections, triangle, a, b, c);
+    }
+
+    const AcousticSceneFormat::Material& getMaterial (size_t triangle) const noexcept
+    {
+        jassert (triangle < getNumTriangles());
+        return sections.materials[sections.materialIndices[triangle]];
+    }
+
+    // finds the closest surface along the ray
+    bool intersect (const AcousticRay& ray, Hit& hit) const noexcept
+    {
+        return CpuDispatch::run ([&] { return traverse<false> (ray, hit); });
+    }
+
+    // only checks whether anything is in the way, which lets the traversal stop at the first hit
+    bool isOccluded (const AcousticRay& ray) const noexcept
+    {
+        Hit hit;
+        return CpuDispatch::run ([&] { return traverse<true> (ray, hit); });
+    }
+
+private:
+    struct Sections
+    {
+        const AcousticSceneFormat::Header* header { nullptr };
+        const void* vertices { nullptr };
+        const AcousticSceneFormat::Triangle* triangles { nullptr };
+        const juce::uint16* materialIndices { nullptr };
+        const AcousticSceneFormat::Material* materials { nullptr };
+        const AcousticSceneFormat::Node* nodes { nullptr };
+    };
+
+    std::unique_ptr<juce::MemoryMappedFile> mappedFile;
+    Sections sections;
+
+    // helper functions
+    static Sections getSections (const void* data) noexcept
+    {
+        auto* bytes = static_cast<const char*> (data);
+        auto* header = reinterpret_cast<const AcousticSceneFormat::Header*> (bytes);
+
+        Sections result;
+        result.header = header;
+        result.vertices = bytes + header->vertexOffset;
+        result.triangles = reinterpret_cast<const AcousticSceneFormat::Triangle*> (bytes + header->triangleOffset);
+        result.materialIndices = reinterpret_cast<const juce::uint16*> (bytes + header->materialIndexOffset);
+        result.materials = reinterpret_cast<const AcousticSceneFormat::Material*> (bytes + header->materialOffset);
+        result.nodes = reinterpret_cast<const AcousticSceneFormat::Node*> (bytes + header->nodeOffset);
+        return result;
+    }
+
+    static AcousticBounds getBounds (const AcousticSceneFormat::Header& header) noexcept
+    {
+        AcousticBounds bounds;
+        bounds.min = { header.boundsMin[0], header.boundsMin[1], header.boundsMin[2] };
+        bounds.max = { header.boundsMax[0], header.boundsMax[1], header.boundsMax[2] };
+        return bounds;
+    }
+
+    static AcousticBounds getBounds (const AcousticSceneFormat::Node& node) noexcept
+    {
+        AcousticBounds bounds;
+        bounds.min = { node.boundsMin[0], node.boundsMin[1], node.boundsMin[2] };
+        bounds.max = { node.boundsMax[0], node.boundsMax[1], node.boundsMax[2] };
+        return bounds;
+    }
+
+    static AcousticVector getVertex (const Sections& scene, size_t vertex) noexcept
+    {
+        if ((scene.header->flags & AcousticSceneFormat::quantisedVertices) != 0)
+        {
+            auto bounds = getBounds (*scene.header);
+            return AcousticSceneFormat::dequantise (static_cast<const AcousticSceneFormat::QuantisedVertex*> (scene.vertices)[vertex], bounds.min, bounds.max);
+        }
+
+        auto* position = static_cast<const float*> (scene.vertices) + 3 * vertex;
+        return { position[0], position[1], position[2] };
+    }
+
+    static void getTriangle (const Sections& scene, size_t triangle, AcousticVector& a, AcousticVector& b, AcousticVector& c) noexcept
+    {
+        auto& vertices = scene.triangles[triangle].vertices;
+        a = getVertex (scene, vertices[0]);
+        b = getVertex (scene, vertices[1]);
+        c = getVertex (scene, vertices[2]);
+    }
+
+    static bool isSectionValid (juce::uint64 offset, juce::uint64 count, juce::uint64 elementSize, size_t numBytes) noexcept
+    {
+        // the counts are 32 bit, so none of this can overflow
+        return offset % AcousticSceneFormat::sectionAlignment == 0
+            && offset >= sizeof (AcousticSceneFormat::Header)
+            && offset <= numBytes
+            && count * elementSize <= numBytes - offset;
+    }
+
+    static juce::Result validateLayout (const void* data, size_t numBytes)
+    {
+        if (data == nullptr || numBytes < sizeof (AcousticSceneFormat::Header))
+            return juce::Result::fail ("The file is too small to be an acoustic scene");
+
+        // the sections are accessed in place, so the file has to be mapped at an aligned address
+        if (reinterpret_cast<size_t> (data) % AcousticSceneFormat::sectionAlignment != 0)
+            return juce::Result::fail ("The scene data is not aligned");
+
+        auto& header = *static_cast<const AcousticSceneFormat::Header*> (data);
+
+        if (std::memcmp (header.magic, AcousticSceneFormat::magic, sizeof (header.magic)) != 0)
+            return juce::Result::fail ("The file is not an acoustic scene");
+
+        if (header.version != AcousticSceneFormat::currentVersion)
+            return juce::Result::fail ("Unsupported acoustic scene version " + juce::String ((int) header.version)
+                                       + ", please re-export the scene");
+
+        if (header.fileSize != numBytes)
+            return juce::Result::fail ("The acoustic scene is truncated");
+
+        if ((header.flags & ~(juce::uint32) AcousticSceneFormat::quantisedVertices) != 0)
+            return juce::Result::fail ("The acoustic scene uses unknown features");
+
+        bool isQuantised = (header.flags & AcousticSceneFormat::quantisedVertices) != 0;
+        size_t vertexSize = isQuantised ? sizeof (AcousticSceneFormat::QuantisedVertex) : 3 * sizeof (float);
+
+        if (! isSectionValid (header.vertexOffset,        header.numVertices,  vertexSize,                                 numBytes)
+         || ! isSectionValid (header.triangleOffset,      header.numTriangles, sizeof (AcousticSceneFormat::Triangle),     numBytes)
+         || ! isSectionValid (header.materialIndexOffset, header.numTriangles, sizeof (juce::uint16),                      numBytes)
+         || ! isSectionValid (header.materialOffset,      header.numMaterials, sizeof (AcousticSceneFormat::Material),     numBytes)
+         || ! isSectionValid (header.nodeOffset,          header.numNodes,     sizeof (AcousticSceneFormat::Node),         numBytes))
+            return juce::Result::fail ("A section of the acoustic scene lies outside of the file");
+
+        if (header.numTriangles > 0 && (header.numMaterials == 0 || header.numNodes == 0))
+            return juce::Result::fail ("The acoustic scene has triangles but no materials or BVH");
+
+        if (header.numMaterials > 65536)
+            return juce::Result::fail ("The acoustic scene has too many materials");
+
+        auto bounds = getBounds (header);
+        for (size_t axis = 0; axis < 3; ++axis)
+            if (! std::isfinite (bounds.min[axis]) || ! std::isfinite (bounds.max[axis]) || (header.numVertices > 0 && bounds.min[axis] > bounds.max[axis]))
+                return juce::Result::fail ("The bounds of the acoustic scene are invalid");
+
+        return juce::Result::ok();
+    }
+
+    static juce::Result validateContents (const Sections& scene)
+    {
+        auto& header = *scene.header;
+
+        // quantised vertices always lie within the (already validated) scene bounds
+        if ((header.flags & AcousticSceneFormat::quantisedVertices) == 0)
+        {
+            for (size_t vertex = 0; vertex < header.numVertices; ++vertex)
+            {
+                auto position = getVertex (scene, vertex);
+                if (! std::isfinite (position.x) || ! std::isfinite (position.y) || ! std::isfinite (position.z))
+                    return juce::Result::fail ("Vertex " + juce::String ((int) vertex) + " is not finite");
+            }
+        }
+
+        // triangles and their materials
+        for (size_t triangle = 0; triangle < header.numTriangles; ++triangle)
+        {
+            for (auto vertex : scene.triangles[triangle].vertices)
+                if (vertex >= header.numVertices)
+                    return juce::Result::fail ("Triangle " + juce::String ((int) triangle) + " refers to a missing vertex");
+
+            if (scene.materialIndices[triangle] >= header.numMaterials)
+                return juce::Result::fail ("Triangle " + juce::String ((int) triangle) + " refers to a missing material");
+        }
+
+        for (size_t material = 0; material < header.numMaterials; ++material)
+        {
+            auto& coefficients = scene.materials[material];
+            for (auto coefficient : { coefficients.absorption, coefficients.scattering, coefficients.diffraction, coefficients.transmission, coefficients.filter })
+                if (! (coefficient >= 0.0f && coefficient <= 1.0f))
+                    return juce::Result::fail ("Material " + juce::String ((int) material) + " has a coefficient outside of [0, 1]");
+        }
+
+        return header.numNodes > 0 ? validateTree (scene) : juce::Result::ok();
+    }
+
+    static juce::Result validateTree (const Sections& scene)
+    {
+        auto& header = *scene.header;
+
+        // we walk the tree depth-first, left child first, so the leaves have to cover the triangles in order,
+        // each triangle exactly once; that also rules out cycles and nodes that are shared between parents
+        struct Entry { juce::uint32 node; size_t depth; };
+        std::vector<Entry> stack { { 0, 1 } };
+        size_t nextTriangle = 0;
+        size_t numVisitedNodes = 0;
+
+        while (! stack.empty())
+        {
+            auto entry = stack.back();
+            stack.pop_back();
+            ++numVisitedNodes;
+
+            auto& node = scene.nodes[entry.node];
+            auto bounds = getBounds (node);
+
+            if (entry.depth > AcousticSceneFormat::maxTreeDepth)
+                return juce::Result::fail ("The BVH of the acoustic scene is too deep");
+
+            if (node.numTriangles == 0)
+            {
+                // children are always stored after their parent
+                if (node.firstChildOrTriangle <= entry.node || (juce::uint64) node.firstChildOrTriangle + 1 >= header.numNodes)
+                    return juce::Result::fail ("BVH node " + juce::String ((int) entry.node) + " has invalid children");
+
+                for (juce::uint32 child = 0; child < 2; ++child)
+                    if (! bounds.contains (getBounds (scene.nodes[node.firstChildOrTriangle + child])))
+                        return juce::Result::fail ("BVH node " + juce::String ((int) entry.node) + " does not contain its children");
+
+                stack.push_back ({ node.firstChildOrTriangle + 1, entry.depth + 1 });
+                stack.push_back ({ node.firstChildOrTriangle,     entry.depth + 1 });
+                continue;
+            }
+
+            if (node.firstChildOrTriangle != nextTriangle || (juce::uint64) node.firstChildOrTriangle + node.numTriangles > header.numTriangles)
+                return juce::Result::fail ("BVH leaf " + juce::String ((int) entry.node) + " has an invalid triangle range");
+
+            for (size_t triangle = node.firstChildOrTriangle; triangle < node.firstChildOrTriangle + node.numTriangles; ++triangle)
+            {
+                AcousticVector a, b, c;
+                getTriangle (scene, triangle, a, b, c);
+
+                AcousticBounds triangleBounds;
+                triangleBounds.expand (a);
+                triangleBounds.expand (b);
+                triangleBounds.expand (c);
+
+                if (! bounds.contains (triangleBounds))
+                    return juce::Result::fail ("BVH leaf " + juce::String ((int) entry.node) + " does not contain its triangles");
+            }
+
+            nextTriangle += node.numTriangles;
+        }
+
+        if (nextTriangle != header.numTriangles || numVisitedNodes != header.numNodes)
+            return juce::Result::fail ("The BVH does not cover the acoustic scene");
+
+        return juce::Result::ok();
+    }
+
+    static bool intersectBounds (const AcousticSceneFormat::Node& node, const AcousticVector& origin, const AcousticVector& inverseDirection, float maxDistance) noexcept
+    {
+        // slab test
+        float nearest = 0.0f;
+        float farthest = maxDistance;
+
+        for (size_t axis = 0; axis < 3; ++axis)
+        {
+            float t0 = (node.boundsMin[axis] - origin[axis]) * inverseDirection[axis];
+            float t1 = (node.boundsMax[axis] - origin[axis]) * inverseDirection[axis];
+            nearest = juce::jmax (nearest, juce::jmin (t0, t1));
+            farthest = juce::jmin (farthest, juce::jmax (t0, t1));
+        }
+
+        return nearest <= farthest;
+    }
+
+    // Möller-Trumbore (two-sided) against the triangles of a leaf, a batch at a time: the vertices are gathered into
+    // one array per coordinate and every lane is tested without branches, so that the compiler vectorises the test
+    template <bool stopAtFirstHit>
+    bool intersectLeaf (size_t firstTriangle, size_t numTriangles, const AcousticRay& ray, float& maxDistance, Hit& hit) const noexcept
+    {
+        constexpr size_t batchSize = 8;
+        bool didHit = false;
+
+        for (size_t begin = firstTriangle; begin < firstTriangle + numTriangles; begin += batchSize)
+        {
+            size_t batchEnd = juce::jmin (begin + batchSize, firstTriangle + numTriangles);
+
+            // lanes without a triangle have degenerate edges, so they never hit
+            alignas (64) float toOriginX[batchSize] {}, toOriginY[batchSize] {}, toOriginZ[batchSize] {};
+            alignas (64) float edge1X[batchSize] {}, edge1Y[batchSize] {}, edge1Z[batchSize] {};
+            alignas (64) float edge2X[batchSize] {}, edge2Y[batchSize] {}, edge2Z[batchSize] {};
+            alignas (64) float distances[batchSize];
+
+            for (size_t triangle = begin; triangle < batchEnd; ++triangle)
+            {
+                AcousticVector a, b, c;
+                getTriangle (sections, triangle, a, b, c);
+
+                size_t lane = triangle - begin;
+                toOriginX[lane] = ray.origin.x - a.x; toOriginY[lane] = ray.origin.y - a.y; toOriginZ[lane] = ray.origin.z - a.z;
+                edge1X[lane] = b.x - a.x; edge1Y[lane] = b.y - a.y; edge1Z[lane] = b.z - a.z;
+                edge2X[lane] = c.x - a.x; edge2Y[lane] = c.y - a.y; edge2Z[lane] = c.z - a.z;
+            }
+
+            float directionX = ray.direction.x, directionY = ray.direction.y, directionZ = ray.direction.z;
+            constexpr float noHit = std::numeric_limits<float>::infinity();
+
+            for (size_t lane = 0; lane < batchSize; ++lane)
+            {
+                float pX = directionY * edge2Z[lane] - directionZ * edge2Y[lane];
+                float pY = directionZ * edge2X[lane] - directionX * edge2Z[lane];
+                float pZ = directionX * edge2Y[lane] - directionY * edge2X[lane];
+                float determinant = edge1X[lane] * pX + edge1Y[lane] * pY + edge1Z[lane] * pZ;
+                float inverseDeterminant = 1.0f / determinant;
+
+                float u = (toOriginX[lane] * pX + toOriginY[lane] * pY + toOriginZ[lane] * pZ) * inverseDeterminant;
+
+                float qX = toOriginY[lane] * edge1Z[lane] - toOriginZ[lane] * edge1Y[lane];
+                float qY = toOriginZ[lane] * edge1X[lane] - toOriginX[lane] * edge1Z[lane];
+                float qZ = toOriginX[lane] * edge1Y[lane] - toOriginY[lane] * edge1X[lane];
+                float v = (directionX * qX + directionY * qY + directionZ * qZ) * inverseDeterminant;
+                float distance = (edge2X[lane] * qX + edge2Y[lane] * qY + edge2Z[lane] * qZ) * inverseDeterminant;
+
+                // a degenerate triangle makes u and v NaN, which fails every comparison
+                bool isHit = std::abs (determinant) >= 1e-12f && u >= 0.0f && u <= 1.0f && v >= 0.0f && u + v <= 1.0f
+                          && distance > 1e-4f && distance < maxDistance;
+                distances[lane] = isHit ? distance : noHit;
+            }
+
+            size_t nearest = 0;
+            for (size_t lane = 1; lane < batchSize; ++lane)
+                if (distances[lane] < distances[nearest])
+                    nearest = lane;
+
+            if (distances[nearest] == noHit)
+                continue;
+
+            // only the nearest hit needs its normal
+            AcousticVector edge1 { edge1X[nearest], edge1Y[nearest], edge1Z[nearest] };
+            AcousticVector edge2 { edge2X[nearest], edge2Y[nearest], edge2Z[nearest] };
+            auto normal = edge1.cross (edge2).normalised();
+
+            hit.distance = distances[nearest];
+            hit.triangle = begin + nearest;
+            hit.normal = normal.dot (ray.direction) > 0.0f ? normal * -1.0f : normal;
+            maxDistance = hit.distance;
+            didHit = true;
+
+            if (stopAtFirstHit)
+                return true;
+        }
+
+        return didHit;
+    }
+
+    template <bool stopAtFirstHit>
+    bool traverse (const AcousticRay& ray, Hit& hit) const noexcept
+    {
+        if (! isLoaded() || sections.header->numNodes == 0)
+            return false;
+
+        AcousticVector inverseDirection { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+        float maxDistance = ray.maxDistance;
+        bool didHit = false;
+
+        // the depth of the tree is bounded by the validation, so a fixed stack is enough
+        std::array<juce::uint32, AcousticSceneFormat::maxTreeDepth + 1> stack;
+        size_t stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0)
+        {
+            auto& node = sections.nodes[stack[--stackSize]];
+            if (! intersectBounds (node, ray.origin, inverseDirection, maxDistance))
+                continue;
+
+            if (node.numTriangles == 0)
+            {
+                stack[stackSize++] = node.firstChildOrTriangle + 1;
+                stack[stackSize++] = node.firstChildOrTriangle;
+                continue;
+            }
+
+            if (intersectLeaf<stopAtFirstHit> (node.firstChildOrTriangle, node.numTriangles, ray, maxDistance, hit))
+            {
+                if (stopAtFirstHit)
+                    return true;
+
+                didHit = true;
+            }
+        }
+
+        return didHit;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticScene)
+};
+
+// the scene that is currently loaded, shared by every plugin instance in the process
+class SharedAcousticScene
+{
+public:
+    // the version changes whenever a scene is loaded or unloaded, so that results of an old scene can be told apart
+    struct Snapshot
+    {
+        std::shared_ptr<const AcousticScene> scene;
+        juce::uint32 version { 0 };
+    };
+
+    std::shared_ptr<const AcousticScene> get() const
+    {
+        return getSnapshot().scene;
+    }
+
+    Snapshot getSnapshot() const
+    {
+        const juce::SpinLock::ScopedLockType lock (sceneLock);
+        return { scene, version };
+    }
+
+    void set (std::shared_ptr<const AcousticScene> newScene)
+    {
+        {
+            const juce::SpinLock::ScopedLockType lock (sceneLock);
+            std::swap (scene, newScene);
+            ++version;
+        }
+
+        // the old scene is unmapped here (outside of the lock) once its last reader lets go of it
+    }
+
+private:
+    juce::SpinLock sceneLock;
+    std::shared_ptr<const AcousticScene> scene;
+    juce::uint32 version { 0 };
+};
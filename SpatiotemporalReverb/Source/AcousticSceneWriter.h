@@ -0,0 +1,347 @@
+//
+//  AcousticSceneWriter.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "AcousticScene.h"
+
+/*  Builds an acoustic scene file (see AcousticScene.h) from the triangles and materials exported by Unity.
+    The BVH is built here, once, with the surface area heuristic, so that loading the scene at runtime is just a mapping.
+*/
+class AcousticSceneWriter
+{
+public:
+    AcousticSceneWriter()
+    {
+    }
+
+    size_t addMaterial (const AcousticSceneFormat::Material& material)
+    {
+        materials.push_back (material);
+        return materials.size() - 1;
+    }
+
+    // positions holds 3 floats per vertex, indices 3 vertices per triangle and materialIndices one material per triangle
+    juce::Result addTriangles (const float* positions, size_t numVertices, const int* indices, const int* materialIndices, size_t numTriangles)
+    {
+        // make sure that the input is valid before anything is added
+        for (size_t i = 0; i < 3 * numVertices; ++i)
+            if (! std::isfinite (positions[i]))
+                return juce::Result::fail ("Vertex " + juce::String ((int) (i / 3)) + " is not finite");
+
+        for (size_t triangle = 0; triangle < numTriangles; ++triangle)
+        {
+            for (size_t corner = 0; corner < 3; ++corner)
+                if (indices[3 * triangle + corner] < 0 || (size_t) indices[3 * triangle + corner] >= numVertices)
+                    return juce::Result::fail ("Triangle " + juce::String ((int) triangle) + " refers to a missing vertex");
+
+            if (materialIndices[triangle] < 0 || (size_t) materialIndices[triangle] >= materials.size())
+                return juce::Result::fail ("Triangle " + juce::String ((int) triangle) + " refers to a missing material");
+        }
+
+        auto firstVertex = (juce::uint32) vertices.size();
+        for (size_t vertex = 0; vertex < numVertices; ++vertex)
+            vertices.push_back ({ positions[3 * vertex], positions[3 * vertex + 1], positions[3 * vertex + 2] });
+
+        for (size_t triangle = 0; triangle < numTriangles; ++triangle)
+        {
+            triangles.push_back ({ { firstVertex + (juce::uint32) indices[3 * triangle],
+                                     firstVertex + (juce::uint32) indices[3 * triangle + 1],
+                                     firstVertex + (juce::uint32) indices[3 * triangle + 2] } });
+            triangleMaterials.push_back ((juce::uint16) materialIndices[triangle]);
+        }
+
+        return juce::Result::ok();
+    }
+
+    juce::Result writeTo (const juce::File& file, bool quantiseVertices)
+    {
+        juce::MemoryBlock data;
+        auto result = build (data, quantiseVertices);
+        if (result.failed())
+            return result;
+
+        // the file is replaced in one go, so a running game never maps a half-written scene
+        if (! file.replaceWithData (data.getData(), data.getSize()))
+            return juce::Result::fail ("Could not write " + file.getFullPathName());
+
+        return juce::Result::ok();
+    }
+
+    juce::Result build (juce::MemoryBlock& data, bool quantiseVertices)
+    {
+        if (materials.size() > 65536)
+            return juce::Result::fail ("An acoustic scene can hold at most 65536 materials");
+
+        if (vertices.size() > std::numeric_limits<juce::uint32>::max() || triangles.size() > std::numeric_limits<juce::uint32>::max())
+            return juce::Result::fail ("The acoustic scene is too large");
+
+        AcousticBounds sceneBounds;
+        for (auto& vertex : vertices)
+            sceneBounds.expand (vertex);
+
+        if (vertices.empty())
+            sceneBounds = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f } };
+
+        // the BVH is built on the vertices as the tracer will see them, i.e. after the quantisation
+        std::vector<AcousticSceneFormat::QuantisedVertex> quantisedVertices;
+        std::vector<AcousticVector> storedVertices = vertices;
+
+        if (quantiseVertices)
+        {
+            for (size_t vertex = 0; vertex < vertices.size(); ++vertex)
+            {
+                quantisedVertices.push_back (quantise (vertices[vertex], sceneBounds));
+                storedVertices[vertex] = AcousticSceneFormat::dequantise (quantisedVertices.back(), sceneBounds.min, sceneBounds.max);
+            }
+        }
+
+        auto tree = buildTree (storedVertices);
+
+        // lay out the sections
+        AcousticSceneFormat::Header header {};
+        std::memcpy (header.magic, AcousticSceneFormat::magic, sizeof (header.magic));
+        header.version = AcousticSceneFormat::currentVersion;
+        header.flags = quantiseVertices ? AcousticSceneFormat::quantisedVertices : 0;
+        header.numVertices = (juce::uint32) vertices.size();
+        header.numTriangles = (juce::uint32) triangles.size();
+        header.numMaterials = (juce::uint32) materials.size();
+        header.numNodes = (juce::uint32) tree.nodes.size();
+
+        for (size_t axis = 0; axis < 3; ++axis)
+        {
+            header.boundsMin[axis] = sceneBounds.min[axis];
+            header.boundsMax[axis] = sceneBounds.max[axis];
+        }
+
+        size_t vertexSize = quantiseVertices ? sizeof (AcousticSceneFormat::QuantisedVertex) : 3 * sizeof (float);
+        size_t offset = sizeof (header);
+        header.vertexOffset        = reserveSection (offset, vertices.size() * vertexSize);
+        header.triangleOffset      = reserveSection (offset, triangles.size() * sizeof (AcousticSceneFormat::Triangle));
+        header.materialIndexOffset = reserveSection (offset, triangles.size() * sizeof (juce::uint16));
+        header.materialOffset      = reserveSection (offset, materials.size() * sizeof (AcousticSceneFormat::Material));
+        header.nodeOffset          = reserveSection (offset, tree.nodes.size() * sizeof (AcousticSceneFormat::Node));
+        header.fileSize            = offset;
+
+        // and fill them in, with the triangles in the order of the BVH leaves
+        data.setSize (offset, true);
+        auto* bytes = static_cast<char*> (data.getData());
+        std::memcpy (bytes, &header, sizeof (header));
+
+        if (quantiseVertices)
+        {
+            std::memcpy (bytes + header.vertexOffset, quantisedVertices.data(), quantisedVertices.size() * vertexSize);
+        }
+        else
+        {
+            auto* positions = reinterpret_cast<float*> (bytes + header.vertexOffset);
+            for (auto& vertex : vertices)
+            {
+                *positions++ = vertex.x;
+                *positions++ = vertex.y;
+                *positions++ = vertex.z;
+            }
+        }
+
+        auto* sortedTriangles = reinterpret_cast<AcousticSceneFormat::Triangle*> (bytes + header.triangleOffset);
+        auto* sortedMaterials = reinterpret_cast<juce::uint16*> (bytes + header.materialIndexOffset);
+        for (size_t i = 0; i < tree.triangleOrder.size(); ++i)
+        {
+            sortedTriangles[i] = triangles[tree.triangleOrder[i]];
+            sortedMaterials[i] = triangleMaterials[tree.triangleOrder[i]];
+        }
+
+        std::memcpy (bytes + header.materialOffset, materials.data(), materials.size() * sizeof (AcousticSceneFormat::Material));
+        std::memcpy (bytes + header.nodeOffset, tree.nodes.data(), tree.nodes.size() * sizeof (AcousticSceneFormat::Node));
+
+        // we never write a file that the runtime would reject
+        return AcousticScene::validate (data.getData(), data.getSize());
+    }
+
+private:
+    static constexpr size_t maxTrianglesPerLeaf = 4;
+    static constexpr size_t numBins = 16;
+
+    std::vector<AcousticVector> vertices;
+    std::vector<AcousticSceneFormat::Triangle> triangles;
+    std::vector<juce::uint16> triangleMaterials;
+    std::vector<AcousticSceneFormat::Material> materials;
+
+    struct Tree
+    {
+        std::vector<AcousticSceneFormat::Node> nodes;
+        std::vector<size_t> triangleOrder;
+    };
+
+    struct BuildTriangle
+    {
+        size_t index;
+        AcousticBounds bounds;
+        AcousticVector centroid;
+    };
+
+    // helper functions
+    static size_t reserveSection (size_t& offset, size_t numBytes)
+    {
+        size_t sectionOffset = (offset + AcousticSceneFormat::sectionAlignment - 1) & ~(AcousticSceneFormat::sectionAlignment - 1);
+        offset = sectionOffset + numBytes;
+        return sectionOffset;
+    }
+
+    static AcousticSceneFormat::QuantisedVertex quantise (const AcousticVector& vertex, const AcousticBounds& bounds)
+    {
+        AcousticSceneFormat::QuantisedVertex quantised;
+        for (size_t axis = 0; axis < 3; ++axis)
+        {
+            float extent = bounds.max[axis] - bounds.min[axis];
+            float normalised = extent > 0.0f ? (vertex[axis] - bounds.min[axis]) / extent : 0.0f;
+            quantised.position[axis] = (juce::uint16) juce::jlimit (0L, 65535L, std::lround (normalised * 65535.0f));
+        }
+
+        return quantised;
+    }
+
+    Tree buildTree (const std::vector<AcousticVector>& positions) const
+    {
+        Tree tree;
+        if (triangles.empty())
+            return tree;
+
+        std::vector<BuildTriangle> buildTriangles;
+        buildTriangles.reserve (triangles.size());
+
+        for (size_t triangle = 0; triangle < triangles.size(); ++triangle)
+        {
+            BuildTriangle buildTriangle { triangle, {}, {} };
+            for (auto vertex : triangles[triangle].vertices)
+                buildTriangle.bounds.expand (positions[vertex]);
+
+            buildTriangle.centroid = (buildTriangle.bounds.min + buildTriangle.bounds.max) * 0.5f;
+            buildTriangles.push_back (buildTriangle);
+        }
+
+        tree.nodes.reserve (2 * triangles.size());
+        tree.nodes.push_back ({});
+        buildNode (tree, buildTriangles, 0, 0, buildTriangles.size(), 1);
+
+        for (auto& buildTriangle : buildTriangles)
+            tree.triangleOrder.push_back (buildTriangle.index);
+
+        return tree;
+    }
+
+    static void setBounds (AcousticSceneFormat::Node& node, const AcousticBounds& bounds)
+    {
+        for (size_t axis = 0; axis < 3; ++axis)
+        {
+            node.boundsMin[axis] = bounds.min[axis];
+            node.boundsMax[axis] = bounds.max[axis];
+        }
+    }
+
+    void buildNode (Tree& tree, std::vector<BuildTriangle>& buildTriangles, size_t nodeIndex, size_t begin, size_t end, size_t depth) const
+    {
+        AcousticBounds bounds, centroidBounds;
+        for (size_t i = begin; i < end; ++i)
+        {
+            bounds.expand (buildTriangles[i].bounds);
+            centroidBounds.expand (buildTriangles[i].centroid);
+        }
+
+        setBounds (tree.nodes[nodeIndex], bounds);
+
+        size_t count = end - begin;
+        size_t middle = count > maxTrianglesPerLeaf && depth < AcousticSceneFormat::maxTreeDepth ? findSplit (buildTriangles, begin, end, bounds, centroidBounds) : end;
+
+        if (middle == begin || middle == end)
+        {
+            tree.nodes[nodeIndex].firstChildOrTriangle = (juce::uint32) begin;
+            tree.nodes[nodeIndex].numTriangles = (juce::uint32) count;
+            return;
+        }
+
+        // both children are stored next to each other, after their parent
+        auto firstChild = (juce::uint32) tree.nodes.size();
+        tree.nodes.push_back ({});
+        tree.nodes.push_back ({});
+        tree.nodes[nodeIndex].firstChildOrTriangle = firstChild;
+        tree.nodes[nodeIndex].numTriangles = 0;
+
+        buildNode (tree, buildTriangles, firstChild,     begin,  middle, depth + 1);
+        buildNode (tree, buildTriangles, firstChild + 1, middle, end,    depth + 1);
+    }
+
+    // partitions the triangles and returns where the right child begins, or end if the node should stay a leaf
+    static size_t findSplit (std::vector<BuildTriangle>& buildTriangles, size_t begin, size_t end, const AcousticBounds& bounds, const AcousticBounds& centroidBounds)
+    {
+        // we bin the centroids along the longest axis
+        auto extent = centroidBounds.max - centroidBounds.min;
+        size_t axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        size_t count = end - begin;
+
+        if (! (extent[axis] > 0.0f))
+        {
+            // all centroids coincide, so a large leaf is split in half to keep the tree shallow
+            return count > 4 * maxTrianglesPerLeaf ? begin + count / 2 : end;
+        }
+
+        struct Bin { AcousticBounds bounds; size_t count { 0 }; };
+        std::array<Bin, numBins> bins;
+
+        auto getBin = [&] (const BuildTriangle& triangle)
+        {
+            auto bin = (size_t) ((triangle.centroid[axis] - centroidBounds.min[axis]) / extent[axis] * (float) numBins);
+            return juce::jmin (bin, numBins - 1);
+        };
+
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto& bin = bins[getBin (buildTriangles[i])];
+            bin.bounds.expand (buildTriangles[i].bounds);
+            ++bin.count;
+        }
+
+        // evaluate the surface area heuristic for every plane between two bins
+        std::array<float, numBins - 1> rightCosts;
+        AcousticBounds rightBounds;
+        size_t rightCount = 0;
+        for (size_t plane = numBins - 1; plane > 0; --plane)
+        {
+            rightBounds.expand (bins[plane].bounds);
+            rightCount += bins[plane].count;
+            rightCosts[plane - 1] = rightBounds.getSurfaceArea() * (float) rightCount;
+        }
+
+        AcousticBounds leftBounds;
+        size_t leftCount = 0;
+        float bestCost = std::numeric_limits<float>::max();
+        size_t bestPlane = 0;
+        for (size_t plane = 0; plane < numBins - 1; ++plane)
+        {
+            leftBounds.expand (bins[plane].bounds);
+            leftCount += bins[plane].count;
+
+            float cost = leftBounds.getSurfaceArea() * (float) leftCount + rightCosts[plane];
+            if (leftCount > 0 && leftCount < count && cost < bestCost)
+            {
+                bestCost = cost;
+                bestPlane = plane;
+            }
+        }
+
+        // one traversal step against intersecting every triangle of the leaf
+        float surfaceArea = bounds.getSurfaceArea();
+        float splitCost = 1.0f + (surfaceArea > 0.0f ? bestCost / surfaceArea : (float) count);
+        if (bestCost == std::numeric_limits<float>::max() || (splitCost >= (float) count && count <= 4 * maxTrianglesPerLeaf))
+            return end;
+
+        auto middle = std::partition (buildTriangles.begin() + (std::ptrdiff_t) begin, buildTriangles.begin() + (std::ptrdiff_t) end,
+                                      [&] (const BuildTriangle& triangle) { return getBin (triangle) <= bestPlane; });
+
+        return (size_t) (middle - buildTriangles.begin());
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (AcousticSceneWriter)
+};
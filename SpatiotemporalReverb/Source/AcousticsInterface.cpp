@@ -0,0 +1,708 @@
+//
+//  AcousticsInterface.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "AcousticScene.h"
+#include "AcousticSceneWriter.h"
+#include "AcousticQueryService.h"
+#include "AcousticRooms.h"
+#include "AcousticRoomBuses.h"
+#include "AcousticDiffraction.h"
+#include "QualityGovernor.h"
+#include "CpuDispatch.h"
+#include "StageProfiler.h"
+#include "TraceRecorder.h"
+#include "CaptureReplay.h"
+
+/*  The C functions that Unity calls (through DllImport) to hand the native acoustics their data.
+    Like the parameter functions of the plugin, they return 1 on success and 0 on failure; the reason for the
+    last failure can be fetched with GetAcousticsError(). They are called from Unity's main thread.
+*/
+namespace
+{
+    // the objects that the plugin instances share with Unity; the workers of the query service (and the writer of the
+    // trace) are threads, so they are created on first use (or by InitialiseAcoustics()) and let go of by
+    // ShutdownAcoustics(), rather than being started and joined while the library is loaded and unloaded (where
+    // Windows holds the loader lock, which a thread that is joined there may be waiting for)
+    struct Services
+    {
+        juce::SharedResourcePointer<SharedAcousticScene> sharedScene;
+        juce::SharedResourcePointer<SharedAcousticRooms> sharedRooms;
+        juce::SharedResourcePointer<AcousticRoomBuses> roomBuses;
+        juce::SharedResourcePointer<SharedAcousticEdgeGraph> sharedEdgeGraph;
+
+        // the analysis runs on the workers of the service, the results are read from its mailboxes
+        juce::SharedResourcePointer<AcousticQueryService> queryService;
+        juce::SharedResourcePointer<QualityGovernor> qualityGovernor;
+        juce::SharedResourcePointer<StageProfiler> stageProfiler;
+        juce::SharedResourcePointer<TraceRecorder> traceRecorder;
+        juce::SharedResourcePointer<CaptureSession> captureSession;
+    };
+
+    std::unique_ptr<Services> services;
+
+    // how far each portal of the rooms that were analysed last is open (e.g. a door), from 0 to 1
+    std::shared_ptr<const AcousticRoomMap> portalRooms;
+    std::vector<float> portalOpenness;
+    juce::String lastError;
+
+    // what the game thread has read from each mailbox so far
+    std::array<juce::uint32, AcousticQueryService::maxNumSources> lastReadSequences {};
+
+    Services& getServices()
+    {
+        if (services == nullptr)
+            services = std::make_unique<Services>();
+
+        return *services;
+    }
+
+    int reportResult (const juce::Result& result)
+    {
+        lastError = result.getErrorMessage();
+        return result.wasOk() ? 1 : 0;
+    }
+
+    // the rooms are analysed on a worker, so we only learn that new rooms are there once we see them; their portals
+    // start out fully open
+    void updatePortalsOf (const std::shared_ptr<const AcousticRoomMap>& rooms)
+    {
+        if (rooms != portalRooms)
+        {
+            portalOpenness.assign (rooms->getNumPortals(), 1.0f);
+            portalRooms = rooms;
+        }
+    }
+}
+
+extern "C"
+{
+    // creates the shared objects (and starts their threads) up front, so that the first call that needs them doesn't
+    // pay for it; Unity calls it when the acoustics start, every other function creates them too if it hasn't been
+    JUCE_EXPORT int InitialiseAcoustics()
+    {
+        getServices();
+        return reportResult (juce::Result::ok());
+    }
+
+    // lets go of the shared objects; their threads stop once the plugin instances (which hold them too) are gone.
+    // Unity calls it when the acoustics are done with, before the library is unloaded
+    JUCE_EXPORT int ShutdownAcoustics()
+    {
+        portalRooms.reset();
+        portalOpenness.clear();
+        lastReadSequences.fill (0);
+        services.reset();
+        return reportResult (juce::Result::ok());
+    }
+
+    // materials holds the 5 coefficients of MaterialAudioAttributes per material, in the order of AcousticSceneFormat::Material
+    JUCE_EXPORT int ExportAcousticScene (const char* path,
+                                         const float* positions, int numVertices,
+                                         const int* indices, const int* triangleMaterials, int numTriangles,
+                                         const float* materials, int numMaterials,
+                                         int quantiseVertices)
+    {
+        if (path == nullptr || numVertices < 0 || numTriangles < 0 || numMaterials < 0
+            || (numVertices > 0 && positions == nullptr) || (numTriangles > 0 && (indices == nullptr || triangleMaterials == nullptr))
+            || (numMaterials > 0 && materials == nullptr))
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        AcousticSceneWriter writer;
+        for (int material = 0; material < numMaterials; ++material)
+        {
+            auto* coefficients = materials + 5 * material;
+            writer.addMaterial ({ coefficients[0], coefficients[1], coefficients[2], coefficients[3], coefficients[4] });
+        }
+
+        auto result = writer.addTriangles (positions, (size_t) numVertices, indices, triangleMaterials, (size_t) numTriangles);
+        if (result.failed())
+            return reportResult (result);
+
+        return reportResult (writer.writeTo (juce::File (juce::String::fromUTF8 (path)), quantiseVertices != 0));
+    }
+
+    // maps the scene and makes it the scene that all plugin instances trace against
+    JUCE_EXPORT int LoadAcousticScene (const char* path)
+    {
+        if (path == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        auto scene = std::make_shared<AcousticScene>();
+        auto result = scene->open (juce::File (juce::String::fromUTF8 (path)));
+        if (result.wasOk())
+        {
+            // the rooms and edges of the old scene are of no use anymore
+            getServices().sharedRooms->set (nullptr);
+            getServices().sharedEdgeGraph->set (nullptr);
+            getServices().sharedScene->set (std::move (scene));
+        }
+
+        return reportResult (result);
+    }
+
+    JUCE_EXPORT int UnloadAcousticScene()
+    {
+        // the workers let go of the old scene with the next job of each source
+        getServices().sharedRooms->set (nullptr);
+        getServices().sharedEdgeGraph->set (nullptr);
+        getServices().sharedScene->set (nullptr);
+        return reportResult (juce::Result::ok());
+    }
+
+    // checks a scene file without loading it
+    JUCE_EXPORT int ValidateAcousticScene (const char* path)
+    {
+        if (path == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        AcousticScene scene;
+        return reportResult (scene.open (juce::File (juce::String::fromUTF8 (path))));
+    }
+
+    // queues the analysis that splits the loaded scene into rooms and estimates their reverb; it traces a few rays per
+    // cell of cellSize metres, so it runs on a worker of the analysis and the rooms are there once
+    // IsAcousticRoomAnalysisPending() returns 0. It is meant to be called once after loading
+    JUCE_EXPORT int AnalyseAcousticRooms (float cellSize)
+    {
+        if (cellSize <= 0.0f)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        auto snapshot = getServices().sharedScene->getSnapshot();
+        if (snapshot.scene == nullptr)
+            return reportResult (juce::Result::fail ("No acoustic scene is loaded"));
+
+        AcousticRoomMap::Settings settings;
+        settings.cellSize = cellSize;
+        getServices().queryService->analyseRooms (settings);
+        return reportResult (juce::Result::ok());
+    }
+
+    // returns 1 while a queued room analysis hasn't published its rooms yet
+    JUCE_EXPORT int IsAcousticRoomAnalysisPending()
+    {
+        return getServices().queryService->isRoomAnalysisPending() ? 1 : 0;
+    }
+
+    // sets how far the portal nearest to the position (within 2 m) is open, from 0 (closed) to 1; returns its index + 1
+    JUCE_EXPORT int SetAcousticPortalOpenness (const float* position, float openness)
+    {
+        if (position == nullptr || openness < 0.0f || openness > 1.0f)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        auto rooms = getServices().sharedRooms->get();
+        if (rooms == nullptr)
+            return reportResult (juce::Result::fail ("The rooms haven't been analysed"));
+
+        updatePortalsOf (rooms);
+        int portal = rooms->findNearestPortal ({ position[0], position[1], position[2] }, 2.0f);
+        if (portal < 0)
+            return reportResult (juce::Result::fail ("There is no portal near the position"));
+
+        portalOpenness[(size_t) portal] = openness;
+        reportResult (juce::Result::ok());
+        return portal + 1;
+    }
+
+    // updates the shared room buses for the listener's position; called once per frame
+    JUCE_EXPORT int UpdateAcousticRoomBuses (const float* listenerPosition)
+    {
+        if (listenerPosition == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        auto rooms = getServices().sharedRooms->get();
+        if (rooms == nullptr)
+            return reportResult (juce::Result::fail ("The rooms haven't been analysed"));
+
+        updatePortalsOf (rooms);
+
+        constexpr size_t maxNumRooms = AcousticRoomBuses::maxNumRooms;
+        size_t numRooms = juce::jmin (rooms->getNumRooms(), maxNumRooms);
+
+        // a pass through the delay takes a mean free path, and the feedback makes the bus decay in the room's reverb time
+        auto speedOfSound = getServices().queryService->getSpeedOfSound();
+        std::array<float, maxNumRooms> absorptionAreas {};
+        for (size_t room = 0; room < numRooms; ++room)
+        {
+            auto& properties = rooms->getRoom (room);
+            float delayTime = juce::jlimit (0.001f, 1.0f, properties.meanFreePath / speedOfSound);
+            float feedback = std::pow (10.0f, -3.0f * delayTime / juce::jmax (0.01f, properties.getReverbTime()));
+            getServices().roomBuses->setRoom (room, delayTime, juce::jlimit (0.0f, 0.99f, feedback), 4.0f * std::cbrt (properties.volume) / speedOfSound);
+            absorptionAreas[room] = properties.surfaceArea * properties.meanAbsorption;
+        }
+
+        // the open area between each pair of rooms (and between each room and the outside, in the last column)
+        std::array<std::array<float, maxNumRooms + 1>, maxNumRooms> openAreas {};
+        for (size_t portal = 0; portal < rooms->getNumPortals(); ++portal)
+        {
+            auto& properties = rooms->getPortal (portal);
+            auto roomA = (size_t) properties.rooms[0];
+            auto roomB = properties.rooms[1] >= 0 ? (size_t) properties.rooms[1] : maxNumRooms;
+            if (roomA >= numRooms || (roomB >= numRooms && roomB != maxNumRooms))
+                continue;
+
+            float openArea = portalOpenness[portal] * properties.area;
+            openAreas[roomA][roomB] += openArea;
+            if (roomB < maxNumRooms)
+                openAreas[roomB][roomA] += openArea;
+        }
+
+        // a room takes in the share of the energy coming through its portals that it doesn't absorb itself (Kuttruff)
+        auto getCoupling = [&] (float openArea, float absorptionArea)
+        {
+            return openArea > 0.0f ? std::sqrt (openArea / (absorptionArea + openArea)) : 0.0f;
+        };
+
+        int listenerRoom = rooms->getRoomIndexAt ({ listenerPosition[0], listenerPosition[1], listenerPosition[2] });
+        if (listenerRoom >= (int) numRooms)
+            listenerRoom = -1;
+
+        for (size_t from = 0; from < maxNumRooms; ++from)
+        {
+            for (size_t to = 0; to < maxNumRooms; ++to)
+                getServices().roomBuses->setCoupling (from, to, from < numRooms && to < numRooms && from != to ? getCoupling (openAreas[from][to], absorptionAreas[to]) : 0.0f);
+
+            // outside of every room, the listener hears what leaves the rooms through their openings to the outside
+            float listenerGain = 0.0f;
+            if (from < numRooms)
+            {
+                if (listenerRoom < 0)
+                    listenerGain = getCoupling (openAreas[from][maxNumRooms], absorptionAreas[from]);
+                else if ((int) from == listenerRoom)
+                    listenerGain = 1.0f;
+                else
+                    listenerGain = getCoupling (openAreas[from][(size_t) listenerRoom], absorptionAreas[(size_t) listenerRoom]);
+            }
+
+            getServices().roomBuses->setListenerGain (from, listenerGain);
+        }
+
+        return reportResult (juce::Result::ok());
+    }
+
+    // writes the room at the position to room: volume, surface area, mean absorption, mean free path and the Eyring
+    // reverb times of the 6 octave bands from 125 Hz to 4 kHz; fails outside of every closed room
+    JUCE_EXPORT int GetAcousticRoom (const float* position, float* room)
+    {
+        if (position == nullptr || room == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        auto rooms = getServices().sharedRooms->get();
+        if (rooms == nullptr)
+            return reportResult (juce::Result::fail ("The rooms haven't been analysed"));
+
+        auto* found = rooms->getRoomAt ({ position[0], position[1], position[2] });
+        if (found == nullptr)
+            return reportResult (juce::Result::fail ("The position isn't in a closed room"));
+
+        room[0] = found->volume;
+        room[1] = found->surfaceArea;
+        room[2] = found->meanAbsorption;
+        room[3] = found->meanFreePath;
+        for (size_t band = 0; band < AcousticBands::numBands; ++band)
+            room[4 + band] = found->eyringReverbTimes[band];
+
+        return reportResult (juce::Result::ok());
+    }
+
+    // queues the extraction of the diffracting edges of the loaded scene, which links the ones that see each other;
+    // like the room analysis it runs on a worker, and the edges are there once IsAcousticDiffractionAnalysisPending()
+    // returns 0
+    JUCE_EXPORT int AnalyseAcousticDiffraction()
+    {
+        auto snapshot = getServices().sharedScene->getSnapshot();
+        if (snapshot.scene == nullptr)
+            return reportResult (juce::Result::fail ("No acoustic scene is loaded"));
+
+        getServices().queryService->analyseEdges (AcousticEdgeGraph::Settings());
+        return reportResult (juce::Result::ok());
+    }
+
+    JUCE_EXPORT int IsAcousticDiffractionAnalysisPending()
+    {
+        return getServices().queryService->isEdgeAnalysisPending() ? 1 : 0;
+    }
+
+    // writes the shortest path from the source around the obstacles to the listener to path: its length, the gain and
+    // the low-pass cutoff frequency of its edges, where the sound seems to come from (3 values) and the number of edges
+    // (0 if nothing is in the way); fails if there is no path over at most two edges
+    JUCE_EXPORT int FindAcousticDiffractionPath (const float* sourcePosition, const float* listenerPosition, float* path)
+    {
+        if (sourcePosition == nullptr || listenerPosition == nullptr || path == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        auto snapshot = getServices().sharedScene->getSnapshot();
+        auto graph = getServices().sharedEdgeGraph->get();
+        if (snapshot.scene == nullptr || graph == nullptr || graph->getSceneVersion() != snapshot.version)
+            return reportResult (juce::Result::fail ("The edges haven't been analysed"));
+
+        DiffractionPath found;
+        if (! getServices().queryService->findDiffractionPath (*graph, *snapshot.scene, snapshot.version,
+                                                 { sourcePosition[0], sourcePosition[1], sourcePosition[2] },
+                                                 { listenerPosition[0], listenerPosition[1], listenerPosition[2] }, found))
+            return reportResult (juce::Result::fail ("There is no path around the obstacles"));
+
+        path[0] = found.length;
+        path[1] = found.getGain();
+        path[2] = found.getCutoffFrequency();
+        path[3] = found.apparentPosition.x;
+        path[4] = found.apparentPosition.y;
+        path[5] = found.apparentPosition.z;
+        path[6] = (float) found.numEdges;
+        return reportResult (juce::Result::ok());
+    }
+
+    // queues an analysis of the source with rayBudget new rays; it replaces a query of the slot that hasn't run yet
+    JUCE_EXPORT int SubmitAcousticQuery (int slot, const float* sourcePosition, const float* listenerPosition, int rayBudget)
+    {
+        if (! juce::isPositiveAndBelow (slot, AcousticQueryService::maxNumSources)
+            || sourcePosition == nullptr || listenerPosition == nullptr || rayBudget < 0)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        if (getServices().sharedScene->get() == nullptr)
+            return reportResult (juce::Result::fail ("No acoustic scene is loaded"));
+
+        getServices().queryService->submit (slot, { { sourcePosition[0], sourcePosition[1], sourcePosition[2] },
+                                      { listenerPosition[0], listenerPosition[1], listenerPosition[2] },
+                                      (size_t) rayBudget });
+        return reportResult (juce::Result::ok());
+    }
+
+    // writes the latest estimate of the slot to estimate[0..3]; returns 0 if nothing new has been published since the last call
+    JUCE_EXPORT int ReadAcousticQueryResult (int slot, float* estimate)
+    {
+        if (! juce::isPositiveAndBelow (slot, AcousticQueryService::maxNumSources) || estimate == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        ReverbEstimate result;
+        if (! getServices().queryService->readResult (slot, result, lastReadSequences[(size_t) slot]))
+            return reportResult (juce::Result::fail ("No new result"));
+
+        estimate[0] = result.obstructedReflections;
+        estimate[1] = result.longestDistance;
+        estimate[2] = result.averageDistance;
+        estimate[3] = result.averageAbsorption;
+        return reportResult (juce::Result::ok());
+    }
+
+    JUCE_EXPORT int RemoveAcousticSource (int slot)
+    {
+        if (! juce::isPositiveAndBelow (slot, AcousticQueryService::maxNumSources))
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        // a source that goes away after the shutdown (Unity destroys its objects in any order) has nothing to remove
+        if (services != nullptr)
+            services->queryService->removeSource (slot);
+
+        return reportResult (juce::Result::ok());
+    }
+
+    // called once per game frame; the workers stop starting new jobs once budgetMilliseconds of CPU time is used up
+    JUCE_EXPORT int BeginAcousticFrame (float budgetMilliseconds)
+    {
+        if (budgetMilliseconds < 0.0f)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        getServices().queryService->beginFrame ((double) budgetMilliseconds);
+        return reportResult (juce::Result::ok());
+    }
+
+    // the CPU time in milliseconds that the workers spent on the last frame
+    JUCE_EXPORT float GetAcousticFrameMilliseconds()
+    {
+        return (float) getServices().queryService->getLastFrameMilliseconds();
+    }
+
+    // sets the CPU budget that the quality governor keeps the plugin instances and the analysis within: the share of
+    // real time that all processBlock() calls together may take, and the tracing time per frame
+    JUCE_EXPORT int SetAcousticQualityBudget (float processingLoad, float tracingMilliseconds)
+    {
+        if (processingLoad <= 0.0f || tracingMilliseconds <= 0.0f)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        getServices().qualityGovernor->setBudget ({ processingLoad, tracingMilliseconds });
+        return reportResult (juce::Result::ok());
+    }
+
+    // measures the last frame against the budget and changes the quality of (at most) one instance; called once per
+    // frame, after BeginAcousticFrame
+    JUCE_EXPORT int UpdateAcousticQuality()
+    {
+        getServices().qualityGovernor->update ((float) getServices().queryService->getLastFrameMilliseconds());
+        return reportResult (juce::Result::ok());
+    }
+
+    // telemetry receives the processing load, the tracing time, the pressure (the larger of the two relative to its
+    // budget), the number of instances, the number of instances below full quality, the last changed instance and
+    // the last change (+1 raised, -1 lowered, 0 none)
+    JUCE_EXPORT int GetAcousticQualityTelemetry (float* telemetry)
+    {
+        if (telemetry == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        auto current = getServices().qualityGovernor->getTelemetry();
+        telemetry[0] = current.processingLoad;
+        telemetry[1] = current.tracingMilliseconds;
+        telemetry[2] = current.pressure;
+        telemetry[3] = (float) current.numVoices;
+        telemetry[4] = (float) current.numDegradedVoices;
+        telemetry[5] = (float) current.lastChangedVoice;
+        telemetry[6] = (float) current.lastChange;
+        return reportResult (juce::Result::ok());
+    }
+
+    // the speed of sound in the medium of the level, in meters per second; it turns the distances of the analysis into
+    // the delay times of the reverb and the propagation delay of the direct sound
+    JUCE_EXPORT int SetAcousticSpeedOfSound (float speedOfSound)
+    {
+        if (! (speedOfSound > 0.0f))
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        getServices().queryService->setSpeedOfSound (speedOfSound);
+        return reportResult (juce::Result::ok());
+    }
+
+    // forces the instruction set of the DSP and tracing kernels (0 generic, 1 SSE2, 2 AVX2, 3 AVX-512, 4 NEON), e.g. to
+    // compare them; -1 goes back to the best one of the machine. Fails if the machine or the build doesn't have it
+    JUCE_EXPORT int ForceAcousticKernelIsa (int isa)
+    {
+        if (isa < 0)
+        {
+            CpuDispatch::reset();
+            return reportResult (juce::Result::ok());
+        }
+
+        if (isa >= CpuDispatch::numIsas || ! CpuDispatch::force ((CpuIsa) isa))
+            return reportResult (juce::Result::fail ("This instruction set is not available"));
+
+        return reportResult (juce::Result::ok());
+    }
+
+    // returns the instruction set that the kernels run with, and copies its name into buffer (UTF-8, null terminated)
+    // if one is given
+    JUCE_EXPORT int GetAcousticKernelIsa (char* buffer, int bufferSize)
+    {
+        auto isa = CpuDispatch::getActiveIsa();
+        if (buffer != nullptr && bufferSize > 0)
+            juce::String (CpuDispatch::getName (isa)).copyToUTF8 (buffer, (size_t) bufferSize);
+
+        return (int) isa;
+    }
+
+    // switches the timing of the stages of all plugin instances on (1) or off (0); fails if it is compiled out
+    JUCE_EXPORT int SetAcousticProfiling (int enabled)
+    {
+       #if SPATIOTEMPORAL_REVERB_PROFILING
+        StageProfiler::setEnabled (enabled != 0);
+        return reportResult (juce::Result::ok());
+       #else
+        juce::ignoreUnused (enabled);
+        return reportResult (juce::Result::fail ("Profiling is compiled out"));
+       #endif
+    }
+
+    // fills instances with the ids of the profiled plugin instances (at most maxNumInstances) and returns how many there are
+    JUCE_EXPORT int GetAcousticProfileInstances (int* instances, int maxNumInstances)
+    {
+        int numInstances = 0;
+        getServices().stageProfiler->forEachInstance ([&] (int instance, const StageProfile&)
+        {
+            if (instances != nullptr && numInstances < maxNumInstances)
+                instances[numInstances] = instance;
+
+            ++numInstances;
+        });
+
+        return numInstances;
+    }
+
+    // profile receives the acoustic source of the instance, its number of blocks and of deadline misses, followed by
+    // count, min, mean, p99 and max (in microseconds) of every stage, in the order of ProcessingStage
+    // (3 + 5 * GetAcousticProfileNumStages() values)
+    JUCE_EXPORT int GetAcousticProfile (int instance, float* profile)
+    {
+        if (profile == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        bool wasFound = false;
+        auto cyclesPerMicrosecond = getServices().stageProfiler->getCyclesPerMicrosecond();
+        getServices().stageProfiler->forEachInstance ([&] (int id, const StageProfile& stageProfile)
+        {
+            if (id != instance)
+                return;
+
+            wasFound = true;
+            profile[0] = (float) stageProfile.getAcousticSource();
+            profile[1] = (float) stageProfile.getStatistics (ProcessingStage::block, cyclesPerMicrosecond).count;
+            profile[2] = (float) stageProfile.getDeadlineMisses();
+
+            for (size_t stage = 0; stage < StageProfile::numStages; ++stage)
+            {
+                auto statistics = stageProfile.getStatistics ((ProcessingStage) stage, cyclesPerMicrosecond);
+                auto* values = profile + 3 + 5 * stage;
+                values[0] = (float) statistics.count;
+                values[1] = (float) statistics.minMicroseconds;
+                values[2] = (float) statistics.meanMicroseconds;
+                values[3] = (float) statistics.p99Microseconds;
+                values[4] = (float) statistics.maxMicroseconds;
+            }
+        });
+
+        return reportResult (wasFound ? juce::Result::ok() : juce::Result::fail ("There is no such instance"));
+    }
+
+    JUCE_EXPORT int GetAcousticProfileNumStages()
+    {
+        return (int) StageProfile::numStages;
+    }
+
+    // copies the name of a stage into buffer (UTF-8, null terminated) and returns the number of bytes written
+    JUCE_EXPORT int GetAcousticProfileStageName (int stage, char* buffer, int bufferSize)
+    {
+        if (! juce::isPositiveAndBelow (stage, (int) StageProfile::numStages) || buffer == nullptr || bufferSize <= 0)
+            return 0;
+
+        return (int) StageProfile::getStageName ((ProcessingStage) stage).copyToUTF8 (buffer, (size_t) bufferSize);
+    }
+
+    // starts the timings of an instance over at its next block; -1 starts all of them over
+    JUCE_EXPORT int ResetAcousticProfile (int instance)
+    {
+        bool wasFound = false;
+        getServices().stageProfiler->forEachInstance ([&] (int id, StageProfile& stageProfile)
+        {
+            if (instance < 0 || id == instance)
+            {
+                stageProfile.requestReset();
+                wasFound = true;
+            }
+        });
+
+        return reportResult (wasFound || instance < 0 ? juce::Result::ok() : juce::Result::fail ("There is no such instance"));
+    }
+
+    // starts (1) or stops (0) recording the blocks and setter calls of all plugin instances into the trace ring
+    JUCE_EXPORT int SetAcousticTracing (int enabled)
+    {
+        getServices().traceRecorder->setEnabled (enabled != 0);
+        return reportResult (juce::Result::ok());
+    }
+
+    // writes the latest events of the trace ring to path as a Chrome trace (JSON) on a background thread; fails if the
+    // previous trace is still being written. GetAcousticTraceState() tells when the file is done
+    JUCE_EXPORT int WriteAcousticTrace (const char* path)
+    {
+        if (path == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        auto file = juce::File (juce::String::fromUTF8 (path));
+        if (! getServices().traceRecorder->writeTrace (file))
+            return reportResult (juce::Result::fail ("A trace is still being written"));
+
+        return reportResult (juce::Result::ok());
+    }
+
+    // returns 0 if no trace was requested, 1 while it's being written, 2 once it's written and 3 if it couldn't be
+    JUCE_EXPORT int GetAcousticTraceState()
+    {
+        return (int) getServices().traceRecorder->getWriteState();
+    }
+
+    // starts capturing the input, the setter calls and the parameters of every prepared plugin instance into
+    // directory/capture-<instance>.stcap (replacing earlier captures there); fails if no instance could be captured
+    JUCE_EXPORT int StartAcousticCapture (const char* directory)
+    {
+        if (directory == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        if (getServices().captureSession->start (juce::File (juce::String::fromUTF8 (directory))) == 0)
+            return reportResult (juce::Result::fail ("There is no prepared instance to capture"));
+
+        return reportResult (juce::Result::ok());
+    }
+
+    // stops the captures and closes their files; fails if a capture lost records because the disk couldn't keep up
+    // (its file then ends where the records were lost)
+    JUCE_EXPORT int StopAcousticCapture()
+    {
+        getServices().captureSession->stop();
+
+        if (getServices().captureSession->getNumOverruns() > 0)
+            return reportResult (juce::Result::fail ("A capture stopped early since it couldn't be written fast enough"));
+
+        return reportResult (juce::Result::ok());
+    }
+
+    // renders the captures at paths again (in parallel, each into a WAV file next to it) and writes the hash of each
+    // output to hashes, or 0 for a capture that couldn't be rendered. Returns the number of captures rendered; the
+    // reasons for the failures can be fetched with GetAcousticsError(). Blocks until all of them are done
+    JUCE_EXPORT int ReplayAcousticCaptures (const char* const* paths, int numPaths, juce::uint64* hashes)
+    {
+        if (paths == nullptr || hashes == nullptr || numPaths < 0)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        std::vector<CaptureReplay::Render> renders ((size_t) numPaths);
+        for (size_t index = 0; index < renders.size(); ++index)
+            renders[index].capture = juce::File (juce::String::fromUTF8 (paths[index] != nullptr ? paths[index] : ""));
+
+        CaptureReplay::renderAll (renders);
+
+        int numRendered = 0;
+        juce::StringArray errors;
+        for (size_t index = 0; index < renders.size(); ++index)
+        {
+            hashes[index] = renders[index].result.wasOk() ? renders[index].hash : 0;
+            if (renders[index].result.wasOk())
+                ++numRendered;
+            else
+                errors.add (renders[index].result.getErrorMessage());
+        }
+
+        lastError = errors.joinIntoString ("\n");
+        return numRendered;
+    }
+
+    // statistics receives lookups, hits, partial hits, misses, evictions and the number of cached entries (reverb
+    // estimates and diffraction paths together)
+    JUCE_EXPORT int GetAcousticCacheStatistics (juce::int64* statistics)
+    {
+        if (statistics == nullptr)
+            return reportResult (juce::Result::fail ("Invalid arguments"));
+
+        size_t numEntries;
+        auto cacheStatistics = getServices().queryService->getCacheStatistics (numEntries);
+        statistics[0] = cacheStatistics.lookups;
+        statistics[1] = cacheStatistics.hits;
+        statistics[2] = cacheStatistics.partialHits;
+        statistics[3] = cacheStatistics.misses;
+        statistics[4] = cacheStatistics.evictions;
+        statistics[5] = (juce::int64) numEntries;
+        return reportResult (juce::Result::ok());
+    }
+
+    // runs the unit tests of the plugin (see Source/Tests) and returns the number of failed checks; the results of each
+    // test go to the log, which is how the measurements that they log (noise floors, timings) are read
+    JUCE_EXPORT int RunAcousticUnitTests()
+    {
+        juce::UnitTestRunner runner;
+        runner.setAssertOnFailure (false);
+        runner.runTestsInCategory ("SpatiotemporalReverb");
+
+        int numFailures = 0;
+        for (int i = 0; i < runner.getNumResults(); ++i)
+            numFailures += runner.getResult (i)->failures;
+
+        return numFailures;
+    }
+
+    // copies the reason for the last failure into buffer (UTF-8, null terminated) and returns the number of bytes written
+    JUCE_EXPORT int GetAcousticsError (char* buffer, int bufferSize)
+    {
+        if (buffer == nullptr || bufferSize <= 0)
+            return 0;
+
+        return (int) lastError.copyToUTF8 (buffer, (size_t) bufferSize);
+    }
+}
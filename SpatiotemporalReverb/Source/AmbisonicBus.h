@@ -0,0 +1,330 @@
+//
+//  AmbisonicBus.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "CpuDispatch.h"
+
+// the ambisonic format of the bus: ACN channel order with SN3D normalisation (AmbiX), up to third order
+namespace Ambisonics
+{
+    constexpr int maxOrder = 3;
+    constexpr size_t maxNumChannels = (maxOrder + 1) * (maxOrder + 1);
+
+    constexpr size_t getNumChannels (int order) noexcept
+    {
+        return (size_t) ((order + 1) * (order + 1));
+    }
+
+    // the encoding gains of a direction (azimuth counterclockwise from the front, elevation up from the horizon, both in
+    // radians); the channels above the order are set to 0
+    inline void encode (float azimuth, float elevation, int order, float* gains) noexcept
+    {
+        // make sure that the order is valid
+        jassert (order >= 0 && order <= maxOrder);
+
+        float sinA = std::sin (azimuth), cosA = std::cos (azimuth);
+        float sin2A = std::sin (2.0f * azimuth), cos2A = std::cos (2.0f * azimuth);
+        float sin3A = std::sin (3.0f * azimuth), cos3A = std::cos (3.0f * azimuth);
+        float sinE = std::sin (elevation), cosE = std::cos (elevation);
+
+        std::fill (gains, gains + maxNumChannels, 0.0f);
+        gains[0] = 1.0f;
+
+        if (order >= 1)
+        {
+            gains[1] = sinA * cosE;
+            gains[2] = sinE;
+            gains[3] = cosA * cosE;
+        }
+
+        if (order >= 2)
+        {
+            const float root3Half = std::sqrt (3.0f) / 2.0f;
+            gains[4] = root3Half * sin2A * cosE * cosE;
+            gains[5] = root3Half * sinA * 2.0f * sinE * cosE;
+            gains[6] = 0.5f * (3.0f * sinE * sinE - 1.0f);
+            gains[7] = root3Half * cosA * 2.0f * sinE * cosE;
+            gains[8] = root3Half * cos2A * cosE * cosE;
+        }
+
+        if (order >= 3)
+        {
+            const float root5Eighths = std::sqrt (5.0f / 8.0f), root15Half = std::sqrt (15.0f) / 2.0f, root3Eighths = std::sqrt (3.0f / 8.0f);
+            gains[9] = root5Eighths * sin3A * cosE * cosE * cosE;
+            gains[10] = root15Half * sin2A * sinE * cosE * cosE;
+            gains[11] = root3Eighths * sinA * cosE * (5.0f * sinE * sinE - 1.0f);
+            gains[12] = 0.5f * sinE * (5.0f * sinE * sinE - 3.0f);
+            gains[13] = root3Eighths * cosA * cosE * (5.0f * sinE * sinE - 1.0f);
+            gains[14] = root15Half * cos2A * sinE * cosE * cosE;
+            gains[15] = root5Eighths * cos3A * cosE * cosE * cosE;
+        }
+    }
+
+    constexpr int getOrderOfChannel (size_t channel) noexcept
+    {
+        return channel < 1 ? 0 : channel < 4 ? 1 : channel < 9 ? 2 : 3;
+    }
+}
+
+/*  Decodes the ambisonic bus to the speakers of the output, once for all sources.
+    - stereo uses two first-order cardioids pointing left and right, which keep sources in the front as loud as
+      sources on the sides
+    - quad, 5.1 and 7.1 decode at third order with max-rE weights to a ring of virtual speakers, which are panned
+      onto the real ones (AllRAD), so a source stays audible in the gaps of irregular layouts; LFE channels get nothing
+    - mono takes the omnidirectional channel
+    The gains are normalised so that a source on the horizon keeps its energy on average over all directions.
+*/
+class AmbisonicDecoder
+{
+public:
+    static constexpr size_t maxNumOutputs = 8;
+
+    // picks the layout from the number of output channels (1, 2, 4, 6 or 8, in Unity's speaker order); returns false
+    // for any other count, in which case nothing is decoded
+    bool setNumOutputs (size_t newNumOutputs)
+    {
+        numOutputs = 0;
+        for (auto& row : matrix)
+            row.fill (0.0f);
+
+        // azimuths in degrees, NaN for the LFE
+        constexpr float lfe = std::numeric_limits<float>::quiet_NaN();
+        std::vector<float> azimuths;
+        switch (newNumOutputs)
+        {
+            case 1: matrix[0][0] = 1.0f; numOutputs = 1; return true;
+            case 2: setStereo(); numOutputs = 2; return true;
+            case 4: azimuths = { 45.0f, -45.0f, 135.0f, -135.0f }; break;
+            case 6: azimuths = { 30.0f, -30.0f, 0.0f, lfe, 110.0f, -110.0f }; break;
+            case 8: azimuths = { 30.0f, -30.0f, 0.0f, lfe, 150.0f, -150.0f, 90.0f, -90.0f }; break;
+            default: return false;
+        }
+
+        setAllRad (azimuths);
+        numOutputs = newNumOutputs;
+        return true;
+    }
+
+    size_t getNumOutputs() const noexcept
+    {
+        return numOutputs;
+    }
+
+    // outputs = matrix * bus, over the outputs that the decoder was set up for
+    void decode (const float* const* bus, float* const* outputs, size_t numSamples) const noexcept
+    {
+        for (size_t output = 0; output < numOutputs; ++output)
+        {
+            std::fill (outputs[output], outputs[output] + numSamples, 0.0f);
+            for (size_t channel = 0; channel < Ambisonics::maxNumChannels; ++channel)
+                if (matrix[output][channel] != 0.0f)
+                    DspKernels::multiplyAdd (outputs[output], bus[channel], matrix[output][channel], numSamples);
+        }
+    }
+
+private:
+    std::array<std::array<float, Ambisonics::maxNumChannels>, maxNumOutputs> matrix {};
+    size_t numOutputs { 0 };
+
+    // helper functions
+    void setStereo()
+    {
+        // cardioids: 0.5 * (W +- Y)
+        matrix[0][0] = 0.5f; matrix[0][1] = 0.5f;
+        matrix[1][0] = 0.5f; matrix[1][1] = -0.5f;
+        normalise (2);
+    }
+
+    void setAllRad (const std::vector<float>& azimuths)
+    {
+        // the max-rE weights of a third-order decoder, per order
+        const std::array<float, Ambisonics::maxOrder + 1> maxReWeights { 1.0f, 0.861136f, 0.612334f, 0.304747f };
+
+        // the bus is decoded to many virtual speakers around the horizon, which are panned onto the real ones with
+        // VBAP; unlike a plain projection onto the real speakers, this keeps the gaps of irregular layouts (like the
+        // back of 5.1) from swallowing the sources in them
+        constexpr int numVirtualSpeakers = 72;
+        std::array<float, Ambisonics::maxNumChannels> gains;
+        std::vector<float> speakerGains (azimuths.size());
+
+        for (int virtualSpeaker = 0; virtualSpeaker < numVirtualSpeakers; ++virtualSpeaker)
+        {
+            float azimuth = (float) virtualSpeaker * juce::MathConstants<float>::twoPi / (float) numVirtualSpeakers;
+            Ambisonics::encode (azimuth, 0.0f, Ambisonics::maxOrder, gains.data());
+            getVbapGains (azimuths, azimuth, speakerGains);
+
+            // (2 * order + 1) undoes the SN3D normalisation of the encoder
+            for (size_t output = 0; output < azimuths.size(); ++output)
+            {
+                if (speakerGains[output] == 0.0f)
+                    continue;
+
+                for (size_t channel = 0; channel < Ambisonics::maxNumChannels; ++channel)
+                {
+                    int order = Ambisonics::getOrderOfChannel (channel);
+                    matrix[output][channel] += speakerGains[output] * gains[channel] * maxReWeights[(size_t) order] * (float) (2 * order + 1);
+                }
+            }
+        }
+
+        normalise (azimuths.size());
+    }
+
+    // pans a direction between the two speakers around it (of those with a direction), with constant power
+    static void getVbapGains (const std::vector<float>& azimuths, float azimuth, std::vector<float>& gains)
+    {
+        std::fill (gains.begin(), gains.end(), 0.0f);
+
+        // the nearest speaker on either side, going counterclockwise and clockwise
+        size_t left = 0, right = 0;
+        float leftDistance = 10.0f, rightDistance = 10.0f;
+        for (size_t speaker = 0; speaker < azimuths.size(); ++speaker)
+        {
+            if (std::isnan (azimuths[speaker]))
+                continue;
+
+            float counterclockwise = std::fmod (juce::degreesToRadians (azimuths[speaker]) - azimuth + 2.0f * juce::MathConstants<float>::twoPi,
+                                                juce::MathConstants<float>::twoPi);
+            float clockwise = juce::MathConstants<float>::twoPi - counterclockwise;
+
+            if (counterclockwise < leftDistance) { leftDistance = counterclockwise; left = speaker; }
+            if (clockwise <= rightDistance) { rightDistance = clockwise; right = speaker; }
+        }
+
+        // the gains are solved from the two speaker directions (tangent law), then normalised to constant power
+        float span = leftDistance + rightDistance;
+        float leftGain = std::sin (rightDistance) / std::sin (span);
+        float rightGain = std::sin (leftDistance) / std::sin (span);
+        if (left == right || ! std::isfinite (leftGain) || ! std::isfinite (rightGain))
+        {
+            gains[left] = 1.0f;
+            return;
+        }
+
+        float power = std::sqrt (leftGain * leftGain + rightGain * rightGain);
+        gains[left] = leftGain / power;
+        gains[right] = rightGain / power;
+    }
+
+    void normalise (size_t numRows)
+    {
+        // the mean energy over sources all around the horizon
+        constexpr int numDirections = 72;
+        std::array<float, Ambisonics::maxNumChannels> gains;
+        double energy = 0.0;
+
+        for (int direction = 0; direction < numDirections; ++direction)
+        {
+            Ambisonics::encode ((float) direction * juce::MathConstants<float>::twoPi / (float) numDirections, 0.0f, Ambisonics::maxOrder, gains.data());
+            for (size_t output = 0; output < numRows; ++output)
+            {
+                float gain = 0.0f;
+                for (size_t channel = 0; channel < Ambisonics::maxNumChannels; ++channel)
+                    gain += matrix[output][channel] * gains[channel];
+
+                energy += (double) (gain * gain);
+            }
+        }
+
+        auto scale = (float) std::sqrt ((double) numDirections / energy);
+        for (size_t output = 0; output < numRows; ++output)
+            for (auto& gain : matrix[output])
+                gain *= scale;
+    }
+};
+
+/*  One ambisonic mix of all the sources, so that spatialisation costs a gain vector per source and a single decoder.
+    - the plugin instance of a source encodes its signal at its direction and adds it to the bus (see send())
+    - one plugin instance takes the mix of each block (see receive()) and decodes it for the output
+    The bus is shared by every plugin instance in the process and works like AcousticRoomBuses: send() and receive()
+    are called from the audio thread, and a send that comes after the receive of a block is heard with the next block.
+*/
+class AmbisonicBus
+{
+public:
+    // called before playback, since it allocates
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        isPrepared = false;
+
+        maximumBlockSize = spec.maximumBlockSize;
+        for (auto& channel : channels)
+            channel.assign (maximumBlockSize, 0.0f);
+
+        sendGeneration = 0;
+        isPrepared = true;
+    }
+
+    bool isActive() const noexcept
+    {
+        return isPrepared;
+    }
+
+    // whether an instance has decoded the bus lately, i.e. whether a send would be heard
+    bool isReceived() const noexcept
+    {
+        auto receiveTime = lastReceiveTime.load();
+        return isPrepared && receiveTime != 0 && juce::Time::getMillisecondCounter() - receiveTime < 500;
+    }
+
+    // encodes a block of a source's signal and adds it to the bus; the gains move linearly from startGains (the
+    // gains of the previous block) to endGains over the block, so a moving source doesn't click. Only the channels
+    // of the source's order are touched. Returns false if it couldn't be sent
+    bool send (const float* samples, size_t numSamples, const float* startGains, const float* endGains, int order) noexcept
+    {
+        if (! isPrepared || numSamples > maximumBlockSize || numSamples == 0)
+            return false;
+
+        // a send that was never received (e.g. while no instance decodes the bus) is dropped
+        if (sendGeneration != generation)
+        {
+            for (auto& channel : channels)
+                std::fill (channel.begin(), channel.end(), 0.0f);
+
+            sendGeneration = generation;
+        }
+
+        for (size_t channel = 0; channel < Ambisonics::getNumChannels (order); ++channel)
+        {
+            auto* bus = channels[channel].data();
+            float gain = startGains[channel];
+            float increment = (endGains[channel] - gain) / (float) numSamples;
+
+            for (size_t sample = 0; sample < numSamples; ++sample)
+                bus[sample] += (gain + increment * (float) sample) * samples[sample];
+        }
+
+        return true;
+    }
+
+    // takes the mix of the block and starts the next one; bus receives a pointer per channel, which stays valid until
+    // the next call to send()
+    bool receive (std::array<const float*, Ambisonics::maxNumChannels>& bus, size_t numSamples) noexcept
+    {
+        if (! isPrepared || numSamples > maximumBlockSize)
+            return false;
+
+        // nothing was sent during the last block
+        if (sendGeneration != generation)
+            for (auto& channel : channels)
+                std::fill (channel.begin(), channel.begin() + (std::ptrdiff_t) numSamples, 0.0f);
+
+        for (size_t channel = 0; channel < Ambisonics::maxNumChannels; ++channel)
+            bus[channel] = channels[channel].data();
+
+        ++generation;
+        lastReceiveTime = juce::Time::getMillisecondCounter();
+        return true;
+    }
+
+private:
+    std::array<std::vector<float>, Ambisonics::maxNumChannels> channels;
+    size_t maximumBlockSize { 0 };
+    juce::uint32 generation { 1 };
+    juce::uint32 sendGeneration { 0 };
+    std::atomic<bool> isPrepared { false };
+    std::atomic<juce::uint32> lastReceiveTime { 0 };
+};
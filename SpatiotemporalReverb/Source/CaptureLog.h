@@ -0,0 +1,578 @@
+//
+//  CaptureLog.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+/*  The binary format of a capture: everything that reaches one plugin instance from the outside (the input audio of
+    every block, the setter calls from Unity, the parameter changes and the quality that the governor gave it), in the
+    order the audio thread saw it, so that CaptureReplay can render the instance again offline.
+    The file starts with a Header, followed by records of a RecordType byte and its payload. Everything is stored
+    in the byte order of the machine (little endian on every platform the plugin is built for).
+*/
+namespace CaptureFormat
+{
+    constexpr juce::uint32 magic = 0x43525453; // "STRC"
+    constexpr juce::uint32 version = 2;
+
+    struct Header
+    {
+        juce::uint32 magic;
+        juce::uint32 version;
+        double sampleRate;
+        juce::uint32 maximumBlockSize;
+        juce::uint32 numChannels;   // of the captured input
+        juce::int64 diffusionSeed;  // the seed of the random delays of the diffusion
+        juce::uint32 reverbRateDivisor; // the rate of the diffusion and the delay as a fraction of the sample rate
+        juce::uint32 unused;        // keeps the size a multiple of 8 bytes
+    };
+
+    static_assert (sizeof (Header) == 40, "the header must not be padded differently between compilers");
+
+    enum class RecordType : juce::uint8
+    {
+        block,                 // uint32 number of samples, then the input as floats, channel after channel
+        parameter,             // uint16 index, float normalised value
+        quality,               // uint8 level of the quality governor
+
+        // the setter calls: uint32 microseconds since the start of the last block, then their float arguments
+        audioPositioning,      // pan, front/back, distance, transmission, left and right filter coefficients
+        obstructedReflections,
+        diffusionSize,
+        delayTime,
+        feedback,
+        propagationDelay,      // the travel time of the direct sound, from the acoustic analysis
+        numTypes
+    };
+
+    constexpr int maxNumCallValues = 6;
+
+    inline int getNumCallValues (RecordType type) noexcept
+    {
+        return type == RecordType::audioPositioning ? maxNumCallValues : 1;
+    }
+
+    inline bool isCall (RecordType type) noexcept
+    {
+        return type >= RecordType::audioPositioning && type < RecordType::numTypes;
+    }
+}
+
+/*  Records what reaches one plugin instance into a capture file, without blocking or allocating on the audio thread.
+    - the audio thread writes its records (blocks, parameters, quality and the calls it makes itself) into a FIFO,
+      which the CaptureSession thread drains into the file
+    - the setters that Unity calls from its own thread write into a second FIFO, which the audio thread moves over
+      at the start of the next block; this keeps the file in the order in which the calls took effect
+    The FIFOs are allocated when the first capture starts and kept until the instance goes away, since the audio
+    thread may still be writing into them when a capture stops.
+*/
+class CaptureWriter
+{
+public:
+    CaptureWriter() = default;
+
+    // called from prepareToPlay
+    void prepare (double sampleRate, size_t maximumBlockSize, size_t numChannels, juce::int64 diffusionSeed, int reverbRateDivisor)
+    {
+        const juce::SpinLock::ScopedLockType lock (headerLock);
+        header = { CaptureFormat::magic, CaptureFormat::version, sampleRate, (juce::uint32) maximumBlockSize,
+                   (juce::uint32) juce::jmin (numChannels, (size_t) maxNumChannels), diffusionSeed,
+                   (juce::uint32) reverbRateDivisor, 0 };
+    }
+
+    // called from the audio thread at the start of every block
+    void beginBlock() noexcept
+    {
+        auto state = captureState.load (std::memory_order_acquire);
+        if (state == stopping)
+            captureState.compare_exchange_strong (state, stopped);
+
+        isCapturingBlock = state == capturing;
+        if (! isCapturingBlock)
+            return;
+
+        audioThreadId = juce::Thread::getCurrentThreadId();
+
+        // the calls since the last block go first, with their time relative to the start of that block
+        PendingCall call;
+        while (readPending (call))
+            writeCall (call.type, call.values, call.ticks);
+
+        blockStartTicks = juce::Time::getHighResolutionTicks();
+    }
+
+    // called from any thread
+    void recordCall (CaptureFormat::RecordType type, std::initializer_list<float> values) noexcept
+    {
+        if (captureState.load (std::memory_order_acquire) != capturing)
+            return;
+
+        PendingCall call { type, juce::Time::getHighResolutionTicks(), {} };
+        std::copy_n (values.begin(), juce::jmin ((int) values.size(), CaptureFormat::maxNumCallValues), call.values);
+
+        if (juce::Thread::getCurrentThreadId() == audioThreadId.load() && isCapturingBlock)
+        {
+            writeCall (call.type, call.values, call.ticks);
+            return;
+        }
+
+        const juce::SpinLock::ScopedLockType lock (pendingLock);
+        if (pendingFifo.getFreeSpace() >= (int) sizeof (PendingCall))
+            writeTo (pendingFifo, pendingBuffer, &call, sizeof (call));
+        else
+            hasOverrun = true;
+    }
+
+    // called from the audio thread; the quality is only recorded when it changes
+    void recordQuality (int level) noexcept
+    {
+        if (! isCapturingBlock || level == lastQualityLevel)
+            return;
+
+        lastQualityLevel = level;
+        auto quality = (juce::uint8) level;
+        writeRecord (CaptureFormat::RecordType::quality, { { &quality, sizeof (quality) } });
+    }
+
+    // called from the audio thread before the block is processed: records the parameters that changed and the input
+    void recordBlock (const juce::Array<juce::AudioProcessorParameter*>& parameters, const juce::AudioBuffer<float>& buffer,
+                      int numChannels, size_t numSamples) noexcept
+    {
+        if (! isCapturingBlock)
+            return;
+
+        for (int index = 0; index < juce::jmin (parameters.size(), maxNumParameters); ++index)
+        {
+            float value = parameters[index]->getValue();
+            if (value == lastParameterValues[(size_t) index])
+                continue;
+
+            lastParameterValues[(size_t) index] = value;
+            auto parameterIndex = (juce::uint16) index;
+            writeRecord (CaptureFormat::RecordType::parameter, { { &parameterIndex, sizeof (parameterIndex) }, { &value, sizeof (value) } });
+        }
+
+        numChannels = juce::jmin (numChannels, (int) header.numChannels, buffer.getNumChannels());
+        auto samples = (juce::uint32) numSamples;
+        auto bytesPerChannel = numSamples * sizeof (float);
+
+        std::array<Span, 1 + maxNumChannels> spans { { { &samples, sizeof (samples) } } };
+        for (int ch = 0; ch < numChannels; ++ch)
+            spans[(size_t) ch + 1] = { buffer.getReadPointer (ch), bytesPerChannel };
+
+        // the channels that the buffer doesn't have are written as silence, so every block has the same layout
+        auto missingChannels = header.numChannels - (juce::uint32) numChannels;
+        writeRecord (CaptureFormat::RecordType::block, spans.data(), (size_t) numChannels + 1, missingChannels * bytesPerChannel);
+    }
+
+private:
+    friend class CaptureSession;
+
+    static constexpr int maxNumParameters = 64;
+    static constexpr int maxNumChannels = 2;
+    static constexpr int fifoSize = 1 << 22;      // a few seconds of stereo input
+    static constexpr int pendingFifoSize = 1 << 16;
+
+    enum State
+    {
+        idle,
+        capturing,
+        stopping,
+        stopped
+    };
+
+    struct PendingCall
+    {
+        CaptureFormat::RecordType type;
+        juce::int64 ticks;
+        float values[CaptureFormat::maxNumCallValues];
+    };
+
+    struct Span
+    {
+        const void* data;
+        size_t size;
+    };
+
+    // written by prepare, read by the session when a capture starts
+    juce::SpinLock headerLock;
+    CaptureFormat::Header header {};
+
+    std::atomic<int> captureState { idle };
+    std::atomic<bool> hasOverrun { false };
+
+    // the audio thread's records, drained by the session thread
+    juce::AbstractFifo fifo { fifoSize };
+    juce::HeapBlock<char> buffer;
+
+    // the calls from other threads, moved over by the audio thread
+    juce::SpinLock pendingLock;
+    juce::AbstractFifo pendingFifo { pendingFifoSize };
+    juce::HeapBlock<char> pendingBuffer;
+
+    // only touched by the audio thread (and by the session before a capture starts)
+    std::atomic<juce::Thread::ThreadID> audioThreadId { nullptr };
+    bool isCapturingBlock { false };
+    juce::int64 blockStartTicks { 0 };
+    int lastQualityLevel { -1 };
+    std::array<float, maxNumParameters> lastParameterValues;
+
+    // called by the session, while the audio thread doesn't capture
+    bool start (juce::OutputStream& stream)
+    {
+        CaptureFormat::Header headerToWrite;
+        {
+            const juce::SpinLock::ScopedLockType lock (headerLock);
+            headerToWrite = header;
+        }
+
+        if (headerToWrite.sampleRate <= 0.0 || ! stream.write (&headerToWrite, sizeof (headerToWrite)))
+            return false;
+
+        if (buffer == nullptr)
+        {
+            buffer.malloc ((size_t) fifoSize);
+            pendingBuffer.malloc ((size_t) pendingFifoSize);
+        }
+
+        fifo.reset();
+        pendingFifo.reset();
+        hasOverrun = false;
+        lastQualityLevel = -1;
+        lastParameterValues.fill (std::numeric_limits<float>::quiet_NaN());
+        blockStartTicks = juce::Time::getHighResolutionTicks();
+
+        captureState.store (capturing, std::memory_order_release);
+        return true;
+    }
+
+    // called by the session; returns false if the audio thread may still be writing
+    bool requestStop() noexcept
+    {
+        int state = capturing;
+        captureState.compare_exchange_strong (state, stopping);
+        return captureState.load() == stopped;
+    }
+
+    void finishStop() noexcept
+    {
+        captureState = idle;
+    }
+
+    // called by the session thread
+    bool drainTo (juce::OutputStream& stream)
+    {
+        int start1, size1, start2, size2;
+        fifo.prepareToRead (fifo.getNumReady(), start1, size1, start2, size2);
+
+        bool wasWritten = (size1 == 0 || stream.write (buffer + start1, (size_t) size1))
+                       && (size2 == 0 || stream.write (buffer + start2, (size_t) size2));
+
+        fifo.finishedRead (size1 + size2);
+        return wasWritten;
+    }
+
+    // helper functions
+    static void writeTo (juce::AbstractFifo& target, char* targetBuffer, const void* data, size_t size) noexcept
+    {
+        int start1, size1, start2, size2;
+        target.prepareToWrite ((int) size, start1, size1, start2, size2);
+        std::memcpy (targetBuffer + start1, data, (size_t) size1);
+        std::memcpy (targetBuffer + start2, static_cast<const char*> (data) + size1, (size_t) size2);
+        target.finishedWrite (size1 + size2);
+    }
+
+    static void writeZerosTo (juce::AbstractFifo& target, char* targetBuffer, size_t size) noexcept
+    {
+        int start1, size1, start2, size2;
+        target.prepareToWrite ((int) size, start1, size1, start2, size2);
+        std::memset (targetBuffer + start1, 0, (size_t) size1);
+        std::memset (targetBuffer + start2, 0, (size_t) size2);
+        target.finishedWrite (size1 + size2);
+    }
+
+    // a record is written whole or not at all; a capture that lost a record stops, so its file stays replayable
+    void writeRecord (CaptureFormat::RecordType type, std::initializer_list<Span> spans) noexcept
+    {
+        writeRecord (type, spans.begin(), spans.size(), 0);
+    }
+
+    void writeRecord (CaptureFormat::RecordType type, const Span* spans, size_t numSpans, size_t numZeros) noexcept
+    {
+        size_t size = 1 + numZeros;
+        for (size_t span = 0; span < numSpans; ++span)
+            size += spans[span].size;
+
+        if (fifo.getFreeSpace() < (int) size)
+        {
+            hasOverrun = true;
+            isCapturingBlock = false;
+            captureState = stopping;
+            return;
+        }
+
+        writeTo (fifo, buffer, &type, 1);
+        for (size_t span = 0; span < numSpans; ++span)
+            writeTo (fifo, buffer, spans[span].data, spans[span].size);
+
+        writeZerosTo (fifo, buffer, numZeros);
+    }
+
+    void writeCall (CaptureFormat::RecordType type, const float* values, juce::int64 ticks) noexcept
+    {
+        // the time since the start of the last block, which is the block that the call follows
+        auto microseconds = juce::Time::highResolutionTicksToSeconds (juce::jmax ((juce::int64) 0, ticks - blockStartTicks)) * 1e6;
+        auto time = (juce::uint32) juce::jmin (microseconds, (double) std::numeric_limits<juce::uint32>::max());
+
+        writeRecord (type, { { &time, sizeof (time) }, { values, sizeof (float) * (size_t) CaptureFormat::getNumCallValues (type) } });
+    }
+
+    bool readPending (PendingCall& call) noexcept
+    {
+        if (pendingFifo.getNumReady() < (int) sizeof (PendingCall))
+            return false;
+
+        int start1, size1, start2, size2;
+        pendingFifo.prepareToRead ((int) sizeof (PendingCall), start1, size1, start2, size2);
+        std::memcpy (&call, pendingBuffer + start1, (size_t) size1);
+        std::memcpy (reinterpret_cast<char*> (&call) + size1, pendingBuffer + start2, (size_t) size2);
+        pendingFifo.finishedRead (size1 + size2);
+        return true;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (CaptureWriter)
+};
+
+/*  Starts and stops the captures of all plugin instances at once, and drains them into their files on a thread of
+    its own. Only the instances that exist when a capture starts are captured.
+*/
+class CaptureSession : private juce::Thread
+{
+public:
+    CaptureSession() : juce::Thread ("Capture session")
+    {
+        startThread();
+    }
+
+    ~CaptureSession() override
+    {
+        stop();
+        stopThread (1000);
+    }
+
+    void add (CaptureWriter& writer, int instance)
+    {
+        const juce::ScopedLock lock (captureLock);
+        captures.push_back ({ &writer, instance, nullptr });
+    }
+
+    void remove (CaptureWriter& writer)
+    {
+        const juce::ScopedLock lock (captureLock);
+        for (auto capture = captures.begin(); capture != captures.end(); ++capture)
+        {
+            if (capture->writer == &writer)
+            {
+                finish (*capture);
+                captures.erase (capture);
+                return;
+            }
+        }
+    }
+
+    // starts capturing every prepared instance into directory/capture-<instance>.stcap; returns the number of captures
+    int start (const juce::File& directory)
+    {
+        stop();
+
+        if (directory.createDirectory().failed())
+            return 0;
+
+        const juce::ScopedLock lock (captureLock);
+        int numStarted = 0;
+        for (auto& capture : captures)
+        {
+            auto file = directory.getChildFile ("capture-" + juce::String (capture.instance) + ".stcap");
+            file.deleteFile();
+
+            auto stream = std::make_unique<juce::FileOutputStream> (file);
+            if (! stream->openedOk() || ! capture.writer->start (*stream))
+                continue;
+
+            capture.stream = std::move (stream);
+            ++numStarted;
+        }
+
+        return numStarted;
+    }
+
+    // stops all captures at the start of their next block and closes their files
+    void stop()
+    {
+        const juce::ScopedLock lock (captureLock);
+        for (auto& capture : captures)
+            finish (capture);
+    }
+
+    // the number of captures that lost records because the disk couldn't keep up (and stopped there)
+    int getNumOverruns() const
+    {
+        const juce::ScopedLock lock (captureLock);
+        return (int) std::count_if (captures.begin(), captures.end(), [] (const Capture& capture) { return capture.writer->hasOverrun.load(); });
+    }
+
+private:
+    struct Capture
+    {
+        CaptureWriter* writer;
+        int instance;
+        std::unique_ptr<juce::FileOutputStream> stream; // nullptr while not capturing
+    };
+
+    juce::CriticalSection captureLock;
+    std::vector<Capture> captures;
+
+    // helper functions
+    void finish (Capture& capture)
+    {
+        if (capture.stream == nullptr)
+            return;
+
+        // the audio thread acknowledges the stop at the start of its next block; if it isn't running it can't be
+        // writing either, so we don't wait for it for longer than any block takes
+        auto timeout = juce::Time::getMillisecondCounter() + 1000;
+        while (! capture.writer->requestStop() && juce::Time::getMillisecondCounter() < timeout)
+            juce::Thread::sleep (1);
+
+        capture.writer->drainTo (*capture.stream);
+        capture.stream->flush();
+        capture.stream.reset();
+        capture.writer->finishStop();
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            {
+                const juce::ScopedLock lock (captureLock);
+                for (auto& capture : captures)
+                    if (capture.stream != nullptr)
+                        capture.writer->drainTo (*capture.stream);
+            }
+
+            wait (20);
+        }
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (CaptureSession)
+};
+
+/*  Reads a capture file back, one record at a time. The whole file is read into memory when it is opened. */
+class CaptureReader
+{
+public:
+    struct Record
+    {
+        CaptureFormat::RecordType type;
+        juce::uint32 microseconds;                       // calls: the time since the start of the block they follow
+        int parameterIndex;                              // parameter
+        int qualityLevel;                                // quality
+        float values[CaptureFormat::maxNumCallValues];   // calls: their arguments, parameter: the normalised value
+        int numSamples;                                  // block
+        const float* channels[2];                        // block: the input, valid until the next record is read
+    };
+
+    CaptureReader() = default;
+
+    juce::Result open (const juce::File& file)
+    {
+        data.reset();
+        position = sizeof (CaptureFormat::Header);
+
+        if (! file.loadFileAsData (data) || data.getSize() < sizeof (CaptureFormat::Header))
+            return juce::Result::fail ("Could not read the capture " + file.getFullPathName());
+
+        std::memcpy (&header, data.getData(), sizeof (header));
+        if (header.magic != CaptureFormat::magic || header.version != CaptureFormat::version)
+            return juce::Result::fail (file.getFileName() + " is not a capture of this version");
+
+        // make sure that the header is valid
+        if (header.sampleRate <= 0.0 || header.maximumBlockSize == 0 || header.numChannels == 0 || header.numChannels > 2)
+            return juce::Result::fail (file.getFileName() + " has an invalid header");
+
+        return juce::Result::ok();
+    }
+
+    const CaptureFormat::Header& getHeader() const noexcept
+    {
+        return header;
+    }
+
+    // returns false at the end of the file, or at a record that was cut off
+    bool readNext (Record& record)
+    {
+        juce::uint8 type;
+        if (! read (&type, sizeof (type)) || type >= (juce::uint8) CaptureFormat::RecordType::numTypes)
+            return false;
+
+        record.type = (CaptureFormat::RecordType) type;
+
+        switch (record.type)
+        {
+            case CaptureFormat::RecordType::block:
+            {
+                juce::uint32 numSamples;
+                if (! read (&numSamples, sizeof (numSamples)) || numSamples > header.maximumBlockSize)
+                    return false;
+
+                // the samples are copied out, since they needn't be aligned in the file
+                record.numSamples = (int) numSamples;
+                samples.resize ((size_t) numSamples * header.numChannels);
+                for (size_t ch = 0; ch < 2; ++ch)
+                    record.channels[ch] = samples.data() + (size_t) numSamples * juce::jmin (ch, (size_t) header.numChannels - 1);
+
+                return read (samples.data(), samples.size() * sizeof (float));
+            }
+
+            case CaptureFormat::RecordType::parameter:
+            {
+                juce::uint16 index;
+                record.parameterIndex = read (&index, sizeof (index)) ? index : -1;
+                return record.parameterIndex >= 0 && read (record.values, sizeof (float));
+            }
+
+            case CaptureFormat::RecordType::quality:
+            {
+                juce::uint8 level;
+                record.qualityLevel = read (&level, sizeof (level)) ? level : -1;
+                return record.qualityLevel >= 0;
+            }
+
+            default:
+                return read (&record.microseconds, sizeof (record.microseconds))
+                    && read (record.values, sizeof (float) * (size_t) CaptureFormat::getNumCallValues (record.type));
+        }
+    }
+
+private:
+    juce::MemoryBlock data;
+    size_t position { 0 };
+    CaptureFormat::Header header {};
+    std::vector<float> samples;
+
+    // helper functions
+    bool read (void* destination, size_t size)
+    {
+        if (position + size > data.getSize())
+            return false;
+
+        std::memcpy (destination, static_cast<const char*> (data.getData()) + position, size);
+        position += size;
+        return true;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (CaptureReader)
+};
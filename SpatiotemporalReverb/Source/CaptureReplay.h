@@ -0,0 +1,206 @@
+//
+//  CaptureReplay.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "CaptureLog.h"
+#include "PluginProcessor.h"
+
+/*  Renders captures (see CaptureLog.h) again offline, as fast as the CPU allows, with one plugin instance per capture
+    and the captures spread over all cores:
+    - the instance is prepared like the captured one and runs non-realtime, so the switches of the diffusion and the
+      growth of the delay lines take effect within the block that asks for them instead of a few blocks later
+    - the setter calls are applied between the blocks they were recorded between (their time within the block is
+      kept in the file, but a block is processed as a whole either way)
+    - the parameters that connect an instance to the others (the acoustic source, the room bus and the spatialisation)
+      keep their defaults, since a replay runs alone; what the acoustic analysis set is replayed through the calls
+    The output is written next to the capture as a 32-bit float WAV file, and its hash tells two renders apart
+    without comparing the files. Two renders of a capture are bit-identical as long as the same kernels run, so for
+    comparing machines the instruction set should be pinned (ForceAcousticKernelIsa).
+*/
+class CaptureReplay
+{
+public:
+    struct Render
+    {
+        juce::File capture;
+        juce::Result result { juce::Result::ok() };
+        juce::uint64 hash { 0 };    // FNV-1a over the bits of the output samples, block after block
+    };
+
+    // renders one capture; called from any thread
+    static void render (Render& render)
+    {
+        CaptureReader reader;
+        render.result = reader.open (render.capture);
+        if (render.result.failed())
+            return;
+
+        auto& header = reader.getHeader();
+        auto numChannels = (int) header.numChannels;
+        auto maximumBlockSize = (int) header.maximumBlockSize;
+
+        SpatiotemporalReverbAudioProcessor processor;
+        processor.setNonRealtime (true);
+        processor.setPlayConfigDetails (numChannels, numChannels, header.sampleRate, maximumBlockSize);
+        processor.setDiffusionSeed (header.diffusionSeed);
+        processor.setReverbRateDivisor ((int) header.reverbRateDivisor);
+        processor.setQualityOverride (0);
+        processor.prepareToPlay (header.sampleRate, maximumBlockSize);
+
+        auto outputFile = render.capture.withFileExtension ("wav");
+        outputFile.deleteFile();
+
+        auto outputStream = std::make_unique<juce::FileOutputStream> (outputFile);
+        if (! outputStream->openedOk())
+        {
+            render.result = juce::Result::fail ("Could not write " + outputFile.getFullPathName());
+            return;
+        }
+
+        juce::WavAudioFormat wavFormat;
+        std::unique_ptr<juce::AudioFormatWriter> writer (wavFormat.createWriterFor (outputStream.get(), header.sampleRate,
+                                                                                    (unsigned int) numChannels, 32, {}, 0));
+        if (writer == nullptr)
+        {
+            render.result = juce::Result::fail ("Could not write " + outputFile.getFullPathName());
+            return;
+        }
+
+        // the writer owns the stream from here on
+        outputStream.release();
+
+        juce::AudioBuffer<float> buffer (numChannels, maximumBlockSize);
+        juce::MidiBuffer midiMessages;
+        auto& parameters = processor.getParameters();
+        render.hash = fnvOffsetBasis;
+
+        CaptureReader::Record record;
+        while (reader.readNext (record))
+        {
+            switch (record.type)
+            {
+                case CaptureFormat::RecordType::block:
+                {
+                    buffer.setSize (numChannels, record.numSamples, false, false, true);
+                    for (int ch = 0; ch < numChannels; ++ch)
+                        buffer.copyFrom (ch, 0, record.channels[ch], record.numSamples);
+
+                    processor.processBlock (buffer, midiMessages);
+
+                    if (! writer->writeFromAudioSampleBuffer (buffer, 0, record.numSamples))
+                    {
+                        render.result = juce::Result::fail ("Could not write " + outputFile.getFullPathName());
+                        return;
+                    }
+
+                    for (int ch = 0; ch < numChannels; ++ch)
+                        render.hash = hash (render.hash, buffer.getReadPointer (ch), (size_t) record.numSamples);
+
+                    break;
+                }
+
+                case CaptureFormat::RecordType::parameter:
+                {
+                    if (record.parameterIndex >= parameters.size())
+                        break;
+
+                    auto* parameter = dynamic_cast<juce::AudioProcessorParameterWithID*> (parameters[record.parameterIndex]);
+                    if (parameter != nullptr && ! isConnectingParameter (parameter->paramID))
+                        parameter->setValue (record.values[0]);
+
+                    break;
+                }
+
+                case CaptureFormat::RecordType::quality:
+                    processor.setQualityOverride (juce::jmin (record.qualityLevel, QualityGovernor::numLevels - 1));
+                    break;
+
+                case CaptureFormat::RecordType::audioPositioning:
+                    processor.applyAudioPositioning (record.values[0], record.values[1], record.values[2],
+                                                     record.values[3], record.values[4], record.values[5]);
+                    break;
+
+                case CaptureFormat::RecordType::obstructedReflections:
+                    processor.setObstructedReflections (record.values[0]);
+                    break;
+
+                case CaptureFormat::RecordType::diffusionSize:
+                    processor.setDiffusionSize (record.values[0]);
+                    break;
+
+                case CaptureFormat::RecordType::delayTime:
+                    processor.setDelayTime (record.values[0]);
+                    break;
+
+                case CaptureFormat::RecordType::feedback:
+                    processor.setFeedback (record.values[0]);
+                    break;
+
+                case CaptureFormat::RecordType::propagationDelay:
+                    processor.setPropagationDelayTime (record.values[0]);
+                    break;
+
+                case CaptureFormat::RecordType::numTypes:
+                    break;
+            }
+        }
+    }
+
+    // renders the captures in parallel, on as many threads as there are cores (but not more than captures)
+    static void renderAll (std::vector<Render>& renders)
+    {
+        std::atomic<size_t> nextRender { 0 };
+        auto numWorkers = juce::jmin ((size_t) juce::SystemStats::getNumCpus(), renders.size());
+
+        std::vector<std::unique_ptr<Worker>> workers;
+        for (size_t index = 0; index < numWorkers; ++index)
+        {
+            workers.push_back (std::make_unique<Worker> (renders, nextRender, (int) index));
+            workers.back()->startThread();
+        }
+
+        for (auto& worker : workers)
+            worker->waitForThreadToExit (-1);
+    }
+
+private:
+    static constexpr juce::uint64 fnvOffsetBasis = 0xcbf29ce484222325;
+    static constexpr juce::uint64 fnvPrime = 0x100000001b3;
+
+    class Worker : public juce::Thread
+    {
+    public:
+        Worker (std::vector<Render>& rendersToUse, std::atomic<size_t>& nextRenderToUse, int index)
+            : juce::Thread ("Capture replay " + juce::String (index)), renders (rendersToUse), nextRender (nextRenderToUse)
+        {
+        }
+
+        void run() override
+        {
+            for (auto index = nextRender++; index < renders.size() && ! threadShouldExit(); index = nextRender++)
+                render (renders[index]);
+        }
+
+    private:
+        std::vector<Render>& renders;
+        std::atomic<size_t>& nextRender;
+    };
+
+    // helper functions
+    static bool isConnectingParameter (const juce::String& paramID)
+    {
+        return paramID == "acousticSource" || paramID == "roomBus" || paramID == "spatialisation";
+    }
+
+    static juce::uint64 hash (juce::uint64 value, const float* samples, size_t numSamples) noexcept
+    {
+        auto* bytes = reinterpret_cast<const juce::uint8*> (samples);
+        for (size_t byte = 0; byte < numSamples * sizeof (float); ++byte)
+            value = (value ^ bytes[byte]) * fnvPrime;
+
+        return value;
+    }
+};
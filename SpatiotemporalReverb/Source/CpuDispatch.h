@@ -0,0 +1,207 @@
+//
+//  CpuDispatch.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+// the instruction sets that the hot code is compiled for
+enum class CpuIsa
+{
+    generic, // whatever the build targets
+    sse2,
+    avx2,    // with FMA
+    avx512,  // F and VL
+    neon
+};
+
+/*  Runs the hot code (the reverb chain, the room buses, the mixing and saturation, the ray-triangle tests) compiled
+    for the best instruction set of the machine, although the plugin is built once for the baseline.
+    run() calls a function through a trampoline per instruction set. The trampolines are compiled with the target of
+    their instruction set and flatten everything they call, so the whole call tree underneath is compiled (and
+    vectorised) for that target. The instruction set is picked once, when it's first needed; the environment
+    variable SPATIOTEMPORAL_REVERB_ISA (generic, sse2, avx2, avx512 or neon) or force() override it, e.g. to
+    benchmark or test the variants against each other.
+    A call through a virtual function can't be flattened, so the code behind one runs as compiled for the baseline
+    unless it dispatches again itself (like DiffusionConfiguration, behind the interface of SwitchableDiffusion).
+    Only GCC and Clang can compile a function for another target, so other compilers only have the generic variant.
+    On ARM, NEON is part of the baseline.
+*/
+class CpuDispatch
+{
+public:
+    static constexpr int numIsas = 5;
+
+    // the best instruction set that the machine supports and that is compiled in
+    static CpuIsa getBestIsa() noexcept
+    {
+        static const CpuIsa best = detectBestIsa();
+        return best;
+    }
+
+    static bool isSupported (CpuIsa isa) noexcept
+    {
+        switch (isa)
+        {
+            case CpuIsa::generic: return true;
+           #if JUCE_INTEL && (JUCE_GCC || JUCE_CLANG)
+            case CpuIsa::sse2:    return juce::SystemStats::hasSSE2();
+            case CpuIsa::avx2:    return juce::SystemStats::hasAVX2() && juce::SystemStats::hasFMA3();
+            case CpuIsa::avx512:  return juce::SystemStats::hasAVX512F() && juce::SystemStats::hasAVX512VL()
+                                      && juce::SystemStats::hasAVX2() && juce::SystemStats::hasFMA3();
+           #endif
+           #if JUCE_ARM && defined (__ARM_NEON)
+            case CpuIsa::neon:    return true;
+           #endif
+            default:              return false;
+        }
+    }
+
+    static CpuIsa getActiveIsa() noexcept
+    {
+        return (CpuIsa) getActiveIsaState().load (std::memory_order_relaxed);
+    }
+
+    // forces an instruction set (e.g. for benchmarking); returns false if this machine or build doesn't have it
+    static bool force (CpuIsa isa) noexcept
+    {
+        if (! isSupported (isa))
+            return false;
+
+        getActiveIsaState() = (int) isa;
+        return true;
+    }
+
+    // goes back to the best instruction set
+    static void reset() noexcept
+    {
+        getActiveIsaState() = (int) getBestIsa();
+    }
+
+    static const char* getName (CpuIsa isa) noexcept
+    {
+        static const char* names[] { "generic", "sse2", "avx2", "avx512", "neon" };
+        return names[(size_t) isa];
+    }
+
+    // calls function compiled for the active instruction set, and returns what it returns
+    template <typename Function>
+    static auto run (Function&& function) -> decltype (function())
+    {
+        switch (getActiveIsa())
+        {
+           #if JUCE_INTEL && (JUCE_GCC || JUCE_CLANG)
+            case CpuIsa::sse2:   return runSse2 (function);
+            case CpuIsa::avx2:   return runAvx2 (function);
+            case CpuIsa::avx512: return runAvx512 (function);
+           #endif
+           #if JUCE_ARM && defined (__ARM_NEON)
+            case CpuIsa::neon:   return runGeneric (function);
+           #endif
+            default:             return runGeneric (function);
+        }
+    }
+
+private:
+    // helper functions
+    static CpuIsa detectBestIsa() noexcept
+    {
+        for (auto isa : { CpuIsa::avx512, CpuIsa::avx2, CpuIsa::sse2, CpuIsa::neon })
+            if (isSupported (isa))
+                return isa;
+
+        return CpuIsa::generic;
+    }
+
+    static std::atomic<int>& getActiveIsaState() noexcept
+    {
+        static std::atomic<int> active { (int) getInitialIsa() };
+        return active;
+    }
+
+    static CpuIsa getInitialIsa() noexcept
+    {
+        auto forced = juce::SystemStats::getEnvironmentVariable ("SPATIOTEMPORAL_REVERB_ISA", {});
+        for (int isa = 0; isa < numIsas; ++isa)
+            if (forced == getName ((CpuIsa) isa) && isSupported ((CpuIsa) isa))
+                return (CpuIsa) isa;
+
+        return getBestIsa();
+    }
+
+    template <typename Function>
+    static auto runGeneric (Function& function) -> decltype (function())
+    {
+        return function();
+    }
+
+   #if JUCE_INTEL && (JUCE_GCC || JUCE_CLANG)
+    template <typename Function>
+    __attribute__ ((target ("sse2"), flatten)) static auto runSse2 (Function& function) -> decltype (function())
+    {
+        return function();
+    }
+
+    template <typename Function>
+    __attribute__ ((target ("avx2,fma"), flatten)) static auto runAvx2 (Function& function) -> decltype (function())
+    {
+        return function();
+    }
+
+    template <typename Function>
+    __attribute__ ((target ("avx512f,avx512vl,avx2,fma"), flatten)) static auto runAvx512 (Function& function) -> decltype (function())
+    {
+        return function();
+    }
+   #endif
+};
+
+// the block kernels of the mixing and the saturation, written so that the compiler vectorises them for any target
+namespace DspKernels
+{
+    // tanh as a rational function, accurate to a few ulp (after Eigen's fast tanh); unlike std::tanh it vectorises
+    inline float tanh (float x) noexcept
+    {
+        constexpr float clamp = 7.90531110763549805f;
+        x = juce::jlimit (-clamp, clamp, x);
+        float x2 = x * x;
+
+        float p = -2.76076847742355e-16f;
+        p = p * x2 + 2.00018790482477e-13f;
+        p = p * x2 - 8.60467152213735e-11f;
+        p = p * x2 + 5.12229709037114e-08f;
+        p = p * x2 + 1.48572235717979e-05f;
+        p = p * x2 + 6.37261928875436e-04f;
+        p = p * x2 + 4.89352455891786e-03f;
+
+        float q = 1.19825839466702e-06f;
+        q = q * x2 + 1.18534705686654e-04f;
+        q = q * x2 + 2.26843463243900e-03f;
+        q = q * x2 + 4.89352518554385e-03f;
+
+        return x * p / q;
+    }
+
+    // output = tanh (inputGain * input) * outputGain (output may be input)
+    inline void saturate (float* output, const float* input, float inputGain, float outputGain, size_t numSamples) noexcept
+    {
+        for (size_t sample = 0; sample < numSamples; ++sample)
+            output[sample] = tanh (inputGain * input[sample]) * outputGain;
+    }
+
+    // output = tanh (reverbGain * reverb + directGain * direct) * outputGain (output may be either input)
+    inline void saturateMix (float* output, const float* reverb, float reverbGain, const float* direct, float directGain,
+                             float outputGain, size_t numSamples) noexcept
+    {
+        for (size_t sample = 0; sample < numSamples; ++sample)
+            output[sample] = tanh (reverbGain * reverb[sample] + directGain * direct[sample]) * outputGain;
+    }
+
+    // output += gain * input
+    inline void multiplyAdd (float* output, const float* input, float gain, size_t numSamples) noexcept
+    {
+        for (size_t sample = 0; sample < numSamples; ++sample)
+            output[sample] += gain * input[sample];
+    }
+}
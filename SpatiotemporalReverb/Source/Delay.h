@@ -8,18 +8,24 @@
 #pragma once
 #include <JuceHeader.h>
 #include "DelayLine.h"
+#include "DelayLineArena.h"
+#include "DelayLineGrowth.h"
 #include "Filter.h"
+#include "SampleLanes.h"
 #include <memory>
 
-template <typename Type, size_t maxNumChannels = 2>
+template <typename Type, size_t maxNumChannels = 2, typename Storage = FullPrecisionStorage<Type>>
 class Delay
 {
 public:
+    using Lanes = SampleLanes<Type>;
+    using NumericType = typename Lanes::NumericType;
+    
     Delay()
     {
         setMaxDelayTime (4.0f);
-        setDelayTime (0, 0.0f); // set left channel delay
-        setDelayTime (1, 0.0f); // set right channel delay
+        for (size_t ch = 0; ch < maxNumChannels; ++ch)
+            setDelayTime (ch, 0.0f); // set the delay of each channel (left and right for stereo)
         // TODO: wet and dry has become obsolete (I think...)
         setWetLevel (1.0f);
         setDryLevel (0.0f);
@@ -31,8 +37,26 @@ public:
         // ensure that the input is valid
         jassert (spec.numChannels <= maxNumChannels);
         
-        sampleRate = (Type) spec.sampleRate;
-        updateDelayLineSize();
+        sampleRate = (NumericType) spec.sampleRate;
+    }
+    
+    void addDelayLinesTo (DelayLineArena& arena)
+    {
+        // we size the circular buffers for the longest delay time requested so far rather than the max delay time;
+        // if a longer delay is requested later on, the delay lines are grown in the background
+        size_t delayLineSamples = getSamplesFor (juce::jmax (requiredDelayTime.load(), minimumDelayTime));
+        for (auto& delayLine : delayLines)
+            arena.add (delayLine, delayLineSamples);
+        
+        // any memory from an earlier growth is released, since the delay lines move back into the arena
+        delayLineGrowth.reset (delayLineSamples, getSamplesFor (maxDelayTime));
+        grownBlock.reset();
+    }
+    
+    // grows the delay lines on the audio thread (e.g. when rendering offline); must be called before addDelayLinesTo
+    void setSynchronousGrowth (bool shouldBeSynchronous) noexcept
+    {
+        delayLineGrowth.setSynchronous (shouldBeSynchronous);
     }
     
     void reset()
@@ -50,95 +74,241 @@ public:
         size_t channels = inputBlock.getNumChannels();
         size_t samples = inputBlock.getNumSamples();
         
-        for (int ch = 0; ch < channels; ++ch)
+        adoptGrownDelayLines();
+        
+        for (size_t ch = 0; ch < channels; ++ch)
         {
-            auto& delayLine = delayLines[ch];
+            auto* input = inputBlock.getChannelPointer (ch);
+            auto* output = outputBlock.getChannelPointer (ch);
             
-            for (int sample = 0; sample < samples; ++sample)
+            // the delay is almost always longer than a chunk, in which case the delayed signal of the whole chunk can be
+            // read up front and the feedback and the mix are done over the chunk; only very short delays need the
+            // interleaved get and push per sample
+            for (size_t start = 0; start < samples; start += chunkSize)
             {
-                auto inputSample = inputBlock.getSample (ch, sample);
-                                        
-                // get the delayedSignal from the delay line
-                auto delayedSample = delayLine.get (delayTimes[ch] * sampleRate);
+                size_t numSamples = juce::jmin (chunkSize, samples - start);
                 
-                // add diffused sample to delay line
-                delayLine.push (std::tanh (inputSample + feedback * delayedSample));
-                
-                // calculate the output sample and send it to the output signal
-                auto outputSample = std::tanh (dryLevel * inputSample + wetLevel * delayedSample);
-                outputBlock.setSample (ch, sample, outputSample);
+                if (getShortestDelayInSamples (ch) >= numSamples)
+                    processChunk (ch, input + start, output + start, numSamples);
+                else
+                    processSamples (ch, input + start, output + start, numSamples);
             }
         }
     }
     
-    void setMaxDelayTime (Type newMax)
+    void setMaxDelayTime (NumericType newMax)
     {
         // we ensure that the input value is valid
-        jassert (newMax > Type (0));
-        maxDelayTime = newMax;
+        jassert (newMax > NumericType (0));
         
-        updateDelayLineSize();
+        // NOTE: the new max only takes effect the next time the delay lines are added to an arena
+        maxDelayTime = newMax;
     }
     
-    void setDelayTime (size_t channel, Type newDelayTime)
+    void setDelayTime (size_t channel, NumericType newDelayTime)
     {
         // ensure that the input values are valid
-        jassert (channel <= maxNumChannels);
-        jassert (newDelayTime >= Type (0) && newDelayTime <= maxDelayTime);
+        jassert (channel < maxNumChannels);
+        jassert (newDelayTime >= NumericType (0) && newDelayTime <= maxDelayTime);
         
-        delayTimes[channel] = newDelayTime;
+        delayTimes[channel].fill (newDelayTime);
+        requireDelayTime (newDelayTime);
     }
     
-    void setDelayTimes (Type newDelayTime)
+    void setDelayTimes (NumericType newDelayTime)
     {
         // ensure that the input value is valid
-        jassert (newDelayTime >= Type (0) && newDelayTime <= maxDelayTime);
+        jassert (newDelayTime >= NumericType (0) && newDelayTime <= maxDelayTime);
         
         for (auto& delayTime : delayTimes)
-            delayTime = newDelayTime;
+            delayTime.fill (newDelayTime);
+        
+        requireDelayTime (newDelayTime);
     }
     
-    void setWetLevel (Type newWetLevel)
+    void setWetLevel (NumericType newWetLevel)
     {
         // ensure that the input value is valid, i.e. in range [0, 1]
-        jassert (newWetLevel >= Type (0) && newWetLevel <= Type (1));
-        wetLevel = newWetLevel;
+        jassert (newWetLevel >= NumericType (0) && newWetLevel <= NumericType (1));
+        wetLevel = Lanes::expand (newWetLevel);
     }
     
-    void setDryLevel (Type newDryLevel)
+    void setDryLevel (NumericType newDryLevel)
     {
         // ensure that the input value is valid, i.e. in range [0, 1]
-        jassert (newDryLevel >= Type (0) && newDryLevel <= Type (1));
-        dryLevel = newDryLevel;
+        jassert (newDryLevel >= NumericType (0) && newDryLevel <= NumericType (1));
+        dryLevel = Lanes::expand (newDryLevel);
     }
     
-    void setFeedback (Type newFeedbackValue)
+    void setFeedback (NumericType newFeedbackValue)
     {
         // ensure that the input value is valid, i.e. in range [0, 1]
-        jassert (newFeedbackValue >= Type (0) && newFeedbackValue <= Type (1));
-        feedback = newFeedbackValue;
+        jassert (newFeedbackValue >= NumericType (0) && newFeedbackValue <= NumericType (1));
+        feedback = Lanes::expand (newFeedbackValue);
+    }
+    
+    // when Type is a SIMD register every lane is a separate source with its own delay time and feedback
+    void setLaneDelayTime (size_t lane, NumericType newDelayTime)
+    {
+        // ensure that the input values are valid
+        jassert (lane < Lanes::numLanes);
+        jassert (newDelayTime >= NumericType (0) && newDelayTime <= maxDelayTime);
+        
+        for (auto& delayTime : delayTimes)
+            delayTime[lane] = newDelayTime;
+        
+        requireDelayTime (newDelayTime);
+    }
+    
+    void setLaneFeedback (size_t lane, NumericType newFeedbackValue)
+    {
+        // ensure that the input values are valid
+        jassert (lane < Lanes::numLanes);
+        jassert (newFeedbackValue >= NumericType (0) && newFeedbackValue <= NumericType (1));
+        
+        Lanes::set (feedback, lane, newFeedbackValue);
     }
 
 private:
     // parameters
-    Type maxDelayTime { 2.0f };
-    Type sampleRate { Type (44.1e3) };
+    NumericType maxDelayTime { 2.0f };
+    NumericType sampleRate { NumericType (44.1e3) };
     Type wetLevel;
     Type dryLevel;
     Type feedback;
     
     juce::Random random;
     
+    // scratch space of the block-wise processing
+    static constexpr size_t chunkSize = 64;
+    std::array<Type, chunkSize> delayedChunk;
+    std::array<Type, chunkSize> feedbackChunk;
+    
     // delay lines
-    std::array<DelayLine<Type>, maxNumChannels> delayLines;
-    std::array<Type,            maxNumChannels> delayTimes;
+    std::array<DelayLine<Type, Storage>, maxNumChannels> delayLines;
+    std::array<std::array<NumericType, Lanes::numLanes>, maxNumChannels> delayTimes;
+    
+    // demand-sized delay memory
+    using Growth = DelayLineGrowth<typename Storage::StoredType, maxNumChannels>;
     
-    // helper function
-    void updateDelayLineSize()
+    static constexpr NumericType minimumDelayTime { NumericType (0.125) };
+    std::atomic<NumericType> requiredDelayTime { NumericType (0) };
+    Growth delayLineGrowth;
+    std::unique_ptr<typename Growth::Block> grownBlock; // nullptr while the delay lines live in the arena
+    
+    // helper functions
+    size_t getSamplesFor (NumericType delayTime) const
     {
-        // we adjust the size of the circular buffers for each of our delay lines
-        size_t delayLineSamples = (size_t) std::ceil (maxDelayTime * sampleRate);
-        for (auto& delayLine : delayLines)
-            delayLine.resize (delayLineSamples);
+        // one extra sample, so that a delay of exactly delayTime is still within the buffer
+        return (size_t) std::ceil (delayTime * sampleRate) + 1;
+    }
+    
+    void requireDelayTime (NumericType newDelayTime)
+    {
+        // remember the longest delay requested so far and have the delay lines grown if they're too short for it
+        if (newDelayTime > requiredDelayTime.load())
+        {
+            requiredDelayTime = newDelayTime;
+            delayLineGrowth.requestCapacity (getSamplesFor (newDelayTime));
+        }
+    }
+    
+    void adoptGrownDelayLines() noexcept
+    {
+        // move the delay lines over to the larger block (a copy of the old, smaller buffers) and retire the old memory,
+        // which is freed by the growth thread rather than here on the audio thread
+        // NOTE: the arena can't free a part of its single allocation, so after the first growth the region that the
+        // delay lines were laid out in stays allocated (but untouched) until the next addDelayLinesTo; that is at most
+        // the size they were laid out at, i.e. the longest delay known at the time (and at least minimumDelayTime),
+        // and later growths retire heap blocks, which are freed
+        if (auto* block = delayLineGrowth.acquireGrownBlock())
+        {
+            for (size_t ch = 0; ch < maxNumChannels; ++ch)
+                delayLines[ch].moveTo (block->getDelayLine (ch), block->getNumSamples());
+            
+            delayLineGrowth.retire (grownBlock.release());
+            grownBlock.reset (block);
+        }
+    }
+    
+    void processChunk (size_t channel, const Type* input, Type* output, size_t numSamples) noexcept
+    {
+        auto& delayLine = delayLines[channel];
+        
+        // get the delayed signal of the whole chunk from the delay line, one read per lane
+        if constexpr (Lanes::numLanes == 1)
+        {
+            delayLine.getBlock (getDelayInSamples (delayLine, delayTimes[channel][0]), delayedChunk.data(), numSamples);
+        }
+        else
+        {
+            for (size_t lane = 0; lane < Lanes::numLanes; ++lane)
+            {
+                delayLine.getBlock (getDelayInSamples (delayLine, delayTimes[channel][lane]), feedbackChunk.data(), numSamples);
+                for (size_t sample = 0; sample < numSamples; ++sample)
+                    Lanes::set (delayedChunk[sample], lane, Lanes::get (feedbackChunk[sample], lane));
+            }
+        }
+        
+        // add the input and the feedback to the delay line
+        for (size_t sample = 0; sample < numSamples; ++sample)
+            feedbackChunk[sample] = Lanes::tanh (input[sample] + feedback * delayedChunk[sample]);
+        
+        delayLine.pushBlock (feedbackChunk.data(), numSamples);
+        
+        // calculate the output samples (the output may be the input)
+        for (size_t sample = 0; sample < numSamples; ++sample)
+            output[sample] = Lanes::tanh (dryLevel * input[sample] + wetLevel * delayedChunk[sample]);
+    }
+    
+    void processSamples (size_t channel, const Type* input, Type* output, size_t numSamples) noexcept
+    {
+        auto& delayLine = delayLines[channel];
+        
+        for (size_t sample = 0; sample < numSamples; ++sample)
+        {
+            auto inputSample = input[sample];
+            
+            // get the delayedSignal from the delay line
+            auto delayedSample = getDelayedSample (delayLine, channel);
+            
+            // add diffused sample to delay line
+            delayLine.push (Lanes::tanh (inputSample + feedback * delayedSample));
+            
+            // calculate the output sample and send it to the output signal
+            output[sample] = Lanes::tanh (dryLevel * inputSample + wetLevel * delayedSample);
+        }
+    }
+    
+    size_t getShortestDelayInSamples (size_t channel) const noexcept
+    {
+        size_t shortest = std::numeric_limits<size_t>::max();
+        for (auto delayTime : delayTimes[channel])
+            shortest = juce::jmin (shortest, getDelayInSamples (delayLines[channel], delayTime));
+        
+        return shortest;
+    }
+    
+    Type getDelayedSample (const DelayLine<Type, Storage>& delayLine, size_t channel) const noexcept
+    {
+        if constexpr (Lanes::numLanes == 1)
+        {
+            return delayLine.get (getDelayInSamples (delayLine, delayTimes[channel][0]));
+        }
+        else
+        {
+            // each lane reads at its own delay, so we gather one lane from each of the reads
+            Type delayedSample {};
+            for (size_t lane = 0; lane < Lanes::numLanes; ++lane)
+                Lanes::set (delayedSample, lane, Lanes::get (delayLine.get (getDelayInSamples (delayLine, delayTimes[channel][lane])), lane));
+            
+            return delayedSample;
+        }
+    }
+    
+    size_t getDelayInSamples (const DelayLine<Type, Storage>& delayLine, NumericType delayTime) const noexcept
+    {
+        // while the delay lines are being grown the delay is limited to what they can currently hold
+        return juce::jmin ((size_t) (delayTime * sampleRate), delayLine.getSize() - 1);
     }
 };
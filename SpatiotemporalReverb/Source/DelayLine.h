@@ -7,24 +7,55 @@
 
 #pragma once
 #include <JuceHeader.h>
+#include "SampleLanes.h"
+#include "DelayLineStorage.h"
 
-template <typename Type>
+/*  A circular buffer in memory that it doesn't own (see DelayLineArena). A delay line without memory (e.g. when the
+    arena couldn't allocate any) is empty: it reads back silence and drops whatever is pushed into it.
+*/
+template <typename Type, typename Storage = FullPrecisionStorage<Type>>
 class DelayLine
 {
 public:
+    using StoredType = typename Storage::StoredType;
+    
     void clear()
     {
-        std::fill (rawData.begin(), rawData.end(), Type (0));
+        std::fill (rawData, rawData + size, Storage::encode (Type {}));
     }
     
     size_t getSize() const
     {
-        return rawData.size();
+        return size;
+    }
+    
+    // whether every sample of the buffer has been written since the last invalidate()
+    bool isFull() const noexcept
+    {
+        return numValidSamples == size;
+    }
+    
+    void invalidate() noexcept
+    {
+        // rather than clearing the buffer we only reset the watermark of valid samples;
+        // anything older than the watermark reads back as silence until it has been overwritten
+        numValidSamples = 0;
+    }
+    
+    bool isEmpty() const noexcept
+    {
+        return size == 0;
     }
     
     void push (Type valueToAdd) noexcept
     {
-        rawData[writeIndex] = valueToAdd;
+        if (isEmpty())
+            return;
+        
+        rawData[writeIndex] = Storage::encode (valueToAdd);
+        
+        if (numValidSamples < size)
+            ++numValidSamples;
         
         // wrap around the buffer if the writeIndex is at the end
         writeIndex = writeIndex == 0 ? getSize() - 1 : writeIndex - 1;
@@ -32,39 +63,141 @@ public:
     
     Type get (size_t delayInSamples) const noexcept
     {
+        if (isEmpty())
+            return Type {};
+        
         // make sure that delayInSamples is within the bounds
         jassert ((delayInSamples >= 0) && (delayInSamples < getSize()));
+        
+        // samples behind the watermark are stale
+        if (delayInSamples >= numValidSamples)
+            return Type {};
 
         // we wrap around the buffer if the index exceeds the size of the buffer
-        return rawData[(writeIndex + 1 + delayInSamples) % getSize()];
+        return Storage::decode (rawData[(writeIndex + 1 + delayInSamples) % getSize()]);
+    }
+    
+    // the same as numSamples calls of get (delayInSamples), each followed by a push, as long as the delay is at least
+    // the block length (so no sample of the block is read after it has been overwritten) and the pushes are done
+    // afterwards with pushBlock(); the samples are read as (at most) two contiguous segments of the circular buffer
+    void getBlock (size_t delayInSamples, Type* destination, size_t numSamples) const noexcept
+    {
+        if (isEmpty())
+        {
+            std::fill (destination, destination + numSamples, Type {});
+            return;
+        }
+        
+        // make sure that the block can be read ahead of its pushes
+        jassert (delayInSamples < getSize() && delayInSamples + 1 >= numSamples);
+        
+        // a sample is stale if it is behind the watermark at the time it would have been read
+        size_t numStale = delayInSamples >= numValidSamples ? juce::jmin (numSamples, delayInSamples - numValidSamples + 1) : 0;
+        std::fill (destination, destination + numStale, Type {});
+        
+        // the buffer is written backwards, so the read position moves down by one sample per sample
+        size_t start = (writeIndex + 1 + delayInSamples) % getSize();
+        size_t firstSegmentEnd = juce::jmin (numSamples, start + 1);
+        
+        for (size_t sample = numStale; sample < firstSegmentEnd; ++sample)
+            destination[sample] = Storage::decode (rawData[start - sample]);
+        
+        for (size_t sample = juce::jmax (numStale, firstSegmentEnd); sample < numSamples; ++sample)
+            destination[sample] = Storage::decode (rawData[start + getSize() - sample]);
     }
     
+    // the same as a push() of each sample in turn
+    void pushBlock (const Type* source, size_t numSamples) noexcept
+    {
+        if (isEmpty())
+            return;
+        
+        // make sure that the block fits into the buffer
+        jassert (numSamples <= getSize());
+        
+        size_t firstSegmentEnd = juce::jmin (numSamples, writeIndex + 1);
+        
+        for (size_t sample = 0; sample < firstSegmentEnd; ++sample)
+            rawData[writeIndex - sample] = Storage::encode (source[sample]);
+        
+        for (size_t sample = firstSegmentEnd; sample < numSamples; ++sample)
+            rawData[writeIndex + getSize() - sample] = Storage::encode (source[sample]);
+        
+        numValidSamples = juce::jmin (getSize(), numValidSamples + numSamples);
+        writeIndex = (writeIndex + getSize() - numSamples % getSize()) % getSize();
+    }
+    
+    // adds (or subtracts) the sample delayInSamples behind each sample of the block that was just pushed with pushBlock(),
+    // i.e. destination[i] += get (delayInSamples + numSamples - 1 - i); a sparse FIR is a sum of these, one per tap
+    void addDelayedBlock (size_t delayInSamples, Type* destination, size_t numSamples, bool shouldSubtract) const noexcept
+    {
+        if (isEmpty())
+            return;
+
+        // make sure that the oldest sample of the block is still in the buffer
+        jassert (delayInSamples + numSamples <= getSize());
+
+        // samples behind the watermark are stale and add nothing
+        size_t numStale = delayInSamples + numSamples > numValidSamples ? juce::jmin (numSamples, delayInSamples + numSamples - numValidSamples) : 0;
+
+        // the buffer is written backwards, so the read position moves down by one sample per sample
+        size_t start = (writeIndex + delayInSamples + numSamples) % getSize();
+        size_t firstSegmentEnd = juce::jmin (numSamples, start + 1);
+        size_t secondSegmentStart = juce::jmax (numStale, firstSegmentEnd);
+
+        if (shouldSubtract)
+        {
+            for (size_t sample = numStale; sample < firstSegmentEnd; ++sample)
+                destination[sample] -= Storage::decode (rawData[start - sample]);
+
+            for (size_t sample = secondSegmentStart; sample < numSamples; ++sample)
+                destination[sample] -= Storage::decode (rawData[start + getSize() - sample]);
+        }
+        else
+        {
+            for (size_t sample = numStale; sample < firstSegmentEnd; ++sample)
+                destination[sample] += Storage::decode (rawData[start - sample]);
+
+            for (size_t sample = secondSegmentStart; sample < numSamples; ++sample)
+                destination[sample] += Storage::decode (rawData[start + getSize() - sample]);
+        }
+    }
+
     void setSample (size_t delayInSamples, Type newValue) noexcept
     {
+        if (isEmpty())
+            return;
+        
         // make sure that delayInSamples is within the bounds
         jassert ((delayInSamples >= 0) && (delayInSamples < getSize()));
         
         // we wrap around the buffer if the index exceeds the size of the buffer
-        rawData[(writeIndex + 1 + delayInSamples) % getSize()] = newValue;
+        rawData[(writeIndex + 1 + delayInSamples) % getSize()] = Storage::encode (newValue);
     }
     
     void addSample (size_t delayInSamples, Type newSample) noexcept
     {
+        if (isEmpty())
+            return;
+        
         // make sure that delayInSamples is within the bounds
         jassert ((delayInSamples >= 0) && (delayInSamples < getSize()));
         
-        auto existingSample = rawData[(readIndex + 1 + delayInSamples) % getSize()];
+        auto existingSample = Storage::decode (rawData[(readIndex + 1 + delayInSamples) % getSize()]);
         
         // we wrap around the buffer if the index exceeds the size of the buffer
         // we use a tangent hyperbolic function to make a clean accumulated sample
-        rawData[(readIndex + 1 + delayInSamples) % getSize()] = std::tanh(existingSample + newSample);
+        rawData[(readIndex + 1 + delayInSamples) % getSize()] = Storage::encode (SampleLanes<Type>::tanh (existingSample + newSample));
     }
     
     Type getNextSample ()
     {
-        Type nextSample = rawData[(readIndex + 1) % getSize()];
+        if (isEmpty())
+            return Type {};
+        
+        Type nextSample = Storage::decode (rawData[(readIndex + 1) % getSize()]);
         // we make sure to reset the data after we read it
-        rawData[(readIndex + 1) % getSize()] = Type (0);
+        rawData[(readIndex + 1) % getSize()] = Storage::encode (Type {});
         
         // wrap around the buffer if the readIndex is at the end
         readIndex = readIndex == getSize() - 1 ? 0 : readIndex + 1;
@@ -72,17 +205,44 @@ public:
         return nextSample;
     }
     
-    void resize (size_t numSamples)
+    void setStorage (StoredType* memory, size_t numSamples)
+    {
+        // the memory is owned by a DelayLineArena, which hands it out already cleared
+        jassert ((memory == nullptr) == (numSamples == 0));
+        rawData = memory;
+        size = numSamples;
+        writeIndex = 0;
+        readIndex = 0;
+        numValidSamples = 0;
+    }
+
+    void moveTo (StoredType* memory, size_t numSamples) noexcept
     {
-        // ensure that the input value is valid
-        jassert (numSamples > 0);
-        rawData.resize (numSamples);
+        // the new memory must be larger and already cleared
+        jassert (memory != nullptr && numSamples > size);
+        
+        // an empty delay line has nothing to carry over
+        if (isEmpty())
+        {
+            setStorage (memory, numSamples);
+            return;
+        }
+        
+        // the buffer is written backwards, so the newest sample is the one after the write index and the older ones
+        // follow it (wrapping around); they are copied over from the newest on, so get() returns the same samples
+        size_t newestIndex = (writeIndex + 1) % size;
+        std::copy (rawData + newestIndex, rawData + size, memory + 1);
+        std::copy (rawData, rawData + newestIndex, memory + 1 + (size - newestIndex));
+        
+        rawData = memory;
+        size = numSamples;
         writeIndex = 0;
-        clear();
     }
 
 private:
-    std::vector<Type> rawData;
+    StoredType* rawData { nullptr };
+    size_t size { 0 };
     size_t writeIndex = 0;
     size_t readIndex = 0; // TODO: Deprecated
+    size_t numValidSamples = 0;
 };
@@ -0,0 +1,197 @@
+//
+//  DelayLineArena.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "DelayLine.h"
+
+#if JUCE_MAC || JUCE_LINUX || JUCE_ANDROID
+ #include <sys/mman.h>
+#endif
+
+#if JUCE_MAC
+ #include <mach/vm_statistics.h>
+#endif
+
+/*  The arena owns the memory of all the delay lines of a processor. The delay lines are
+    registered in one pass (see the addDelayLinesTo() functions of Delay and Diffusion) and
+    then laid out back-to-back in a single allocation, each one starting on a cache line.
+    The per-sample loop then walks one contiguous region instead of dozens of scattered
+    heap blocks. If the allocation fails the arena stays empty, and so do its delay lines.
+*/
+class DelayLineArena
+{
+public:
+    DelayLineArena()
+    {
+    }
+
+    ~DelayLineArena()
+    {
+        reset();
+    }
+
+    template <typename Type, typename Storage>
+    void add (DelayLine<Type, Storage>& delayLine, size_t numSamples)
+    {
+        // ensure that the input value is valid and that the arena hasn't been allocated yet
+        jassert (numSamples > 0);
+        jassert (memory == nullptr);
+
+        requests.push_back ({ &delayLine, numSamples, totalBytes, &bindDelayLine<Type, Storage> });
+        totalBytes += alignUp (numSamples * sizeof (typename Storage::StoredType), cacheLineSize);
+    }
+
+    void allocate()
+    {
+        // make sure that we don't leak a previous allocation
+        jassert (memory == nullptr);
+
+        if (totalBytes == 0)
+            return;
+
+        // without the memory the delay lines are left empty, which makes the processor silent rather than crash
+        if (! allocateBlock())
+        {
+            reset();
+            return;
+        }
+
+        // hand out the memory to each of the registered delay lines
+        for (auto& request : requests)
+            request.bind (request.delayLine, static_cast<char*> (memory) + request.offset, request.numSamples);
+    }
+
+    void reset()
+    {
+        // detach the delay lines before the memory is released
+        for (auto& request : requests)
+            request.bind (request.delayLine, nullptr, 0);
+
+        requests.clear();
+        totalBytes = 0;
+
+        releaseBlock();
+    }
+
+    size_t getTotalBytes() const
+    {
+        return totalBytes;
+    }
+
+    size_t getNumDelayLines() const
+    {
+        return requests.size();
+    }
+
+    bool isAllocated() const
+    {
+        return memory != nullptr;
+    }
+
+private:
+    static constexpr size_t cacheLineSize = 64;
+    static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+
+    struct Request
+    {
+        void* delayLine;
+        size_t numSamples;
+        size_t offset;
+        void (*bind) (void* delayLine, void* memory, size_t numSamples);
+    };
+
+    std::vector<Request> requests;
+    size_t totalBytes { 0 };
+
+    void* memory { nullptr };
+    size_t allocatedBytes { 0 };
+    bool isMapped { false };
+
+    // helper functions
+    template <typename Type, typename Storage>
+    static void bindDelayLine (void* delayLine, void* memory, size_t numSamples)
+    {
+        static_cast<DelayLine<Type, Storage>*> (delayLine)->setStorage (static_cast<typename Storage::StoredType*> (memory), numSamples);
+    }
+
+    static size_t alignUp (size_t numBytes, size_t alignment)
+    {
+        return (numBytes + alignment - 1) & ~(alignment - 1);
+    }
+
+    bool allocateBlock()
+    {
+        // large arenas are padded to whole huge pages so that the OS can back them with 2 MB pages,
+        // which saves TLB misses when hundreds of instances are running at the same time
+        bool useHugePages = totalBytes >= hugePageSize;
+        size_t alignment = useHugePages ? hugePageSize : cacheLineSize;
+        allocatedBytes = alignUp (totalBytes, alignment);
+
+       #if JUCE_MAC && JUCE_INTEL
+        if (useHugePages)
+        {
+            // macOS only hands out superpages when they are requested explicitly through mmap
+            void* mapped = mmap (nullptr, allocatedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+
+            if (mapped != MAP_FAILED)
+            {
+                memory = mapped;
+                isMapped = true;
+                return true; // mapped memory is already zeroed
+            }
+        }
+       #endif
+
+       #if JUCE_WINDOWS
+        memory = _aligned_malloc (allocatedBytes, alignment);
+       #else
+        if (posix_memalign (&memory, alignment, allocatedBytes) != 0)
+            memory = nullptr;
+       #endif
+
+        if (memory == nullptr)
+        {
+            allocatedBytes = 0;
+            return false;
+        }
+
+       #if (JUCE_LINUX || JUCE_ANDROID) && defined (MADV_HUGEPAGE)
+        if (useHugePages)
+            madvise (memory, allocatedBytes, MADV_HUGEPAGE);
+       #endif
+
+        // all delay lines start out silent
+        std::memset (memory, 0, allocatedBytes);
+        return true;
+    }
+
+    void releaseBlock()
+    {
+        if (memory == nullptr)
+            return;
+
+        if (isMapped)
+        {
+           #if JUCE_MAC || JUCE_LINUX || JUCE_ANDROID
+            munmap (memory, allocatedBytes);
+           #endif
+        }
+        else
+        {
+           #if JUCE_WINDOWS
+            _aligned_free (memory);
+           #else
+            std::free (memory);
+           #endif
+        }
+
+        memory = nullptr;
+        allocatedBytes = 0;
+        isMapped = false;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (DelayLineArena)
+};
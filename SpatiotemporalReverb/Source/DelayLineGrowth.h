@@ -0,0 +1,233 @@
+//
+//  DelayLineGrowth.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+// a single background thread, shared by all instances, that allocates and frees delay memory; it sleeps until a group
+// of delay lines asks for more memory, and only polls while a grown block still waits for an audio thread
+class DelayLineGrowthThread : public juce::Thread
+{
+public:
+    struct Client
+    {
+        virtual ~Client() = default;
+
+        // does the pending work of the client; returns true while it waits for its audio thread
+        virtual bool serviceGrowth() = 0;
+    };
+
+    DelayLineGrowthThread() : juce::Thread ("Delay line growth")
+    {
+        startThread();
+    }
+
+    ~DelayLineGrowthThread() override
+    {
+        stopThread (1000);
+    }
+
+    void addClient (Client* client)
+    {
+        const juce::ScopedLock lock (clientLock);
+        if (std::find (clients.begin(), clients.end(), client) == clients.end())
+            clients.push_back (client);
+    }
+
+    // this blocks until the thread is out of the client's serviceGrowth()
+    void removeClient (Client* client)
+    {
+        const juce::ScopedLock lock (clientLock);
+        clients.erase (std::remove (clients.begin(), clients.end(), client), clients.end());
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            bool isWaitingForAudioThread = false;
+            {
+                const juce::ScopedLock lock (clientLock);
+                for (auto* client : clients)
+                    isWaitingForAudioThread = client->serviceGrowth() || isWaitingForAudioThread;
+            }
+
+            // a notify() that came in while the clients were serviced isn't lost, it ends the next wait at once
+            wait (isWaitingForAudioThread ? 20 : -1);
+        }
+    }
+
+private:
+    juce::CriticalSection clientLock;
+    std::vector<Client*> clients;
+};
+
+/*  Grows the memory of a group of delay lines without allocating or freeing on the audio thread (RCU-style):
+    1. any thread requests a capacity with requestCapacity()
+    2. the growth thread allocates a larger block and publishes it
+    3. the audio thread picks it up with acquireGrownBlock(), moves the delay lines over and retires the old block
+    4. the growth thread frees the retired block
+    Only one block is in flight at a time, so a single pending and a single retired slot are enough.
+    When rendering offline (setSynchronous (true)) steps 2 and 4 happen on the audio thread instead, so that the
+    block the delay lines grow at doesn't depend on the timing of the growth thread.
+*/
+template <typename StoredType, size_t numDelayLines>
+class DelayLineGrowth : private DelayLineGrowthThread::Client
+{
+public:
+    class Block
+    {
+    public:
+        explicit Block (size_t numSamples) : samplesPerLine (numSamples)
+        {
+            // every delay line starts on its own cache line, and the memory starts out silent
+            stride = alignUp (numSamples * sizeof (StoredType), cacheLineSize);
+            rawMemory.calloc (stride * numDelayLines + cacheLineSize);
+            alignedMemory = reinterpret_cast<char*> (alignUp ((size_t) rawMemory.get(), cacheLineSize));
+        }
+
+        StoredType* getDelayLine (size_t index) const noexcept
+        {
+            jassert (index < numDelayLines);
+            return reinterpret_cast<StoredType*> (alignedMemory + index * stride);
+        }
+
+        size_t getNumSamples() const noexcept
+        {
+            return samplesPerLine;
+        }
+
+    private:
+        juce::HeapBlock<char> rawMemory;
+        char* alignedMemory { nullptr };
+        size_t samplesPerLine;
+        size_t stride { 0 };
+    };
+
+    DelayLineGrowth()
+    {
+    }
+
+    ~DelayLineGrowth() override
+    {
+        reset (0, 0);
+    }
+
+    // must only be called while the audio thread is not processing, e.g. from prepareToPlay
+    void reset (size_t initialSamplesPerLine, size_t maxSamplesPerLine)
+    {
+        // this blocks until the growth thread is out of serviceGrowth()
+        growthThread->removeClient (this);
+
+        delete pendingBlock.exchange (nullptr);
+        delete retiredBlock.exchange (nullptr);
+
+        requestedSamples = initialSamplesPerLine;
+        publishedSamples = initialSamplesPerLine;
+        maximumSamples = maxSamplesPerLine;
+
+        // the growth thread is woken by the requests from now on
+        if (maximumSamples > 0)
+            growthThread->addClient (this);
+    }
+
+    // allocates and frees on the audio thread (e.g. when rendering offline) instead of the growth thread; must be called
+    // before reset
+    void setSynchronous (bool shouldBeSynchronous) noexcept
+    {
+        isSynchronous = shouldBeSynchronous;
+    }
+
+    // called from any thread, including the audio thread: a request that raises the capacity wakes the growth thread,
+    // which briefly takes the lock of its event (like the background thread of a BufferingAudioSource); that only
+    // happens on the rare requests that actually grow the delay lines, any other request only touches atomics
+    void requestCapacity (size_t samplesPerLine) noexcept
+    {
+        // we don't grow anything before the delay lines have been laid out for the first time
+        if (publishedSamples.load() == 0)
+            return;
+
+        size_t current = requestedSamples.load();
+        while (samplesPerLine > current && ! requestedSamples.compare_exchange_weak (current, samplesPerLine)) {}
+
+        if (samplesPerLine > current && ! isSynchronous)
+            growthThread->notify();
+    }
+
+    // called from the audio thread; returns a larger block to move the delay lines to, or nullptr
+    Block* acquireGrownBlock() noexcept
+    {
+        if (isSynchronous)
+        {
+            delete retiredBlock.exchange (nullptr);
+            growIfRequested();
+        }
+
+        // wait until the previously retired block has been reclaimed
+        if (retiredBlock.load (std::memory_order_acquire) != nullptr)
+            return nullptr;
+
+        return pendingBlock.exchange (nullptr, std::memory_order_acq_rel);
+    }
+
+    // called from the audio thread once it no longer touches the old block (nullptr if it was arena memory)
+    void retire (Block* oldBlock) noexcept
+    {
+        retiredBlock.store (oldBlock, std::memory_order_release);
+    }
+
+private:
+    static constexpr size_t cacheLineSize = 64;
+
+    juce::SharedResourcePointer<DelayLineGrowthThread> growthThread;
+
+    std::atomic<Block*> pendingBlock { nullptr };
+    std::atomic<Block*> retiredBlock { nullptr };
+    std::atomic<size_t> requestedSamples { 0 };
+    std::atomic<size_t> publishedSamples { 0 };
+    size_t maximumSamples { 0 };
+    std::atomic<bool> isSynchronous { false };
+
+    // helper functions
+    static size_t alignUp (size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    void growIfRequested()
+    {
+        size_t requested = requestedSamples.load();
+        size_t published = publishedSamples.load();
+
+        if (requested > published && pendingBlock.load (std::memory_order_acquire) == nullptr)
+        {
+            // we grow geometrically so that a slowly rising delay time only causes a handful of reallocations
+            size_t capacity = published;
+            while (capacity < requested)
+                capacity *= 2;
+
+            capacity = juce::jmax (requested, juce::jmin (capacity, maximumSamples));
+
+            pendingBlock.store (new Block (capacity), std::memory_order_release);
+            publishedSamples = capacity;
+        }
+    }
+
+    bool serviceGrowth() override
+    {
+        if (isSynchronous)
+            return false;
+
+        // deferred reclamation of the memory that the audio thread has stopped using
+        delete retiredBlock.exchange (nullptr, std::memory_order_acq_rel);
+        growIfRequested();
+
+        // the audio thread neither signals that it has picked up the new block nor that it has retired the old one,
+        // so we poll until both have happened
+        return pendingBlock.load() != nullptr || retiredBlock.load() != nullptr || requestedSamples.load() > publishedSamples.load();
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (DelayLineGrowth)
+};
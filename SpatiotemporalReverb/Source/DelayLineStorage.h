@@ -0,0 +1,246 @@
+//
+//  DelayLineStorage.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "SampleLanes.h"
+
+#if defined (__F16C__)
+ #include <immintrin.h>
+#endif
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+ #include <arm_neon.h>
+#endif
+
+/*  The storage policies decide how a DelayLine keeps its samples in memory. With hundreds of sources the delay
+    memory is streamed through the cache every block, so storing 16 bits per sample instead of 32 halves both
+    the memory and the cache traffic of every instance.
+
+    - FullPrecisionStorage: the samples are stored as they are (the default)
+    - HalfFloatStorage:     IEEE half precision, i.e. 11 bits of precision at any level (about -66 dB relative)
+    - ScaledInt16Storage:   16-bit fixed point over [-4, 4], i.e. a fixed noise floor at about -84 dBFS
+
+    The delay of the reverb feeds its lines through a tanh, so they stay within [-1, 1], but the lines of the diffusion
+    don't: the first step mixes n copies of the input through a Hadamard matrix, which adds them up to sqrt (n) times
+    the input in one channel (2.8 times for 8 channels, 4 times for 16). The fixed-point range leaves room for that.
+    The measured noise floors are in Tests/DelayLineStorageTests.cpp.
+
+    The half-float conversion uses the F16C instructions (or those of ARMv8.2) only when the build enables them, e.g.
+    with -mf16c (every CPU with AVX2 has them); otherwise it falls back to the portable conversion, which gives the
+    same bits but is slower.
+*/
+template <typename Type>
+struct FullPrecisionStorage
+{
+    using StoredType = Type;
+
+    static StoredType encode (Type value) noexcept
+    {
+        return value;
+    }
+
+    static Type decode (const StoredType& stored) noexcept
+    {
+        return stored;
+    }
+};
+
+template <typename Type>
+struct HalfFloatStorage
+{
+    using Lanes = SampleLanes<Type>;
+    using StoredType = std::array<juce::uint16, Lanes::numLanes>;
+
+    static StoredType encode (Type value) noexcept
+    {
+        StoredType stored;
+
+       #if defined (__F16C__)
+        if constexpr (Lanes::numLanes == 4 && std::is_same_v<typename Lanes::NumericType, float>)
+        {
+            // a whole SSE register is converted with a single instruction
+            alignas (16) float lanes[4];
+            value.copyToRawArray (lanes);
+            _mm_storel_epi64 (reinterpret_cast<__m128i*> (stored.data()), _mm_cvtps_ph (_mm_load_ps (lanes), _MM_FROUND_TO_NEAREST_INT));
+            return stored;
+        }
+       #elif (defined (__ARM_NEON) || defined (__ARM_NEON__)) && defined (__ARM_FP16_FORMAT_IEEE)
+        if constexpr (Lanes::numLanes == 4 && std::is_same_v<typename Lanes::NumericType, float>)
+        {
+            alignas (16) float lanes[4];
+            value.copyToRawArray (lanes);
+            vst1_u16 (stored.data(), vreinterpret_u16_f16 (vcvt_f16_f32 (vld1q_f32 (lanes))));
+            return stored;
+        }
+       #endif
+
+        for (size_t lane = 0; lane < Lanes::numLanes; ++lane)
+            stored[lane] = floatToHalf ((float) Lanes::get (value, lane));
+
+        return stored;
+    }
+
+    static Type decode (const StoredType& stored) noexcept
+    {
+       #if defined (__F16C__)
+        if constexpr (Lanes::numLanes == 4 && std::is_same_v<typename Lanes::NumericType, float>)
+        {
+            alignas (16) float lanes[4];
+            _mm_store_ps (lanes, _mm_cvtph_ps (_mm_loadl_epi64 (reinterpret_cast<const __m128i*> (stored.data()))));
+            return Type::fromRawArray (lanes);
+        }
+       #elif (defined (__ARM_NEON) || defined (__ARM_NEON__)) && defined (__ARM_FP16_FORMAT_IEEE)
+        if constexpr (Lanes::numLanes == 4 && std::is_same_v<typename Lanes::NumericType, float>)
+        {
+            alignas (16) float lanes[4];
+            vst1q_f32 (lanes, vcvt_f32_f16 (vreinterpret_f16_u16 (vld1_u16 (stored.data()))));
+            return Type::fromRawArray (lanes);
+        }
+       #endif
+
+        Type value {};
+        for (size_t lane = 0; lane < Lanes::numLanes; ++lane)
+            Lanes::set (value, lane, (typename Lanes::NumericType) halfToFloat (stored[lane]));
+
+        return value;
+    }
+
+    static juce::uint16 floatToHalf (float value) noexcept
+    {
+       #if defined (__F16C__)
+        return (juce::uint16) _cvtss_sh (value, _MM_FROUND_TO_NEAREST_INT);
+       #elif (defined (__ARM_NEON) || defined (__ARM_NEON__)) && defined (__ARM_FP16_FORMAT_IEEE)
+        __fp16 half = (__fp16) value;
+        juce::uint16 bits;
+        std::memcpy (&bits, &half, sizeof (bits));
+        return bits;
+       #else
+        // portable round-to-nearest-even conversion, bit-identical to the hardware instructions
+        juce::uint32 bits;
+        std::memcpy (&bits, &value, sizeof (bits));
+
+        juce::uint32 sign = (bits >> 16) & 0x8000u;
+        juce::uint32 floatExponent = (bits >> 23) & 0xffu;
+        juce::uint32 mantissa = bits & 0x7fffffu;
+
+        // infinity and NaN
+        if (floatExponent == 0xffu)
+            return (juce::uint16) (sign | 0x7c00u | (mantissa != 0 ? 0x200u : 0u));
+
+        int exponent = (int) floatExponent - 127 + 15;
+
+        // too large for half precision
+        if (exponent >= 31)
+            return (juce::uint16) (sign | 0x7c00u);
+
+        // subnormal half precision (or too small, in which case we flush to zero)
+        if (exponent <= 0)
+        {
+            if (exponent < -10)
+                return (juce::uint16) sign;
+
+            mantissa |= 0x800000u;
+            juce::uint32 shift = (juce::uint32) (14 - exponent);
+            juce::uint32 half = mantissa >> shift;
+            juce::uint32 remainder = mantissa & ((1u << shift) - 1u);
+            juce::uint32 halfway = 1u << (shift - 1u);
+
+            if (remainder > halfway || (remainder == halfway && (half & 1u) != 0))
+                ++half;
+
+            return (juce::uint16) (sign | half);
+        }
+
+        // a carry out of the mantissa correctly rounds up into the exponent
+        juce::uint32 half = sign | ((juce::uint32) exponent << 10) | (mantissa >> 13);
+        juce::uint32 remainder = mantissa & 0x1fffu;
+
+        if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u) != 0))
+            ++half;
+
+        return (juce::uint16) half;
+       #endif
+    }
+
+    static float halfToFloat (juce::uint16 half) noexcept
+    {
+       #if defined (__F16C__)
+        return _cvtsh_ss (half);
+       #elif (defined (__ARM_NEON) || defined (__ARM_NEON__)) && defined (__ARM_FP16_FORMAT_IEEE)
+        __fp16 value;
+        std::memcpy (&value, &half, sizeof (value));
+        return (float) value;
+       #else
+        juce::uint32 sign = (juce::uint32) (half & 0x8000u) << 16;
+        int exponent = (half >> 10) & 0x1f;
+        juce::uint32 mantissa = half & 0x3ffu;
+        juce::uint32 bits;
+
+        if (exponent == 0x1f)
+        {
+            bits = sign | 0x7f800000u | (mantissa << 13);
+        }
+        else if (exponent != 0)
+        {
+            bits = sign | ((juce::uint32) (exponent - 15 + 127) << 23) | (mantissa << 13);
+        }
+        else if (mantissa == 0)
+        {
+            bits = sign;
+        }
+        else
+        {
+            // normalise the subnormal half
+            exponent = 1;
+            while ((mantissa & 0x400u) == 0)
+            {
+                mantissa <<= 1;
+                --exponent;
+            }
+
+            bits = sign | ((juce::uint32) (exponent - 15 + 127) << 23) | ((mantissa & 0x3ffu) << 13);
+        }
+
+        float value;
+        std::memcpy (&value, &bits, sizeof (value));
+        return value;
+       #endif
+    }
+};
+
+template <typename Type>
+struct ScaledInt16Storage
+{
+    using Lanes = SampleLanes<Type>;
+    using NumericType = typename Lanes::NumericType;
+    using StoredType = std::array<juce::int16, Lanes::numLanes>;
+
+    // the range that is stored, and the step between two stored values
+    static constexpr NumericType headroom = NumericType (4);
+    static constexpr NumericType scale = NumericType (32767) / headroom;
+
+    static StoredType encode (Type value) noexcept
+    {
+        StoredType stored;
+        for (size_t lane = 0; lane < Lanes::numLanes; ++lane)
+        {
+            // anything beyond the headroom is clipped
+            auto sample = juce::jlimit (-headroom, headroom, Lanes::get (value, lane));
+            stored[lane] = (juce::int16) std::lrint (sample * scale);
+        }
+
+        return stored;
+    }
+
+    static Type decode (const StoredType& stored) noexcept
+    {
+        Type value {};
+        for (size_t lane = 0; lane < Lanes::numLanes; ++lane)
+            Lanes::set (value, lane, NumericType (stored[lane]) * (NumericType (1) / scale));
+
+        return value;
+    }
+};
@@ -10,11 +10,15 @@
 #pragma once
 #include <JuceHeader.h>
 #include "DiffusionStep.h"
+#include "SampleLanes.h"
+#include "StageProfiler.h"
 
-template<typename Type, size_t numDiffusionChannels = 8, size_t numDiffusionSteps = 8>
+template<typename Type, size_t numDiffusionChannels = 8, size_t numDiffusionSteps = 8, typename Storage = FullPrecisionStorage<Type>>
 class Diffusion
 {
 public:
+    using NumericType = typename SampleLanes<Type>::NumericType;
+    
     Diffusion()
     {
     }
@@ -35,6 +39,20 @@ public:
         }
     }
     
+    // seeds the random delays of the steps (each step gets its own seed derived from it); must be called before prepare
+    void setSeed (juce::int64 seed)
+    {
+        for (size_t step = 0; step < numDiffusionSteps; ++step)
+            diffusionSteps[step].setSeed (seed + (juce::int64) step);
+    }
+    
+    void addDelayLinesTo (DelayLineArena& arena)
+    {
+        // the steps are laid out in processing order, so the chain walks forward through the arena
+        for (auto& step : diffusionSteps)
+            step.addDelayLinesTo (arena);
+    }
+    
     template <typename ProcessContext>
     void process (const ProcessContext& context)
     {
@@ -44,25 +62,102 @@ public:
         size_t channels = inputBlock.getNumChannels();
         size_t samples = inputBlock.getNumSamples();
         
-        for (int ch = 0; ch < channels; ++ch)
+        // when the amount of steps changes we run the longer of the two chains for this block
+        // and crossfade from the old chain's output to the new chain's output
+        size_t previousSteps = activeDiffusionSteps;
+        size_t targetSteps = std::min (targetDiffusionSteps.load (std::memory_order_relaxed),
+                                       maxDiffusionSteps.load (std::memory_order_relaxed));
+        
+        // only the next step is kept warm, so the chain grows by a single step per block, and only once that step has
+        // been fed for as long as its delays (the steps after it read back silence until then); it shrinks at once
+        if (targetSteps > previousSteps)
+            targetSteps = diffusionSteps[previousSteps].isWarm() ? previousSteps + 1 : previousSteps;
+        size_t shortChain = std::min (previousSteps, targetSteps);
+        size_t longChain = std::max (previousSteps, targetSteps);
+        
+        DiffusionStepTimer<numDiffusionSteps> stepTimer (profile);
+        
+        // the steps write their output into the other of the two split buffers, which is the input of the next step
+        std::array<std::array<Type*, numDiffusionChannels>, 2> splitChannels;
+        for (size_t ch = 0; ch < numDiffusionChannels; ++ch)
+            for (size_t buffer = 0; buffer < 2; ++buffer)
+                splitChannels[buffer][ch] = splitSignal[buffer][ch].data();
+        
+        // the block is pushed through the chain a chunk at a time and one step after the other, so only the delay lines
+        // of one step are in use at a time while the chunk stays in the cache between the steps; since the chain has no
+        // feedback this gives the same output as running each sample through all the steps
+        for (size_t ch = 0; ch < channels; ++ch)
         {
-            for (int sample = 0; sample < samples; ++sample)
+            auto* input = inputBlock.getChannelPointer (ch);
+            auto* output = outputBlock.getChannelPointer (ch);
+            
+            for (size_t start = 0; start < samples; start += chunkSize)
             {
-                auto inputSample = inputBlock.getSample (ch, sample);
+                size_t numSamples = juce::jmin (chunkSize, samples - start);
+                stepTimer.begin();
                 
                 // split the input signal into the diffusion channels
-                std::array<Type, numDiffusionChannels> splitSignal;
-                splitSignal.fill (inputSample);
+                for (auto& channel : splitSignal[0])
+                    std::copy (input + start, input + start + numSamples, channel.begin());
                 
                 // add the diffusion
-                for (size_t step = 0; step <= activeDiffusionSteps; ++step)
-                    diffusionSteps[step].process (splitSignal.data());
-    
+                for (size_t step = 0; step < shortChain; ++step)
+                {
+                    diffusionSteps[step].processBlock (splitChannels[step % 2].data(), splitChannels[(step + 1) % 2].data(), numSamples);
+                    stepTimer.lap (step);
+                }
+                
+                if (previousSteps != targetSteps)
+                    sumChannels (splitSignal[shortChain % 2], shortChainChunk.data(), numSamples);
+                
+                for (size_t step = shortChain; step < longChain; ++step)
+                {
+                    diffusionSteps[step].processBlock (splitChannels[step % 2].data(), splitChannels[(step + 1) % 2].data(), numSamples);
+                    stepTimer.lap (step);
+                }
+                
+                // the first inactive step is kept warm by writing into its delay lines without reading from them,
+                // so it can be switched on without replaying stale samples
+                if (longChain < numDiffusionSteps)
+                    diffusionSteps[longChain].feedBlock (splitChannels[longChain % 2].data(), numSamples);
+                
                 // combine the split signal to a single channel and send it to the output signal
-                auto outputSample = (std::accumulate (std::begin(splitSignal), std::end(splitSignal), 0.0f)) / numDiffusionChannels;
-                outputBlock.setSample (ch, sample, outputSample);
+                sumChannels (splitSignal[longChain % 2], output + start, numSamples);
+                
+                if (previousSteps != targetSteps)
+                {
+                    for (size_t sample = 0; sample < numSamples; ++sample)
+                    {
+                        auto fade = NumericType (start + sample + 1) / NumericType (samples);
+                        Type outputSample = output[start + sample];
+                        Type oldSample = previousSteps < targetSteps ? shortChainChunk[sample] : outputSample;
+                        Type newSample = previousSteps < targetSteps ? outputSample : shortChainChunk[sample];
+                        output[start + sample] = oldSample + (newSample - oldSample) * fade;
+                    }
+                }
             }
         }
+        
+        // the steps behind the new warm step are no longer fed, so we invalidate them (a cheap watermark reset
+        // rather than a clear) which makes them read back silence instead of stale samples when re-enabled
+        for (size_t step = targetSteps + 1; step <= std::min (longChain, numDiffusionSteps - 1); ++step)
+            diffusionSteps[step].invalidate();
+        
+        activeDiffusionSteps = targetSteps;
+        
+        stepTimer.recordTo (longChain);
+    }
+    
+    // the amount of steps that the last block ended with
+    size_t getActiveDiffusionSteps() const noexcept
+    {
+        return activeDiffusionSteps;
+    }
+    
+    // the profile that the steps are timed into (nullptr for none)
+    void setProfile (StageProfile* newProfile) noexcept
+    {
+        profile = newProfile;
     }
     
     void setDiffusionSteps (float diffusionTime)
@@ -72,17 +167,76 @@ public:
         
         // calculate the amount of diffusion steps needed
         int step = 0;
-        while (diffusionTimeSmoother > diffusionStepAtomicSize * (2 << step) && step <= numDiffusionSteps) step++;
-        activeDiffusionSteps = step;
+        while (diffusionTimeSmoother > diffusionStepAtomicSize * (2 << step) && step < numDiffusionSteps) step++;
+        
+        // the step index is inclusive, so the chain always runs at least one step
+        targetDiffusionSteps.store (std::min ((size_t) step + 1, numDiffusionSteps), std::memory_order_relaxed);
+    }
+    
+    // settles the smoothing on the diffusion time at once, so that a diffusion that starts out at a time that no
+    // longer changes doesn't slide there from its default
+    void snapDiffusionTime (float diffusionTime)
+    {
+        diffusionTimeSmoother = diffusionTime;
+        setDiffusionSteps (diffusionTime);
+    }
+    
+    // caps the amount of steps whatever the diffusion time asks for (e.g. to save CPU); changes are crossfaded like any other
+    void setMaxDiffusionSteps (size_t newMaxDiffusionSteps)
+    {
+        // make sure that the maximum is valid
+        jassert (newMaxDiffusionSteps > 0);
+        maxDiffusionSteps.store (std::min (newMaxDiffusionSteps, numDiffusionSteps), std::memory_order_relaxed);
+    }
+    
+    // the amount of steps that the chain grows to: what the diffusion time asks for, within the cap
+    size_t getTargetDiffusionSteps() const noexcept
+    {
+        return std::min (targetDiffusionSteps.load (std::memory_order_relaxed), maxDiffusionSteps.load (std::memory_order_relaxed));
+    }
+    
+    // the summed delays of the steps that the chain grows to, in samples; a step is only switched on once it has been
+    // fed for as long as its delays, so this is how long a fresh chain takes to get there (plus a block per step)
+    size_t getTotalDelay() const noexcept
+    {
+        size_t totalDelay = 0;
+        for (size_t step = 0; step < getTargetDiffusionSteps(); ++step)
+            totalDelay += diffusionSteps[step].getMaxDelay();
+        
+        return totalDelay;
     }
     
 private:
-    Type sampleRate { Type (44.1e3) };
-    Type diffusionStepAtomicSize { Type (0.012f) };
+    NumericType sampleRate { NumericType (44.1e3) };
+    NumericType diffusionStepAtomicSize { NumericType (0.012f) };
     
-    size_t activeDiffusionSteps { 0 };
-    Type diffusionTimeSmoother { Type (0.24f) };
+    // the amount of steps currently processed (audio thread) and the amount requested by Unity
+    size_t activeDiffusionSteps { 1 };
+    std::atomic<size_t> targetDiffusionSteps { 1 };
+    std::atomic<size_t> maxDiffusionSteps { numDiffusionSteps };
+    NumericType diffusionTimeSmoother { NumericType (0.24f) };
     
     // we declare an array of diffusion steps that functions as a diffusion chain
-    std::array<DiffusionStep<Type, numDiffusionChannels>, numDiffusionSteps> diffusionSteps;
+    std::array<DiffusionStep<Type, numDiffusionChannels, Storage>, numDiffusionSteps> diffusionSteps;
+    
+    // the chunk that runs through the chain one step at a time, split into the diffusion channels
+    static constexpr size_t chunkSize = 64;
+    std::array<std::array<std::array<Type, chunkSize>, numDiffusionChannels>, 2> splitSignal;
+    std::array<Type, chunkSize> shortChainChunk;
+    
+    // the steps run a chunk at a time, so each of them is timed on its own
+    StageProfile* profile { nullptr };
+    
+    // helper function
+    static void sumChannels (const std::array<std::array<Type, chunkSize>, numDiffusionChannels>& channels, Type* destination, size_t numSamples)
+    {
+        std::fill (destination, destination + numSamples, Type {});
+        
+        for (auto& channel : channels)
+            for (size_t sample = 0; sample < numSamples; ++sample)
+                destination[sample] += channel[sample];
+        
+        for (size_t sample = 0; sample < numSamples; ++sample)
+            destination[sample] *= NumericType (1) / numDiffusionChannels;
+    }
 };
@@ -9,20 +9,32 @@
 #pragma once
 #include <JuceHeader.h>
 #include "DelayLine.h"
+#include "DelayLineArena.h"
 #include "Matrix.h"
+#include "SampleLanes.h"
 
 
 // we define the structure of the diffusion steps
-template <typename Type, size_t numChannels = 8>
+template <typename Type, size_t numChannels = 8, typename Storage = FullPrecisionStorage<Type>>
 class DiffusionStep
 {
 public:
+    using NumericType = typename SampleLanes<Type>::NumericType;
+    
     DiffusionStep()
     {
     }
     
+    // the delays and polarities are drawn from this seed, so a step prepared twice (or in another run) comes out the same
+    void setSeed (juce::int64 newSeed)
+    {
+        seed = newSeed;
+    }
+    
     void prepare (size_t delayInSamplesUpperBound)
     {
+        random.setSeed (seed);
+        
         // we set up each of the diffusion-step channels
         for (size_t ch = 0; ch < numChannels; ++ch)
         {
@@ -35,40 +47,85 @@ public:
             // we choose a random delay within the sample range
             delayInSamples[ch] = random.nextInt(range);
             
-            // we set up the delay line
-            delayLines[ch].resize (delayInSamples[ch] + 1);
-            delayLines[ch].clear();
-            
             // we randomly set polarity inversions
-            invertPolarity[ch] = random.nextBool();
+            polarities[ch] = random.nextBool() ? NumericType (-1) : NumericType (1);
         }
     }
     
-    void process (Type* input)
+    void addDelayLinesTo (DelayLineArena& arena)
     {
-        // iterate through the channels writing and reading from the delay line
-        for (int ch = 0; ch < numChannels; ++ch)
+        // each delay line only needs to be long enough for its chosen delay
+        for (size_t ch = 0; ch < numChannels; ++ch)
+            arena.add (delayLines[ch], delayInSamples[ch] + 1);
+    }
+    
+    // runs a block through the step, with one buffer per channel of the step; input and output must not overlap
+    void processBlock (const Type* const* input, Type* const* output, size_t numSamples)
+    {
+        for (size_t ch = 0; ch < numChannels; ++ch)
         {
-            delayLines[ch].push(input[ch]);
-            input[ch] = delayLines[ch].get(delayInSamples[ch]);
+            auto& delayLine = delayLines[ch];
+            
+            // a sample is pushed before the delayed one is read, which is the same as reading one sample less far back
+            // before pushing; when no sample of the block is read after it has been pushed, the delayed block is read in
+            // one go (as at most two contiguous runs of the delay line), otherwise sample by sample
+            if (delayInSamples[ch] >= numSamples)
+            {
+                delayLine.getBlock (delayInSamples[ch] - 1, output[ch], numSamples);
+                delayLine.pushBlock (input[ch], numSamples);
+            }
+            else
+            {
+                for (size_t sample = 0; sample < numSamples; ++sample)
+                {
+                    delayLine.push (input[ch][sample]);
+                    output[ch][sample] = delayLine.get (delayInSamples[ch]);
+                }
+            }
         }
         
-        // Mix with a Hadamard matrix
-        Hadamard<Type, numChannels>::process (input);
-        
+        // Mix with a Hadamard matrix and invert the polarities
+        // TODO: implement a random shuffle (switching the signals between channels)
+        Hadamard<Type, numChannels>::processBlock (output, numSamples, polarities.data());
+    }
+    
+    void feedBlock (const Type* const* channels, size_t numSamples)
+    {
+        // write the input into the delay lines without reading or mixing, which keeps an inactive step warm
         for (size_t ch = 0; ch < numChannels; ++ch)
         {
-            // TODO: implement a random shuffle (switching the signals between channels)
-            
-            // invert polarities
-            if (invertPolarity[ch]) input[ch] *= -1;
+            // a delay line shorter than the block only keeps the end of it
+            if (numSamples <= delayLines[ch].getSize())
+                delayLines[ch].pushBlock (channels[ch], numSamples);
+            else
+                for (size_t sample = 0; sample < numSamples; ++sample)
+                    delayLines[ch].push (channels[ch][sample]);
         }
     }
     
+    // the longest delay of the channels, which is how long the step has to be fed before it is warm
+    size_t getMaxDelay() const noexcept
+    {
+        return *std::max_element (delayInSamples.begin(), delayInSamples.end()) + 1;
+    }
+    
+    // whether the delay lines have been fed for long enough that no read comes back stale
+    bool isWarm() const noexcept
+    {
+        return std::all_of (delayLines.begin(), delayLines.end(), [] (auto& delayLine) { return delayLine.isFull(); });
+    }
+    
+    void invalidate()
+    {
+        for (auto& delayLine : delayLines)
+            delayLine.invalidate();
+    }
+    
 private:
-    std::array<Type,            numChannels> delayInSamples;
-    std::array<DelayLine<Type>, numChannels> delayLines;
-    std::array<bool,            numChannels> invertPolarity;
+    std::array<size_t,          numChannels> delayInSamples;
+    std::array<DelayLine<Type, Storage>, numChannels> delayLines;
+    std::array<NumericType,     numChannels> polarities;
     
     juce::Random random;
+    juce::int64 seed { juce::Random().nextInt64() };
 };
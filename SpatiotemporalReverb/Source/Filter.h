@@ -7,11 +7,15 @@
 
 #pragma once
 #include <JuceHeader.h>
+#include "SampleLanes.h"
+#include "LaneStateVariableFilter.h"
 
 template <typename Type, size_t maxNumChannels = 2>
 class Filter
 {
 public:
+    using NumericType = typename SampleLanes<Type>::NumericType;
+    
     Filter()
     {
         setWetLevel (1.0f);
@@ -20,7 +24,7 @@ public:
     
     void prepare (const juce::dsp::ProcessSpec& spec)
     {
-        sampleRate = (Type) spec.sampleRate;
+        sampleRate = (NumericType) spec.sampleRate;
         
         filterChain.prepare (spec);
         
@@ -33,7 +37,21 @@ public:
     template <typename ProcessContext>
     void process (const ProcessContext& context)
     {
-        filterChain.process (context);
+        // the simplified filter runs the occlusion stage alone, at the lowest of the three cutoffs
+        if (isSimplified)
+            filterChain.template get<occlusionFilter>().process (context);
+        else
+            filterChain.process (context);
+    }
+    
+    // trades the three filter stages for one (e.g. to save CPU)
+    void setSimplified (bool shouldBeSimplified)
+    {
+        if (isSimplified == shouldBeSimplified)
+            return;
+        
+        isSimplified = shouldBeSimplified;
+        updateOcclusionCutoff();
     }
     
     
@@ -42,11 +60,16 @@ public:
         float factor = 10.0f; // for audible effect
         float freqCutoff = 10e3f - distance * factor;            
         filterChain.template get<distanceFilter>().setCutoffFrequency (freqCutoff);
+        distanceCutoff = freqCutoff;
+        
+        if (isSimplified)
+            updateOcclusionCutoff();
     }
     
     void setOcclusionFilter (float freqCutoff)
     {
-        filterChain.template get<occlusionFilter>().setCutoffFrequency (freqCutoff);
+        occlusionCutoff = freqCutoff;
+        updateOcclusionCutoff();
     }
     
     void setHeadShadowFilter (float panInfo, float frontBackInfo)
@@ -56,35 +79,43 @@ public:
         headShadowSmoother -= 0.1 * (headShadowSmoother - freqCutoff); // S-curve applied
         
         filterChain.template get<headShadowFilter>().setCutoffFrequency (headShadowSmoother);
+        
+        if (isSimplified)
+            updateOcclusionCutoff();
     }
     
-    void setWetLevel (Type newWetLevel)
+    void setWetLevel (NumericType newWetLevel)
     {
         // ensure that the input value is valid, i.e. in range [0, 1]
-        jassert (newWetLevel >= Type (0) && newWetLevel <= Type (1));
+        jassert (newWetLevel >= NumericType (0) && newWetLevel <= NumericType (1));
         wetLevel = newWetLevel;
     }
     
-    void setDryLevel (Type newDryLevel)
+    void setDryLevel (NumericType newDryLevel)
     {
         // ensure that the input value is valid, i.e. in range [0, 1]
-        jassert (newDryLevel >= Type (0) && newDryLevel <= Type (1));
+        jassert (newDryLevel >= NumericType (0) && newDryLevel <= NumericType (1));
         dryLevel = newDryLevel;
     }
     
-    void setWetDryBalance (Type newWetLevel)
+    void setWetDryBalance (NumericType newWetLevel)
     {
         // ensure that the input value is valid, i.e. in range [0, 1]
-        jassert (newWetLevel >= Type (0) && newWetLevel <= Type (1));
+        jassert (newWetLevel >= NumericType (0) && newWetLevel <= NumericType (1));
         wetLevel = newWetLevel;
         dryLevel = 1.0f - newWetLevel;
     }
 
 private:
-    Type sampleRate { Type (44.1e3) };
-    Type wetLevel;
-    Type dryLevel;
-    Type headShadowSmoother { Type (10e3f) };
+    NumericType sampleRate { NumericType (44.1e3) };
+    NumericType wetLevel;
+    NumericType dryLevel;
+    NumericType headShadowSmoother { NumericType (10e3f) };
+    
+    // the cutoffs that the simplified filter combines
+    bool isSimplified { false };
+    float distanceCutoff { 10e3f };
+    float occlusionCutoff { 10e3f };
     
     // filter chain setup
     enum
@@ -94,7 +125,15 @@ private:
         headShadowFilter
     };
     
-    juce::dsp::ProcessorChain<juce::dsp::StateVariableTPTFilter<Type>,
-                              juce::dsp::StateVariableTPTFilter<Type>,
-                              juce::dsp::StateVariableTPTFilter<Type>> filterChain;
+    // the filters run on the lanes of Type, which the JUCE filter (only compiled for float and double) can't
+    juce::dsp::ProcessorChain<LaneStateVariableFilter<Type>,
+                              LaneStateVariableFilter<Type>,
+                              LaneStateVariableFilter<Type>> filterChain;
+    
+    // helper function
+    void updateOcclusionCutoff()
+    {
+        float cutoff = isSimplified ? std::min ({ distanceCutoff, occlusionCutoff, (float) headShadowSmoother }) : occlusionCutoff;
+        filterChain.template get<occlusionFilter>().setCutoffFrequency (cutoff);
+    }
 };
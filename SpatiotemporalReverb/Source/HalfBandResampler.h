@@ -0,0 +1,300 @@
+//
+//  HalfBandResampler.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "SampleLanes.h"
+
+/*  A half-band FIR filter that halves (decimate) or doubles (interpolate) the sample rate of a signal, run as two
+    polyphase branches: every other coefficient of a half-band filter is zero except the centre one (a half), so one
+    branch is a short symmetric FIR at the low rate and the other is a plain delay. Halving the rate costs
+    numTapsPerBranch multiplies per output sample, and doubling it the same per input sample.
+    The coefficients are a Kaiser-windowed sinc; with 12 taps per branch the passband is flat (within 0.2 dB) up to
+    about 0.2 of the higher rate (10 kHz at 48 kHz) and everything above 0.31 of it is attenuated by more than 80 dB.
+    Going down and up again delays the signal by 4 * numTapsPerBranch - 2 samples at the higher rate.
+*/
+template <typename Type, size_t maxNumChannels = 2, size_t numTapsPerBranch = 12>
+class HalfBandFilter
+{
+public:
+    using NumericType = typename SampleLanes<Type>::NumericType;
+
+    // the delay of going down and up again, in samples at the higher rate
+    static constexpr size_t roundTripLatency = 4 * numTapsPerBranch - 2;
+
+    HalfBandFilter()
+    {
+        // the coefficients h[k] of the filter with 4K - 1 taps are zero wherever k - (2K - 1) is a nonzero even number,
+        // so the branch only keeps h[2j] for j < 2K, which is symmetric (and only its first half is stored)
+        constexpr auto centre = (double) (2 * numTapsPerBranch - 1);
+        constexpr double beta = 8.0;
+
+        double sum = 0.0;
+        for (size_t tap = 0; tap < numTapsPerBranch; ++tap)
+        {
+            auto offset = (double) (2 * tap) - centre;
+            auto sinc = std::sin (juce::MathConstants<double>::halfPi * offset) / (juce::MathConstants<double>::pi * offset);
+            auto position = offset / centre;
+            auto window = besselI0 (beta * std::sqrt (1.0 - position * position)) / besselI0 (beta);
+
+            coefficients[tap] = sinc * window;
+            sum += 2.0 * coefficients[tap];
+        }
+
+        // the branch adds up to a half, like the centre tap, so the filter passes DC at unity
+        for (auto& coefficient : coefficients)
+            coefficient = (NumericType) (coefficient * 0.5 / sum);
+    }
+
+    void reset()
+    {
+        for (auto& channel : channels)
+            channel = {};
+    }
+
+    // halves the rate of a block; returns the amount of samples written to output, which is every other sample of the
+    // input counted across blocks (so half of numSamples, rounded up or down depending on the blocks before)
+    size_t decimate (size_t channel, const Type* input, size_t numSamples, Type* output) noexcept
+    {
+        // make sure that the channel is valid
+        jassert (channel < maxNumChannels);
+
+        auto& state = channels[channel];
+        size_t numOutputs = 0;
+
+        for (size_t sample = 0; sample < numSamples; ++sample)
+        {
+            // the odd samples only go through the delay of the centre tap
+            if (state.isOddSample)
+            {
+                state.odd.push (input[sample]);
+                state.isOddSample = false;
+                continue;
+            }
+
+            state.even.push (input[sample]);
+            state.isOddSample = true;
+
+            output[numOutputs++] = state.even.convolve (coefficients) + state.odd.get (numTapsPerBranch - 1) * NumericType (0.5);
+        }
+
+        return numOutputs;
+    }
+
+    // doubles the rate of a block of numInputs samples into numSamples samples; numSamples must be the amount of
+    // samples that the block was decimated from, since the filter holds back the second half of an input sample when
+    // there is no room for it (the rounding of decimate)
+    void interpolate (size_t channel, const Type* input, size_t numInputs, Type* output, size_t numSamples) noexcept
+    {
+        // make sure that the channel is valid
+        jassert (channel < maxNumChannels);
+
+        auto& state = channels[channel];
+        size_t numOutputs = 0;
+
+        if (state.hasHeldBackSample && numSamples > 0)
+        {
+            output[numOutputs++] = state.heldBackSample;
+            state.hasHeldBackSample = false;
+        }
+
+        for (size_t sample = 0; sample < numInputs; ++sample)
+        {
+            state.interpolated.push (input[sample]);
+
+            // the zeros stuffed in between the samples are left out, which is where the gain of 2 comes from
+            auto evenSample = state.interpolated.convolve (coefficients) * NumericType (2);
+            auto oddSample = state.interpolated.get (numTapsPerBranch - 1);
+
+            // make sure that the block was decimated from this many samples
+            jassert (numOutputs < numSamples);
+            output[numOutputs++] = evenSample;
+
+            if (numOutputs < numSamples)
+            {
+                output[numOutputs++] = oddSample;
+            }
+            else
+            {
+                state.heldBackSample = oddSample;
+                state.hasHeldBackSample = true;
+            }
+        }
+
+        // make sure that the block was decimated from this many samples
+        jassert (numOutputs == numSamples);
+    }
+
+private:
+    // the recent samples of a branch, newest first, kept twice in a row so the window never wraps around
+    template <size_t length>
+    struct History
+    {
+        std::array<Type, 2 * length> samples {};
+        size_t newest { 0 };
+
+        void push (Type sample) noexcept
+        {
+            newest = newest == 0 ? length - 1 : newest - 1;
+            samples[newest] = sample;
+            samples[newest + length] = sample;
+        }
+
+        Type get (size_t age) const noexcept
+        {
+            return samples[newest + age];
+        }
+
+        // the symmetric coefficients are applied to the sum of the two samples they share
+        Type convolve (const std::array<NumericType, numTapsPerBranch>& branch) const noexcept
+        {
+            auto* window = samples.data() + newest;
+            Type sum {};
+
+            for (size_t tap = 0; tap < numTapsPerBranch; ++tap)
+                sum += (window[tap] + window[length - 1 - tap]) * branch[tap];
+
+            return sum;
+        }
+    };
+
+    struct ChannelState
+    {
+        // the branches of decimate()
+        History<2 * numTapsPerBranch> even;
+        History<numTapsPerBranch> odd;
+        bool isOddSample { false };
+
+        // the samples that interpolate() has been given
+        History<2 * numTapsPerBranch> interpolated;
+        Type heldBackSample {};
+        bool hasHeldBackSample { false };
+    };
+
+    std::array<NumericType, numTapsPerBranch> coefficients;
+    std::array<ChannelState, maxNumChannels> channels;
+
+    // helper function
+    static double besselI0 (double x)
+    {
+        // the power series of the modified Bessel function of the first kind, which converges quickly for a window
+        double sum = 1.0, term = 1.0;
+        for (int k = 1; k < 32; ++k)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+
+        return sum;
+    }
+};
+
+/*  Runs a part of the processing at a half or a quarter of the sample rate, through one or two HalfBandFilters:
+    decimate() returns the block at the reduced rate (to be processed in place) and interpolate() brings it back to
+    the full rate, into the block that was decimated. With a rate divisor of 1 both leave the block as it is.
+    The processors in between must be prepared with getReducedSpec(), which is also what shrinks their delay lines.
+*/
+template <typename Type, size_t maxNumChannels = 2>
+class HalfBandResampler
+{
+public:
+    static constexpr size_t maxNumStages = 2;
+
+    HalfBandResampler()
+    {
+    }
+
+    // divisor is 1, 2 or 4; must only be called while the audio thread is not processing
+    void prepare (const juce::dsp::ProcessSpec& spec, int divisor)
+    {
+        // make sure that the divisor is valid
+        jassert (divisor == 1 || divisor == 2 || divisor == 4);
+        jassert (spec.numChannels <= maxNumChannels);
+
+        numStages = divisor >= 4 ? 2 : (divisor == 2 ? 1 : 0);
+        reducedSpec = spec;
+
+        for (size_t stage = 0; stage < numStages; ++stage)
+        {
+            // a stage gives out at most half of its input, rounded up
+            reducedSpec.sampleRate /= 2.0;
+            reducedSpec.maximumBlockSize = (reducedSpec.maximumBlockSize + 1) / 2;
+
+            stages[stage].reset();
+            for (auto& buffer : buffers[stage])
+                buffer.assign ((size_t) reducedSpec.maximumBlockSize, Type {});
+        }
+    }
+
+    // the spec of the processors that run at the reduced rate
+    const juce::dsp::ProcessSpec& getReducedSpec() const noexcept
+    {
+        return reducedSpec;
+    }
+
+    // the delay of going down and up again, in samples at the full rate: each stage adds its round trip at its own
+    // higher rate (46 and 138 samples in all at a half and a quarter of the rate)
+    size_t getLatency() const noexcept
+    {
+        size_t latency = 0;
+        for (size_t stage = 0; stage < numStages; ++stage)
+            latency += HalfBandFilter<Type, maxNumChannels>::roundTripLatency << stage;
+
+        return latency;
+    }
+
+    juce::dsp::AudioBlock<Type> decimate (const juce::dsp::AudioBlock<Type>& block) noexcept
+    {
+        if (numStages == 0)
+            return block;
+
+        numChannels = juce::jmin (block.getNumChannels(), maxNumChannels);
+        numSamples[0] = block.getNumSamples();
+
+        for (size_t stage = 0; stage < numStages; ++stage)
+        {
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                auto* input = stage == 0 ? block.getChannelPointer (ch) : buffers[stage - 1][ch].data();
+                numSamples[stage + 1] = stages[stage].decimate (ch, input, numSamples[stage], buffers[stage][ch].data());
+            }
+        }
+
+        for (size_t ch = 0; ch < numChannels; ++ch)
+            reducedChannels[ch] = buffers[numStages - 1][ch].data();
+
+        return juce::dsp::AudioBlock<Type> (reducedChannels.data(), numChannels, numSamples[numStages]);
+    }
+
+    // block is the one that was just decimated, and the reduced block has been processed in place since
+    void interpolate (const juce::dsp::AudioBlock<Type>& block) noexcept
+    {
+        if (numStages == 0)
+            return;
+
+        for (size_t stage = numStages; stage-- > 0;)
+        {
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                auto* output = stage == 0 ? block.getChannelPointer (ch) : buffers[stage - 1][ch].data();
+                stages[stage].interpolate (ch, buffers[stage][ch].data(), numSamples[stage + 1], output, numSamples[stage]);
+            }
+        }
+    }
+
+private:
+    size_t numStages { 0 };
+    juce::dsp::ProcessSpec reducedSpec {};
+
+    std::array<HalfBandFilter<Type, maxNumChannels>, maxNumStages> stages;
+    std::array<std::array<std::vector<Type>, maxNumChannels>, maxNumStages> buffers;
+    std::array<Type*, maxNumChannels> reducedChannels {};
+
+    // the shape of the block that was decimated last, at each rate
+    size_t numChannels { 0 };
+    std::array<size_t, maxNumStages + 1> numSamples {};
+
+    JUCE_DECLARE_NON_COPYABLE (HalfBandResampler)
+};
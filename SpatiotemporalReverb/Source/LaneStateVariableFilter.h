@@ -0,0 +1,149 @@
+//
+//  LaneStateVariableFilter.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "SampleLanes.h"
+
+/*  The topology-preserving-transform state variable filter of juce::dsp::StateVariableTPTFilter, templated on the
+    sample type of the reverb classes. JUCE only compiles its filter for float and double, so a chain whose samples are
+    juce::dsp::SIMDRegister<float> lanes (see SourceLaneGroup) runs this one instead; the coefficients are shared by
+    all lanes, while every lane keeps its own state. With a float it computes the same samples as the JUCE filter.
+*/
+template <typename Type>
+class LaneStateVariableFilter
+{
+public:
+    using NumericType = typename SampleLanes<Type>::NumericType;
+
+    LaneStateVariableFilter()
+    {
+        update();
+    }
+
+    void setType (juce::dsp::StateVariableTPTFilterType newType)
+    {
+        filterType = newType;
+    }
+
+    void setCutoffFrequency (NumericType newCutoffFrequency)
+    {
+        // make sure that the cutoff frequency is valid
+        jassert (newCutoffFrequency > NumericType (0) && newCutoffFrequency < NumericType (sampleRate * 0.5));
+
+        cutoffFrequency = newCutoffFrequency;
+        update();
+    }
+
+    void setResonance (NumericType newResonance)
+    {
+        // make sure that the resonance is valid
+        jassert (newResonance > NumericType (0));
+
+        resonance = newResonance;
+        update();
+    }
+
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        // make sure that the spec is valid
+        jassert (spec.sampleRate > 0 && spec.numChannels > 0);
+
+        sampleRate = spec.sampleRate;
+        s1.resize (spec.numChannels);
+        s2.resize (spec.numChannels);
+
+        reset();
+        update();
+    }
+
+    void reset()
+    {
+        std::fill (s1.begin(), s1.end(), Type {});
+        std::fill (s2.begin(), s2.end(), Type {});
+    }
+
+    template <typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        auto inputBlock = context.getInputBlock();
+        auto outputBlock = context.getOutputBlock();
+
+        size_t channels = inputBlock.getNumChannels();
+        size_t samples = inputBlock.getNumSamples();
+
+        // make sure that the block fits the filter
+        jassert (channels <= s1.size() && outputBlock.getNumChannels() == channels);
+
+        if (context.isBypassed)
+        {
+            if (context.usesSeparateInputAndOutputBlocks())
+                outputBlock.copyFrom (inputBlock);
+
+            return;
+        }
+
+        for (size_t ch = 0; ch < channels; ++ch)
+        {
+            auto* input = inputBlock.getChannelPointer (ch);
+            auto* output = outputBlock.getChannelPointer (ch);
+
+            for (size_t sample = 0; sample < samples; ++sample)
+                output[sample] = processSample ((int) ch, input[sample]);
+        }
+
+        snapToZero();
+    }
+
+    Type processSample (int channel, Type inputValue) noexcept
+    {
+        auto& ls1 = s1[(size_t) channel];
+        auto& ls2 = s2[(size_t) channel];
+
+        auto yHP = (inputValue - ls1 * (g + R2) - ls2) * h;
+
+        auto yBP = yHP * g + ls1;
+        ls1      = yHP * g + yBP;
+
+        auto yLP = yBP * g + ls2;
+        ls2      = yBP * g + yLP;
+
+        switch (filterType)
+        {
+            case juce::dsp::StateVariableTPTFilterType::lowpass:  return yLP;
+            case juce::dsp::StateVariableTPTFilterType::bandpass: return yBP;
+            case juce::dsp::StateVariableTPTFilterType::highpass: return yHP;
+            default:                                              return yLP;
+        }
+    }
+
+    // flushes the states that have decayed to denormals, lane by lane
+    void snapToZero() noexcept
+    {
+        for (auto* states : { &s1, &s2 })
+            for (auto& state : *states)
+                for (size_t lane = 0; lane < SampleLanes<Type>::numLanes; ++lane)
+                    if (std::abs (SampleLanes<Type>::get (state, lane)) < NumericType (1.0e-8))
+                        SampleLanes<Type>::set (state, lane, NumericType (0));
+    }
+
+private:
+    juce::dsp::StateVariableTPTFilterType filterType { juce::dsp::StateVariableTPTFilterType::lowpass };
+    NumericType cutoffFrequency { NumericType (1000) };
+    NumericType resonance { NumericType (1.0 / juce::MathConstants<double>::sqrt2) };
+    double sampleRate { 44.1e3 };
+
+    // the coefficients, shared by all lanes, and the two integrator states of every channel
+    NumericType g { 0 }, h { 0 }, R2 { 0 };
+    std::vector<Type> s1, s2;
+
+    // helper function
+    void update()
+    {
+        g = NumericType (std::tan (juce::MathConstants<double>::pi * cutoffFrequency / sampleRate));
+        R2 = NumericType (1.0 / resonance);
+        h = NumericType (1.0 / (1.0 + R2 * g + g * g));
+    }
+};
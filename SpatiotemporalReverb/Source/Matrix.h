@@ -10,6 +10,7 @@
 #pragma once
 #include <JuceHeader.h>
 #include <cmath>
+#include "SampleLanes.h"
 
 /* NOTE: size must be a power of 2 */
 template<typename Type, size_t size>
@@ -40,10 +41,64 @@ public:
         
         // the true Hadamard transform factor would be: 1.0f / std::pow(2, size/2);
         // However, this leaves the signal inaudible so instead we use:
-        Type factor = std::sqrt (1.0f / size);
+        auto factor = (typename SampleLanes<Type>::NumericType) std::sqrt (1.0f / size);
         
         // looping through each row of the input, corresponding to the diffusion-step channels
         for (int i = 0; i < size; ++i)
             input[i] *= factor;
     }
+    
+    // the same as process() on every sample of a block followed by a gain per row (e.g. a polarity inversion), where
+    // channels holds one buffer per row; the butterflies run over whole buffers, so the inner loops are straight runs
+    // over contiguous samples, and the normalisation and the gains are applied within the last of them
+    static void processBlock (Type* const* channels, size_t numSamples, const typename SampleLanes<Type>::NumericType* gains) {
+        auto factor = (typename SampleLanes<Type>::NumericType) std::sqrt (1.0f / size);
+        
+        if (size == 1)
+        {
+            for (size_t sample = 0; sample < numSamples; ++sample)
+                channels[0][sample] = channels[0][sample] * factor * gains[0];
+            
+            return;
+        }
+        
+        for (size_t hSize = 1; hSize < size; hSize *= 2)
+        {
+            bool isLastStage = 2 * hSize == size;
+            
+            for (size_t start = 0; start < size; start += 2 * hSize)
+            {
+                for (size_t i = start; i < start + hSize; ++i)
+                {
+                    Type* first = channels[i];
+                    Type* second = channels[i + hSize];
+                    
+                    if (isLastStage)
+                    {
+                        // a gain of -1 only flips the sign, so the scaled gain gives the same result as applying both
+                        auto firstGain = factor * gains[i];
+                        auto secondGain = factor * gains[i + hSize];
+                        
+                        for (size_t sample = 0; sample < numSamples; ++sample)
+                        {
+                            Type a = first[sample];
+                            Type b = second[sample];
+                            first[sample] = (a + b) * firstGain;
+                            second[sample] = (a - b) * secondGain;
+                        }
+                    }
+                    else
+                    {
+                        for (size_t sample = 0; sample < numSamples; ++sample)
+                        {
+                            Type a = first[sample];
+                            Type b = second[sample];
+                            first[sample] = a + b;
+                            second[sample] = a - b;
+                        }
+                    }
+                }
+            }
+        }
+    }
 };
@@ -69,6 +69,28 @@ SpatiotemporalReverbAudioProcessor::SpatiotemporalReverbAudioProcessor()
                                                                        1.0f,
                                                                        0.0f));
     
+    // add acoustics parameters
+    addParameter(acousticSource = new juce::AudioParameterInt(juce::ParameterID("acousticSource", 1),
+                                                              "Acoustic Source",
+                                                              -1,
+                                                              AcousticQueryService::maxNumSources - 1,
+                                                              -1));
+    addParameter(roomBus = new juce::AudioParameterChoice(juce::ParameterID("roomBus", 1),
+                                                          "Room Bus",
+                                                          juce::StringArray { "Off", "Send", "Return" },
+                                                          roomBusOff));
+    addParameter(diffusionTopology = new juce::AudioParameterChoice(juce::ParameterID("diffusionTopology", 1),
+                                                                    "Diffusion Topology",
+                                                                    juce::StringArray { "Auto", "4x4", "8x8", "16x6", "Velvet", "Velvet Tail" },
+                                                                    0));
+    addParameter(spatialisation = new juce::AudioParameterChoice(juce::ParameterID("spatialisation", 1),
+                                                                 "Spatialisation",
+                                                                 juce::StringArray { "Pan", "Ambisonic 1st Order", "Ambisonic 3rd Order", "Ambisonic Decoder" },
+                                                                 spatialisationPan));
+    addParameter(sourceLanes = new juce::AudioParameterBool(juce::ParameterID("sourceLanes", 1),
+                                                            "Source Lanes",
+                                                            false));
+    
     // set up the high pass for the reverb signal processing
     processorChain.template get<highPassIndex>().setType (juce::dsp::StateVariableTPTFilterType::highpass);
     processorChain.template get<highPassIndex>().setCutoffFrequency (3e2f);
@@ -83,14 +105,27 @@ SpatiotemporalReverbAudioProcessor::SpatiotemporalReverbAudioProcessor()
     delayTimeSmoother = 0.0f;
     feedbackSmoother = 0.0f;
     
+    governorVoice = qualityGovernor->addVoice();
+    profilerInstance = stageProfiler->add (stageProfile);
+    processorChain.template get<diffusionIndex>().setProfile (&stageProfile);
+    captureSession->add (captureWriter, profilerInstance);
+    
     applyAudioPositioning = [&] (float panInfo, float frontBackInfo, float distance, float transmission, float filterCoefLeft, float filterCoefRight)
     {
         jassert(distance != 0.0f);
+        traceRecorder->record (TraceEventType::audioPositioning, profilerInstance, panInfo, frontBackInfo, distance);
+        captureWriter.recordCall (CaptureFormat::RecordType::audioPositioning, { panInfo, frontBackInfo, distance, transmission, filterCoefLeft, filterCoefRight });
         
         // instead of taking the direct value from Unity we apply smoothening to avoid audio artifacts (an S-curve)
         gainSmoother -= 0.02f * (gainSmoother - transmission / distance); // amplitude is inversely proportional to distance
         panSmoother -= 0.04f * (panSmoother - panInfo);
         
+        // the direction of the source for the ambisonic encoder: panInfo maps the angle to the listener's right from
+        // 180 to 0 degrees onto 0 to 1, and frontBackInfo is the angle to the listener's forward in degrees
+        float towardsRight = std::cos (juce::degreesToRadians (180.0f - 180.0f * panInfo));
+        float towardsFront = std::cos (juce::degreesToRadians (frontBackInfo));
+        sourceAzimuth = std::atan2 (-towardsRight, towardsFront);
+        
         // set the value parameter based on the Unity input
         getParameters()[0]->setValue(gainSmoother);
         getParameters()[1]->setValue(panSmoother);
@@ -107,6 +142,8 @@ SpatiotemporalReverbAudioProcessor::SpatiotemporalReverbAudioProcessor()
     setObstructedReflections = [&] (float obstructedReflections)
     {
         jassert (0.0f <= obstructedReflections && obstructedReflections <= 1.0f);
+        traceRecorder->record (TraceEventType::obstructedReflections, profilerInstance, obstructedReflections);
+        captureWriter.recordCall (CaptureFormat::RecordType::obstructedReflections, { obstructedReflections });
         // apply S-curve
         obstructedReflectionsSmoother -= 0.4f * (obstructedReflectionsSmoother - obstructedReflections);
         getParameters()[7]->setValue (obstructedReflections);
@@ -114,11 +151,17 @@ SpatiotemporalReverbAudioProcessor::SpatiotemporalReverbAudioProcessor()
     
     setDiffusionSize = [&] (float diffusionTime)
     {
+        traceRecorder->record (TraceEventType::diffusionSize, profilerInstance, diffusionTime);
+        captureWriter.recordCall (CaptureFormat::RecordType::diffusionSize, { diffusionTime });
+        lastDiffusionTime = diffusionTime;
         processorChain.template get<diffusionIndex>().setDiffusionSteps (diffusionTime);
     };
     
     setDelayTime = [&] (float delayTime)
     {
+        traceRecorder->record (TraceEventType::delayTime, profilerInstance, delayTime);
+        captureWriter.recordCall (CaptureFormat::RecordType::delayTime, { delayTime });
+        
         // apply S-curve
         delayTimeSmoother -= 0.02f * (delayTimeSmoother - delayTime);
         processorChain.template get<delayIndex>().setDelayTimes (delayTimeSmoother);
@@ -126,6 +169,9 @@ SpatiotemporalReverbAudioProcessor::SpatiotemporalReverbAudioProcessor()
     
     setFeedback = [&] (float feedback)
     {
+        traceRecorder->record (TraceEventType::feedback, profilerInstance, feedback);
+        captureWriter.recordCall (CaptureFormat::RecordType::feedback, { feedback });
+        
         // apply S-curve
         feedbackSmoother -= 0.02f * (feedbackSmoother - feedback);
         processorChain.template get<delayIndex>().setFeedback (feedbackSmoother);
@@ -135,6 +181,11 @@ SpatiotemporalReverbAudioProcessor::SpatiotemporalReverbAudioProcessor()
 
 SpatiotemporalReverbAudioProcessor::~SpatiotemporalReverbAudioProcessor()
 {
+    captureSession->remove (captureWriter);
+    roomBuses->stopRendering (this);
+    sourceVoiceManager->removeVoice (sourceVoice);
+    qualityGovernor->removeVoice (governorVoice);
+    stageProfiler->remove (profilerInstance);
 }
 
 //==============================================================================
@@ -203,8 +254,47 @@ void SpatiotemporalReverbAudioProcessor::changeProgramName (int index, const juc
 void SpatiotemporalReverbAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
     auto spec = juce::dsp::ProcessSpec { sampleRate, (juce::uint32) samplesPerBlock, 2 };
-    processorChain.prepare (spec);
+    
+    // offline (in a replay) the diffusion and the delay lines are switched and grown within the block that asks for
+    // it, and the diffusion is seeded, so that the same input renders to the same output
+    auto& diffusion = processorChain.template get<diffusionIndex>();
+    diffusion.setSeed (diffusionSeed);
+    diffusion.setSynchronous (isNonRealtime());
+    processorChain.template get<delayIndex>().setSynchronousGrowth (isNonRealtime());
+    
+    // the diffusion and the delay run at the reduced rate of the reverb, the filters around them at the full rate
+    reverbResampler.prepare (spec, reverbRateDivisor);
+    processorChain.template get<highPassIndex>().prepare (spec);
+    processorChain.template get<diffusionIndex>().prepare (reverbResampler.getReducedSpec());
+    processorChain.template get<delayIndex>().prepare (reverbResampler.getReducedSpec());
+    processorChain.template get<filterIndex>().prepare (spec);
     filter.prepare(spec);
+    directSignal.setSize (2, samplesPerBlock);
+    propagationDelay.prepare (spec);
+    
+    // lay out the delay lines of the delay in one contiguous block
+    delayLineArena.reset();
+    processorChain.template get<delayIndex>().addDelayLinesTo (delayLineArena);
+    delayLineArena.allocate();
+    
+    // the room buses are shared by all instances, they are only prepared again when the spec outgrows them
+    roomBusBuffer.assign ((size_t) samplesPerBlock, 0.0f);
+    roomBuses->prepare ({ sampleRate, (juce::uint32) samplesPerBlock, 1 });
+    
+    // the lane of this source is taken again, since the group it was in may not run at the new sample rate
+    sourceLaneInput.assign ((size_t) samplesPerBlock, 0.0f);
+    sourceLaneOutput.assign ((size_t) samplesPerBlock, 0.0f);
+    sourceVoiceManager->removeVoice (sourceVoice);
+    sourceVoice = sourceVoiceManager->addVoice ({ sampleRate, (juce::uint32) samplesPerBlock, 1 });
+    
+    // the same goes for the ambisonic bus; the decoder follows the output layout of this instance
+    ambisonicBuffer.assign ((size_t) samplesPerBlock, 0.0f);
+    ambisonicGains.fill (0.0f);
+    ambisonicDecoder.setNumOutputs ((size_t) getTotalNumOutputChannels());
+    if (! ambisonicBus->isActive())
+        ambisonicBus->prepare ({ sampleRate, (juce::uint32) samplesPerBlock, (juce::uint32) Ambisonics::maxNumChannels });
+    
+    captureWriter.prepare (sampleRate, (size_t) samplesPerBlock, (size_t) getTotalNumInputChannels(), diffusionSeed, reverbRateDivisor);
 }
 
 void SpatiotemporalReverbAudioProcessor::releaseResources()
@@ -221,11 +311,15 @@ bool SpatiotemporalReverbAudioProcessor::isBusesLayoutSupported (const BusesLayo
     return true;
   #else
     // This is the place where you check if the layout is supported.
-    // In this template code we only support mono or stereo.
+    // We support mono or stereo, plus the speaker layouts that the ambisonic decoder knows.
     // Some plugin hosts, such as certain GarageBand versions, will only
     // load plugins that support stereo bus layouts.
-    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono()
-     && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+    auto outputSet = layouts.getMainOutputChannelSet();
+    if (outputSet != juce::AudioChannelSet::mono()
+     && outputSet != juce::AudioChannelSet::stereo()
+     && outputSet != juce::AudioChannelSet::quadraphonic()
+     && outputSet != juce::AudioChannelSet::create5point1()
+     && outputSet != juce::AudioChannelSet::create7point1())
         return false;
 
     // This checks if the input layout matches the output layout
@@ -244,51 +338,262 @@ void SpatiotemporalReverbAudioProcessor::processBlock (juce::AudioBuffer<float>&
     juce::ignoreUnused (midiMessages);
     
     juce::ScopedNoDenormals noDenormals;
+    QualityGovernor::ScopedMeasurement measurement (*qualityGovernor, governorVoice);
+    stageProfile.applyReset();
+    stageProfile.setAcousticSource (acousticSource->get());
+    ScopedBlockTimer blockTimer (*stageProfiler, stageProfile, (size_t) buffer.getNumSamples(), getSampleRate());
+    TraceRecorder::ScopedBlock traceBlock (*traceRecorder, profilerInstance, (size_t) buffer.getNumSamples(), getSampleRate());
+    captureWriter.beginBlock();
     auto totalNumInputChannels  = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
 
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
     
-    // setup the audio block(s) for processing
-    juce::AudioBuffer<float> bufferCopy (2, buffer.getNumSamples());
-    for (int ch = 0; ch < totalNumInputChannels; ++ch)
-        bufferCopy.copyFrom (ch, 0, buffer, ch, 0, buffer.getNumSamples());
+    // we pick up the latest analysis of our source, without ever waiting for the workers
+    if (ReverbEstimate estimate; acousticQueryService->readResult (acousticSource->get(), estimate, lastAcousticResult))
+    {
+        auto speedOfSound = acousticQueryService->getSpeedOfSound();
+        setObstructedReflections (juce::jlimit (0.0f, 1.0f, estimate.obstructedReflections));
+        setDiffusionSize (estimate.longestDistance * 4.0f / speedOfSound);
+        setDelayTime (estimate.averageDistance / speedOfSound);
+        setPropagationDelayTime (estimate.directDistance / speedOfSound);
+        setFeedback (juce::jlimit (0.0f, 0.99f, 1.0f - estimate.averageAbsorption));
+        sourceRoom = estimate.sourceRoom;
+    }
+    
+    // the governor decides how much this instance may cost; the louder it is, the longer it keeps its quality
+    qualityGovernor->setPriority (governorVoice, gain->get(), acousticSource->get());
+    auto qualityLevel = qualityOverride >= 0 ? qualityOverride.load() : qualityGovernor->getLevel (governorVoice);
+    auto& quality = QualityGovernor::getQualityOfLevel (qualityLevel);
+    processorChain.template get<diffusionIndex>().setMaxDiffusionSteps (quality.maxDiffusionSteps);
+    processorChain.template get<filterIndex>().setSimplified (quality.simplifiedFilters);
+    filter.setSimplified (quality.simplifiedFilters);
+    
+    // small rooms get a cheap diffusion and large halls a dense one; the switch is prepared off the audio thread
+    auto& diffusion = processorChain.template get<diffusionIndex>();
+    if (diffusionTopology->getIndex() == 0)
+        diffusion.requestTopology (SwitchableDiffusion<float>::chooseTopology (lastDiffusionTime, diffusion.getTopology()));
+    else
+        diffusion.requestTopology ((DiffusionTopology) (diffusionTopology->getIndex() - 1));
+    
+    auto numSamples = (size_t) buffer.getNumSamples();
+    
+    // the capture holds everything the block depends on, before the block changes it
+    captureWriter.recordQuality (qualityLevel);
+    captureWriter.recordBlock (getParameters(), buffer, totalNumInputChannels, numSamples);
+    
+    // the returning instance only plays the room buses, its own input is ignored
+    if (roomBus->getIndex() == roomBusReturn && numSamples <= roomBusBuffer.size())
+    {
+        roomBuses->render (this, roomBusBuffer.data(), numSamples);
+        CpuDispatch::run ([&]
+        {
+            for (int ch = 0; ch < totalNumOutputChannels; ++ch)
+                DspKernels::saturate (buffer.getWritePointer (ch), roomBusBuffer.data(), reverbLevel->get(), 1.0f, numSamples);
+        });
+        
+        return;
+    }
+    
+    // the decoding instance only plays the ambisonic bus, its own input is ignored
+    if (spatialisation->getIndex() == spatialisationDecoder)
+    {
+        std::array<const float*, Ambisonics::maxNumChannels> ambisonicChannels;
+        if (ambisonicDecoder.getNumOutputs() == (size_t) totalNumOutputChannels && ambisonicBus->receive (ambisonicChannels, numSamples))
+            CpuDispatch::run ([&] { ambisonicDecoder.decode (ambisonicChannels.data(), buffer.getArrayOfWritePointers(), numSamples); });
+        else
+            buffer.clear();
+        
+        return;
+    }
+    
+    // the reverb is stereo, so the further channels of a speaker layout are only played by the decoder
+    for (int ch = 2; ch < buffer.getNumChannels(); ++ch)
+        buffer.clear (ch, 0, buffer.getNumSamples());
+    
+    totalNumInputChannels = juce::jmin (totalNumInputChannels, 2);
+    
+    // a source in a room with a bus sends its (mono) signal there instead of running its own reverb; at a low quality
+    // the governor does the same for a source whose bus isn't set, as long as another instance plays the buses (and
+    // this one runs in realtime, since an offline replay has nobody to play them)
+    bool sendsToRoomBus = roomBus->getIndex() == roomBusSend
+                       || (roomBus->getIndex() == roomBusOff && quality.shareReverb && roomBuses->isRendered() && ! isNonRealtime());
+    
+    bool sentToRoomBus = false;
+    if (sendsToRoomBus && totalNumInputChannels > 0 && numSamples <= roomBusBuffer.size())
+    {
+        for (size_t sample = 0; sample < numSamples; ++sample)
+        {
+            float sum = 0.0f;
+            for (int ch = 0; ch < totalNumInputChannels; ++ch)
+                sum += buffer.getSample (ch, (int) sample);
+            
+            roomBusBuffer[sample] = sum / (float) totalNumInputChannels;
+        }
+        
+        sentToRoomBus = roomBuses->send (sourceRoom, roomBusBuffer.data(), numSamples, 1.0f);
+    }
+    
+    // otherwise a source with lanes hands its (mono) signal to its lane and gets the reverb of its last block back;
+    // an offline replay runs its own reverb, since the groups are shared with the instances that play in realtime
+    bool renderedInLane = false;
+    if (! sentToRoomBus && sourceLanes->get() && ! isNonRealtime() && totalNumInputChannels > 0 && numSamples <= sourceLaneInput.size())
+    {
+        std::fill (sourceLaneInput.begin(), sourceLaneInput.begin() + (std::ptrdiff_t) numSamples, 0.0f);
+        for (int ch = 0; ch < totalNumInputChannels; ++ch)
+            DspKernels::multiplyAdd (sourceLaneInput.data(), buffer.getReadPointer (ch), 1.0f / (float) totalNumInputChannels, numSamples);
+        
+        renderedInLane = sourceVoiceManager->process (sourceVoice, sourceLaneInput.data(), sourceLaneOutput.data(), numSamples,
+                                                      delayTimeSmoother, feedbackSmoother, lastDiffusionTime);
+    }
+    
+    // setup the audio block(s) for processing; the copy of the direct signal only allocates when the block is larger
+    // than the one announced in prepareToPlay, which the trace then records
+    if (numSamples > (size_t) directSignal.getNumSamples())
+    {
+        directSignal.setSize (2, (int) numSamples);
+        traceRecorder->record (TraceEventType::allocation, profilerInstance, (float) (2 * numSamples * sizeof (float)));
+    }
+    
+    for (int ch = 0; ch < 2; ++ch)
+    {
+        if (ch < totalNumInputChannels)
+            directSignal.copyFrom (ch, 0, buffer, ch, 0, buffer.getNumSamples());
+        else
+            directSignal.clear (ch, 0, buffer.getNumSamples());
+    }
 
-    juce::dsp::AudioBlock<float> block (buffer);
-    juce::dsp::AudioBlock<float> filterOnlyBlock (bufferCopy);
+    juce::dsp::AudioBlock<float> block (buffer.getArrayOfWritePointers(), (size_t) juce::jmin (buffer.getNumChannels(), 2), numSamples);
+    auto filterOnlyBlock = juce::dsp::AudioBlock<float> (directSignal).getSubBlock (0, numSamples);
     
     
     /* SIGNAL 1: Dry Signal -> Highpass Filter -> Diffuser -> Delay -> Filter -> Output */
     // we process the dry signal through diffusion and delay
     juce::dsp::ProcessContextReplacing<float> context (block);
     processorChain.template get<filterIndex>().setWetDryBalance(obstructedReflections->get());
-    processorChain.process (context);
+    if (sentToRoomBus)
+    {
+        block.clear();
+    }
+    else if (renderedInLane)
+    {
+        for (size_t ch = 0; ch < block.getNumChannels(); ++ch)
+            std::copy (sourceLaneOutput.begin(), sourceLaneOutput.begin() + (std::ptrdiff_t) numSamples, block.getChannelPointer (ch));
+        
+        // the filter of the lanes is the same for all sources, so the reverb still goes through the filter of this
+        // instance, which follows its obstruction
+        ScopedStageTimer timer (&stageProfile, ProcessingStage::reverbFilter);
+        CpuDispatch::run ([&] { processorChain.template get<filterIndex>().process (context); });
+    }
+    else
+    {
+        // the stages are run one by one (as the chain would run them) so that each of them can be timed
+        auto processStage = [&] (auto& processor, ProcessingStage stage, const juce::dsp::ProcessContextReplacing<float>& stageContext)
+        {
+            ScopedStageTimer timer (&stageProfile, stage);
+            processor.process (stageContext);
+        };
+        
+        CpuDispatch::run ([&]
+        {
+            processStage (processorChain.template get<highPassIndex>(), ProcessingStage::highPass, context);
+            
+            // the diffusion and the delay run at the reduced rate of the reverb (which is the full rate by default)
+            juce::dsp::AudioBlock<float> reducedBlock;
+            {
+                ScopedStageTimer timer (&stageProfile, ProcessingStage::decimation);
+                reducedBlock = reverbResampler.decimate (block);
+            }
+            
+            juce::dsp::ProcessContextReplacing<float> reducedContext (reducedBlock);
+            processStage (processorChain.template get<diffusionIndex>(), ProcessingStage::diffusion, reducedContext);
+            processStage (processorChain.template get<delayIndex>(), ProcessingStage::delay, reducedContext);
+            
+            {
+                ScopedStageTimer timer (&stageProfile, ProcessingStage::interpolation);
+                reverbResampler.interpolate (block);
+            }
+            
+            processStage (processorChain.template get<filterIndex>(), ProcessingStage::reverbFilter, context);
+        });
+        
+        // the changes of the diffusion go into the trace, next to the blocks they happen in
+        if (auto steps = (int) diffusion.getActiveDiffusionSteps(); steps != diffusionStepsActive)
+        {
+            diffusionStepsActive = steps;
+            traceRecorder->record (TraceEventType::diffusionSteps, profilerInstance, (float) steps);
+        }
+        
+        if (auto topology = (int) diffusion.getTopology(); topology != diffusionTopologyActive)
+        {
+            diffusionTopologyActive = topology;
+            traceRecorder->record (TraceEventType::diffusionTopology, profilerInstance, (float) topology);
+        }
+    }
     
     
-    /* SIGNAL 2: Dry Signal -> Filter -> Output */
-    // we process the direct signal through the filter
+    /* SIGNAL 2: Dry Signal -> Propagation Delay -> Filter -> Output */
+    // we delay the direct signal by its travel time (when there is an acoustic source to measure it) and filter it
     juce::dsp::ProcessContextReplacing<float> filterOnlyContext (filterOnlyBlock);
-    filter.process (filterOnlyContext);
+    CpuDispatch::run ([&]
+    {
+        {
+            ScopedStageTimer timer (&stageProfile, ProcessingStage::propagationDelay);
+            propagationDelay.process (filterOnlyContext);
+        }
+        
+        ScopedStageTimer timer (&stageProfile, ProcessingStage::directFilter);
+        filter.process (filterOnlyContext);
+    });
     
     
-    for (int ch = 0; ch < totalNumInputChannels; ++ch)
+    // an encoding instance leaves the direction to the ambisonic bus, as long as the bus is decoded
+    int ambisonicOrder = spatialisation->getIndex() == spatialisationFirstOrder ? 1
+                       : spatialisation->getIndex() == spatialisationThirdOrder ? 3 : 0;
+    bool encodesAmbisonics = ambisonicOrder > 0 && ambisonicBus->isReceived() && totalNumInputChannels > 0
+                          && numSamples <= ambisonicBuffer.size();
+    
+    // the mix includes the encoding and the send to the ambisonic bus
+    ScopedStageTimer mixTimer (&stageProfile, ProcessingStage::mix);
+    CpuDispatch::run ([&]
     {
-        // calculate the channel-wise pan value
-        float panValue = ch == 0 ?  juce::jmap(pan->get(), -1.0f, 1.0f, -1.0f, 0.0f) * (-1) :
-                                    juce::jmap(pan->get(), -1.0f, 1.0f, 0.0f, 1.0f);
-        
-        for (int sample = 0; sample < context.getOutputBlock().getNumSamples(); ++sample)
+        for (int ch = 0; ch < totalNumInputChannels; ++ch)
         {
-            auto reverbSample = context.getOutputBlock().getSample (ch, sample);
-            auto filterSample = filterOnlyContext.getOutputBlock().getSample (ch, sample);
+            // calculate the channel-wise pan value
+            float panValue = encodesAmbisonics ? 1.0f :
+                             ch == 0 ?  juce::jmap(pan->get(), -1.0f, 1.0f, -1.0f, 0.0f) * (-1) :
+                                        juce::jmap(pan->get(), -1.0f, 1.0f, 0.0f, 1.0f);
             
             // TODO: apply different pan values to the two signals - perhaps just a lesser value to the reverb sample
             
-            // apply panning and gain control to the processed sample
-            auto outputSample = std::tanh (reverbLevel->get() * reverbSample + directLevel->get() * filterSample) * panValue * gain->get();
-            context.getOutputBlock().setSample(ch, sample, outputSample);
+            // apply panning and gain control to the processed samples, a block at a time
+            auto* reverbSamples = context.getOutputBlock().getChannelPointer ((size_t) ch);
+            auto* filterSamples = filterOnlyContext.getOutputBlock().getChannelPointer ((size_t) ch);
+            DspKernels::saturateMix (reverbSamples, reverbSamples, reverbLevel->get(), filterSamples, directLevel->get(),
+                                     panValue * gain->get(), context.getOutputBlock().getNumSamples());
         }
+    });
+    
+    if (! encodesAmbisonics)
+    {
+        // the next encoded block fades in from silence
+        ambisonicGains.fill (0.0f);
+        return;
+    }
+    
+    // the (mono) mix is encoded at the direction of the source and takes the place of our own output
+    std::fill (ambisonicBuffer.begin(), ambisonicBuffer.begin() + (std::ptrdiff_t) numSamples, 0.0f);
+    for (int ch = 0; ch < totalNumInputChannels; ++ch)
+        DspKernels::multiplyAdd (ambisonicBuffer.data(), buffer.getReadPointer (ch), 1.0f / (float) totalNumInputChannels, numSamples);
+    
+    std::array<float, Ambisonics::maxNumChannels> newGains;
+    Ambisonics::encode (sourceAzimuth.load(), 0.0f, ambisonicOrder, newGains.data());
+    
+    if (ambisonicBus->send (ambisonicBuffer.data(), numSamples, ambisonicGains.data(), newGains.data(), ambisonicOrder))
+    {
+        ambisonicGains = newGains;
+        buffer.clear();
     }
 }
 
@@ -333,6 +638,33 @@ void SpatiotemporalReverbAudioProcessor::setFilterValues(float panInfo, float fr
     processorChain.template get<filterIndex>().setOcclusionFilter(occlusionFilterCoef);
 }
 
+void SpatiotemporalReverbAudioProcessor::setPropagationDelayTime (float delayTime)
+{
+    captureWriter.recordCall (CaptureFormat::RecordType::propagationDelay, { delayTime });
+    propagationDelay.setDelayTime (delayTime);
+}
+
+void SpatiotemporalReverbAudioProcessor::setDiffusionSeed (juce::int64 seed)
+{
+    diffusionSeed = seed;
+}
+
+void SpatiotemporalReverbAudioProcessor::setQualityOverride (int level)
+{
+    // make sure that the level is valid
+    jassert (level < QualityGovernor::numLevels);
+    
+    qualityOverride = level;
+}
+
+void SpatiotemporalReverbAudioProcessor::setReverbRateDivisor (int divisor)
+{
+    // make sure that the divisor is valid
+    jassert (divisor == 1 || divisor == 2 || divisor == 4);
+    
+    reverbRateDivisor = divisor;
+}
+
 //==============================================================================
 // This creates new instances of the plugin..
 juce::AudioProcessor* JUCE_CALLTYPE createPluginFilter()
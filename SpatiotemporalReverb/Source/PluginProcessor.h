@@ -15,7 +15,40 @@
 
 // custom reverb functionality
 #include "Diffusion.h"
+#include "SwitchableDiffusion.h"
 #include "Delay.h"
+#include "DelayLineArena.h"
+#include "DelayLineStorage.h"
+#include "HalfBandResampler.h"
+#include "PropagationDelay.h"
+
+// asynchronous acoustic analysis
+#include "AcousticQueryService.h"
+#include "AcousticRoomBuses.h"
+#include "SourceVoiceManager.h"
+
+// spatialisation through one shared ambisonic mix
+#include "AmbisonicBus.h"
+
+// keeping the CPU load within budget
+#include "QualityGovernor.h"
+#include "StageProfiler.h"
+#include "TraceRecorder.h"
+
+// recording what reaches an instance, so that it can be rendered again offline
+#include "CaptureLog.h"
+
+// the sample format of the reverb's delay lines; HalfFloatStorage or ScaledInt16Storage halve the delay memory
+// (and the cache traffic) of every instance at the cost of a raised noise floor in the reverb tail
+using ReverbDelayStorage = FullPrecisionStorage<float>;
+
+// the rate of the reverb's diffusion and delay as a fraction of the sample rate, unless an instance is given another one:
+// 1, 2 or 4; at a half (or a quarter) they take about that share of the CPU and of the delay memory, while the reverb
+// is flat up to about 0.2 (or 0.1) of the sample rate, i.e. 10 kHz (or 4.5 kHz) at 48 kHz, and comes 46 (or 138)
+// samples later than the direct sound (HalfBandResampler::getLatency()). That latency isn't compensated: it is a
+// fraction of the delay that the reflections take anyway (the average distance over the speed of sound), and
+// compensating it would mean holding back the direct sound, which is what the listener hears first
+constexpr int defaultReverbRateDivisor = 1;
 
 //==============================================================================
 /**
@@ -65,6 +98,19 @@ public:
     
     //==============================================================================
     void setFilterValues(float panInfo, float frontBackInfo, float distance, float occlusionFilterCoef);
+    
+    // the travel time of the direct sound (in seconds), which the acoustic analysis usually sets
+    void setPropagationDelayTime (float delayTime);
+    
+    // the seed of the random delays of the diffusion; a replay sets the one of its capture before prepareToPlay()
+    void setDiffusionSeed (juce::int64 seed);
+    
+    // pins the quality to a level of the QualityGovernor (-1 leaves it to the governor), as a replay does
+    void setQualityOverride (int level);
+    
+    // the rate of the reverb's diffusion and delay as a fraction of the sample rate (1, 2 or 4, see
+    // defaultReverbRateDivisor); like the seed of the diffusion it takes effect at the next prepareToPlay()
+    void setReverbRateDivisor (int divisor);
 
 private:
     // localization parameters
@@ -83,6 +129,49 @@ private:
     // filter parameters
     juce::AudioParameterFloat* obstructedReflections;
     
+    // the slot of the acoustic query service whose results drive the reverb (-1 leaves it to Unity)
+    juce::AudioParameterInt* acousticSource;
+    juce::SharedResourcePointer<AcousticQueryService> acousticQueryService;
+    juce::uint32 lastAcousticResult { 0 };
+    
+    // the shared reverb of the room that the source is in; an instance either sends its source to the bus of its
+    // room (instead of running its own reverb) or renders the buses of all rooms for the listener
+    enum RoomBusMode
+    {
+        roomBusOff,
+        roomBusSend,
+        roomBusReturn
+    };
+    
+    juce::AudioParameterChoice* roomBus;
+    juce::SharedResourcePointer<AcousticRoomBuses> roomBuses;
+    std::vector<float> roomBusBuffer;
+    int sourceRoom { -1 };
+    
+    // the reverb of this source rendered in a lane of a group that it shares with the sources of other instances
+    // (one block later), rather than by the chain of this instance
+    juce::AudioParameterBool* sourceLanes;
+    juce::SharedResourcePointer<SourceVoiceManager> sourceVoiceManager;
+    std::vector<float> sourceLaneInput, sourceLaneOutput;
+    int sourceVoice { -1 };
+    
+    // lowers the quality of this instance when all of them together take too much CPU
+    juce::SharedResourcePointer<QualityGovernor> qualityGovernor;
+    int governorVoice { -1 };
+    
+    // the timings of the stages of processBlock(), which the C API snapshots; the id of the instance also names its
+    // track in the trace of the blocks and the setter calls
+    juce::SharedResourcePointer<StageProfiler> stageProfiler;
+    StageProfile stageProfile;
+    int profilerInstance { -1 };
+    juce::SharedResourcePointer<TraceRecorder> traceRecorder;
+    
+    // the capture of what reaches this instance, which the session of all instances writes to disk
+    juce::SharedResourcePointer<CaptureSession> captureSession;
+    CaptureWriter captureWriter;
+    juce::int64 diffusionSeed { juce::Random().nextInt64() };
+    std::atomic<int> qualityOverride { -1 };
+    
     // S-curve parameters
     float gainSmoother;
     float panSmoother;
@@ -94,6 +183,28 @@ private:
     
     // indicator of the amount of diffusion currently active
     int diffusionStepsActive { 0 };
+    int diffusionTopologyActive { -1 };
+    
+    // the configuration of the diffusion; "Auto" picks it from the size of the room
+    juce::AudioParameterChoice* diffusionTopology;
+    std::atomic<float> lastDiffusionTime { 0.24f };
+    
+    // an instance either pans its source itself, encodes it into the shared ambisonic bus (as long as another
+    // instance decodes the bus) or decodes the bus for its output, ignoring its own input
+    enum SpatialisationMode
+    {
+        spatialisationPan,
+        spatialisationFirstOrder,
+        spatialisationThirdOrder,
+        spatialisationDecoder
+    };
+    
+    juce::AudioParameterChoice* spatialisation;
+    juce::SharedResourcePointer<AmbisonicBus> ambisonicBus;
+    AmbisonicDecoder ambisonicDecoder;
+    std::vector<float> ambisonicBuffer;
+    std::array<float, Ambisonics::maxNumChannels> ambisonicGains {}; // of the last block, the start of the next ramp
+    std::atomic<float> sourceAzimuth { 0.0f };                         // in radians, counterclockwise from the front
     
     // processor chain
     enum
@@ -104,9 +215,24 @@ private:
         filterIndex
     };
         
-    juce::dsp::ProcessorChain<juce::dsp::StateVariableTPTFilter<float>, Diffusion<float, 8, 8>, Delay<float>, Filter<float, 2>> processorChain;
+    juce::dsp::ProcessorChain<juce::dsp::StateVariableTPTFilter<float>, SwitchableDiffusion<float, ReverbDelayStorage>, Delay<float, 2, ReverbDelayStorage>, Filter<float, 2>> processorChain;
     Filter<float, 2> filter;
     
+    // the copy of the direct signal that only runs through the filter; it is sized in prepareToPlay and only grows
+    // (on the audio thread) when the host passes a larger block than it announced
+    juce::AudioBuffer<float> directSignal;
+    
+    // brings the diffusion and the delay to their reduced rate and back (see defaultReverbRateDivisor)
+    HalfBandResampler<float, 2> reverbResampler;
+    int reverbRateDivisor { defaultReverbRateDivisor };
+    
+    // the time the direct sound takes to reach the listener, which gives moving sources their Doppler shift
+    PropagationDelay<2> propagationDelay;
+    
+    // a single allocation holding the memory of the delay lines of the delay (each diffusion configuration has its own,
+    // since it is built off the audio thread)
+    DelayLineArena delayLineArena;
+    
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SpatiotemporalReverbAudioProcessor)
 };
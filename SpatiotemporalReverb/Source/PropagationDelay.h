@@ -0,0 +1,133 @@
+//
+//  PropagationDelay.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+/*  Delays the direct sound by the time it takes to travel from the source to the listener. The delay follows the
+    distance smoothly, so a moving source is pitched up or down by the Doppler effect rather than clicking.
+    - the target delay (distance / speed of sound) is set from any thread, typically at the game's frame rate
+    - once per block the delay moves towards it with a one-pole smoother, and at most maxDelayRate samples per sample,
+      which caps the Doppler shift when a source teleports
+    - within the block the delay is ramped linearly and read with a 4-point cubic (Catmull-Rom) interpolation
+    The buffer has a power-of-two size, so wrapping is a mask, and the input of a block is written in one go before
+    it is read, which keeps the cost at a handful of operations per sample and channel.
+*/
+template <size_t maxNumChannels = 2>
+class PropagationDelay
+{
+public:
+    void prepare (const juce::dsp::ProcessSpec& spec, float maxDelayTimeToUse = 1.0f)
+    {
+        // make sure that the spec and the max delay time are valid
+        jassert (spec.numChannels <= maxNumChannels && maxDelayTimeToUse > 0.0f);
+
+        sampleRate = (float) spec.sampleRate;
+        maxDelaySamples = juce::jmax (minDelaySamples, maxDelayTimeToUse * sampleRate);
+
+        // room for the longest delay, the block that is written ahead of the reads and the interpolation
+        auto bufferSize = juce::nextPowerOfTwo ((int) std::ceil (maxDelaySamples) + (int) spec.maximumBlockSize + 4);
+        buffer.setSize ((int) maxNumChannels, bufferSize);
+        mask = (size_t) bufferSize - 1;
+
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        buffer.clear();
+        writePosition = 0;
+        isSettled = false; // the next target is taken at once instead of being slid to
+    }
+
+    // called from any thread
+    void setDelayTime (float newDelayTime) noexcept
+    {
+        // make sure that the delay time is valid
+        jassert (newDelayTime >= 0.0f);
+        targetDelayTime = newDelayTime;
+    }
+
+    float getCurrentDelayTime() const noexcept
+    {
+        return currentDelaySamples / sampleRate;
+    }
+
+    template <typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        auto inputBlock = context.getInputBlock();
+        auto outputBlock = context.getOutputBlock();
+
+        size_t channels = juce::jmin (inputBlock.getNumChannels(), maxNumChannels);
+        size_t samples = inputBlock.getNumSamples();
+
+        if (buffer.getNumSamples() == 0 || samples == 0 || samples + 4 + (size_t) maxDelaySamples > mask + 1)
+            return;
+
+        // the delay of the end of the block, moved towards the target
+        float targetDelaySamples = juce::jlimit (minDelaySamples, maxDelaySamples, targetDelayTime.load() * sampleRate);
+        float startDelaySamples = isSettled ? currentDelaySamples : targetDelaySamples;
+
+        float smoothing = 1.0f - std::exp (-(float) samples / (smoothingTime * sampleRate));
+        float maxChange = maxDelayRate * (float) samples;
+        float endDelaySamples = startDelaySamples + juce::jlimit (-maxChange, maxChange, smoothing * (targetDelaySamples - startDelaySamples));
+
+        float delayIncrement = (endDelaySamples - startDelaySamples) / (float) samples;
+        currentDelaySamples = endDelaySamples;
+        isSettled = true;
+
+        for (size_t ch = 0; ch < channels; ++ch)
+        {
+            auto* input = inputBlock.getChannelPointer (ch);
+            auto* output = outputBlock.getChannelPointer (ch);
+            auto* delayed = buffer.getWritePointer ((int) ch);
+
+            // the whole block is written before it is read; the minimum delay keeps every read behind the writes
+            for (size_t sample = 0; sample < samples; ++sample)
+                delayed[(writePosition + sample) & mask] = input[sample];
+
+            for (size_t sample = 0; sample < samples; ++sample)
+            {
+                // the read position relative to the start of the block, so that the fraction keeps its precision
+                float readOffset = (float) sample - (startDelaySamples + delayIncrement * (float) sample);
+                float wholeOffset = std::floor (readOffset);
+                float fraction = readOffset - wholeOffset;
+
+                // the offset is negative, so we add the size of the buffer before wrapping with the mask
+                auto index = writePosition + mask + 1 + (size_t) (juce::int64) wholeOffset;
+
+                float previous = delayed[(index - 1) & mask];
+                float current = delayed[index & mask];
+                float next = delayed[(index + 1) & mask];
+                float afterNext = delayed[(index + 2) & mask];
+
+                // Catmull-Rom
+                float c1 = 0.5f * (next - previous);
+                float c2 = previous - 2.5f * current + 2.0f * next - 0.5f * afterNext;
+                float c3 = 0.5f * (afterNext - previous) + 1.5f * (current - next);
+                output[sample] = ((c3 * fraction + c2) * fraction + c1) * fraction + current;
+            }
+        }
+
+        writePosition = (writePosition + samples) & mask;
+    }
+
+private:
+    static constexpr float minDelaySamples = 2.0f; // the interpolation reads two samples ahead of the read position
+    static constexpr float maxDelayRate = 0.5f;    // in samples per sample, i.e. sources up to half the speed of sound
+    static constexpr float smoothingTime = 0.05f;  // in seconds, long enough to hide the steps of the frame rate
+
+    juce::AudioBuffer<float> buffer;
+    size_t mask { 0 };
+    size_t writePosition { 0 };
+
+    float sampleRate { 44.1e3f };
+    float maxDelaySamples { minDelaySamples };
+    float currentDelaySamples { minDelaySamples };
+    bool isSettled { false };
+
+    std::atomic<float> targetDelayTime { 0.0f };
+};
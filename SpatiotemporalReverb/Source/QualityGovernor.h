@@ -0,0 +1,279 @@
+//
+//  QualityGovernor.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+/*  Keeps the cost of the reverb within a CPU budget by lowering the quality of the least important sources when the
+    budget is overrun, and raising it again once there is room.
+    - every plugin instance (a voice) measures its processBlock() and reports its priority (its gain)
+    - once per game frame, update() compares the share of real time spent in processBlock() and the tracing time of the
+      acoustic analysis with their budgets
+    - over budget, the voice with the lowest priority drops a level; well under budget for a while, the voice with the
+      highest priority regains one. A voice that has just changed is left alone for a while, so the levels don't flap
+    A level sets the diffusion steps, whether the reverb is shared through the room bus, the share of the ray budget
+    and whether the filters are simplified. The voices read their level lock-free on the audio thread.
+*/
+class QualityGovernor
+{
+public:
+    static constexpr int maxNumVoices = 256;
+
+    struct Quality
+    {
+        size_t maxDiffusionSteps;
+        bool shareReverb;      // send to the bus of the room (when the buses are rendered) instead of running an own reverb
+        float rayBudgetScale;
+        bool simplifiedFilters;
+    };
+
+    static constexpr int numLevels = 4;
+
+    struct Budget
+    {
+        float processingLoad { 0.25f };   // the share of real time that all the processBlock() calls together may take
+        float tracingMilliseconds { 2.0f }; // the tracing time of the acoustic analysis per frame
+    };
+
+    // what the governor saw and did in its last update
+    struct Telemetry
+    {
+        float processingLoad { 0.0f };
+        float tracingMilliseconds { 0.0f };
+        float pressure { 0.0f }; // the larger of the two measurements relative to their budgets
+        int numVoices { 0 };
+        int numDegradedVoices { 0 };
+        int lastChangedVoice { -1 };
+        int lastChange { 0 };    // +1 if a voice was raised, -1 if one was lowered
+    };
+
+    // measures the scope (e.g. a processBlock() call) and adds its time to the voice
+    class ScopedMeasurement
+    {
+    public:
+        ScopedMeasurement (QualityGovernor& ownerToUse, int voiceToUse) noexcept
+            : owner (ownerToUse), voice (voiceToUse), start (juce::Time::getHighResolutionTicks())
+        {
+        }
+
+        ~ScopedMeasurement()
+        {
+            if (juce::isPositiveAndBelow (voice, maxNumVoices))
+                owner.voices[(size_t) voice].processingTicks += juce::Time::getHighResolutionTicks() - start;
+        }
+
+    private:
+        QualityGovernor& owner;
+        int voice;
+        juce::int64 start;
+
+        JUCE_DECLARE_NON_COPYABLE (ScopedMeasurement)
+    };
+
+    QualityGovernor()
+    {
+        lastUpdateTicks = juce::Time::getHighResolutionTicks();
+    }
+
+    static const Quality& getQualityOfLevel (int level) noexcept
+    {
+        static const std::array<Quality, numLevels> levels { {
+            { 8, false, 1.0f, false },
+            { 6, false, 0.5f, false },
+            { 4, false, 0.25f, true },
+            { 2, true, 0.125f, true }
+        } };
+
+        jassert (juce::isPositiveAndBelow (level, numLevels));
+        return levels[(size_t) level];
+    }
+
+    // returns the new voice, or -1 if there are too many
+    int addVoice() noexcept
+    {
+        for (int voice = 0; voice < maxNumVoices; ++voice)
+        {
+            bool isActive = false;
+            auto& state = voices[(size_t) voice];
+            if (state.isActive.compare_exchange_strong (isActive, true))
+            {
+                state.level = 0;
+                state.processingTicks = 0;
+                state.acousticSource = -1;
+                state.priority = 1.0f;
+                return voice;
+            }
+        }
+
+        return -1;
+    }
+
+    void removeVoice (int voice) noexcept
+    {
+        if (juce::isPositiveAndBelow (voice, maxNumVoices))
+            voices[(size_t) voice].isActive = false;
+    }
+
+    // called by the voice from the audio thread; a louder voice keeps its quality longer
+    void setPriority (int voice, float priority, int acousticSource) noexcept
+    {
+        if (! juce::isPositiveAndBelow (voice, maxNumVoices))
+            return;
+
+        voices[(size_t) voice].priority.store (priority, std::memory_order_relaxed);
+        voices[(size_t) voice].acousticSource.store (acousticSource, std::memory_order_relaxed);
+    }
+
+    const Quality& getQuality (int voice) const noexcept
+    {
+        return getQualityOfLevel (juce::isPositiveAndBelow (voice, maxNumVoices) ? voices[(size_t) voice].level.load() : 0);
+    }
+
+    int getLevel (int voice) const noexcept
+    {
+        return juce::isPositiveAndBelow (voice, maxNumVoices) ? voices[(size_t) voice].level.load() : 0;
+    }
+
+    // the share of its ray budget that a slot of the acoustic query service may use
+    float getRayBudgetScale (int acousticSource) const noexcept
+    {
+        if (acousticSource < 0)
+            return 1.0f;
+
+        // a slot can drive several voices, of which the best one decides
+        int level = numLevels;
+        for (auto& state : voices)
+            if (state.isActive && state.acousticSource.load (std::memory_order_relaxed) == acousticSource)
+                level = juce::jmin (level, state.level.load());
+
+        return level < numLevels ? getQualityOfLevel (level).rayBudgetScale : 1.0f;
+    }
+
+    void setBudget (const Budget& newBudget) noexcept
+    {
+        // make sure that the budget is valid
+        jassert (newBudget.processingLoad > 0.0f && newBudget.tracingMilliseconds > 0.0f);
+
+        const juce::SpinLock::ScopedLockType lock (updateLock);
+        budget = newBudget;
+    }
+
+    // called once per game frame with the tracing time of the last frame
+    void update (float tracingMilliseconds)
+    {
+        const juce::SpinLock::ScopedLockType lock (updateLock);
+
+        auto now = juce::Time::getHighResolutionTicks();
+        auto elapsedTicks = now - lastUpdateTicks;
+        if (elapsedTicks <= 0)
+            return;
+
+        lastUpdateTicks = now;
+        double elapsedSeconds = juce::Time::highResolutionTicksToSeconds (elapsedTicks);
+
+        juce::int64 processingTicks = 0;
+        int numVoices = 0, numDegradedVoices = 0;
+        for (auto& state : voices)
+        {
+            processingTicks += state.processingTicks.exchange (0);
+            if (state.isActive)
+            {
+                ++numVoices;
+                numDegradedVoices += state.level > 0 ? 1 : 0;
+            }
+        }
+
+        // the measurements are smoothed, so that a single slow block doesn't cost any quality
+        float load = (float) ((double) processingTicks / (double) elapsedTicks);
+        telemetry.processingLoad += smoothing * (load - telemetry.processingLoad);
+        telemetry.tracingMilliseconds += smoothing * (tracingMilliseconds - telemetry.tracingMilliseconds);
+        telemetry.pressure = juce::jmax (telemetry.processingLoad / budget.processingLoad,
+                                         telemetry.tracingMilliseconds / budget.tracingMilliseconds);
+        telemetry.numVoices = numVoices;
+        telemetry.numDegradedVoices = numDegradedVoices;
+        telemetry.lastChange = 0;
+
+        secondsSinceChange += elapsedSeconds;
+        secondsUnderBudget = telemetry.pressure < raiseThreshold ? secondsUnderBudget + elapsedSeconds : 0.0;
+
+        if (telemetry.pressure > lowerThreshold && secondsSinceChange >= lowerInterval)
+            changeLevel (+1, -1);
+        else if (secondsUnderBudget >= raiseHoldTime && secondsSinceChange >= raiseHoldTime)
+            changeLevel (-1, +1);
+    }
+
+    Telemetry getTelemetry() const
+    {
+        const juce::SpinLock::ScopedLockType lock (updateLock);
+        return telemetry;
+    }
+
+private:
+    // the hysteresis: a voice is lowered above the budget, but only raised again well under it
+    static constexpr float lowerThreshold = 1.0f;
+    static constexpr float raiseThreshold = 0.7f;
+    static constexpr double lowerInterval = 0.1;  // in seconds, between two voices being lowered
+    static constexpr double raiseHoldTime = 1.0;  // in seconds under budget before a voice is raised
+    static constexpr double minDwellTime = 0.5;   // in seconds, before the same voice is changed again
+    static constexpr float smoothing = 0.3f;
+
+    struct VoiceState
+    {
+        std::atomic<bool> isActive { false };
+        std::atomic<int> level { 0 };
+        std::atomic<juce::int64> processingTicks { 0 };
+        std::atomic<float> priority { 1.0f };
+        std::atomic<int> acousticSource { -1 };
+        juce::int64 lastChangeTicks { 0 }; // guarded by updateLock
+    };
+
+    std::array<VoiceState, maxNumVoices> voices;
+
+    juce::SpinLock updateLock;
+    Budget budget;
+    Telemetry telemetry;
+    juce::int64 lastUpdateTicks { 0 };
+    double secondsSinceChange { 0.0 };
+    double secondsUnderBudget { 0.0 };
+
+    // helper functions
+    // lowers (direction +1) the voice with the lowest priority or raises (direction -1) the one with the highest
+    void changeLevel (int direction, int priorityOrder)
+    {
+        auto now = juce::Time::getHighResolutionTicks();
+        auto minDwellTicks = juce::Time::secondsToHighResolutionTicks (minDwellTime);
+
+        int chosen = -1;
+        float chosenPriority = 0.0f;
+
+        for (int voice = 0; voice < maxNumVoices; ++voice)
+        {
+            auto& state = voices[(size_t) voice];
+            int newLevel = state.level + direction;
+            if (! state.isActive || ! juce::isPositiveAndBelow (newLevel, numLevels) || now - state.lastChangeTicks < minDwellTicks)
+                continue;
+
+            float priority = state.priority.load (std::memory_order_relaxed) * (float) priorityOrder;
+            if (chosen < 0 || priority > chosenPriority)
+            {
+                chosen = voice;
+                chosenPriority = priority;
+            }
+        }
+
+        if (chosen < 0)
+            return;
+
+        auto& state = voices[(size_t) chosen];
+        state.level += direction;
+        state.lastChangeTicks = now;
+        secondsSinceChange = 0.0;
+        secondsUnderBudget = 0.0;
+        telemetry.lastChangedVoice = chosen;
+        telemetry.lastChange = -direction;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (QualityGovernor)
+};
@@ -0,0 +1,71 @@
+//
+//  SampleLanes.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include <cmath>
+
+/*  The reverb classes are templated on their sample type. With a plain float each sample is one source,
+    while with a juce::dsp::SIMDRegister<float> each lane of the register is a separate source that shares
+    the same topology. The few operations that differ between the two are collected here.
+*/
+template <typename Type>
+struct SampleLanes
+{
+    using NumericType = Type;
+    static constexpr size_t numLanes = 1;
+
+    static Type expand (NumericType value) noexcept
+    {
+        return value;
+    }
+
+    static NumericType get (const Type& value, size_t) noexcept
+    {
+        return value;
+    }
+
+    static void set (Type& value, size_t, NumericType laneValue) noexcept
+    {
+        value = laneValue;
+    }
+
+    static Type tanh (Type value) noexcept
+    {
+        return std::tanh (value);
+    }
+};
+
+template <typename ElementType>
+struct SampleLanes<juce::dsp::SIMDRegister<ElementType>>
+{
+    using Type = juce::dsp::SIMDRegister<ElementType>;
+    using NumericType = ElementType;
+    static constexpr size_t numLanes = Type::SIMDNumElements;
+
+    static Type expand (NumericType value) noexcept
+    {
+        return Type::expand (value);
+    }
+
+    static NumericType get (const Type& value, size_t lane) noexcept
+    {
+        return value.get (lane);
+    }
+
+    static void set (Type& value, size_t lane, NumericType laneValue) noexcept
+    {
+        value.set (lane, laneValue);
+    }
+
+    static Type tanh (Type value) noexcept
+    {
+        // there is no vectorised tanh in the SIMD register, so we saturate each lane on its own
+        for (size_t lane = 0; lane < numLanes; ++lane)
+            value.set (lane, std::tanh (value.get (lane)));
+
+        return value;
+    }
+};
@@ -0,0 +1,141 @@
+//
+//  SourceLaneGroup.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "Diffusion.h"
+#include "Delay.h"
+#include "Filter.h"
+#include "LaneStateVariableFilter.h"
+#include "DelayLineArena.h"
+#include "SampleLanes.h"
+
+/*  Renders several mono sources through one reverb chain by giving each source its own lane of a
+    juce::dsp::SIMDRegister<float>. The chain mirrors the reverb path of the plugin
+    (highpass -> diffusion -> delay -> filter), so the per-sample work is done once for all lanes; its filters are
+    LaneStateVariableFilters, since JUCE only compiles its own for float and double.
+    All lanes share the topology of the chain (diffusion delays, diffusion steps and filter cutoffs),
+    while delay time and feedback are set per lane.
+*/
+class SourceLaneGroup
+{
+public:
+    using LaneType = juce::dsp::SIMDRegister<float>;
+    static constexpr size_t numLanes = SampleLanes<LaneType>::numLanes;
+
+    SourceLaneGroup()
+    {
+        // set up the high pass for the reverb signal processing
+        processorChain.template get<highPassIndex>().setType (juce::dsp::StateVariableTPTFilterType::highpass);
+        processorChain.template get<highPassIndex>().setCutoffFrequency (3e2f);
+
+        laneDiffusionTimes.fill (0.0f);
+    }
+
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        // every lane carries a mono source, so the chain itself only sees one channel
+        auto laneSpec = juce::dsp::ProcessSpec { spec.sampleRate, spec.maximumBlockSize, 1 };
+        processorChain.prepare (laneSpec);
+
+        // lay out the delay lines of the diffusion and the delay in one contiguous block
+        delayLineArena.reset();
+        processorChain.template get<diffusionIndex>().addDelayLinesTo (delayLineArena);
+        processorChain.template get<delayIndex>().addDelayLinesTo (delayLineArena);
+        delayLineArena.allocate();
+
+        // the interleaved block holds one SIMD register per sample
+        interleavedBlock = juce::dsp::AudioBlock<LaneType> (interleavedData, 1, spec.maximumBlockSize);
+    }
+
+    // inputs and outputs point to one mono buffer per lane, where a nullptr marks an unused lane
+    void process (const float* const* laneInputs, float* const* laneOutputs, size_t numSamples)
+    {
+        // make sure that the block fits in the interleaved buffer
+        jassert (numSamples <= interleavedBlock.getNumSamples());
+
+        auto* frames = interleavedBlock.getChannelPointer (0);
+
+        // interleave the sources into the lanes
+        for (size_t sample = 0; sample < numSamples; ++sample)
+        {
+            LaneType frame {};
+            for (size_t lane = 0; lane < numLanes; ++lane)
+                SampleLanes<LaneType>::set (frame, lane, laneInputs[lane] != nullptr ? laneInputs[lane][sample] : 0.0f);
+
+            frames[sample] = frame;
+        }
+
+        auto block = interleavedBlock.getSubBlock (0, numSamples);
+        juce::dsp::ProcessContextReplacing<LaneType> context (block);
+        processorChain.process (context);
+
+        // and split them up again
+        for (size_t lane = 0; lane < numLanes; ++lane)
+        {
+            if (laneOutputs[lane] == nullptr)
+                continue;
+
+            for (size_t sample = 0; sample < numSamples; ++sample)
+                laneOutputs[lane][sample] = SampleLanes<LaneType>::get (frames[sample], lane);
+        }
+    }
+
+    void setDelayTime (size_t lane, float delayTime)
+    {
+        processorChain.template get<delayIndex>().setLaneDelayTime (lane, delayTime);
+    }
+
+    void setFeedback (size_t lane, float feedback)
+    {
+        processorChain.template get<delayIndex>().setLaneFeedback (lane, feedback);
+    }
+
+    void setDiffusionSize (size_t lane, float diffusionTime)
+    {
+        setLaneDiffusionTime (lane, diffusionTime);
+        updateDiffusion();
+    }
+
+    // sets the diffusion time of a lane without moving the shared diffusion steps towards it (see updateDiffusion())
+    void setLaneDiffusionTime (size_t lane, float diffusionTime)
+    {
+        laneDiffusionTimes[lane] = diffusionTime;
+    }
+
+    // the diffusion steps are shared by all lanes, so the group follows the lane that needs the most diffusion; every
+    // call moves the steps one step of their smoothing towards it
+    void updateDiffusion()
+    {
+        processorChain.template get<diffusionIndex>().setDiffusionSteps (*std::max_element (laneDiffusionTimes.begin(), laneDiffusionTimes.end()));
+    }
+
+    void resetLane (size_t lane)
+    {
+        // a freed lane is silenced so that it doesn't hold back the diffusion of the remaining lanes
+        setDelayTime (lane, 0.0f);
+        setFeedback (lane, 0.0f);
+        laneDiffusionTimes[lane] = 0.0f;
+    }
+
+private:
+    // processor chain
+    enum
+    {
+        highPassIndex,
+        diffusionIndex,
+        delayIndex,
+        filterIndex
+    };
+
+    juce::dsp::ProcessorChain<LaneStateVariableFilter<LaneType>, Diffusion<LaneType, 8, 8>, Delay<LaneType, 1>, Filter<LaneType, 1>> processorChain;
+    DelayLineArena delayLineArena;
+
+    // interleaved audio data
+    juce::HeapBlock<char> interleavedData;
+    juce::dsp::AudioBlock<LaneType> interleavedBlock;
+
+    std::array<float, numLanes> laneDiffusionTimes;
+};
@@ -0,0 +1,222 @@
+//
+//  SourceVoiceManager.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "CpuDispatch.h"
+#include "SourceLaneGroup.h"
+
+/*  Groups the plugin instances of the process into SourceLaneGroups, so that the reverbs of several sources are
+    rendered in the lanes of a SIMD register instead of one after the other.
+    - an instance takes a voice (a lane of a group) when it is prepared; the voices are packed densely into the groups
+      and a group is only prepared once its first voice comes, since that allocates
+    - every block, each instance hands its (mono) input and its reverb parameters to process() and gets the output
+      of its lane back; the group renders once all of its voices have handed in their block, so every lane comes one
+      block later than its input (whichever instance Unity happens to run first)
+    - a voice whose instance stops processing doesn't hold up the others: when a voice hands in a second block before
+      the group has rendered, the group renders without the missing ones
+    process() must be called from the audio thread (Unity renders all of its mixer effects on one thread); it never
+    waits for a lock, and returns false when the voice can't be rendered, in which case the instance runs its own
+    reverb. The diffusion steps and the filter cutoffs of a group are shared by its lanes (see SourceLaneGroup).
+*/
+class SourceVoiceManager
+{
+public:
+    static constexpr size_t maxNumGroups = 16;
+    static constexpr int maxNumVoices = (int) (maxNumGroups * SourceLaneGroup::numLanes);
+
+    SourceVoiceManager()
+    {
+    }
+
+    // takes a free lane in a group of the same sample rate and returns its voice, or -1 if all of them are taken;
+    // called off the audio thread (e.g. from prepareToPlay), since a group that is laid out for the first time (or
+    // for longer blocks) allocates
+    int addVoice (const juce::dsp::ProcessSpec& spec)
+    {
+        const juce::ScopedLock lock (voiceLock);
+
+        for (size_t groupIndex = 0; groupIndex < maxNumGroups; ++groupIndex)
+        {
+            auto& group = groups[groupIndex];
+            if (group.numVoices > 0 && group.sampleRate != spec.sampleRate)
+                continue;
+
+            for (size_t lane = 0; lane < SourceLaneGroup::numLanes; ++lane)
+            {
+                if (group.isUsed[lane])
+                    continue;
+
+                // the audio thread skips the group while it is laid out (it never waits for the lock)
+                const juce::SpinLock::ScopedLockType processLock (group.processLock);
+                if (! group.isPrepared || group.sampleRate != spec.sampleRate || group.maximumBlockSize < spec.maximumBlockSize)
+                    prepareGroup (group, spec);
+
+                group.lanes.resetLane (lane);
+                group.parameters[lane] = {};
+                group.isUsed[lane] = true;
+                group.hasSent[lane] = false;
+                std::fill (group.outputs[lane].begin(), group.outputs[lane].end(), 0.0f);
+                ++group.numVoices;
+
+                return (int) (groupIndex * SourceLaneGroup::numLanes + lane);
+            }
+        }
+
+        return -1;
+    }
+
+    // frees the lane of a voice for the next instance; called off the audio thread, when the instance goes away or is
+    // prepared again
+    void removeVoice (int voice)
+    {
+        if (! juce::isPositiveAndBelow (voice, maxNumVoices))
+            return;
+
+        const juce::ScopedLock lock (voiceLock);
+        auto& group = groups[(size_t) voice / SourceLaneGroup::numLanes];
+        auto lane = (size_t) voice % SourceLaneGroup::numLanes;
+
+        const juce::SpinLock::ScopedLockType processLock (group.processLock);
+        if (! group.isUsed[lane])
+            return;
+
+        group.lanes.resetLane (lane);
+        group.isUsed[lane] = false;
+        group.hasSent[lane] = false;
+        --group.numVoices;
+    }
+
+    // hands in a block of the voice's source and writes the reverb of its lane to output (mono), one block later;
+    // returns false (and leaves output as it is) if the voice couldn't be rendered
+    bool process (int voice, const float* input, float* output, size_t numSamples,
+                  float delayTime, float feedback, float diffusionTime) noexcept
+    {
+        if (! juce::isPositiveAndBelow (voice, maxNumVoices))
+            return false;
+
+        auto& group = groups[(size_t) voice / SourceLaneGroup::numLanes];
+        auto lane = (size_t) voice % SourceLaneGroup::numLanes;
+
+        const juce::SpinLock::ScopedTryLockType lock (group.processLock);
+        if (! lock.isLocked() || ! group.isPrepared || ! group.isUsed[lane] || numSamples > group.maximumBlockSize)
+            return false;
+
+        // the block of this voice is due again before the others have all handed theirs in (or the blocks don't have
+        // the same size), so the group renders what it has
+        if (group.hasSent[lane] || (group.numPendingSamples > 0 && group.numPendingSamples != numSamples))
+            renderGroup (group);
+
+        // the lane's reverb of the last rendered block
+        auto numRenderedSamples = juce::jmin (numSamples, group.numRenderedSamples);
+        std::copy (group.outputs[lane].begin(), group.outputs[lane].begin() + (std::ptrdiff_t) numRenderedSamples, output);
+        std::fill (output + numRenderedSamples, output + numSamples, 0.0f);
+
+        group.parameters[lane] = { delayTime, feedback, diffusionTime };
+        std::copy (input, input + numSamples, group.inputs[lane].begin());
+        group.hasSent[lane] = true;
+        group.numPendingSamples = numSamples;
+
+        bool hasEveryVoiceSent = true;
+        for (size_t other = 0; other < SourceLaneGroup::numLanes; ++other)
+            hasEveryVoiceSent = hasEveryVoiceSent && (group.hasSent[other] || ! group.isUsed[other]);
+
+        if (hasEveryVoiceSent)
+            renderGroup (group);
+
+        return true;
+    }
+
+    // the amount of groups that hold at least one voice
+    size_t getNumGroups() const
+    {
+        const juce::ScopedLock lock (voiceLock);
+        return (size_t) std::count_if (groups.begin(), groups.end(), [] (const Group& group) { return group.numVoices > 0; });
+    }
+
+private:
+    struct LaneParameters
+    {
+        float delayTime { 0.0f };
+        float feedback { 0.0f };
+        float diffusionTime { 0.0f };
+    };
+
+    struct Group
+    {
+        SourceLaneGroup lanes;
+        juce::SpinLock processLock;
+        bool isPrepared { false };
+        double sampleRate { 0.0 };
+        juce::uint32 maximumBlockSize { 0 };
+
+        // which lanes belong to a voice, and which of them have handed in the pending block
+        std::array<bool, SourceLaneGroup::numLanes> isUsed {};
+        std::array<bool, SourceLaneGroup::numLanes> hasSent {};
+        size_t numVoices { 0 };
+        size_t numPendingSamples { 0 };
+        size_t numRenderedSamples { 0 };
+
+        std::array<std::vector<float>, SourceLaneGroup::numLanes> inputs, outputs;
+
+        // the parameters that came with the last block of each voice
+        std::array<LaneParameters, SourceLaneGroup::numLanes> parameters;
+    };
+
+    std::array<Group, maxNumGroups> groups;
+    juce::CriticalSection voiceLock;
+
+    // helper functions
+    static void prepareGroup (Group& group, const juce::dsp::ProcessSpec& spec)
+    {
+        // the voices that are already playing keep their block size
+        group.sampleRate = spec.sampleRate;
+        group.maximumBlockSize = juce::jmax (group.maximumBlockSize, spec.maximumBlockSize);
+        group.lanes.prepare ({ group.sampleRate, group.maximumBlockSize, 1 });
+
+        for (size_t lane = 0; lane < SourceLaneGroup::numLanes; ++lane)
+        {
+            group.inputs[lane].assign (group.maximumBlockSize, 0.0f);
+            group.outputs[lane].assign (group.maximumBlockSize, 0.0f);
+            group.hasSent[lane] = false;
+        }
+
+        group.numPendingSamples = 0;
+        group.numRenderedSamples = 0;
+        group.isPrepared = true;
+    }
+
+    static void renderGroup (Group& group) noexcept
+    {
+        std::array<const float*, SourceLaneGroup::numLanes> inputs {};
+        std::array<float*, SourceLaneGroup::numLanes> outputs {};
+
+        for (size_t lane = 0; lane < SourceLaneGroup::numLanes; ++lane)
+        {
+            if (! group.isUsed[lane])
+                continue;
+
+            group.lanes.setDelayTime (lane, group.parameters[lane].delayTime);
+            group.lanes.setFeedback (lane, group.parameters[lane].feedback);
+            group.lanes.setLaneDiffusionTime (lane, group.parameters[lane].diffusionTime);
+
+            // a voice that missed the block keeps running on silence
+            inputs[lane] = group.hasSent[lane] ? group.inputs[lane].data() : nullptr;
+            outputs[lane] = group.outputs[lane].data();
+        }
+
+        // the shared diffusion steps take one step of their smoothing per block, like those of an instance
+        group.lanes.updateDiffusion();
+
+        auto numSamples = group.numPendingSamples;
+        CpuDispatch::run ([&] { group.lanes.process (inputs.data(), outputs.data(), numSamples); });
+
+        group.hasSent.fill (false);
+        group.numRenderedSamples = numSamples;
+        group.numPendingSamples = 0;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (SourceVoiceManager)
+};
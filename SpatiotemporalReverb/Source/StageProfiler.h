@@ -0,0 +1,442 @@
+//
+//  StageProfiler.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+#if JUCE_MSVC && JUCE_INTEL
+ #include <intrin.h>
+#endif
+
+// 0 compiles the timers out entirely; the C API then reports that profiling isn't available
+#ifndef SPATIOTEMPORAL_REVERB_PROFILING
+ #define SPATIOTEMPORAL_REVERB_PROFILING 1
+#endif
+
+// the stages of processBlock() that are timed
+enum class ProcessingStage
+{
+    block,            // the whole processBlock()
+    highPass,
+    diffusion,        // the whole diffusion chain
+    diffusionStep1,   // up to diffusionStep1 + maxNumDiffusionSteps - 1, for the steps that are active
+    delay = diffusionStep1 + 8,
+    reverbFilter,
+    propagationDelay,
+    directFilter,
+    mix,
+    decimation,       // of the reverb to its reduced rate, when it runs at one
+    interpolation,
+    numStages
+};
+
+// the time stamp counter of the CPU (or the closest equivalent), read in a few cycles
+struct CycleCounter
+{
+    static juce::uint64 now() noexcept
+    {
+       #if JUCE_INTEL && (JUCE_GCC || JUCE_CLANG)
+        return __builtin_ia32_rdtsc();
+       #elif JUCE_INTEL && JUCE_MSVC
+        return __rdtsc();
+       #elif JUCE_ARM && JUCE_64BIT && (JUCE_GCC || JUCE_CLANG)
+        juce::uint64 ticks;
+        asm volatile ("mrs %0, cntvct_el0" : "=r" (ticks));
+        return ticks;
+       #else
+        return (juce::uint64) juce::Time::getHighResolutionTicks();
+       #endif
+    }
+};
+
+/*  The timings of the stages of one plugin instance, written by its audio thread and read by any thread.
+    Every stage has a log-scaled histogram (four buckets per octave of cycles) from which the percentiles are taken,
+    next to the exact count, sum, min and max. There is a single writer, so the counters are plain relaxed atomics:
+    a reader may see a block half-recorded, never a torn value.
+*/
+class StageProfile
+{
+public:
+    static constexpr size_t maxNumDiffusionSteps = 8;
+    static constexpr size_t numStages = (size_t) ProcessingStage::numStages;
+
+    struct Statistics
+    {
+        juce::uint64 count { 0 };
+        double minMicroseconds { 0.0 }, meanMicroseconds { 0.0 }, p99Microseconds { 0.0 }, maxMicroseconds { 0.0 };
+    };
+
+    StageProfile() = default;
+
+    static ProcessingStage getDiffusionStep (size_t step) noexcept
+    {
+        jassert (step < maxNumDiffusionSteps);
+        return (ProcessingStage) ((size_t) ProcessingStage::diffusionStep1 + step);
+    }
+
+    static juce::String getStageName (ProcessingStage stage)
+    {
+        auto index = (size_t) stage;
+        if (index >= (size_t) ProcessingStage::diffusionStep1 && index < (size_t) ProcessingStage::delay)
+            return "diffusion step " + juce::String (index - (size_t) ProcessingStage::diffusionStep1 + 1);
+
+        switch (stage)
+        {
+            case ProcessingStage::block:            return "block";
+            case ProcessingStage::highPass:         return "high pass";
+            case ProcessingStage::diffusion:        return "diffusion";
+            case ProcessingStage::delay:            return "delay";
+            case ProcessingStage::reverbFilter:     return "reverb filter";
+            case ProcessingStage::propagationDelay: return "propagation delay";
+            case ProcessingStage::directFilter:     return "direct filter";
+            case ProcessingStage::mix:              return "mix";
+            case ProcessingStage::decimation:       return "decimation";
+            case ProcessingStage::interpolation:    return "interpolation";
+            default:                                return {};
+        }
+    }
+
+    // called from the audio thread
+    void record (ProcessingStage stage, juce::uint64 cycles) noexcept
+    {
+        auto& histogram = histograms[(size_t) stage];
+        auto count = histogram.count.load (std::memory_order_relaxed);
+
+        if (count == 0 || cycles < histogram.minCycles.load (std::memory_order_relaxed))
+            histogram.minCycles.store (cycles, std::memory_order_relaxed);
+
+        if (cycles > histogram.maxCycles.load (std::memory_order_relaxed))
+            histogram.maxCycles.store (cycles, std::memory_order_relaxed);
+
+        auto& bucket = histogram.buckets[getBucket (cycles)];
+        bucket.store (bucket.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        histogram.totalCycles.store (histogram.totalCycles.load (std::memory_order_relaxed) + cycles, std::memory_order_relaxed);
+        histogram.count.store (count + 1, std::memory_order_relaxed);
+    }
+
+    // called from the audio thread at the end of a block that had deadlineCycles to run in
+    void recordBlock (juce::uint64 cycles, juce::uint64 deadlineCycles) noexcept
+    {
+        record (ProcessingStage::block, cycles);
+        if (cycles > deadlineCycles)
+            deadlineMisses.store (deadlineMisses.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    Statistics getStatistics (ProcessingStage stage, double cyclesPerMicrosecond) const noexcept
+    {
+        auto& histogram = histograms[(size_t) stage];
+        Statistics statistics;
+        statistics.count = histogram.count.load (std::memory_order_relaxed);
+        if (statistics.count == 0)
+            return statistics;
+
+        statistics.minMicroseconds = (double) histogram.minCycles.load (std::memory_order_relaxed) / cyclesPerMicrosecond;
+        statistics.maxMicroseconds = (double) histogram.maxCycles.load (std::memory_order_relaxed) / cyclesPerMicrosecond;
+        statistics.meanMicroseconds = (double) histogram.totalCycles.load (std::memory_order_relaxed) / (double) statistics.count / cyclesPerMicrosecond;
+
+        // the p99 is the upper edge of the bucket that it falls into, capped by the max
+        juce::uint64 seen = 0, rank = (statistics.count * 99 + 99) / 100;
+        for (size_t bucket = 0; bucket < numBuckets; ++bucket)
+        {
+            seen += histogram.buckets[bucket].load (std::memory_order_relaxed);
+            if (seen >= rank)
+            {
+                statistics.p99Microseconds = juce::jmin (statistics.maxMicroseconds, (double) getBucketUpperEdge (bucket) / cyclesPerMicrosecond);
+                break;
+            }
+        }
+
+        return statistics;
+    }
+
+    juce::uint64 getDeadlineMisses() const noexcept
+    {
+        return deadlineMisses.load (std::memory_order_relaxed);
+    }
+
+    // the acoustic source of the instance, so that the caller can tell the instances apart
+    void setAcousticSource (int newAcousticSource) noexcept
+    {
+        acousticSource.store (newAcousticSource, std::memory_order_relaxed);
+    }
+
+    int getAcousticSource() const noexcept
+    {
+        return acousticSource.load (std::memory_order_relaxed);
+    }
+
+    // asks the audio thread to start over at its next block
+    void requestReset() noexcept
+    {
+        shouldReset = true;
+    }
+
+    // called from the audio thread at the start of a block
+    void applyReset() noexcept
+    {
+        if (! shouldReset.exchange (false))
+            return;
+
+        for (auto& histogram : histograms)
+        {
+            histogram.count = 0;
+            histogram.totalCycles = 0;
+            histogram.minCycles = 0;
+            histogram.maxCycles = 0;
+            for (auto& bucket : histogram.buckets)
+                bucket = 0;
+        }
+
+        deadlineMisses = 0;
+    }
+
+private:
+    // four buckets per octave from 2^6 cycles, the lowest and highest also taking everything below and above
+    static constexpr int firstOctave = 6;
+    static constexpr int numOctaves = 26;
+    static constexpr size_t numBuckets = (size_t) numOctaves * 4;
+
+    struct Histogram
+    {
+        std::atomic<juce::uint64> count { 0 };
+        std::atomic<juce::uint64> totalCycles { 0 };
+        std::atomic<juce::uint64> minCycles { 0 };
+        std::atomic<juce::uint64> maxCycles { 0 };
+        std::array<std::atomic<juce::uint32>, numBuckets> buckets {};
+    };
+
+    std::array<Histogram, numStages> histograms;
+    std::atomic<juce::uint64> deadlineMisses { 0 };
+    std::atomic<int> acousticSource { -1 };
+    std::atomic<bool> shouldReset { false };
+
+    // helper functions
+    static size_t getBucket (juce::uint64 cycles) noexcept
+    {
+        if (cycles < ((juce::uint64) 1 << firstOctave))
+            return 0;
+
+        auto high = (juce::uint32) (cycles >> 32);
+        int octave = high != 0 ? 32 + juce::findHighestSetBit (high) : juce::findHighestSetBit ((juce::uint32) cycles);
+        auto quarter = (size_t) ((cycles >> (octave - 2)) & 3);
+        return juce::jmin (numBuckets - 1, (size_t) (octave - firstOctave) * 4 + quarter);
+    }
+
+    static juce::uint64 getBucketUpperEdge (size_t bucket) noexcept
+    {
+        auto octave = (int) (bucket / 4) + firstOctave;
+        auto quarter = (juce::uint64) (bucket % 4);
+        return ((juce::uint64) 1 << octave) + (quarter + 1) * ((juce::uint64) 1 << (octave - 2));
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (StageProfile)
+};
+
+/*  The registry of the StageProfiles of all plugin instances in the process, which the C API snapshots.
+    Profiling is switched on and off for all instances at once; while it's off a timer costs one relaxed load.
+*/
+class StageProfiler
+{
+public:
+    static constexpr int maxNumInstances = 256;
+
+    StageProfiler()
+    {
+        calibrate();
+    }
+
+    static bool isEnabled() noexcept
+    {
+       #if SPATIOTEMPORAL_REVERB_PROFILING
+        return getEnabledState().load (std::memory_order_relaxed);
+       #else
+        return false;
+       #endif
+    }
+
+    static void setEnabled (bool shouldBeEnabled) noexcept
+    {
+        getEnabledState() = shouldBeEnabled;
+    }
+
+    // returns the id of the instance, or -1 if there are too many
+    int add (StageProfile& profile)
+    {
+        const juce::SpinLock::ScopedLockType lock (instanceLock);
+        for (int instance = 0; instance < maxNumInstances; ++instance)
+        {
+            if (instances[(size_t) instance] == nullptr)
+            {
+                instances[(size_t) instance] = &profile;
+                return instance;
+            }
+        }
+
+        return -1;
+    }
+
+    void remove (int instance)
+    {
+        const juce::SpinLock::ScopedLockType lock (instanceLock);
+        if (juce::isPositiveAndBelow (instance, maxNumInstances))
+            instances[(size_t) instance] = nullptr;
+    }
+
+    // calls function (instance, profile) for every registered instance, while none of them can go away
+    template <typename Function>
+    void forEachInstance (Function&& function) const
+    {
+        const juce::SpinLock::ScopedLockType lock (instanceLock);
+        for (int instance = 0; instance < maxNumInstances; ++instance)
+            if (auto* profile = instances[(size_t) instance])
+                function (instance, *profile);
+    }
+
+    double getCyclesPerMicrosecond() const noexcept
+    {
+        return cyclesPerSecond * 1e-6;
+    }
+
+    // the cycles of a block of numSamples at sampleRate, i.e. the time the block has to be done in
+    juce::uint64 getDeadlineCycles (size_t numSamples, double sampleRate) const noexcept
+    {
+        return (juce::uint64) ((double) numSamples / sampleRate * cyclesPerSecond);
+    }
+
+private:
+    std::array<StageProfile*, maxNumInstances> instances {};
+    juce::SpinLock instanceLock;
+    double cyclesPerSecond { 1e9 };
+
+    // helper functions
+    static std::atomic<bool>& getEnabledState() noexcept
+    {
+        static std::atomic<bool> enabled { false };
+        return enabled;
+    }
+
+    void calibrate()
+    {
+        // the counter runs at a fixed rate (invariant TSC, or the generic timer on ARM), which we measure once
+        // against the high resolution clock over a millisecond
+        auto startTicks = juce::Time::getHighResolutionTicks();
+        auto startCycles = CycleCounter::now();
+        auto minTicks = juce::Time::secondsToHighResolutionTicks (1e-3);
+
+        juce::int64 elapsedTicks;
+        do
+        {
+            elapsedTicks = juce::Time::getHighResolutionTicks() - startTicks;
+        }
+        while (elapsedTicks < minTicks);
+
+        auto elapsedCycles = CycleCounter::now() - startCycles;
+        cyclesPerSecond = (double) elapsedCycles / juce::Time::highResolutionTicksToSeconds (elapsedTicks);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (StageProfiler)
+};
+
+// times the scope as a stage of a profile; with profiling compiled out this is an empty object
+class ScopedStageTimer
+{
+public:
+   #if SPATIOTEMPORAL_REVERB_PROFILING
+    ScopedStageTimer (StageProfile* profileToUse, ProcessingStage stageToUse) noexcept
+        : profile (StageProfiler::isEnabled() ? profileToUse : nullptr), stage (stageToUse),
+          start (profile != nullptr ? CycleCounter::now() : 0)
+    {
+    }
+
+    ~ScopedStageTimer()
+    {
+        if (profile != nullptr)
+            profile->record (stage, CycleCounter::now() - start);
+    }
+
+private:
+    StageProfile* profile;
+    ProcessingStage stage;
+    juce::uint64 start;
+   #else
+    ScopedStageTimer (StageProfile*, ProcessingStage) noexcept {}
+   #endif
+
+    JUCE_DECLARE_NON_COPYABLE (ScopedStageTimer)
+};
+
+// times the steps of a diffusion chain that runs a chunk at a time and one step after the other: begin() at the start
+// of every chunk and lap (step) after every step, then recordTo() at the end of the block
+template <size_t numSteps>
+class DiffusionStepTimer
+{
+public:
+    explicit DiffusionStepTimer (StageProfile* profileToUse) noexcept
+        : profile (StageProfiler::isEnabled() ? profileToUse : nullptr)
+    {
+    }
+
+    void begin() noexcept
+    {
+        if (profile != nullptr)
+            lastCycles = CycleCounter::now();
+    }
+
+    void lap (size_t step) noexcept
+    {
+        if (profile != nullptr)
+        {
+            auto now = CycleCounter::now();
+            cycles[step] += now - lastCycles;
+            lastCycles = now;
+        }
+    }
+
+    void recordTo (size_t numActiveSteps) const noexcept
+    {
+        if (profile == nullptr)
+            return;
+
+        for (size_t step = 0; step < juce::jmin (numActiveSteps, StageProfile::maxNumDiffusionSteps); ++step)
+            profile->record (StageProfile::getDiffusionStep (step), cycles[step]);
+    }
+
+private:
+    StageProfile* profile;
+    std::array<juce::uint64, numSteps> cycles {};
+    juce::uint64 lastCycles { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE (DiffusionStepTimer)
+};
+
+// times a whole block against its deadline, the duration of the block at the sample rate
+class ScopedBlockTimer
+{
+public:
+   #if SPATIOTEMPORAL_REVERB_PROFILING
+    ScopedBlockTimer (const StageProfiler& profilerToUse, StageProfile& profileToUse, size_t numSamples, double sampleRate) noexcept
+        : profile (StageProfiler::isEnabled() ? &profileToUse : nullptr),
+          deadlineCycles (sampleRate > 0.0 ? profilerToUse.getDeadlineCycles (numSamples, sampleRate)
+                                           : std::numeric_limits<juce::uint64>::max()),
+          start (profile != nullptr ? CycleCounter::now() : 0)
+    {
+    }
+
+    ~ScopedBlockTimer()
+    {
+        if (profile != nullptr)
+            profile->recordBlock (CycleCounter::now() - start, deadlineCycles);
+    }
+
+private:
+    StageProfile* profile;
+    juce::uint64 deadlineCycles;
+    juce::uint64 start;
+   #else
+    ScopedBlockTimer (const StageProfiler&, StageProfile&, size_t, double) noexcept {}
+   #endif
+
+    JUCE_DECLARE_NON_COPYABLE (ScopedBlockTimer)
+};
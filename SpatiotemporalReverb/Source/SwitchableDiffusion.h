@@ -0,0 +1,417 @@
+//
+//  SwitchableDiffusion.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "Diffusion.h"
+#include "VelvetDiffusion.h"
+#include "DelayLineArena.h"
+#include "DelayLineGrowth.h"
+#include "CpuDispatch.h"
+
+// the configurations of channels x steps that are compiled in, from the cheapest to the densest, and the velvet-noise
+// diffusion (a single channel of sparse taps, see VelvetDiffusion.h) with and without its late tail
+enum class DiffusionTopology
+{
+    compact4x4,
+    standard8x8,
+    dense16x6,
+    velvet,
+    velvetLateTail
+};
+
+// one precompiled diffusion configuration behind a common interface, with the memory of its delay lines; the dispatch
+// to the instruction set of the machine happens behind the interface, since it can't flatten a virtual call
+template <typename Type, typename Storage>
+class DiffusionEngine
+{
+public:
+    virtual ~DiffusionEngine() = default;
+
+    virtual void prepare (const juce::dsp::ProcessSpec& spec) = 0;
+    virtual void process (const juce::dsp::ProcessContextReplacing<Type>& context) = 0;
+    virtual void setDiffusionSteps (float diffusionTime) = 0;
+    virtual void snapDiffusionTime (float diffusionTime) = 0;
+    virtual void setMaxDiffusionSteps (size_t maxDiffusionSteps) = 0;
+    virtual void setProfile (StageProfile* profile) = 0;
+    virtual void setSeed (juce::int64 seed) = 0;
+    virtual size_t getActiveDiffusionSteps() const noexcept = 0;
+    virtual size_t getTargetDiffusionSteps() const noexcept = 0;
+    virtual size_t getTotalDelay() const noexcept = 0;
+    virtual DiffusionTopology getTopology() const noexcept = 0;
+
+    static std::unique_ptr<DiffusionEngine> create (DiffusionTopology topology);
+};
+
+template <typename Type, typename Storage, typename DiffusionType>
+class DiffusionConfiguration : public DiffusionEngine<Type, Storage>
+{
+public:
+    explicit DiffusionConfiguration (DiffusionTopology topologyToUse) : topology (topologyToUse)
+    {
+    }
+
+    void prepare (const juce::dsp::ProcessSpec& spec) override
+    {
+        diffusion.prepare (spec);
+
+        // every configuration keeps its delay lines in one block of its own, so it can be built off the audio thread
+        arena.reset();
+        diffusion.addDelayLinesTo (arena);
+        arena.allocate();
+    }
+
+    void process (const juce::dsp::ProcessContextReplacing<Type>& context) override
+    {
+        // the configuration is known here, so the whole chain is compiled into the trampoline of each instruction set
+        CpuDispatch::run ([&] { diffusion.process (context); });
+    }
+
+    void setDiffusionSteps (float diffusionTime) override
+    {
+        diffusion.setDiffusionSteps (diffusionTime);
+    }
+
+    void snapDiffusionTime (float diffusionTime) override
+    {
+        diffusion.snapDiffusionTime (diffusionTime);
+    }
+
+    void setMaxDiffusionSteps (size_t maxDiffusionSteps) override
+    {
+        diffusion.setMaxDiffusionSteps (maxDiffusionSteps);
+    }
+
+    void setProfile (StageProfile* profile) override
+    {
+        diffusion.setProfile (profile);
+    }
+
+    size_t getActiveDiffusionSteps() const noexcept override
+    {
+        return diffusion.getActiveDiffusionSteps();
+    }
+
+    size_t getTargetDiffusionSteps() const noexcept override
+    {
+        return diffusion.getTargetDiffusionSteps();
+    }
+
+    size_t getTotalDelay() const noexcept override
+    {
+        return diffusion.getTotalDelay();
+    }
+
+    void setSeed (juce::int64 seed) override
+    {
+        diffusion.setSeed (seed);
+    }
+
+    DiffusionTopology getTopology() const noexcept override
+    {
+        return topology;
+    }
+
+private:
+    DiffusionTopology topology;
+    DiffusionType diffusion;
+    DelayLineArena arena;
+
+    JUCE_DECLARE_NON_COPYABLE (DiffusionConfiguration)
+};
+
+// the factory of the configurations: each case instantiates one of them
+template <typename Type, typename Storage>
+std::unique_ptr<DiffusionEngine<Type, Storage>> DiffusionEngine<Type, Storage>::create (DiffusionTopology topology)
+{
+    switch (topology)
+    {
+        case DiffusionTopology::compact4x4:     return std::make_unique<DiffusionConfiguration<Type, Storage, Diffusion<Type, 4, 4, Storage>>> (topology);
+        case DiffusionTopology::standard8x8:    return std::make_unique<DiffusionConfiguration<Type, Storage, Diffusion<Type, 8, 8, Storage>>> (topology);
+        case DiffusionTopology::dense16x6:      return std::make_unique<DiffusionConfiguration<Type, Storage, Diffusion<Type, 16, 6, Storage>>> (topology);
+        case DiffusionTopology::velvet:         return std::make_unique<DiffusionConfiguration<Type, Storage, VelvetDiffusion<Type, 8, false, Storage>>> (topology);
+        case DiffusionTopology::velvetLateTail: return std::make_unique<DiffusionConfiguration<Type, Storage, VelvetDiffusion<Type, 8, true, Storage>>> (topology);
+    }
+
+    jassertfalse;
+    return nullptr;
+}
+
+/*  A Diffusion whose configuration of channels and steps can be switched at runtime, without a glitch:
+    1. any thread requests a topology with requestTopology()
+    2. the growth thread (shared with DelayLineGrowth) builds and prepares the new configuration and publishes it
+    3. the audio thread picks it up, feeds it alongside the current one until its chain has grown through all of its
+       steps (the summed delays of the steps, plus a block per step), and then crossfades over to it (with equal
+       power, since the two outputs are uncorrelated); for a large hall this takes a few seconds
+    4. the old configuration is retired and freed by the growth thread
+    Like DelayLineGrowth, only one configuration is in flight at a time, so single pending and retired slots are enough.
+    When rendering offline (setSynchronous (true)) steps 2 and 4 happen on the calling thread instead, so that the
+    block a configuration arrives at doesn't depend on the timing of the growth thread.
+*/
+template <typename Type, typename Storage = FullPrecisionStorage<Type>>
+class SwitchableDiffusion : private DelayLineGrowthThread::Client
+{
+public:
+    using Engine = DiffusionEngine<Type, Storage>;
+
+    SwitchableDiffusion()
+    {
+    }
+
+    ~SwitchableDiffusion() override
+    {
+        growthThread->removeClient (this);
+        delete pendingEngine.exchange (nullptr);
+        delete retiredEngine.exchange (nullptr);
+    }
+
+    // picks the configuration for a diffusion time (the size of the room), with some hysteresis around the current one
+    static DiffusionTopology chooseTopology (float diffusionTime, DiffusionTopology current) noexcept
+    {
+        constexpr float smallRoom = 0.06f, largeHall = 0.3f, margin = 1.2f;
+
+        float upper = current == DiffusionTopology::compact4x4 ? smallRoom * margin : smallRoom / margin;
+        float lower = current == DiffusionTopology::dense16x6 ? largeHall / margin : largeHall * margin;
+
+        if (diffusionTime < upper)
+            return DiffusionTopology::compact4x4;
+
+        return diffusionTime > lower ? DiffusionTopology::dense16x6 : DiffusionTopology::standard8x8;
+    }
+
+    // must only be called while the audio thread is not processing, e.g. from prepareToPlay
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        // this blocks until the growth thread is out of serviceGrowth()
+        growthThread->removeClient (this);
+        delete pendingEngine.exchange (nullptr);
+        delete retiredEngine.exchange (nullptr);
+        incomingEngine.reset();
+
+        processSpec = spec;
+        swapPosition = 0;
+        warmUpSamples = 0;
+        crossfadeSamples = juce::jmax ((size_t) 1, (size_t) (crossfadeTime * spec.sampleRate));
+        incomingBuffer.setSize ((int) spec.numChannels, (int) spec.maximumBlockSize);
+
+        auto topology = (DiffusionTopology) requestedTopology.load();
+        currentEngine = createEngine (topology);
+        publishedTopology = (int) topology;
+        activeTopology = (int) topology;
+        applySettingsTo (*currentEngine);
+
+        growthThread->addClient (this);
+    }
+
+    // builds and frees the configurations on the thread that calls process() (e.g. when rendering offline) instead of
+    // the growth thread; must only be called while the audio thread is not processing
+    void setSynchronous (bool shouldBeSynchronous) noexcept
+    {
+        isSynchronous = shouldBeSynchronous;
+    }
+    
+    // seeds the random delays of the configurations (which is what makes a rendering repeatable); must be called before prepare
+    void setSeed (juce::int64 newSeed) noexcept
+    {
+        seed = newSeed;
+    }
+    
+    // called from any thread; only a request for another topology wakes the growth thread (see
+    // DelayLineGrowth::requestCapacity), any other one only touches atomics
+    void requestTopology (DiffusionTopology topology) noexcept
+    {
+        if (requestedTopology.exchange ((int) topology) != (int) topology && ! isSynchronous)
+            growthThread->notify();
+    }
+
+    // the topology that is playing (or being crossfaded to)
+    DiffusionTopology getTopology() const noexcept
+    {
+        return (DiffusionTopology) activeTopology.load();
+    }
+
+    // the amount of steps of the configuration that is playing (or being crossfaded to); only for the audio thread
+    size_t getActiveDiffusionSteps() const noexcept
+    {
+        auto* engine = incomingEngine != nullptr ? incomingEngine.get() : currentEngine.get();
+        return engine != nullptr ? engine->getActiveDiffusionSteps() : 0;
+    }
+    
+    // called from any thread; the configurations pick the values up at the start of the next block
+    void setDiffusionSteps (float diffusionTime) noexcept
+    {
+        targetDiffusionTime = diffusionTime;
+        hasNewDiffusionTime = true;
+    }
+
+    void setMaxDiffusionSteps (size_t newMaxDiffusionSteps) noexcept
+    {
+        maxDiffusionSteps = newMaxDiffusionSteps;
+    }
+    
+    // the profile that the steps of the configurations are timed into; must be set before prepare
+    void setProfile (StageProfile* newProfile) noexcept
+    {
+        profile = newProfile;
+    }
+
+    void process (const juce::dsp::ProcessContextReplacing<Type>& context) noexcept
+    {
+        if (currentEngine == nullptr)
+            return;
+
+        // a new configuration is only taken once the previous swap is complete and its leftovers have been freed
+        if (isSynchronous)
+        {
+            delete retiredEngine.exchange (nullptr);
+            buildRequestedEngine();
+        }
+        
+        if (incomingEngine == nullptr && retiredEngine.load (std::memory_order_acquire) == nullptr)
+        {
+            if (auto* engine = pendingEngine.exchange (nullptr, std::memory_order_acq_rel))
+            {
+                incomingEngine.reset (engine);
+                applySettingsTo (*incomingEngine);
+                swapPosition = 0;
+                warmUpSamples = getWarmUpSamples (*incomingEngine);
+                activeTopology = (int) incomingEngine->getTopology();
+            }
+        }
+
+        bool hasNewTime = hasNewDiffusionTime.exchange (false);
+        for (auto* engine : { currentEngine.get(), incomingEngine.get() })
+        {
+            if (engine == nullptr)
+                continue;
+
+            if (hasNewTime)
+                engine->setDiffusionSteps (targetDiffusionTime.load());
+
+            engine->setMaxDiffusionSteps (maxDiffusionSteps.load());
+        }
+
+        auto outputBlock = context.getOutputBlock();
+        auto numSamples = outputBlock.getNumSamples();
+
+        if (incomingEngine == nullptr || numSamples > (size_t) incomingBuffer.getNumSamples()
+            || outputBlock.getNumChannels() > (size_t) incomingBuffer.getNumChannels())
+        {
+            currentEngine->process (context);
+            return;
+        }
+
+        // the warm-up follows the diffusion time until the crossfade has started, but never ends before this block
+        if (swapPosition < warmUpSamples)
+            warmUpSamples = juce::jmax (swapPosition, getWarmUpSamples (*incomingEngine));
+
+        // the incoming configuration gets the same input, the current one processes in place
+        auto incomingBlock = juce::dsp::AudioBlock<Type> (incomingBuffer).getSubsetChannelBlock (0, outputBlock.getNumChannels())
+                                                                         .getSubBlock (0, numSamples);
+        incomingBlock.copyFrom (context.getInputBlock());
+
+        currentEngine->process (context);
+        incomingEngine->process (juce::dsp::ProcessContextReplacing<Type> (incomingBlock));
+
+        for (size_t sample = 0; sample < numSamples; ++sample)
+        {
+            // until the incoming delay lines are warm we only listen to the current configuration
+            auto fadePosition = swapPosition + sample;
+            float fade = fadePosition < warmUpSamples ? 0.0f
+                                                      : juce::jmin (1.0f, (float) (fadePosition - warmUpSamples) / (float) crossfadeSamples);
+            float oldGain = std::cos (fade * juce::MathConstants<float>::halfPi);
+            float newGain = std::sin (fade * juce::MathConstants<float>::halfPi);
+
+            for (size_t ch = 0; ch < outputBlock.getNumChannels(); ++ch)
+                outputBlock.setSample ((int) ch, (int) sample, oldGain * outputBlock.getSample ((int) ch, (int) sample)
+                                                               + newGain * incomingBlock.getSample ((int) ch, (int) sample));
+        }
+
+        swapPosition += numSamples;
+        if (swapPosition >= warmUpSamples + crossfadeSamples)
+        {
+            // the growth thread frees the old configuration, so the audio thread never deallocates
+            retiredEngine.store (currentEngine.release(), std::memory_order_release);
+            currentEngine = std::move (incomingEngine);
+        }
+    }
+
+private:
+    static constexpr double crossfadeTime = 0.1; // in seconds
+
+    juce::SharedResourcePointer<DelayLineGrowthThread> growthThread;
+
+    // only touched by the audio thread (and by prepare)
+    std::unique_ptr<Engine> currentEngine;
+    std::unique_ptr<Engine> incomingEngine;
+    juce::AudioBuffer<Type> incomingBuffer;
+    size_t swapPosition { 0 };
+    size_t warmUpSamples { 0 }; // that the incoming configuration runs silently
+    size_t crossfadeSamples { 1 };
+
+    // set before the growth thread is started, read by it afterwards
+    juce::dsp::ProcessSpec processSpec {};
+
+    std::atomic<Engine*> pendingEngine { nullptr };
+    std::atomic<Engine*> retiredEngine { nullptr };
+    std::atomic<int> requestedTopology { (int) DiffusionTopology::standard8x8 };
+    std::atomic<int> publishedTopology { (int) DiffusionTopology::standard8x8 }; // the last one built, only the growth thread changes it after prepare
+    std::atomic<int> activeTopology { (int) DiffusionTopology::standard8x8 };
+
+    std::atomic<float> targetDiffusionTime { 0.24f };
+    std::atomic<bool> hasNewDiffusionTime { false };
+    std::atomic<size_t> maxDiffusionSteps { std::numeric_limits<size_t>::max() };
+    StageProfile* profile { nullptr };
+    juce::int64 seed { juce::Random().nextInt64() };
+    std::atomic<bool> isSynchronous { false };
+
+    // helper functions
+    void applySettingsTo (Engine& engine)
+    {
+        engine.snapDiffusionTime (targetDiffusionTime.load());
+        engine.setMaxDiffusionSteps (maxDiffusionSteps.load());
+        engine.setProfile (profile);
+    }
+
+    // the chain of a fresh configuration grows by at most a step per block, each step once it has been fed for as long
+    // as its delays
+    size_t getWarmUpSamples (const Engine& engine) const noexcept
+    {
+        return engine.getTotalDelay() + engine.getTargetDiffusionSteps() * (size_t) processSpec.maximumBlockSize;
+    }
+
+    std::unique_ptr<Engine> createEngine (DiffusionTopology topology) const
+    {
+        auto engine = Engine::create (topology);
+        engine->setSeed (seed);
+        engine->prepare (processSpec);
+        return engine;
+    }
+
+    void buildRequestedEngine()
+    {
+        int requested = requestedTopology.load();
+        if (requested != publishedTopology.load() && pendingEngine.load (std::memory_order_acquire) == nullptr)
+        {
+            pendingEngine.store (createEngine ((DiffusionTopology) requested).release(), std::memory_order_release);
+            publishedTopology = requested;
+        }
+    }
+
+    bool serviceGrowth() override
+    {
+        if (isSynchronous)
+            return false;
+
+        // deferred reclamation of the configuration that the audio thread has stopped using
+        delete retiredEngine.exchange (nullptr, std::memory_order_acq_rel);
+        buildRequestedEngine();
+
+        // the audio thread picks up and retires the configurations without a signal, so we poll until it has
+        return pendingEngine.load() != nullptr || retiredEngine.load() != nullptr || requestedTopology.load() != publishedTopology.load();
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (SwitchableDiffusion)
+};
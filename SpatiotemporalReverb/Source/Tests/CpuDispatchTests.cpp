@@ -0,0 +1,112 @@
+//
+//  CpuDispatchTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../CpuDispatch.h"
+#include "../SwitchableDiffusion.h"
+
+/*  Runs the diffusion configurations compiled for each instruction set that this machine supports against the generic
+    variant: the outputs must agree (up to the rounding of fused multiply-adds). The time each variant takes is only
+    logged, since it depends on the machine and its load; a variant that runs as slowly as the generic one is a sign
+    that the diffusion no longer dispatches behind the virtual interface of its engine.
+*/
+class CpuDispatchTests : public juce::UnitTest
+{
+public:
+    CpuDispatchTests() : juce::UnitTest ("CPU dispatch", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        auto input = makeNoise();
+
+        // the first run pays for the caches and the clock of the CPU coming up, so it isn't compared
+        double warmUpTime = 0.0;
+        runEngine (DiffusionTopology::standard8x8, input, warmUpTime);
+
+        for (auto topology : { DiffusionTopology::standard8x8, DiffusionTopology::velvet })
+        {
+            beginTest (juce::String ("Equivalence and speed of ") + (topology == DiffusionTopology::velvet ? "the velvet diffusion" : "the 8x8 diffusion"));
+
+            CpuDispatch::force (CpuIsa::generic);
+            double genericTime = 0.0;
+            auto reference = runEngine (topology, input, genericTime);
+
+            for (auto isa : { CpuIsa::sse2, CpuIsa::avx2, CpuIsa::avx512, CpuIsa::neon })
+            {
+                if (! CpuDispatch::force (isa))
+                    continue;
+
+                double time = 0.0;
+                auto output = runEngine (topology, input, time);
+
+                logMessage (juce::String (CpuDispatch::getName (isa)) + ": " + juce::String (time, 1) + " ms, generic "
+                            + juce::String (genericTime, 1) + " ms, largest difference " + juce::String (getLargestDifference (output, reference)));
+
+                expectLessThan (getLargestDifference (output, reference), 1.0e-4f);
+            }
+        }
+
+        CpuDispatch::reset();
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr int blockSize = 512;
+    static constexpr int numBlocks = 10 * (int) sampleRate / blockSize;
+
+    // helper functions
+    static std::vector<float> makeNoise()
+    {
+        juce::Random random (1);
+        std::vector<float> noise ((size_t) (numBlocks * blockSize));
+        for (auto& sample : noise)
+            sample = random.nextFloat() - 0.5f;
+
+        return noise;
+    }
+
+    // runs the input through a fresh configuration at a diffusion time that keeps all of its steps busy; the fastest
+    // of a few runs is timed, which keeps the other load of the machine out of the comparison
+    static std::vector<float> runEngine (DiffusionTopology topology, const std::vector<float>& input, double& milliseconds)
+    {
+        std::vector<float> output;
+        milliseconds = std::numeric_limits<double>::max();
+
+        for (int run = 0; run < 5; ++run)
+        {
+            auto engine = DiffusionEngine<float, FullPrecisionStorage<float>>::create (topology);
+            engine->setSeed (1);
+            engine->prepare ({ sampleRate, (juce::uint32) blockSize, 1 });
+            engine->snapDiffusionTime (3.0f);
+
+            output = input;
+            auto start = juce::Time::getMillisecondCounterHiRes();
+
+            for (int block = 0; block < numBlocks; ++block)
+            {
+                float* channels[] { output.data() + block * blockSize };
+                juce::dsp::AudioBlock<float> audioBlock (channels, 1, (size_t) blockSize);
+                engine->process (juce::dsp::ProcessContextReplacing<float> (audioBlock));
+            }
+
+            milliseconds = juce::jmin (milliseconds, juce::Time::getMillisecondCounterHiRes() - start);
+        }
+
+        return output;
+    }
+
+    static float getLargestDifference (const std::vector<float>& signal, const std::vector<float>& reference)
+    {
+        float largest = 0.0f;
+        for (size_t sample = 0; sample < signal.size(); ++sample)
+            largest = juce::jmax (largest, std::abs (signal[sample] - reference[sample]));
+
+        return largest;
+    }
+};
+
+static CpuDispatchTests cpuDispatchTests;
@@ -0,0 +1,80 @@
+//
+//  DelayLineArenaTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../DelayLineArena.h"
+#include "../Diffusion.h"
+
+/*  An arena whose allocation fails must stay empty and leave its delay lines empty, and the delay lines (and a
+    diffusion that runs on them) must then read back silence instead of touching the memory they didn't get.
+*/
+class DelayLineArenaTests : public juce::UnitTest
+{
+public:
+    DelayLineArenaTests() : juce::UnitTest ("Delay line arena", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        beginTest ("Allocation");
+        {
+            DelayLineArena arena;
+            DelayLine<float> delayLine;
+            arena.add (delayLine, 1000);
+            arena.allocate();
+
+            expect (arena.isAllocated());
+            expectEquals ((int) delayLine.getSize(), 1000);
+        }
+
+        beginTest ("Failed allocation leaves the arena empty");
+        {
+            // more memory than any address space has
+            DelayLineArena arena;
+            DelayLine<float> small, huge;
+            arena.add (small, 1000);
+            arena.add (huge, (size_t) 1 << 58);
+            arena.allocate();
+
+            expect (! arena.isAllocated());
+            expectEquals ((int) arena.getNumDelayLines(), 0);
+            expect (small.isEmpty() && huge.isEmpty());
+
+            // an empty delay line drops what is pushed and reads back silence
+            std::vector<float> block (64, 1.0f);
+            small.push (1.0f);
+            small.pushBlock (block.data(), block.size());
+            small.getBlock (100, block.data(), block.size());
+
+            expectEquals (small.get (0), 0.0f);
+            expectEquals (*std::max_element (block.begin(), block.end()), 0.0f);
+
+            // the arena can be used again afterwards
+            arena.add (small, 1000);
+            arena.allocate();
+            expect (arena.isAllocated() && ! small.isEmpty());
+        }
+
+        beginTest ("Diffusion on an empty arena");
+        {
+            Diffusion<float, 8, 8> diffusion;
+            diffusion.prepare ({ 48000.0, 512, 2 });
+            diffusion.setDiffusionSteps (0.5f);
+
+            // a diffusion whose delay lines are never laid out is as good as one whose arena failed
+            std::vector<float> left (512, 1.0f), right (512, 1.0f);
+            float* channels[] { left.data(), right.data() };
+            juce::dsp::AudioBlock<float> block (channels, 2, 512);
+            for (int i = 0; i < 10; ++i)
+                diffusion.process (juce::dsp::ProcessContextReplacing<float> (block));
+
+            auto isFinite = [] (float sample) { return std::isfinite (sample); };
+            expect (std::all_of (left.begin(), left.end(), isFinite) && std::all_of (right.begin(), right.end(), isFinite));
+        }
+    }
+};
+
+static DelayLineArenaTests delayLineArenaTests;
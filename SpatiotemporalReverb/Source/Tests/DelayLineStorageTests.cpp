@@ -0,0 +1,121 @@
+//
+//  DelayLineStorageTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../Diffusion.h"
+#include "../DelayLineArena.h"
+
+/*  Measures what the compact storages of DelayLineStorage.h cost in precision: a value that is encoded and decoded
+    again, and the full diffusion chain run on the same noise with the same seed as with full precision. The noise
+    floors are logged, so a change to a storage shows up in the test output.
+*/
+class DelayLineStorageTests : public juce::UnitTest
+{
+public:
+    DelayLineStorageTests() : juce::UnitTest ("Delay line storage", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        beginTest ("Round trip");
+        {
+            // a half float keeps 11 bits of any value, the fixed point a step of headroom / 32767 up to the headroom
+            for (auto value : { 0.0f, 1.0e-3f, 0.3f, -0.7f, 1.0f, -2.8f, 3.99f })
+            {
+                expectWithinAbsoluteError (roundTrip<HalfFloatStorage<float>> (value), value, std::abs (value) / 2048.0f);
+                expectWithinAbsoluteError (roundTrip<ScaledInt16Storage<float>> (value), value, 0.5f / ScaledInt16Storage<float>::scale);
+            }
+
+            // beyond the headroom the fixed point clips
+            expectEquals (roundTrip<ScaledInt16Storage<float>> (8.0f), roundTrip<ScaledInt16Storage<float>> (4.0f));
+        }
+
+        beginTest ("Noise floor of the diffusion");
+        {
+            auto reference = runDiffusion<FullPrecisionStorage<float>>();
+            auto halfFloat = runDiffusion<HalfFloatStorage<float>>();
+            auto int16 = runDiffusion<ScaledInt16Storage<float>>();
+
+            auto level = getRms (reference);
+            auto halfFloatNoise = juce::Decibels::gainToDecibels (getRmsOfDifference (halfFloat, reference) / level, -200.0);
+            auto int16Noise = juce::Decibels::gainToDecibels (getRmsOfDifference (int16, reference), -200.0);
+
+            logMessage ("output level " + juce::String (juce::Decibels::gainToDecibels (level), 1) + " dBFS");
+            logMessage ("half float: noise at " + juce::String (halfFloatNoise, 1) + " dB relative to the output");
+            logMessage ("16-bit fixed point: noise at " + juce::String (int16Noise, 1) + " dBFS");
+
+            // the Hadamard steps take the full-scale input up to 2.8 times full scale, which would clip without headroom
+            expectLessThan (halfFloatNoise, -50.0);
+            expectLessThan (int16Noise, -70.0);
+        }
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr int blockSize = 512;
+
+    // helper functions
+    template <typename Storage>
+    static float roundTrip (float value)
+    {
+        return Storage::decode (Storage::encode (value));
+    }
+
+    // runs full-scale noise through all eight steps, long enough for the chain to have grown to all of them
+    template <typename Storage>
+    static std::vector<float> runDiffusion()
+    {
+        Diffusion<float, 8, 8, Storage> diffusion;
+        diffusion.setSeed (1);
+        diffusion.prepare ({ sampleRate, (juce::uint32) blockSize, 1 });
+
+        DelayLineArena arena;
+        diffusion.addDelayLinesTo (arena);
+        arena.allocate();
+
+        for (int i = 0; i < 1000; ++i)
+            diffusion.setDiffusionSteps (3.0f);
+
+        juce::Random random (1);
+        juce::AudioBuffer<float> buffer (1, blockSize);
+        std::vector<float> output;
+
+        for (int block = 0; block < (int) (6.0 * sampleRate) / blockSize; ++block)
+        {
+            for (int sample = 0; sample < blockSize; ++sample)
+                buffer.setSample (0, sample, random.nextFloat() * 2.0f - 1.0f);
+
+            juce::dsp::AudioBlock<float> audioBlock (buffer);
+            diffusion.process (juce::dsp::ProcessContextReplacing<float> (audioBlock));
+
+            // only the output of the full chain is compared
+            if (diffusion.getActiveDiffusionSteps() == 8)
+                output.insert (output.end(), buffer.getReadPointer (0), buffer.getReadPointer (0) + blockSize);
+        }
+
+        return output;
+    }
+
+    static double getRms (const std::vector<float>& signal)
+    {
+        double sum = 0.0;
+        for (auto sample : signal)
+            sum += (double) sample * sample;
+
+        return std::sqrt (sum / (double) juce::jmax ((size_t) 1, signal.size()));
+    }
+
+    static double getRmsOfDifference (const std::vector<float>& signal, const std::vector<float>& reference)
+    {
+        std::vector<float> difference (juce::jmin (signal.size(), reference.size()));
+        for (size_t sample = 0; sample < difference.size(); ++sample)
+            difference[sample] = signal[sample] - reference[sample];
+
+        return getRms (difference);
+    }
+};
+
+static DelayLineStorageTests delayLineStorageTests;
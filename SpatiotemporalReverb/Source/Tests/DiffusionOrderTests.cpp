@@ -0,0 +1,87 @@
+//
+//  DiffusionOrderTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../Diffusion.h"
+#include "../DelayLineArena.h"
+
+/*  Diffusion pushes a block through its chain a chunk at a time and one step after the other (step-major), and claims
+    that this gives the same output as running each sample through all the steps before the next one (sample-major),
+    since the chain has no feedback. A diffusion that is given blocks of a single sample runs sample-major, so we run
+    the same noise through it and through diffusions given larger blocks, with the same seed, and compare the outputs
+    once all the steps are on.
+*/
+class DiffusionOrderTests : public juce::UnitTest
+{
+public:
+    DiffusionOrderTests() : juce::UnitTest ("Diffusion processing order", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        auto input = makeNoise();
+        auto sampleMajor = runDiffusion (input, 1);
+
+        // a whole number of chunks, a block that ends in a partial chunk and a block shorter than a chunk
+        for (auto blockSize : { 512, 100, 37 })
+        {
+            beginTest ("Blocks of " + juce::String (blockSize) + " samples");
+
+            auto stepMajor = runDiffusion (input, blockSize);
+            float maxDifference = 0.0f;
+            for (size_t sample = comparedFrom; sample < input.size(); ++sample)
+                maxDifference = juce::jmax (maxDifference, std::abs (stepMajor[sample] - sampleMajor[sample]));
+
+            logMessage ("largest difference to the sample-major order " + juce::String (maxDifference));
+            expectEquals (maxDifference, 0.0f);
+        }
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr size_t numSamples = (size_t) (8 * sampleRate);
+
+    // the chain grows a step at a time, and the steps only agree once they have been fed for as long as their delays
+    // (about three seconds for all eight), so the last two seconds are compared
+    static constexpr size_t comparedFrom = (size_t) (6 * sampleRate);
+
+    // helper functions
+    static std::vector<float> makeNoise()
+    {
+        juce::Random random (1);
+        std::vector<float> noise (numSamples);
+        for (auto& sample : noise)
+            sample = random.nextFloat() - 0.5f;
+
+        return noise;
+    }
+
+    std::vector<float> runDiffusion (const std::vector<float>& input, int blockSize)
+    {
+        Diffusion<float, 8, 8> diffusion;
+        diffusion.setSeed (1);
+        diffusion.prepare ({ sampleRate, (juce::uint32) blockSize, 1 });
+
+        DelayLineArena arena;
+        diffusion.addDelayLinesTo (arena);
+        arena.allocate();
+
+        diffusion.snapDiffusionTime (3.0f);
+
+        std::vector<float> output (input);
+        for (size_t start = 0; start < output.size(); start += (size_t) blockSize)
+        {
+            float* channels[] = { output.data() + start };
+            juce::dsp::AudioBlock<float> block (channels, 1, juce::jmin ((size_t) blockSize, output.size() - start));
+            diffusion.process (juce::dsp::ProcessContextReplacing<float> (block));
+        }
+
+        expectEquals ((int) diffusion.getActiveDiffusionSteps(), 8);
+        return output;
+    }
+};
+
+static DiffusionOrderTests diffusionOrderTests;
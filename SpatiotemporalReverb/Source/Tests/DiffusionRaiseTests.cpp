@@ -0,0 +1,94 @@
+//
+//  DiffusionRaiseTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../Diffusion.h"
+#include "../VelvetDiffusion.h"
+#include "../DelayLineArena.h"
+
+/*  Raises the cap on the diffusion steps (as the quality governor does when the CPU load drops) while noise runs
+    through the diffusion, and makes sure that the output doesn't drop out: the steps that are switched back on must
+    have been kept warm, and the chain must crossfade over to them rather than start from silence.
+*/
+class DiffusionRaiseTests : public juce::UnitTest
+{
+public:
+    DiffusionRaiseTests() : juce::UnitTest ("Diffusion step cap raise", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        beginTest ("Hadamard diffusion");
+        expectNoDropout<Diffusion<float, 8, 8>>();
+
+        beginTest ("Velvet diffusion");
+        expectNoDropout<VelvetDiffusion<float, 8>>();
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr int blockSize = 512;
+    static constexpr int numBlocksPerSecond = (int) sampleRate / blockSize;
+
+    // helper functions
+    template <typename DiffusionType>
+    void expectNoDropout()
+    {
+        DiffusionType diffusion;
+        diffusion.setSeed (1);
+        diffusion.prepare ({ sampleRate, (juce::uint32) blockSize, 1 });
+
+        DelayLineArena arena;
+        diffusion.addDelayLinesTo (arena);
+        arena.allocate();
+
+        for (int i = 0; i < 1000; ++i)
+            diffusion.setDiffusionSteps (3.0f);
+
+        // the chain settles at the cap of 2 steps for two seconds, then the cap goes up to 4
+        diffusion.setMaxDiffusionSteps (2);
+
+        juce::Random random (1);
+        juce::AudioBuffer<float> buffer (1, blockSize);
+        double levelBeforeRaise = 0.0, lowestLevelAfterRaise = 1.0e9;
+
+        for (int block = 0; block < 4 * numBlocksPerSecond; ++block)
+        {
+            if (block == 2 * numBlocksPerSecond)
+                diffusion.setMaxDiffusionSteps (4);
+
+            for (int sample = 0; sample < blockSize; ++sample)
+                buffer.setSample (0, sample, random.nextFloat() - 0.5f);
+
+            juce::dsp::AudioBlock<float> audioBlock (buffer);
+            diffusion.process (juce::dsp::ProcessContextReplacing<float> (audioBlock));
+
+            auto level = getRms (buffer.getReadPointer (0), blockSize);
+            if (block == 2 * numBlocksPerSecond - 1)
+                levelBeforeRaise = level;
+            else if (block >= 2 * numBlocksPerSecond)
+                lowestLevelAfterRaise = juce::jmin (lowestLevelAfterRaise, level);
+        }
+
+        logMessage ("level before the raise " + juce::String (juce::Decibels::gainToDecibels (levelBeforeRaise), 1)
+                    + " dBFS, lowest block after it " + juce::String (juce::Decibels::gainToDecibels (lowestLevelAfterRaise), 1) + " dBFS");
+
+        // a step that started out cold would leave blocks of (near) silence
+        expectEquals ((int) diffusion.getActiveDiffusionSteps(), 4);
+        expectGreaterThan (lowestLevelAfterRaise, 0.5 * levelBeforeRaise);
+    }
+
+    static double getRms (const float* samples, int numSamples)
+    {
+        double sum = 0.0;
+        for (int sample = 0; sample < numSamples; ++sample)
+            sum += (double) samples[sample] * samples[sample];
+
+        return std::sqrt (sum / (double) numSamples);
+    }
+};
+
+static DiffusionRaiseTests diffusionRaiseTests;
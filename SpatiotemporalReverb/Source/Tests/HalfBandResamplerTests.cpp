@@ -0,0 +1,149 @@
+//
+//  HalfBandResamplerTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../HalfBandResampler.h"
+#include "../Diffusion.h"
+#include "../DelayLineArena.h"
+
+/*  Runs signals down to a half and a quarter of the rate and up again, as the plugin does around its diffusion and
+    delay when it is given a reverb rate divisor of 2 or 4: the passband must stay flat, what lies above the reduced
+    rate must be filtered out rather than folded back, the latency must be the one that getLatency() reports and the
+    output must not depend on how the signal is split into blocks. The diffusion prepared with the reduced spec must
+    also get by with the share of the delay memory that its rate divisor promises.
+*/
+class HalfBandResamplerTests : public juce::UnitTest
+{
+public:
+    HalfBandResamplerTests() : juce::UnitTest ("Half-band resampler", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        // the passband is flat (within 0.2 dB) up to about 0.2 of the rate of each stage, and the stopband starts at
+        // about 0.31 of it, which at 48 kHz and a divisor of 4 is the stopband of the second stage
+        for (auto divisor : { 2, 4 })
+        {
+            auto flatUpTo = divisor == 2 ? 10000.0 : 4500.0;
+            auto stopFrom = divisor == 2 ? 15000.0 : 8000.0;
+
+            beginTest ("Frequency response at a divisor of " + juce::String (divisor));
+            {
+                for (auto frequency : { 100.0, 1000.0, flatUpTo * 0.5, flatUpTo })
+                    expectWithinAbsoluteError (getRoundTripLevel (divisor, frequency), 0.0, 0.2);
+
+                for (auto frequency : { stopFrom, stopFrom * 1.25, 20000.0 })
+                    expectLessThan (getRoundTripLevel (divisor, frequency), -80.0);
+
+                logMessage ("level at " + juce::String (flatUpTo / 1000.0, 1) + " kHz " + juce::String (getRoundTripLevel (divisor, flatUpTo), 2)
+                            + " dB, at " + juce::String (stopFrom / 1000.0, 1) + " kHz " + juce::String (getRoundTripLevel (divisor, stopFrom), 1) + " dB");
+            }
+
+            beginTest ("Latency and block sizes at a divisor of " + juce::String (divisor));
+            {
+                std::vector<float> impulse (4096, 0.0f);
+                impulse[1000] = 1.0f;
+                auto response = roundTrip (impulse, divisor, false);
+
+                size_t peak = 0;
+                for (size_t sample = 0; sample < response.size(); ++sample)
+                    if (std::abs (response[sample]) > std::abs (response[peak]))
+                        peak = sample;
+
+                HalfBandResampler<float, 1> resampler;
+                resampler.prepare ({ sampleRate, (juce::uint32) maxBlockSize, 1 }, divisor);
+                expectEquals ((int) (peak - 1000), (int) resampler.getLatency());
+
+                // the samples that a block leaves over at the reduced rate are carried over to the next block
+                juce::Random random (1);
+                std::vector<float> noise (20000);
+                for (auto& sample : noise)
+                    sample = random.nextFloat() - 0.5f;
+
+                auto inFixedBlocks = roundTrip (noise, divisor, false);
+                auto inRandomBlocks = roundTrip (noise, divisor, true);
+                expect (inFixedBlocks == inRandomBlocks);
+            }
+
+            beginTest ("Delay memory of the diffusion at a divisor of " + juce::String (divisor));
+            {
+                auto fullRateBytes = getDiffusionBytes (1);
+                auto reducedRateBytes = getDiffusionBytes (divisor);
+
+                logMessage ("delay memory " + juce::String ((int) (reducedRateBytes / 1024)) + " kB, at the full rate "
+                            + juce::String ((int) (fullRateBytes / 1024)) + " kB");
+
+                expectLessThan ((double) reducedRateBytes, 1.1 * (double) fullRateBytes / divisor);
+            }
+        }
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr int maxBlockSize = 700;
+
+    // helper functions
+    // runs a signal down and up again in blocks of 512 samples, or of random lengths
+    static std::vector<float> roundTrip (const std::vector<float>& input, int divisor, bool inRandomBlocks)
+    {
+        HalfBandResampler<float, 1> resampler;
+        resampler.prepare ({ sampleRate, (juce::uint32) maxBlockSize, 1 }, divisor);
+
+        juce::Random random (5);
+        std::vector<float> output (input);
+
+        for (size_t start = 0; start < output.size();)
+        {
+            auto numSamples = juce::jmin (inRandomBlocks ? (size_t) random.nextInt ({ 1, maxBlockSize + 1 }) : (size_t) 512, output.size() - start);
+
+            float* channels[] { output.data() + start };
+            juce::dsp::AudioBlock<float> block (channels, 1, numSamples);
+            resampler.decimate (block);
+            resampler.interpolate (block);
+
+            start += numSamples;
+        }
+
+        return output;
+    }
+
+    // the level of a sine of full scale after going down and up again, once the filters have settled
+    static double getRoundTripLevel (int divisor, double frequency)
+    {
+        std::vector<float> sine ((size_t) sampleRate);
+        for (size_t sample = 0; sample < sine.size(); ++sample)
+            sine[sample] = (float) std::sin (juce::MathConstants<double>::twoPi * frequency * (double) sample / sampleRate);
+
+        auto output = roundTrip (sine, divisor, true);
+
+        constexpr size_t settled = 8000;
+        double energy = 0.0;
+        for (size_t sample = settled; sample < output.size(); ++sample)
+            energy += (double) output[sample] * output[sample];
+
+        // a sine of full scale has a mean square of a half
+        return juce::Decibels::gainToDecibels (std::sqrt (energy / (0.5 * (double) (output.size() - settled))), -200.0);
+    }
+
+    // the delay memory of a diffusion at the reduced rate, as the plugin prepares it
+    static size_t getDiffusionBytes (int divisor)
+    {
+        HalfBandResampler<float, 2> resampler;
+        resampler.prepare ({ sampleRate, 512, 2 }, divisor);
+
+        Diffusion<float, 8, 8> diffusion;
+        diffusion.setSeed (1);
+        diffusion.prepare (resampler.getReducedSpec());
+
+        DelayLineArena arena;
+        diffusion.addDelayLinesTo (arena);
+        arena.allocate();
+
+        return arena.getTotalBytes();
+    }
+};
+
+static HalfBandResamplerTests halfBandResamplerTests;
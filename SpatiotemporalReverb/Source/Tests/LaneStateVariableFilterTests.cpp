@@ -0,0 +1,160 @@
+//
+//  LaneStateVariableFilterTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../LaneStateVariableFilter.h"
+#include "../SourceLaneGroup.h"
+
+/*  The lane filter stands in for juce::dsp::StateVariableTPTFilter wherever the samples are SIMD lanes, so with a
+    float it must compute what the JUCE filter computes, and every lane of a SIMDRegister must compute what a float
+    filter computes on that lane alone. The lane group that runs on it must also render its lanes independently.
+*/
+class LaneStateVariableFilterTests : public juce::UnitTest
+{
+public:
+    LaneStateVariableFilterTests() : juce::UnitTest ("Lane state variable filter", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        for (auto type : { juce::dsp::StateVariableTPTFilterType::lowpass, juce::dsp::StateVariableTPTFilterType::highpass })
+        {
+            auto typeName = juce::String (type == juce::dsp::StateVariableTPTFilterType::lowpass ? "low pass" : "high pass");
+
+            beginTest ("Float against the JUCE filter, " + typeName);
+            {
+                juce::dsp::StateVariableTPTFilter<float> juceFilter;
+                LaneStateVariableFilter<float> laneFilter;
+                setUp (juceFilter, type);
+                setUp (laneFilter, type);
+
+                auto input = makeNoise (1);
+                auto expected = input, output = input;
+                run (juceFilter, expected.data());
+                run (laneFilter, output.data());
+
+                expectEquals (getLargestDifference (output, expected), 0.0f);
+            }
+
+            beginTest ("SIMD lanes against floats, " + typeName);
+            {
+                using LaneType = juce::dsp::SIMDRegister<float>;
+                constexpr auto numLanes = SampleLanes<LaneType>::numLanes;
+
+                LaneStateVariableFilter<LaneType> laneFilter;
+                setUp (laneFilter, type);
+
+                std::array<std::vector<float>, numLanes> lanes;
+                std::vector<LaneType> frames (numSamples);
+                for (size_t lane = 0; lane < numLanes; ++lane)
+                {
+                    lanes[lane] = makeNoise ((juce::int64) lane + 1);
+                    for (size_t sample = 0; sample < numSamples; ++sample)
+                        SampleLanes<LaneType>::set (frames[sample], lane, lanes[lane][sample]);
+                }
+
+                run (laneFilter, frames.data());
+
+                for (size_t lane = 0; lane < numLanes; ++lane)
+                {
+                    LaneStateVariableFilter<float> floatFilter;
+                    setUp (floatFilter, type);
+                    run (floatFilter, lanes[lane].data());
+
+                    std::vector<float> laneOutput (numSamples);
+                    for (size_t sample = 0; sample < numSamples; ++sample)
+                        laneOutput[sample] = SampleLanes<LaneType>::get (frames[sample], lane);
+
+                    expectEquals (getLargestDifference (laneOutput, lanes[lane]), 0.0f);
+                }
+            }
+        }
+
+        beginTest ("Lane group renders its lanes independently");
+        {
+            // a source alone in the group must come out as it does next to another source
+            auto alone = renderLaneGroup (false);
+            auto together = renderLaneGroup (true);
+
+            expectGreaterThan (getLargestDifference (alone, std::vector<float> (alone.size(), 0.0f)), 0.0f);
+            expectEquals (getLargestDifference (alone, together), 0.0f);
+        }
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr size_t numSamples = 4096;
+
+    // helper functions
+    template <typename FilterType>
+    static void setUp (FilterType& filter, juce::dsp::StateVariableTPTFilterType type)
+    {
+        filter.setType (type);
+        filter.prepare ({ sampleRate, (juce::uint32) numSamples, 1 });
+        filter.setCutoffFrequency (3e2f);
+    }
+
+    template <typename FilterType, typename SampleType>
+    static void run (FilterType& filter, SampleType* samples)
+    {
+        // in blocks of 512, like the plugin, so the states are carried over between blocks
+        for (size_t start = 0; start < numSamples; start += 512)
+        {
+            SampleType* channels[] { samples + start };
+            juce::dsp::AudioBlock<SampleType> block (channels, 1, 512);
+            filter.process (juce::dsp::ProcessContextReplacing<SampleType> (block));
+        }
+    }
+
+    static std::vector<float> makeNoise (juce::int64 seed)
+    {
+        juce::Random random (seed);
+        std::vector<float> noise (numSamples);
+        for (auto& sample : noise)
+            sample = random.nextFloat() - 0.5f;
+
+        return noise;
+    }
+
+    static std::vector<float> renderLaneGroup (bool withSecondSource)
+    {
+        SourceLaneGroup group;
+        group.prepare ({ sampleRate, (juce::uint32) numSamples, 1 });
+        group.setDelayTime (0, 0.05f);
+        group.setFeedback (0, 0.5f);
+        group.setDelayTime (1, 0.08f);
+        group.setFeedback (1, 0.3f);
+
+        auto first = makeNoise (1);
+        auto second = makeNoise (2);
+        std::vector<float> output (numSamples), secondOutput (numSamples);
+
+        std::array<const float*, SourceLaneGroup::numLanes> inputs {};
+        std::array<float*, SourceLaneGroup::numLanes> outputs {};
+        inputs[0] = first.data();
+        outputs[0] = output.data();
+
+        if (withSecondSource)
+        {
+            inputs[1] = second.data();
+            outputs[1] = secondOutput.data();
+        }
+
+        group.process (inputs.data(), outputs.data(), numSamples);
+        return output;
+    }
+
+    static float getLargestDifference (const std::vector<float>& signal, const std::vector<float>& reference)
+    {
+        float largest = 0.0f;
+        for (size_t sample = 0; sample < signal.size(); ++sample)
+            largest = juce::jmax (largest, std::abs (signal[sample] - reference[sample]));
+
+        return largest;
+    }
+};
+
+static LaneStateVariableFilterTests laneStateVariableFilterTests;
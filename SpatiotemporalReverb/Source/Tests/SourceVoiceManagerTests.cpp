@@ -0,0 +1,167 @@
+//
+//  SourceVoiceManagerTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../SourceVoiceManager.h"
+
+/*  The voice manager packs the instances densely into lane groups and renders a group once all of its voices have
+    handed in their block, so every voice must come out as its lane of a group driven directly, one block later, and a
+    voice that stops handing in blocks must not hold up the others.
+*/
+class SourceVoiceManagerTests : public juce::UnitTest
+{
+public:
+    SourceVoiceManagerTests() : juce::UnitTest ("Source voice manager", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        beginTest ("Voices are packed densely into the groups");
+        {
+            SourceVoiceManager manager;
+            std::vector<int> voices;
+            for (size_t voice = 0; voice <= SourceLaneGroup::numLanes; ++voice)
+                voices.push_back (manager.addVoice (spec));
+
+            for (size_t voice = 0; voice < voices.size(); ++voice)
+                expectEquals (voices[voice], (int) voice);
+
+            expectEquals ((int) manager.getNumGroups(), 2);
+
+            // a freed lane is taken by the next voice, and a group without voices no longer counts
+            manager.removeVoice (voices[1]);
+            expectEquals (manager.addVoice (spec), voices[1]);
+            manager.removeVoice (voices.back());
+            expectEquals ((int) manager.getNumGroups(), 1);
+
+            // a different sample rate can't share a group
+            expectEquals (manager.addVoice ({ 44100.0, blockSize, 1 }), (int) SourceLaneGroup::numLanes);
+        }
+
+        beginTest ("Voices render their lanes one block later");
+        {
+            auto reference = renderLaneGroup (true);
+            auto rendered = renderVoices (true);
+
+            for (size_t voice = 0; voice < numVoices; ++voice)
+            {
+                expectGreaterThan (getLargestDifference (reference[voice], std::vector<float> (numSamples, 0.0f), 0), 0.0f);
+                expectEquals (getLargestDifference (rendered[voice], reference[voice], blockSize), 0.0f);
+            }
+        }
+
+        beginTest ("A voice that stops doesn't hold up the others");
+        {
+            auto reference = renderLaneGroup (false);
+            auto rendered = renderVoices (false);
+
+            expectEquals (getLargestDifference (rendered[0], reference[0], blockSize), 0.0f);
+        }
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr size_t numSamples = 8192;
+    static constexpr juce::uint32 blockSize = 512;
+    static constexpr size_t numVoices = 2;
+    static constexpr juce::dsp::ProcessSpec spec { sampleRate, blockSize, 1 };
+
+    static constexpr std::array<float, numVoices> delayTimes { 0.05f, 0.08f };
+    static constexpr std::array<float, numVoices> feedbacks { 0.5f, 0.3f };
+    static constexpr std::array<float, numVoices> diffusionTimes { 0.1f, 0.2f };
+
+    // helper functions
+    static std::vector<float> makeNoise (juce::int64 seed)
+    {
+        juce::Random random (seed);
+        std::vector<float> noise (numSamples);
+        for (auto& sample : noise)
+            sample = random.nextFloat() - 0.5f;
+
+        return noise;
+    }
+
+    // the voices through the manager; the second one only hands in its first block if it doesn't keep sending
+    static std::array<std::vector<float>, numVoices> renderVoices (bool secondVoiceKeepsSending)
+    {
+        SourceVoiceManager manager;
+        std::array<int, numVoices> voices;
+        std::array<std::vector<float>, numVoices> inputs, outputs;
+        for (size_t voice = 0; voice < numVoices; ++voice)
+        {
+            voices[voice] = manager.addVoice (spec);
+            inputs[voice] = makeNoise ((juce::int64) voice + 1);
+            outputs[voice].assign (numSamples, 0.0f);
+        }
+
+        for (size_t start = 0; start < numSamples; start += blockSize)
+        {
+            for (size_t voice = 0; voice < numVoices; ++voice)
+            {
+                if (voice > 0 && start > 0 && ! secondVoiceKeepsSending)
+                    continue;
+
+                manager.process (voices[voice], inputs[voice].data() + start, outputs[voice].data() + start, blockSize,
+                                 delayTimes[voice], feedbacks[voice], diffusionTimes[voice]);
+            }
+        }
+
+        return outputs;
+    }
+
+    // the same sources through a lane group driven directly, without the latency of the manager
+    static std::array<std::vector<float>, numVoices> renderLaneGroup (bool secondVoiceKeepsSending)
+    {
+        SourceLaneGroup group;
+        group.prepare (spec);
+
+        std::array<std::vector<float>, numVoices> inputs, outputs;
+        for (size_t voice = 0; voice < numVoices; ++voice)
+        {
+            inputs[voice] = makeNoise ((juce::int64) voice + 1);
+            outputs[voice].assign (numSamples, 0.0f);
+        }
+
+        for (size_t start = 0; start < numSamples; start += blockSize)
+        {
+            std::array<const float*, SourceLaneGroup::numLanes> laneInputs {};
+            std::array<float*, SourceLaneGroup::numLanes> laneOutputs {};
+
+            for (size_t voice = 0; voice < numVoices; ++voice)
+            {
+                group.setDelayTime (voice, delayTimes[voice]);
+                group.setFeedback (voice, feedbacks[voice]);
+                group.setLaneDiffusionTime (voice, diffusionTimes[voice]);
+
+                bool hasSent = voice == 0 || start == 0 || secondVoiceKeepsSending;
+                laneInputs[voice] = hasSent ? inputs[voice].data() + start : nullptr;
+                laneOutputs[voice] = outputs[voice].data() + start;
+            }
+
+            group.updateDiffusion();
+
+            // on the same instruction set as the manager, so that the samples come out the same
+            CpuDispatch::run ([&] { group.process (laneInputs.data(), laneOutputs.data(), blockSize); });
+        }
+
+        return outputs;
+    }
+
+    // compares the signal against the reference delayed by latency samples
+    static float getLargestDifference (const std::vector<float>& signal, const std::vector<float>& reference, size_t latency)
+    {
+        float largest = 0.0f;
+        for (size_t sample = 0; sample < signal.size(); ++sample)
+        {
+            auto expected = sample < latency ? 0.0f : reference[sample - latency];
+            largest = juce::jmax (largest, std::abs (signal[sample] - expected));
+        }
+
+        return largest;
+    }
+};
+
+static SourceVoiceManagerTests sourceVoiceManagerTests;
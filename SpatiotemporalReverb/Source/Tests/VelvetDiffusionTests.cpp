@@ -0,0 +1,207 @@
+//
+//  VelvetDiffusionTests.cpp
+//  SpatiotemporalReverb
+//
+
+#include <JuceHeader.h>
+#include "../Diffusion.h"
+#include "../VelvetDiffusion.h"
+#include "../DelayLineArena.h"
+
+/*  Compares the velvet-noise diffusion with the 8x8 Hadamard diffusion that it can replace: a velvet filter must give
+    the output of the sparse FIR that its taps describe, the velvet diffusion must build up an echo density like that
+    of noise (the density of the Hadamard diffusion is only logged, it comes and goes with the seed). The costs of both
+    are only logged, since timings depend on the machine and its load; with the densities, a change to either diffusion
+    shows up in the test output.
+*/
+class VelvetDiffusionTests : public juce::UnitTest
+{
+public:
+    VelvetDiffusionTests() : juce::UnitTest ("Velvet diffusion", "SpatiotemporalReverb")
+    {
+    }
+
+    void runTest() override
+    {
+        beginTest ("Velvet filter against a direct FIR");
+        expectLessThan (getLargestFilterError(), 1.0e-5);
+
+        beginTest ("Echo density");
+        {
+            Diffusion<float, 8, 8> hadamard;
+            VelvetDiffusion<float, 8> velvet;
+            auto hadamardResponse = getImpulseResponse (hadamard);
+            auto velvetResponse = getImpulseResponse (velvet);
+
+            // the normalised echo density of noise is 1, and a sparse response stays well below it
+            for (auto seconds : { 0.1, 0.5, 1.0, 2.0 })
+            {
+                auto hadamardDensity = getEchoDensity (hadamardResponse, seconds);
+                auto velvetDensity = getEchoDensity (velvetResponse, seconds);
+
+                logMessage ("echo density at " + juce::String (seconds, 1) + " s: Hadamard " + juce::String (hadamardDensity, 2)
+                            + ", velvet " + juce::String (velvetDensity, 2));
+
+                expectGreaterThan (velvetDensity, 0.75);
+            }
+        }
+
+        beginTest ("Cost against the 8x8 Hadamard diffusion");
+        {
+            for (auto diffusionTime : { 0.1f, 0.5f, 3.0f })
+            {
+                auto hadamardTime = getMillisecondsPerSecond<Diffusion<float, 8, 8>> (diffusionTime);
+                auto velvetTime = getMillisecondsPerSecond<VelvetDiffusion<float, 8>> (diffusionTime);
+                auto velvetTailTime = getMillisecondsPerSecond<VelvetDiffusion<float, 8, true>> (diffusionTime);
+
+                logMessage ("diffusion time " + juce::String (diffusionTime, 1) + " s, ms of CPU per s of audio: Hadamard "
+                            + juce::String (hadamardTime, 2) + ", velvet " + juce::String (velvetTime, 2)
+                            + ", velvet with late tail " + juce::String (velvetTailTime, 2));
+            }
+        }
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr int blockSize = 512;
+
+    // helper functions
+    template <typename DiffusionType>
+    static void prepareDiffusion (DiffusionType& diffusion, DelayLineArena& arena, float diffusionTime)
+    {
+        diffusion.setSeed (1);
+        diffusion.prepare ({ sampleRate, (juce::uint32) blockSize, 1 });
+        diffusion.addDelayLinesTo (arena);
+        arena.allocate();
+        diffusion.snapDiffusionTime (diffusionTime);
+    }
+
+    template <typename DiffusionType>
+    static void processBlock (DiffusionType& diffusion, float* samples, int numSamples)
+    {
+        float* channels[] { samples };
+        juce::dsp::AudioBlock<float> audioBlock (channels, 1, (size_t) numSamples);
+        diffusion.process (juce::dsp::ProcessContextReplacing<float> (audioBlock));
+    }
+
+    // runs noise in blocks of random lengths through a filter and compares it with the sum of the delayed taps
+    static double getLargestFilterError()
+    {
+        VelvetFilter<float, 64> filter;
+        filter.setSeed (3);
+        filter.prepare (3000, 40);
+        filter.setSegments (8, [] (size_t segment) { return 1.0f / (float) (segment + 1); });
+
+        DelayLineArena arena;
+        filter.addDelayLinesTo (arena);
+        arena.allocate();
+
+        juce::Random random (1);
+        std::vector<float> input (20000), output (input.size());
+        for (auto& sample : input)
+            sample = random.nextFloat() - 0.5f;
+
+        for (size_t start = 0; start < input.size();)
+        {
+            auto numSamples = juce::jmin ((size_t) random.nextInt ({ 1, (int) filter.maxBlockSize + 1 }), input.size() - start);
+            filter.processBlock (input.data() + start, output.data() + start, numSamples);
+            start += numSamples;
+        }
+
+        double largestError = 0.0;
+        for (size_t sample = 0; sample < input.size(); ++sample)
+        {
+            double expected = 0.0;
+            for (size_t tap = 0; tap < filter.getNumTaps(); ++tap)
+            {
+                auto delay = filter.getTapDelay (tap);
+                if (sample >= delay)
+                    expected += (filter.isTapNegative (tap) ? -1.0 : 1.0) * input[sample - delay] / (double) (tap / 8 + 1);
+            }
+
+            largestError = juce::jmax (largestError, std::abs (expected - output[sample]));
+        }
+
+        return largestError;
+    }
+
+    // the response to an impulse at a diffusion time that switches on all the steps; the chain only grows a step at a
+    // time, so it first runs on silence until all of them are on
+    template <typename DiffusionType>
+    std::vector<float> getImpulseResponse (DiffusionType& diffusion)
+    {
+        DelayLineArena arena;
+        prepareDiffusion (diffusion, arena, 3.0f);
+
+        std::vector<float> silence (blockSize, 0.0f);
+        for (int block = 0; block < 10 * (int) sampleRate / blockSize && diffusion.getActiveDiffusionSteps() < 8; ++block)
+            processBlock (diffusion, silence.data(), blockSize);
+
+        expectEquals ((int) diffusion.getActiveDiffusionSteps(), 8);
+
+        std::vector<float> response ((size_t) (3 * sampleRate) / blockSize * blockSize, 0.0f);
+        response[0] = 1.0f;
+
+        for (size_t start = 0; start < response.size(); start += blockSize)
+            processBlock (diffusion, response.data() + start, blockSize);
+
+        return response;
+    }
+
+    // the normalised echo density (Abel & Huang) of a 20 ms window: the share of its samples beyond one standard
+    // deviation, relative to that share for Gaussian noise
+    static double getEchoDensity (const std::vector<float>& response, double seconds)
+    {
+        auto centre = (size_t) (seconds * sampleRate);
+        auto halfWindow = (size_t) (0.01 * sampleRate);
+
+        double energy = 0.0;
+        for (auto sample = centre - halfWindow; sample < centre + halfWindow; ++sample)
+            energy += (double) response[sample] * response[sample];
+
+        auto standardDeviation = std::sqrt (energy / (double) (2 * halfWindow));
+        if (standardDeviation <= 0.0)
+            return 0.0;
+
+        size_t numOutliers = 0;
+        for (auto sample = centre - halfWindow; sample < centre + halfWindow; ++sample)
+            numOutliers += std::abs (response[sample]) > standardDeviation ? 1 : 0;
+
+        return (double) numOutliers / (double) (2 * halfWindow) / std::erfc (1.0 / std::sqrt (2.0));
+    }
+
+    // the fastest of a few runs of ten seconds of noise, in ms of CPU per second of audio
+    template <typename DiffusionType>
+    static double getMillisecondsPerSecond (float diffusionTime)
+    {
+        constexpr int numSeconds = 10;
+        auto fastest = std::numeric_limits<double>::max();
+
+        for (int run = 0; run < 3; ++run)
+        {
+            DiffusionType diffusion;
+            DelayLineArena arena;
+            prepareDiffusion (diffusion, arena, diffusionTime);
+
+            juce::Random random (1);
+            std::vector<float> buffer (blockSize);
+            double elapsed = 0.0;
+
+            for (int block = 0; block < numSeconds * (int) sampleRate / blockSize; ++block)
+            {
+                for (auto& sample : buffer)
+                    sample = random.nextFloat() - 0.5f;
+
+                auto start = juce::Time::getMillisecondCounterHiRes();
+                processBlock (diffusion, buffer.data(), blockSize);
+                elapsed += juce::Time::getMillisecondCounterHiRes() - start;
+            }
+
+            fastest = juce::jmin (fastest, elapsed / numSeconds);
+        }
+
+        return fastest;
+    }
+};
+
+static VelvetDiffusionTests velvetDiffusionTests;
@@ -0,0 +1,330 @@
+//
+//  TraceRecorder.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+
+// what a trace event records; the values of each type are listed next to it
+enum class TraceEventType : juce::uint8
+{
+    blockBegin,            // number of samples, sample rate
+    blockEnd,
+    audioPositioning,      // pan, front/back angle, distance
+    delayTime,             // delay time (s)
+    diffusionSize,         // diffusion time (s)
+    feedback,              // feedback
+    obstructedReflections, // obstructed reflections
+    diffusionSteps,        // number of active steps
+    diffusionTopology,     // index of the DiffusionTopology
+    allocation             // bytes
+};
+
+/*  A flight recorder for the audio threads of all plugin instances and the setters that Unity calls, so that a glitch
+    can be lined up with the parameter changes and the slow blocks around it:
+    - any thread writes compact events (24 bytes) into one fixed ring, without locks or allocations
+    - the ring always holds the latest events; old ones are overwritten rather than new ones dropped
+    - on demand (writeTrace()) a background thread copies the ring and writes it as a Chrome trace (JSON), which opens
+      in chrome://tracing or Perfetto with one track per instance
+    Each slot is guarded by a sequence number like a seqlock: the writer marks it odd while it writes and even when
+    done, and the reader skips the slots that changed while it copied them.
+    Recording is off until setEnabled (true); while it's off an event costs one relaxed load.
+*/
+class TraceRecorder : private juce::Thread
+{
+public:
+    static constexpr size_t numSlots = 1 << 16;
+
+    // the state of the last requested trace file
+    enum class WriteState
+    {
+        idle,
+        writing,
+        written,
+        failed
+    };
+
+    TraceRecorder() : juce::Thread ("Trace recorder")
+    {
+        slots.reset (new Slot[numSlots]);
+        startTicks = juce::Time::getHighResolutionTicks();
+        startThread();
+    }
+
+    ~TraceRecorder() override
+    {
+        signalThreadShouldExit();
+        writeRequested.signal();
+        stopThread (5000);
+    }
+
+    void setEnabled (bool shouldBeEnabled) noexcept
+    {
+        isRecording = shouldBeEnabled;
+    }
+
+    bool isEnabled() const noexcept
+    {
+        return isRecording.load (std::memory_order_relaxed);
+    }
+
+    // called from any thread, including the audio threads
+    void record (TraceEventType type, int instance, float value1 = 0.0f, float value2 = 0.0f, float value3 = 0.0f) noexcept
+    {
+        if (! isEnabled())
+            return;
+
+        auto index = writeIndex.fetch_add (1, std::memory_order_relaxed);
+        auto& slot = slots[index & (numSlots - 1)];
+
+        slot.sequence.store (2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+
+        slot.words[0].store ((juce::uint64) (juce::Time::getHighResolutionTicks() - startTicks), std::memory_order_relaxed);
+        slot.words[1].store ((juce::uint64) type | ((juce::uint64) (juce::uint16) instance << 8) | ((juce::uint64) toBits (value1) << 32),
+                             std::memory_order_relaxed);
+        slot.words[2].store ((juce::uint64) toBits (value2) | ((juce::uint64) toBits (value3) << 32), std::memory_order_relaxed);
+
+        slot.sequence.store (2 * index + 2, std::memory_order_release);
+    }
+
+    // asks the background thread to write the ring to file; returns false if a trace is still being written
+    bool writeTrace (const juce::File& file)
+    {
+        if (writeState.exchange ((int) WriteState::writing) == (int) WriteState::writing)
+            return false;
+
+        {
+            const juce::SpinLock::ScopedLockType lock (fileLock);
+            traceFile = file;
+        }
+
+        writeRequested.signal();
+        return true;
+    }
+
+    WriteState getWriteState() const noexcept
+    {
+        return (WriteState) writeState.load();
+    }
+
+    // records the begin of a block, and its end when it goes out of scope
+    class ScopedBlock
+    {
+    public:
+        ScopedBlock (TraceRecorder& recorderToUse, int instanceToUse, size_t numSamples, double sampleRate) noexcept
+            : recorder (recorderToUse), instance (instanceToUse)
+        {
+            recorder.record (TraceEventType::blockBegin, instance, (float) numSamples, (float) sampleRate);
+        }
+
+        ~ScopedBlock()
+        {
+            recorder.record (TraceEventType::blockEnd, instance);
+        }
+
+    private:
+        TraceRecorder& recorder;
+        int instance;
+
+        JUCE_DECLARE_NON_COPYABLE (ScopedBlock)
+    };
+
+private:
+    struct Slot
+    {
+        std::atomic<juce::uint64> sequence { 0 };
+        std::atomic<juce::uint64> words[3] {};
+    };
+
+    struct Event
+    {
+        juce::int64 ticks;
+        TraceEventType type;
+        int instance;
+        float values[3];
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<juce::uint64> writeIndex { 0 };
+    std::atomic<bool> isRecording { false };
+    juce::int64 startTicks { 0 };
+
+    juce::WaitableEvent writeRequested;
+    std::atomic<int> writeState { (int) WriteState::idle };
+    juce::SpinLock fileLock;
+    juce::File traceFile; // guarded by fileLock
+
+    // helper functions
+    static juce::uint32 toBits (float value) noexcept
+    {
+        juce::uint32 bits;
+        std::memcpy (&bits, &value, sizeof (bits));
+        return bits;
+    }
+
+    static float fromBits (juce::uint32 bits) noexcept
+    {
+        float value;
+        std::memcpy (&value, &bits, sizeof (value));
+        return value;
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            writeRequested.wait (-1);
+            if (threadShouldExit())
+                break;
+
+            juce::File file;
+            {
+                const juce::SpinLock::ScopedLockType lock (fileLock);
+                file = traceFile;
+            }
+
+            bool wasWritten = file.replaceWithText (toChromeTrace (copyEvents()));
+            writeState = (int) (wasWritten ? WriteState::written : WriteState::failed);
+        }
+    }
+
+    // the events in the ring from the oldest to the newest, without the ones that were being written
+    std::vector<Event> copyEvents() const
+    {
+        auto end = writeIndex.load (std::memory_order_acquire);
+        auto begin = end > numSlots ? end - numSlots : 0;
+
+        std::vector<Event> events;
+        events.reserve ((size_t) (end - begin));
+
+        for (auto index = begin; index < end; ++index)
+        {
+            auto& slot = slots[index & (numSlots - 1)];
+            if (slot.sequence.load (std::memory_order_acquire) != 2 * index + 2)
+                continue;
+
+            juce::uint64 words[3];
+            for (size_t word = 0; word < 3; ++word)
+                words[word] = slot.words[word].load (std::memory_order_relaxed);
+
+            std::atomic_thread_fence (std::memory_order_acquire);
+            if (slot.sequence.load (std::memory_order_relaxed) != 2 * index + 2)
+                continue;
+
+            Event event;
+            event.ticks = (juce::int64) words[0];
+            event.type = (TraceEventType) (words[1] & 0xff);
+            event.instance = (juce::int16) ((words[1] >> 8) & 0xffff);
+            event.values[0] = fromBits ((juce::uint32) (words[1] >> 32));
+            event.values[1] = fromBits ((juce::uint32) words[2]);
+            event.values[2] = fromBits ((juce::uint32) (words[2] >> 32));
+            events.push_back (event);
+        }
+
+        // the threads claim their slots a little before they take the time, so neighbours can be out of order
+        std::stable_sort (events.begin(), events.end(), [] (const Event& a, const Event& b) { return a.ticks < b.ticks; });
+        return events;
+    }
+
+    static juce::String toChromeTrace (const std::vector<Event>& events)
+    {
+        auto ticksPerMicrosecond = (double) juce::Time::getHighResolutionTicksPerSecond() * 1e-6;
+
+        juce::StringArray lines;
+        std::set<int> instances;
+        std::map<int, Event> openBlocks;
+
+        auto makeEvent = [&] (const char* name, const char* phase, const Event& event, const juce::String& args)
+        {
+            auto line = juce::String ("{\"name\":\"") + name + "\",\"ph\":\"" + phase + "\",\"pid\":1,\"tid\":" + juce::String (event.instance)
+                      + ",\"ts\":" + juce::String ((double) event.ticks / ticksPerMicrosecond, 3);
+
+            if (juce::String (phase) == "i")
+                line += ",\"s\":\"t\"";
+
+            return line + (args.isNotEmpty() ? ",\"args\":{" + args + "}}" : "}");
+        };
+
+        auto arg = [] (const char* name, float value)
+        {
+            return juce::String ("\"") + name + "\":" + juce::String (value, 6);
+        };
+
+        for (auto& event : events)
+        {
+            instances.insert (event.instance);
+            auto* values = event.values;
+
+            switch (event.type)
+            {
+                case TraceEventType::blockBegin:
+                    openBlocks[event.instance] = event;
+                    lines.add (makeEvent ("block", "B", event, arg ("samples", values[0])));
+                    break;
+
+                case TraceEventType::blockEnd:
+                {
+                    // a block whose begin was overwritten is left out, since Chrome would pair its end with nothing
+                    auto begin = openBlocks.find (event.instance);
+                    if (begin == openBlocks.end())
+                        break;
+
+                    lines.add (makeEvent ("block", "E", event, {}));
+
+                    // a block that took longer than it plays for is marked, since that is where the audio glitches
+                    auto& beginValues = begin->second.values;
+                    auto deadlineTicks = beginValues[1] > 0.0f ? (double) beginValues[0] / beginValues[1] * ticksPerMicrosecond * 1e6 : 0.0;
+                    if (deadlineTicks > 0.0 && (double) (event.ticks - begin->second.ticks) > deadlineTicks)
+                        lines.add (makeEvent ("deadline miss", "i", event, {}));
+
+                    openBlocks.erase (begin);
+                    break;
+                }
+
+                case TraceEventType::audioPositioning:
+                    lines.add (makeEvent ("applyAudioPositioning", "i", event,
+                                          arg ("pan", values[0]) + "," + arg ("frontBack", values[1]) + "," + arg ("distance", values[2])));
+                    break;
+
+                case TraceEventType::delayTime:
+                    lines.add (makeEvent ("setDelayTime", "i", event, arg ("delayTime", values[0])));
+                    break;
+
+                case TraceEventType::diffusionSize:
+                    lines.add (makeEvent ("setDiffusionSize", "i", event, arg ("diffusionTime", values[0])));
+                    break;
+
+                case TraceEventType::feedback:
+                    lines.add (makeEvent ("setFeedback", "i", event, arg ("feedback", values[0])));
+                    break;
+
+                case TraceEventType::obstructedReflections:
+                    lines.add (makeEvent ("setObstructedReflections", "i", event, arg ("obstructedReflections", values[0])));
+                    break;
+
+                case TraceEventType::diffusionSteps:
+                    lines.add (makeEvent ("diffusion steps", "C", event, arg ("steps", values[0])));
+                    break;
+
+                case TraceEventType::diffusionTopology:
+                    lines.add (makeEvent ("diffusion topology", "C", event, arg ("topology", values[0])));
+                    break;
+
+                case TraceEventType::allocation:
+                    lines.add (makeEvent ("allocation", "i", event, arg ("bytes", values[0])));
+                    break;
+            }
+        }
+
+        // every instance gets a named track
+        for (auto instance : instances)
+            lines.add ("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + juce::String (instance)
+                       + ",\"args\":{\"name\":\"Instance " + juce::String (instance) + "\"}}");
+
+        return "{\"traceEvents\":[\n" + lines.joinIntoString (",\n") + "\n]}\n";
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (TraceRecorder)
+};
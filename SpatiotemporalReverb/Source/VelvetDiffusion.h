@@ -0,0 +1,299 @@
+//
+//  VelvetDiffusion.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "VelvetFilter.h"
+#include "SampleLanes.h"
+#include "StageProfiler.h"
+
+/*  A cheaper alternative to Diffusion, with the same interface: instead of a step of delays mixed through a Hadamard
+    matrix, every step is a velvet-noise filter of a few sparse taps of +1 or -1 on a single delay line. The steps
+    double in length like those of Diffusion, and since every step multiplies the amount of echoes by its amount of
+    taps the density builds up just as quickly, at an addition per tap and sample instead of a delay line per channel
+    and a butterfly.
+    With hasLateTail the cascade is followed by a long velvet-noise filter whose taps decay by 60 dB over the diffusion
+    time, which adds a late tail; its taps behind the -60 dB point are skipped, so a small room pays for a short tail.
+*/
+template<typename Type, size_t numDiffusionSteps = 8, bool hasLateTail = false, typename Storage = FullPrecisionStorage<Type>>
+class VelvetDiffusion
+{
+public:
+    using NumericType = typename SampleLanes<Type>::NumericType;
+
+    // taps of a step and of the late tail, and the taps of the tail that share a gain
+    static constexpr size_t tapsPerStep = 8;
+    static constexpr size_t maxTailTaps = 256;
+    static constexpr size_t tapsPerTailSegment = 8;
+
+    // the cascade keeps the energy of its input, so its output is brought down to the level of Diffusion, whose sum of
+    // 8 uncorrelated channels has an eighth of the energy of its input
+    static constexpr NumericType outputGain = NumericType (0.35355339059327373);
+
+    VelvetDiffusion()
+    {
+    }
+
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        sampleRate = spec.sampleRate;
+
+        // make sure that the diffusion step size is proportional to the sample rate
+        jassert (diffusionStepAtomicSize * sampleRate > 1);
+
+        size_t samplesPerStep = (size_t)(diffusionStepAtomicSize * sampleRate);
+
+        for (auto& step : diffusionSteps)
+        {
+            step.prepare (samplesPerStep, tapsPerStep);
+            samplesPerStep *= 2; // for every step we double the diffusion length
+        }
+
+        // the tail is as long as the longest diffusion time that the steps can follow
+        if (hasLateTail)
+        {
+            lateTail.prepare (samplesPerStep, maxTailTaps);
+            appliedTailTime = 0;
+        }
+    }
+
+    // seeds the random taps of the steps (each step gets its own seed derived from it); must be called before prepare
+    void setSeed (juce::int64 seed)
+    {
+        for (size_t step = 0; step < numDiffusionSteps; ++step)
+            diffusionSteps[step].setSeed (seed + (juce::int64) step);
+
+        lateTail.setSeed (seed + (juce::int64) numDiffusionSteps);
+    }
+
+    void addDelayLinesTo (DelayLineArena& arena)
+    {
+        // the steps are laid out in processing order, so the chain walks forward through the arena
+        for (auto& step : diffusionSteps)
+            step.addDelayLinesTo (arena);
+
+        if (hasLateTail)
+            lateTail.addDelayLinesTo (arena);
+    }
+
+    template <typename ProcessContext>
+    void process (const ProcessContext& context)
+    {
+        auto inputBlock = context.getInputBlock();
+        auto outputBlock = context.getOutputBlock();
+
+        size_t channels = inputBlock.getNumChannels();
+        size_t samples = inputBlock.getNumSamples();
+
+        // when the amount of steps changes we run the longer of the two chains for this block
+        // and crossfade from the old chain's output to the new chain's output
+        size_t previousSteps = activeDiffusionSteps;
+        size_t targetSteps = std::min (targetDiffusionSteps.load (std::memory_order_relaxed),
+                                       maxDiffusionSteps.load (std::memory_order_relaxed));
+
+        // only the next step is kept warm, so the chain grows by a single step per block, and only once that step has
+        // been fed for as long as its delays (the steps after it read back silence until then); it shrinks at once
+        if (targetSteps > previousSteps)
+            targetSteps = diffusionSteps[previousSteps].isWarm() ? previousSteps + 1 : previousSteps;
+        size_t shortChain = std::min (previousSteps, targetSteps);
+        size_t longChain = std::max (previousSteps, targetSteps);
+
+        if (hasLateTail)
+            updateTailDecay();
+
+        DiffusionStepTimer<numDiffusionSteps> stepTimer (profile);
+
+        // the chain runs a chunk at a time and one step after the other, like Diffusion
+        for (size_t ch = 0; ch < channels; ++ch)
+        {
+            auto* input = inputBlock.getChannelPointer (ch);
+            auto* output = outputBlock.getChannelPointer (ch);
+
+            for (size_t start = 0; start < samples; start += chunkSize)
+            {
+                size_t numSamples = juce::jmin (chunkSize, samples - start);
+                stepTimer.begin();
+
+                std::copy (input + start, input + start + numSamples, chunks[0].begin());
+
+                // add the diffusion
+                for (size_t step = 0; step < shortChain; ++step)
+                {
+                    diffusionSteps[step].processBlock (chunks[step % 2].data(), chunks[(step + 1) % 2].data(), numSamples);
+                    stepTimer.lap (step);
+                }
+
+                if (previousSteps != targetSteps)
+                    for (size_t sample = 0; sample < numSamples; ++sample)
+                        shortChainChunk[sample] = chunks[shortChain % 2][sample] * outputGain;
+
+                for (size_t step = shortChain; step < longChain; ++step)
+                {
+                    diffusionSteps[step].processBlock (chunks[step % 2].data(), chunks[(step + 1) % 2].data(), numSamples);
+                    stepTimer.lap (step);
+                }
+
+                // the first inactive step is kept warm by writing into its delay line without reading from it,
+                // so it can be switched on without replaying stale samples
+                if (longChain < numDiffusionSteps)
+                    diffusionSteps[longChain].feedBlock (chunks[longChain % 2].data(), numSamples);
+
+                for (size_t sample = 0; sample < numSamples; ++sample)
+                    output[start + sample] = chunks[longChain % 2][sample] * outputGain;
+
+                if (previousSteps != targetSteps)
+                {
+                    for (size_t sample = 0; sample < numSamples; ++sample)
+                    {
+                        auto fade = NumericType (start + sample + 1) / NumericType (samples);
+                        Type outputSample = output[start + sample];
+                        Type oldSample = previousSteps < targetSteps ? shortChainChunk[sample] : outputSample;
+                        Type newSample = previousSteps < targetSteps ? outputSample : shortChainChunk[sample];
+                        output[start + sample] = oldSample + (newSample - oldSample) * fade;
+                    }
+                }
+
+                // the tail runs behind the cascade, so its sparse taps are smeared by the diffusion
+                if (hasLateTail)
+                {
+                    lateTail.processBlock (output + start, tailChunk.data(), numSamples);
+
+                    for (size_t sample = 0; sample < numSamples; ++sample)
+                        output[start + sample] = (output[start + sample] + tailChunk[sample]) * juce::MathConstants<NumericType>::sqrt2 * NumericType (0.5);
+                }
+            }
+        }
+
+        // the steps behind the new warm step are no longer fed, so we invalidate them (a cheap watermark reset
+        // rather than a clear) which makes them read back silence instead of stale samples when re-enabled
+        for (size_t step = targetSteps + 1; step <= std::min (longChain, numDiffusionSteps - 1); ++step)
+            diffusionSteps[step].invalidate();
+
+        activeDiffusionSteps = targetSteps;
+
+        stepTimer.recordTo (longChain);
+    }
+
+    // the amount of steps that the last block ended with
+    size_t getActiveDiffusionSteps() const noexcept
+    {
+        return activeDiffusionSteps;
+    }
+
+    // the profile that the steps are timed into (nullptr for none)
+    void setProfile (StageProfile* newProfile) noexcept
+    {
+        profile = newProfile;
+    }
+
+    void setDiffusionSteps (float diffusionTime)
+    {
+        // apply S-curve to make sure we don't jump multiple steps at once
+        diffusionTimeSmoother -= 0.02 * (diffusionTimeSmoother - diffusionTime);
+        tailDecayTime.store ((float) diffusionTimeSmoother, std::memory_order_relaxed);
+
+        // calculate the amount of diffusion steps needed
+        int step = 0;
+        while (diffusionTimeSmoother > diffusionStepAtomicSize * (2 << step) && step < numDiffusionSteps) step++;
+
+        // the step index is inclusive, so the chain always runs at least one step
+        targetDiffusionSteps.store (std::min ((size_t) step + 1, numDiffusionSteps), std::memory_order_relaxed);
+    }
+
+    // settles the smoothing on the diffusion time at once, so that a diffusion that starts out at a time that no
+    // longer changes doesn't slide there from its default
+    void snapDiffusionTime (float diffusionTime)
+    {
+        diffusionTimeSmoother = diffusionTime;
+        setDiffusionSteps (diffusionTime);
+    }
+
+    // caps the amount of steps whatever the diffusion time asks for (e.g. to save CPU); changes are crossfaded like any other
+    void setMaxDiffusionSteps (size_t newMaxDiffusionSteps)
+    {
+        // make sure that the maximum is valid
+        jassert (newMaxDiffusionSteps > 0);
+        maxDiffusionSteps.store (std::min (newMaxDiffusionSteps, numDiffusionSteps), std::memory_order_relaxed);
+    }
+
+    // the amount of steps that the chain grows to: what the diffusion time asks for, within the cap
+    size_t getTargetDiffusionSteps() const noexcept
+    {
+        return std::min (targetDiffusionSteps.load (std::memory_order_relaxed), maxDiffusionSteps.load (std::memory_order_relaxed));
+    }
+
+    // the summed delays of the steps that the chain grows to, in samples (see Diffusion::getTotalDelay; a step holds a
+    // chunk behind its longest tap), and of the part of the late tail that is heard: its taps up to the -60 dB point, which is up to 3 s long for a large hall
+    size_t getTotalDelay() const noexcept
+    {
+        size_t totalDelay = 0;
+        for (size_t step = 0; step < getTargetDiffusionSteps(); ++step)
+            totalDelay += diffusionSteps[step].getTapDelay (diffusionSteps[step].getNumTaps() - 1) + chunkSize;
+
+        if (hasLateTail)
+        {
+            auto tailLength = (size_t) ((NumericType) tailDecayTime.load (std::memory_order_relaxed) * sampleRate);
+            totalDelay += juce::jmin (tailLength, lateTail.getTapDelay (lateTail.getNumTaps() - 1) + 1);
+        }
+
+        return totalDelay;
+    }
+
+private:
+    NumericType sampleRate { NumericType (44.1e3) };
+    NumericType diffusionStepAtomicSize { NumericType (0.012f) };
+
+    // the amount of steps currently processed (audio thread) and the amount requested by Unity
+    size_t activeDiffusionSteps { 1 };
+    std::atomic<size_t> targetDiffusionSteps { 1 };
+    std::atomic<size_t> maxDiffusionSteps { numDiffusionSteps };
+    NumericType diffusionTimeSmoother { NumericType (0.24f) };
+
+    // the cascade of velvet-noise filters that functions as a diffusion chain
+    std::array<VelvetFilter<Type, tapsPerStep, Storage>, numDiffusionSteps> diffusionSteps;
+
+    // the late tail and the decay time (in seconds to -60 dB) that its gains were last computed for
+    VelvetFilter<Type, maxTailTaps, Storage> lateTail;
+    std::atomic<float> tailDecayTime { 0.24f };
+    float appliedTailTime { 0 };
+
+    // the chunk that runs through the chain one step at a time
+    static constexpr size_t chunkSize = VelvetFilter<Type, tapsPerStep, Storage>::maxBlockSize;
+    std::array<std::array<Type, chunkSize>, 2> chunks;
+    std::array<Type, chunkSize> shortChainChunk;
+    std::array<Type, chunkSize> tailChunk;
+
+    // the steps run a chunk at a time, so each of them is timed on its own
+    StageProfile* profile { nullptr };
+
+    // helper function
+    void updateTailDecay()
+    {
+        // the gains are only computed again once the decay time has moved by more than a percent
+        float decayTime = juce::jmax (0.001f, tailDecayTime.load (std::memory_order_relaxed));
+        if (std::abs (decayTime - appliedTailTime) <= 0.01f * appliedTailTime)
+            return;
+
+        appliedTailTime = decayTime;
+
+        // each segment decays from its first tap, and stops at -60 dB (after the first one, so the tail is never silent)
+        auto gainOfSegment = [this, decayTime] (size_t segment)
+        {
+            auto time = (NumericType) lateTail.getTapDelay (segment * tapsPerTailSegment) / sampleRate;
+            return time < decayTime || segment == 0 ? std::pow (NumericType (10), NumericType (-3) * time / decayTime) : NumericType (0);
+        };
+
+        // the taps are normalised to unit energy, so the level of the tail doesn't depend on its length
+        NumericType energy { 0 };
+        for (size_t segment = 0; segment * tapsPerTailSegment < lateTail.getNumTaps(); ++segment)
+        {
+            auto numTaps = juce::jmin (tapsPerTailSegment, lateTail.getNumTaps() - segment * tapsPerTailSegment);
+            energy += gainOfSegment (segment) * gainOfSegment (segment) * (NumericType) numTaps;
+        }
+
+        auto normalisation = NumericType (1) / std::sqrt (energy);
+        lateTail.setSegments (tapsPerTailSegment, [&] (size_t segment) { return gainOfSegment (segment) * normalisation; });
+    }
+};
@@ -0,0 +1,163 @@
+//
+//  VelvetFilter.h
+//  SpatiotemporalReverb
+//
+
+#pragma once
+#include <JuceHeader.h>
+#include "DelayLine.h"
+#include "DelayLineArena.h"
+#include "SampleLanes.h"
+
+/*  A sparse FIR filter of velvet noise: the filter is split into a grid of equally long cells, and each cell holds a
+    single tap of +1 or -1 at a random position. The output is a sum and difference of delayed input samples, so the
+    taps cost an addition each and no multiplies; only a gain per segment of taps is multiplied in (one segment of all
+    taps for a flat filter, several for a decaying one).
+*/
+template <typename Type, size_t maxNumTaps, typename Storage = FullPrecisionStorage<Type>>
+class VelvetFilter
+{
+public:
+    using NumericType = typename SampleLanes<Type>::NumericType;
+
+    // the longest block that processBlock() takes at once
+    static constexpr size_t maxBlockSize = 64;
+
+    VelvetFilter()
+    {
+    }
+
+    // the taps are drawn from this seed, so a filter prepared twice (or in another run) comes out the same
+    void setSeed (juce::int64 newSeed)
+    {
+        seed = newSeed;
+    }
+
+    // draws numTapsToUse taps spread over lengthInSamples, with one flat segment of unit energy
+    void prepare (size_t lengthInSamples, size_t numTapsToUse)
+    {
+        // make sure that the taps fit into the filter
+        jassert (numTapsToUse > 0 && numTapsToUse <= maxNumTaps);
+
+        random.setSeed (seed);
+        numTaps = juce::jmin (numTapsToUse, maxNumTaps);
+
+        // the cells are at least a sample long, so the taps never share a delay
+        auto cellLength = juce::jmax ((NumericType) 1, (NumericType) lengthInSamples / (NumericType) numTaps);
+
+        for (size_t tap = 0; tap < numTaps; ++tap)
+        {
+            delayInSamples[tap] = (size_t) (cellLength * (NumericType) tap + cellLength * random.nextFloat());
+            isNegative[tap] = random.nextBool();
+        }
+
+        setSegments (numTaps, [this] (size_t) { return NumericType (1) / std::sqrt ((NumericType) numTaps); });
+    }
+
+    // splits the taps into segments of tapsPerSegment taps and gives each of them gainOfSegment (segment); the segments
+    // after the first silent one (a gain of 0) are skipped, which is what makes a decaying filter cheaper when it is short
+    template <typename GainFunction>
+    void setSegments (size_t tapsPerSegment, GainFunction&& gainOfSegment)
+    {
+        // make sure that the segments are valid
+        jassert (tapsPerSegment > 0);
+
+        segmentLength = juce::jmax ((size_t) 1, tapsPerSegment);
+        numSegments = (numTaps + segmentLength - 1) / segmentLength;
+
+        for (size_t segment = 0; segment < numSegments; ++segment)
+            segmentGains[segment] = gainOfSegment (segment);
+    }
+
+    size_t getNumTaps() const noexcept
+    {
+        return numTaps;
+    }
+
+    // the time of a tap in samples; the taps are sorted by it
+    size_t getTapDelay (size_t tap) const noexcept
+    {
+        return delayInSamples[tap];
+    }
+
+    // whether a tap subtracts its sample rather than adding it
+    bool isTapNegative (size_t tap) const noexcept
+    {
+        return isNegative[tap];
+    }
+
+    void addDelayLinesTo (DelayLineArena& arena)
+    {
+        // the line holds the longest tap behind the oldest sample of a block
+        arena.add (delayLine, delayInSamples[numTaps - 1] + maxBlockSize);
+    }
+
+    // filters a block; input and output must not overlap
+    void processBlock (const Type* input, Type* output, size_t numSamples)
+    {
+        // make sure that the block fits behind the longest tap
+        jassert (numSamples <= maxBlockSize);
+
+        delayLine.pushBlock (input, numSamples);
+        std::fill (output, output + numSamples, Type {});
+
+        for (size_t segment = 0; segment < numSegments; ++segment)
+        {
+            if (segmentGains[segment] == NumericType (0))
+                break;
+
+            // the taps of a segment are summed first, so its gain is a single multiply per sample
+            auto* sum = numSegments == 1 ? output : segmentSum.data();
+            if (numSegments > 1)
+                std::fill (sum, sum + numSamples, Type {});
+
+            for (size_t tap = segment * segmentLength; tap < juce::jmin (numTaps, (segment + 1) * segmentLength); ++tap)
+                delayLine.addDelayedBlock (delayInSamples[tap], sum, numSamples, isNegative[tap]);
+
+            if (numSegments == 1)
+            {
+                for (size_t sample = 0; sample < numSamples; ++sample)
+                    output[sample] *= segmentGains[segment];
+            }
+            else
+            {
+                for (size_t sample = 0; sample < numSamples; ++sample)
+                    output[sample] += sum[sample] * segmentGains[segment];
+            }
+        }
+    }
+
+    void feedBlock (const Type* input, size_t numSamples)
+    {
+        // write the input into the delay line without reading from it, which keeps an inactive filter warm
+        delayLine.pushBlock (input, numSamples);
+    }
+
+    // whether the delay line has been fed for long enough that no tap reads back stale samples
+    bool isWarm() const noexcept
+    {
+        return delayLine.isFull();
+    }
+
+    void invalidate()
+    {
+        delayLine.invalidate();
+    }
+
+private:
+    size_t numTaps { 1 };
+    std::array<size_t, maxNumTaps> delayInSamples {};
+    std::array<bool, maxNumTaps> isNegative {};
+
+    size_t segmentLength { 1 };
+    size_t numSegments { 1 };
+    std::array<NumericType, maxNumTaps> segmentGains {};
+
+    DelayLine<Type, Storage> delayLine;
+
+    // scratch space of processBlock()
+    std::array<Type, maxBlockSize> segmentSum;
+
+    juce::Random random;
+    juce::int64 seed { juce::Random().nextInt64() };
+};